@@ -0,0 +1,483 @@
+/*
+ * squashelf-bench: time libsquashelf on a set of inputs and backends.
+ *
+ * Every run of an (input, backend) case is made in a forked child, so
+ * each one starts with a cold libelf and its own peak RSS; the child
+ * squashes the input into a scratch file under -o. The -r runs of each
+ * case go in rounds over all cases. A case is reported with the fastest
+ * run's per-phase times (from struct squashelf_stats), throughput and
+ * peak RSS, and the median time of all runs, as one text row or JSON
+ * object. Cases that fail are reported with "ok": false rather than
+ * dropped, so JSON baselines stay comparable line for line.
+ */
+#define _GNU_SOURCE
+#include "libsquashelf.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/* How one backend is configured on top of the library defaults */
+struct backend {
+    const char* name;
+    int         useMmap;
+    int         writer;
+    int         copyStart;
+    bool        memory; /* squashelf_write_mem into an arena */
+};
+
+static const struct backend backends[] = {
+    {"libelf", 1, SQUASHELF_WRITER_LIBELF, SQUASHELF_COPY_FILE_RANGE, false},
+    {"libelf-pread", 0, SQUASHELF_WRITER_LIBELF, SQUASHELF_COPY_FILE_RANGE,
+     false},
+    {"direct", 1, SQUASHELF_WRITER_DIRECT, SQUASHELF_COPY_FILE_RANGE, false},
+    {"direct-buffered", 1, SQUASHELF_WRITER_DIRECT, SQUASHELF_COPY_BUFFERED,
+     false},
+    {"uring", 1, SQUASHELF_WRITER_URING, SQUASHELF_COPY_FILE_RANGE, false},
+    {"memory", 1, SQUASHELF_WRITER_DIRECT, SQUASHELF_COPY_FILE_RANGE, true},
+};
+#define BACKEND_COUNT (sizeof(backends) / sizeof(backends[0]))
+
+/* Outcome of one case, as reported by the child */
+struct result {
+    bool                   ok;
+    unsigned               runs;
+    uint64_t               bestNs;   /* wall time of the fastest run */
+    uint64_t               medianNs; /* median wall time of the runs */
+    uint64_t               totalNs;  /* wall time of all runs */
+    struct squashelf_stats stats;    /* phases of the fastest run */
+    size_t                 outputSegments;
+    long                   peakRssKb;
+};
+
+/*
+ * usage:
+ *   Print the command line synopsis.
+ */
+static void usage(const char* prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options] <input.elf>...\n"
+            "  -b, --backend LIST  comma-separated backends (default all)\n"
+            "  -r, --repeat N      runs per case, in rounds (default 5)\n"
+            "  -o, --outdir DIR    scratch directory for outputs (default .)\n"
+            "  -j, --jobs N        direct writer copy threads (default 1)\n"
+            "      --json          emit a JSON array instead of a table\n"
+            "Backends:",
+            prog);
+    for (size_t i = 0; i < BACKEND_COUNT; i++) {
+        fprintf(stderr, " %s", backends[i].name);
+    }
+    fprintf(stderr, "\n");
+}
+
+/*
+ * nowNs:
+ *   CLOCK_MONOTONIC in nanoseconds.
+ */
+static uint64_t nowNs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000UL + (uint64_t)now.tv_nsec;
+}
+
+/*
+ * runOnce:
+ *   Squash input once with backend, writing to scratch, and add the
+ *   library's counters to stats. Returns 0 or -1.
+ */
+static int runOnce(const char* input, const struct backend* backend,
+                   int jobs, const char* scratch,
+                   struct squashelf_stats* stats, size_t* outputSegments)
+{
+    struct squashelf_options opts;
+    squashelf_options_init(&opts);
+    opts.useMmap   = backend->useMmap;
+    opts.writer    = backend->writer;
+    opts.copyStart = backend->copyStart;
+    opts.jobs      = jobs;
+    opts.stats     = stats;
+
+    squashelf_image_t* image = NULL;
+    squashelf_arena_t* arena = NULL;
+    int                rc    = -1;
+    squashelf_t*       in    = squashelf_open_file(input, &opts);
+    if (!in || !(image = squashelf_select(in, &opts))) {
+        goto out;
+    }
+    *outputSegments = squashelf_image_segments(image);
+
+    if (backend->memory) {
+        void*  buf;
+        size_t size;
+        arena = squashelf_arena_new();
+        if (!arena || squashelf_write_mem(image, arena, &buf, &size) != 0) {
+            goto out;
+        }
+    }
+    else {
+        int fd = open(scratch, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            perror("open scratch output");
+            goto out;
+        }
+        int writeRc = squashelf_write_fd(image, fd);
+        if (close(fd) != 0 || writeRc != 0) {
+            goto out;
+        }
+    }
+    rc = 0;
+
+out:
+    squashelf_arena_free(arena);
+    squashelf_image_free(image);
+    squashelf_close(in);
+    return rc;
+}
+
+/*
+ * compareNs:
+ *   qsort comparator for run times.
+ */
+static int compareNs(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * runCase:
+ *   Child side of one run of a case.
+ */
+static void runCase(const char* input, const struct backend* backend,
+                    int jobs, const char* outdir, struct result* res)
+{
+    char scratch[4096];
+    snprintf(scratch, sizeof(scratch), "%s/squashelf-bench.%d.out", outdir,
+             (int)getpid());
+
+    memset(res, 0, sizeof(*res));
+    uint64_t start = nowNs();
+    res->ok = runOnce(input, backend, jobs, scratch, &res->stats,
+                      &res->outputSegments) == 0;
+    res->bestNs = nowNs() - start;
+    res->runs   = res->ok;
+    unlink(scratch);
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        res->peakRssKb = usage.ru_maxrss;
+    }
+}
+
+/*
+ * forkCase:
+ *   Make one run of a case in a child, which hands its result back
+ *   through a pipe. Returns false if the run failed.
+ */
+static bool forkCase(const char* input, const struct backend* backend,
+                     int jobs, const char* outdir, struct result* res)
+{
+    int fds[2];
+    memset(res, 0, sizeof(*res));
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        return false;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        runCase(input, backend, jobs, outdir, res);
+        ssize_t n = write(fds[1], res, sizeof(*res));
+        _exit(n == (ssize_t)sizeof(*res) ? 0 : 1);
+    }
+    close(fds[1]);
+    ssize_t n = read(fds[0], res, sizeof(*res));
+    close(fds[0]);
+    int childStatus;
+    waitpid(pid, &childStatus, 0);
+    if (n != (ssize_t)sizeof(*res) || !WIFEXITED(childStatus) ||
+        WEXITSTATUS(childStatus) != 0) {
+        res->ok = false;
+    }
+    return res->ok;
+}
+
+/*
+ * addRun:
+ *   Fold one run into the case's result, keeping the fastest run's
+ *   phases and the highest peak RSS, and record its time in times.
+ */
+static void addRun(struct result* res, const struct result* run,
+                   uint64_t* times)
+{
+    if (res->runs == 0 || run->bestNs < res->bestNs) {
+        res->bestNs         = run->bestNs;
+        res->stats          = run->stats;
+        res->outputSegments = run->outputSegments;
+    }
+    if (run->peakRssKb > res->peakRssKb) {
+        res->peakRssKb = run->peakRssKb;
+    }
+    res->totalNs += run->bestNs;
+    times[res->runs++] = run->bestNs;
+}
+
+/*
+ * finishCase:
+ *   Take the median of the case's run times (sorting times).
+ */
+static void finishCase(struct result* res, uint64_t* times)
+{
+    unsigned mid = res->runs / 2;
+    if (res->runs == 0) {
+        return;
+    }
+    qsort(times, res->runs, sizeof(*times), compareNs);
+    res->medianNs = res->runs % 2 ? times[mid]
+                                  : (times[mid - 1] + times[mid]) / 2;
+}
+
+/*
+ * printJsonString:
+ *   Write s as a JSON string literal.
+ */
+static void printJsonString(const char* s)
+{
+    putchar('"');
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            printf("\\%c", c);
+        }
+        else if (c < 0x20) {
+            printf("\\u%04x", c);
+        }
+        else {
+            putchar(c);
+        }
+    }
+    putchar('"');
+}
+
+/*
+ * printResult:
+ *   Report one case as a table row or a JSON object.
+ */
+static void printResult(const char* input, const char* backend,
+                        const struct result* res, bool json, bool first)
+{
+    const struct squashelf_stats* st = &res->stats;
+    double seconds = res->bestNs / 1e9;
+    double mbps    = seconds > 0 ? st->payloadBytes / 1e6 / seconds : 0;
+    double segps   = seconds > 0 ? st->segmentsScanned / seconds : 0;
+
+    if (!json) {
+        printf("%-32s %-16s", input, backend);
+        if (!res->ok) {
+            printf(" FAILED\n");
+            return;
+        }
+        printf(" %8lu %10.3f %10.3f %10.3f %12.1f %12.0f %9ld",
+               st->segmentsScanned, st->payloadBytes / 1e6, res->bestNs / 1e6,
+               res->medianNs / 1e6, mbps, segps, res->peakRssKb);
+        for (int p = 0; p < SQUASHELF_PHASE_COUNT; p++) {
+            printf(" %9.3f", st->phaseNs[p] / 1e6);
+        }
+        printf("\n");
+        return;
+    }
+
+    printf("%s\n  {\"input\": ", first ? "" : ",");
+    printJsonString(input);
+    printf(", \"backend\": ");
+    printJsonString(backend);
+    printf(", \"ok\": %s, \"runs\": %u", res->ok ? "true" : "false",
+           res->runs);
+    if (res->ok) {
+        printf(",\n   \"segments\": %lu, \"kept\": %lu, "
+               "\"output_segments\": %zu,\n"
+               "   \"payload_bytes\": %lu, \"output_bytes\": %lu,\n"
+               "   \"best_ms\": %.3f, \"median_ms\": %.3f, "
+               "\"mean_ms\": %.3f, \"mb_per_s\": %.1f,\n"
+               "   \"segments_per_s\": %.0f, \"peak_rss_kb\": %ld, "
+               "\"phases_ms\": {",
+               st->segmentsScanned, st->segmentsKept, res->outputSegments,
+               st->payloadBytes, st->outputBytes, res->bestNs / 1e6,
+               res->medianNs / 1e6, res->totalNs / 1e6 / res->runs, mbps,
+               segps, res->peakRssKb);
+        for (int p = 0; p < SQUASHELF_PHASE_COUNT; p++) {
+            printf("%s\"%s\": %.3f", p ? ", " : "", squashelf_phase_name(p),
+                   st->phaseNs[p] / 1e6);
+        }
+        printf("}");
+    }
+    printf("}");
+}
+
+/*
+ * findBackend:
+ *   Look up a backend by name.
+ */
+static const struct backend* findBackend(const char* name, size_t len)
+{
+    for (size_t i = 0; i < BACKEND_COUNT; i++) {
+        if (strlen(backends[i].name) == len &&
+            strncmp(backends[i].name, name, len) == 0) {
+            return &backends[i];
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char* argv[])
+{
+    const struct backend* selected[BACKEND_COUNT];
+    size_t                selectedCount = 0;
+    unsigned              repeat        = 5;
+    int                   jobs          = 1;
+    const char*           outdir        = ".";
+    bool                  json          = false;
+    enum { OPT_JSON = 256 };
+    static const struct option longOptions[] = {
+        {"backend", required_argument, NULL, 'b'},
+        {"repeat", required_argument, NULL, 'r'},
+        {"outdir", required_argument, NULL, 'o'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"json", no_argument, NULL, OPT_JSON},
+        {NULL, 0, NULL, 0},
+    };
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "b:r:o:j:", longOptions, NULL)) !=
+           -1) {
+        switch (opt) {
+        case 'b':
+            selectedCount = 0;
+            for (const char* name = optarg; *name;) {
+                size_t                len = strcspn(name, ",");
+                const struct backend* b   = findBackend(name, len);
+                if (!b || selectedCount == BACKEND_COUNT) {
+                    fprintf(stderr, "Unknown backend '%.*s'\n", (int)len,
+                            name);
+                    return 1;
+                }
+                selected[selectedCount++] = b;
+                name += len + (name[len] == ',');
+            }
+            break;
+        case 'r':
+            repeat = (unsigned)atoi(optarg);
+            if (repeat < 1) {
+                fprintf(stderr, "Invalid repeat count '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'o':
+            outdir = optarg;
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            if (jobs < 1) {
+                fprintf(stderr, "Invalid job count '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_JSON:
+            json = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (selectedCount == 0) {
+        for (size_t i = 0; i < BACKEND_COUNT; i++) {
+            selected[selectedCount++] = &backends[i];
+        }
+    }
+
+    if (json) {
+        printf("[");
+    }
+    else {
+        printf("%-32s %-16s %8s %10s %10s %10s %12s %12s %9s", "input",
+               "backend", "segs", "MB", "best_ms", "median_ms", "MB/s",
+               "segs/s", "rss_kb");
+        for (int p = 0; p < SQUASHELF_PHASE_COUNT; p++) {
+            printf(" %9.9s", squashelf_phase_name(p));
+        }
+        printf("\n");
+    }
+
+    /* Runs go in rounds over every case rather than back to back, so a
+       stretch of host noise spreads over all cases instead of skewing
+       every run of one */
+    size_t         inputCount = argc - optind;
+    size_t         caseCount  = inputCount * selectedCount;
+    struct result* results    = calloc(caseCount ? caseCount : 1,
+                                       sizeof(*results));
+    uint64_t*      times      = calloc(caseCount ? caseCount * repeat : 1,
+                                       sizeof(*times));
+    if (!results || !times) {
+        perror("calloc results");
+        return 1;
+    }
+    for (size_t c = 0; c < caseCount; c++) {
+        results[c].ok = true;
+    }
+    for (unsigned r = 0; r < repeat; r++) {
+        for (size_t c = 0; c < caseCount; c++) {
+            const char*           input   = argv[optind + c / selectedCount];
+            const struct backend* backend = selected[c % selectedCount];
+            struct result         run;
+            if (!results[c].ok) {
+                continue; /* a failed case is not retried */
+            }
+            if (!forkCase(input, backend, jobs, outdir, &run)) {
+                results[c].ok = false;
+                continue;
+            }
+            addRun(&results[c], &run, times + c * repeat);
+        }
+    }
+
+    int status = 0;
+    for (size_t c = 0; c < caseCount; c++) {
+        finishCase(&results[c], times + c * repeat);
+        if (!results[c].ok) {
+            status = 1;
+        }
+        printResult(argv[optind + c / selectedCount],
+                    selected[c % selectedCount]->name, &results[c], json,
+                    c == 0);
+    }
+    free(results);
+    free(times);
+    if (json) {
+        printf("\n]\n");
+    }
+    return status;
+}
@@ -0,0 +1,378 @@
+/*
+ * genelf: synthetic ELF inputs for the squashelf benchmarks.
+ *
+ * Writes an ELF32 or ELF64 file of either byte order holding only PT_LOAD
+ * segments: the ELF header, the PHT, then each segment's payload (filled
+ * with pseudo-random bytes) at the first offset congruent to its LMA
+ * modulo the alignment. Segment LMAs ascend from a fixed base; --shuffle
+ * puts the PHT (and the payloads, which follow PHT order) out of LMA
+ * order and --overlap makes each segment's LMA range run into the next.
+ * Headers are encoded here rather than through libelf, so the inputs do
+ * not depend on the code being measured.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define ELF_BASE_LMA 0x10000000UL /* LMA of the first segment */
+#define PN_XNUM      0xffff       /* e_phnum escape for extended numbering */
+#define FILL_CHUNK   (1UL << 20)  /* payload bytes generated per write */
+
+/* Shape of the file to generate */
+struct genSpec {
+    int      elfClass;  /* 32 or 64 */
+    bool     bigEndian;
+    size_t   segments;  /* PT_LOAD count, 1 to UINT32_MAX */
+    uint64_t size;      /* p_filesz of each segment */
+    uint64_t bss;       /* p_memsz - p_filesz of each segment */
+    uint64_t align;     /* p_align, a power of two */
+    bool     overlap;   /* LMA ranges overlap their neighbours */
+    bool     shuffle;   /* PHT and payloads out of LMA order */
+    uint64_t seed;
+};
+
+/*
+ * usage:
+ *   Print the command line synopsis.
+ */
+static void usage(const char* prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options] <output.elf>\n"
+            "  -c, --class 32|64     ELF class (default 64)\n"
+            "  -e, --endian le|be    byte order (default le)\n"
+            "  -n, --segments N      PT_LOAD segments (default 16; PN_XNUM\n"
+            "                        from 65535)\n"
+            "  -s, --size SIZE       payload bytes per segment (default 4K)\n"
+            "  -b, --bss SIZE        extra p_memsz per segment (default 0)\n"
+            "  -a, --align N         p_align, a power of two (default 16)\n"
+            "      --overlap         overlapping LMA ranges\n"
+            "      --shuffle         PHT out of LMA order\n"
+            "      --seed N          random seed for payloads and shuffle\n"
+            "SIZE accepts K, M and G suffixes.\n",
+            prog);
+}
+
+/*
+ * parseSize:
+ *   Parse a byte count with an optional K, M or G suffix.
+ */
+static int parseSize(const char* arg, uint64_t* out)
+{
+    char*              end;
+    unsigned long long value;
+
+    errno = 0;
+    value = strtoull(arg, &end, 0);
+    if (errno != 0 || end == arg) {
+        return -1;
+    }
+    switch (*end) {
+    case 'K': case 'k': value <<= 10; end++; break;
+    case 'M': case 'm': value <<= 20; end++; break;
+    case 'G': case 'g': value <<= 30; end++; break;
+    default: break;
+    }
+    if (*end != '\0') {
+        return -1;
+    }
+    *out = value;
+    return 0;
+}
+
+/*
+ * nextRandom:
+ *   xorshift64; plenty for incompressible payloads and shuffles.
+ */
+static uint64_t nextRandom(uint64_t* state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+/*
+ * putValue:
+ *   Store the low width bytes of value at out in the chosen byte order.
+ */
+static unsigned char* putValue(unsigned char* out, uint64_t value, int width,
+                               bool bigEndian)
+{
+    for (int i = 0; i < width; i++) {
+        int shift = bigEndian ? (width - 1 - i) * 8 : i * 8;
+        out[i]    = (unsigned char)(value >> shift);
+    }
+    return out + width;
+}
+
+/*
+ * writeAt:
+ *   pwrite all of buf at offset, retrying short writes.
+ */
+static int writeAt(int fd, const void* buf, size_t len, uint64_t offset)
+{
+    const unsigned char* p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/*
+ * generate:
+ *   Lay out and write the file described by spec to fd.
+ */
+static int generate(const struct genSpec* spec, int fd)
+{
+    bool     is64      = spec->elfClass == 64;
+    bool     be        = spec->bigEndian;
+    int      word      = is64 ? 8 : 4;
+    size_t   ehdrSize  = is64 ? 64 : 52;
+    size_t   phdrSize  = is64 ? 56 : 32;
+    size_t   shdrSize  = is64 ? 64 : 40;
+    bool     xnum      = spec->segments >= PN_XNUM;
+    uint64_t stride    = (spec->size + spec->bss + spec->align - 1) &
+                      ~(spec->align - 1);
+    uint64_t randState = spec->seed ? spec->seed : 0x9e3779b97f4a7c15UL;
+    int      rc        = -1;
+
+    if (spec->overlap) {
+        /* Each segment starts halfway into its predecessor; only file
+           offsets have to honour the alignment, so the LMA need not */
+        stride = (spec->size + spec->bss) / 2;
+    }
+    if (stride == 0) {
+        stride = 1;
+    }
+    uint64_t lmaEnd = ELF_BASE_LMA + (spec->segments - 1) * stride +
+                      spec->size + spec->bss;
+    if (!is64 && lmaEnd > UINT32_MAX) {
+        fprintf(stderr, "Segments end at LMA 0x%lx, past the ELF32 address "
+                        "space\n",
+                lmaEnd);
+        return -1;
+    }
+
+    /* order[i] is the LMA index of the i-th PHT entry */
+    size_t*        order  = malloc(spec->segments * sizeof(*order));
+    unsigned char* pht    = calloc(spec->segments, phdrSize);
+    unsigned char* buffer = malloc(FILL_CHUNK);
+    if (!order || !pht || !buffer) {
+        perror("malloc");
+        goto out;
+    }
+    for (size_t i = 0; i < spec->segments; i++) {
+        order[i] = i;
+    }
+    if (spec->shuffle) {
+        for (size_t i = spec->segments - 1; i > 0; i--) {
+            size_t j = nextRandom(&randState) % (i + 1);
+            size_t k = order[i];
+            order[i] = order[j];
+            order[j] = k;
+        }
+    }
+
+    /* Payloads follow the PHT in PHT order */
+    uint64_t offset = ehdrSize + spec->segments * phdrSize;
+    for (size_t i = 0; i < spec->segments; i++) {
+        uint64_t lma   = ELF_BASE_LMA + order[i] * stride;
+        uint32_t flags = order[i] < spec->segments / 2 ? 0x5 : 0x6; /* RX, RW */
+        offset += (lma - offset) & (spec->align - 1);
+
+        unsigned char* p = pht + i * phdrSize;
+        p = putValue(p, 1, 4, be); /* PT_LOAD */
+        if (is64) {
+            p = putValue(p, flags, 4, be);
+        }
+        p = putValue(p, offset, word, be);
+        p = putValue(p, lma, word, be);                /* p_vaddr */
+        p = putValue(p, lma, word, be);                /* p_paddr */
+        p = putValue(p, spec->size, word, be);         /* p_filesz */
+        p = putValue(p, spec->size + spec->bss, word, be); /* p_memsz */
+        if (!is64) {
+            p = putValue(p, flags, 4, be);
+        }
+        putValue(p, spec->align, word, be);
+
+        for (uint64_t done = 0; done < spec->size;) {
+            size_t n = spec->size - done < FILL_CHUNK ? spec->size - done
+                                                      : FILL_CHUNK;
+            for (size_t k = 0; k < n; k += 8) {
+                uint64_t r = nextRandom(&randState);
+                memcpy(buffer + k, &r, n - k < 8 ? n - k : 8);
+            }
+            if (writeAt(fd, buffer, n, offset + done) != 0) {
+                perror("write payload");
+                goto out;
+            }
+            done += n;
+        }
+        offset += spec->size;
+    }
+
+    /* Extended numbering keeps the real count in section 0's sh_info */
+    uint64_t shoff = 0;
+    if (xnum) {
+        shoff = (offset + 7) & ~7UL;
+        unsigned char  shdr[64] = {0};
+        unsigned char* p        = shdr + 4 + 4 + 4 * word; /* sh_link */
+        p = putValue(p, 0, 4, be);
+        putValue(p, spec->segments, 4, be);
+        if (writeAt(fd, shdr, shdrSize, shoff) != 0) {
+            perror("write SHT");
+            goto out;
+        }
+    }
+
+    unsigned char  ehdr[64] = {0x7f, 'E', 'L', 'F', is64 ? 2 : 1, be ? 2 : 1,
+                               1};
+    unsigned char* p        = ehdr + 16;
+    p = putValue(p, 2, 2, be);              /* ET_EXEC */
+    p = putValue(p, is64 ? 62 : 40, 2, be); /* EM_X86_64 / EM_ARM */
+    p = putValue(p, 1, 4, be);              /* EV_CURRENT */
+    p = putValue(p, ELF_BASE_LMA, word, be);
+    p = putValue(p, ehdrSize, word, be);    /* e_phoff */
+    p = putValue(p, shoff, word, be);
+    p = putValue(p, 0, 4, be);              /* e_flags */
+    p = putValue(p, ehdrSize, 2, be);
+    p = putValue(p, phdrSize, 2, be);
+    p = putValue(p, xnum ? PN_XNUM : spec->segments, 2, be);
+    p = putValue(p, shdrSize, 2, be);
+    p = putValue(p, xnum ? 1 : 0, 2, be);   /* e_shnum */
+    putValue(p, 0, 2, be);                  /* e_shstrndx */
+    if (writeAt(fd, ehdr, ehdrSize, 0) != 0 ||
+        writeAt(fd, pht, spec->segments * phdrSize, ehdrSize) != 0) {
+        perror("write headers");
+        goto out;
+    }
+    rc = 0;
+
+out:
+    free(order);
+    free(pht);
+    free(buffer);
+    return rc;
+}
+
+int main(int argc, char* argv[])
+{
+    struct genSpec spec = {
+        .elfClass = 64,
+        .segments = 16,
+        .size     = 4096,
+        .align    = 16,
+    };
+    enum { OPT_OVERLAP = 256, OPT_SHUFFLE, OPT_SEED };
+    static const struct option longOptions[] = {
+        {"class", required_argument, NULL, 'c'},
+        {"endian", required_argument, NULL, 'e'},
+        {"segments", required_argument, NULL, 'n'},
+        {"size", required_argument, NULL, 's'},
+        {"bss", required_argument, NULL, 'b'},
+        {"align", required_argument, NULL, 'a'},
+        {"overlap", no_argument, NULL, OPT_OVERLAP},
+        {"shuffle", no_argument, NULL, OPT_SHUFFLE},
+        {"seed", required_argument, NULL, OPT_SEED},
+        {NULL, 0, NULL, 0},
+    };
+    uint64_t value;
+    int      opt;
+
+    while ((opt = getopt_long(argc, argv, "c:e:n:s:b:a:", longOptions,
+                              NULL)) != -1) {
+        switch (opt) {
+        case 'c':
+            spec.elfClass = atoi(optarg);
+            if (spec.elfClass != 32 && spec.elfClass != 64) {
+                fprintf(stderr, "Invalid class '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'e':
+            if (strcmp(optarg, "le") != 0 && strcmp(optarg, "be") != 0) {
+                fprintf(stderr, "Invalid byte order '%s'\n", optarg);
+                return 1;
+            }
+            spec.bigEndian = strcmp(optarg, "be") == 0;
+            break;
+        case 'n':
+            if (parseSize(optarg, &value) != 0 || value < 1 ||
+                value > UINT32_MAX) {
+                fprintf(stderr, "Invalid segment count '%s'\n", optarg);
+                return 1;
+            }
+            spec.segments = value;
+            break;
+        case 's':
+        case 'b':
+            if (parseSize(optarg, &value) != 0) {
+                fprintf(stderr, "Invalid size '%s'\n", optarg);
+                return 1;
+            }
+            *(opt == 's' ? &spec.size : &spec.bss) = value;
+            break;
+        case 'a':
+            if (parseSize(optarg, &value) != 0 || value == 0 ||
+                (value & (value - 1)) != 0) {
+                fprintf(stderr, "Invalid alignment '%s'\n", optarg);
+                return 1;
+            }
+            spec.align = value;
+            break;
+        case OPT_OVERLAP:
+            spec.overlap = true;
+            break;
+        case OPT_SHUFFLE:
+            spec.shuffle = true;
+            break;
+        case OPT_SEED:
+            if (parseSize(optarg, &spec.seed) != 0) {
+                fprintf(stderr, "Invalid seed '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind + 1 != argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    int fd = open(argv[optind], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("open output");
+        return 1;
+    }
+    int rc = generate(&spec, fd);
+    if (close(fd) != 0) {
+        perror("close output");
+        rc = -1;
+    }
+    if (rc != 0) {
+        unlink(argv[optind]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,665 @@
+/*
+ * perfcheck: compare a squashelf-bench JSON report with a baseline.
+ *
+ * Cases are matched by input and backend. A case regresses when its
+ * median run (with -b, its fastest) got slower, or its peak RSS grew, by
+ * more than -t percent, or -T for the backends listed with -i, whose
+ * times mostly measure the disk, and by more than an absolute floor (-m
+ * milliseconds, -k KiB), so the jitter of short cases does not fail the
+ * check. With -d, the times are first divided by the host drift, the
+ * median slowdown over all cases, so a host that is busy for a whole
+ * report doesn't fail every case; a change that slows every case alike
+ * is taken out the same way, so -d is for spotting regressions confined
+ * to some cases on a noisy host, not for gating. A case that was ok in
+ * the baseline and now fails, or is missing, regresses too. Every case
+ * is listed with its change; the phase that grew the most is named for
+ * the ones that regressed. Exits 1 if any case regressed.
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <getopt.h>
+#include <stdbool.h>
+
+/* Phase timings kept per case; squashelf-bench reports fewer */
+#define MAX_PHASES 32
+
+/* One case of a report */
+struct benchCase {
+    char*  input;
+    char*  backend;
+    bool   ok;
+    double bestMs;
+    double medianMs; /* 0 in reports from before median_ms */
+    double peakRssKb;
+    size_t phaseCount;
+    char*  phaseNames[MAX_PHASES];
+    double phaseMs[MAX_PHASES];
+};
+
+/* A whole report and the parser's position in its text */
+struct report {
+    const char*       path;
+    const char*       pos;
+    struct benchCase* cases;
+    size_t            count;
+};
+
+/*
+ * usage:
+ *   Print the command line synopsis.
+ */
+static void usage(const char* prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options] <baseline.json> <results.json>\n"
+            "  -t, --tolerance PCT     allowed slowdown or RSS growth "
+            "(default 10)\n"
+            "  -T, --io-tolerance PCT  the same for the -i backends (default "
+            "-t)\n"
+            "  -i, --io-backends LIST  comma-separated I/O-bound backends\n"
+            "  -m, --min-ms MS         ignore time changes up to MS (default "
+            "1)\n"
+            "  -k, --min-kb KB         ignore RSS changes up to KB (default "
+            "1024)\n"
+            "  -b, --best              compare the fastest runs, not the "
+            "medians\n"
+            "  -d, --drift             take out a slowdown shared by all "
+            "cases\n",
+            prog);
+}
+
+/*
+ * readFile:
+ *   Read all of path into a NUL-terminated buffer.
+ */
+static char* readFile(const char* path)
+{
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        perror(path);
+        return NULL;
+    }
+    size_t size = 0;
+    size_t cap  = 1 << 16;
+    char*  buf  = malloc(cap);
+    while (buf) {
+        size += fread(buf + size, 1, cap - size - 1, fp);
+        if (size < cap - 1) {
+            break;
+        }
+        char* grown = realloc(buf, cap *= 2);
+        if (!grown) {
+            free(buf);
+        }
+        buf = grown;
+    }
+    if (!buf) {
+        perror("malloc");
+    }
+    else if (ferror(fp)) {
+        perror(path);
+        free(buf);
+        buf = NULL;
+    }
+    else {
+        buf[size] = '\0';
+    }
+    fclose(fp);
+    return buf;
+}
+
+/*
+ * skipSpace:
+ *   Advance past whitespace; returns the next character.
+ */
+static char skipSpace(struct report* rep)
+{
+    while (isspace((unsigned char)*rep->pos)) {
+        rep->pos++;
+    }
+    return *rep->pos;
+}
+
+/*
+ * expect:
+ *   Consume c, or report where the JSON went wrong.
+ */
+static bool expect(struct report* rep, char c)
+{
+    if (skipSpace(rep) != c) {
+        fprintf(stderr, "%s: expected '%c' at \"%.20s\"\n", rep->path, c,
+                rep->pos);
+        return false;
+    }
+    rep->pos++;
+    return true;
+}
+
+/*
+ * nextMember:
+ *   Consume the ',' before another member or element, if there is one.
+ */
+static bool nextMember(struct report* rep)
+{
+    if (skipSpace(rep) != ',') {
+        return false;
+    }
+    rep->pos++;
+    return true;
+}
+
+/*
+ * parseString:
+ *   Parse a JSON string into a new buffer. Escapes are kept as the
+ *   character after the backslash, which is all the report's input
+ *   names need to compare equal.
+ */
+static char* parseString(struct report* rep)
+{
+    if (!expect(rep, '"')) {
+        return NULL;
+    }
+    const char* start = rep->pos;
+    char*       out   = malloc(strlen(start) + 1);
+    size_t      len   = 0;
+    if (!out) {
+        perror("malloc");
+        return NULL;
+    }
+    while (*rep->pos && *rep->pos != '"') {
+        if (*rep->pos == '\\' && rep->pos[1]) {
+            rep->pos++;
+        }
+        out[len++] = *rep->pos++;
+    }
+    if (!*rep->pos) {
+        fprintf(stderr, "%s: unterminated string\n", rep->path);
+        free(out);
+        return NULL;
+    }
+    rep->pos++;
+    out[len] = '\0';
+    return out;
+}
+
+/*
+ * skipValue:
+ *   Step over one JSON value of any type.
+ */
+static bool skipValue(struct report* rep)
+{
+    char c = skipSpace(rep);
+    if (c == '"') {
+        char* s  = parseString(rep);
+        bool  ok = s != NULL;
+        free(s);
+        return ok;
+    }
+    if (c == '{' || c == '[') {
+        char close = c == '{' ? '}' : ']';
+        rep->pos++;
+        if (skipSpace(rep) == close) {
+            rep->pos++;
+            return true;
+        }
+        do {
+            if (c == '{' && !(skipValue(rep) && expect(rep, ':'))) {
+                return false;
+            }
+            if (!skipValue(rep)) {
+                return false;
+            }
+        } while (nextMember(rep));
+        return expect(rep, close);
+    }
+    const char* start = rep->pos;
+    while (*rep->pos && (isalnum((unsigned char)*rep->pos) ||
+                         strchr("+-.", *rep->pos))) {
+        rep->pos++;
+    }
+    if (rep->pos == start) {
+        fprintf(stderr, "%s: unexpected \"%.20s\"\n", rep->path, start);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * parseNumber:
+ *   Parse a JSON number.
+ */
+static bool parseNumber(struct report* rep, double* value)
+{
+    char* end;
+    skipSpace(rep);
+    *value = strtod(rep->pos, &end);
+    if (end == rep->pos) {
+        fprintf(stderr, "%s: expected a number at \"%.20s\"\n", rep->path,
+                rep->pos);
+        return false;
+    }
+    rep->pos = end;
+    return true;
+}
+
+/*
+ * parsePhases:
+ *   Parse the "phases_ms" object of a case.
+ */
+static bool parsePhases(struct report* rep, struct benchCase* bc)
+{
+    if (!expect(rep, '{')) {
+        return false;
+    }
+    if (skipSpace(rep) == '}') {
+        rep->pos++;
+        return true;
+    }
+    do {
+        char* name = parseString(rep);
+        if (!name || !expect(rep, ':')) {
+            free(name);
+            return false;
+        }
+        if (bc->phaseCount == MAX_PHASES) {
+            free(name);
+            if (!skipValue(rep)) {
+                return false;
+            }
+            continue;
+        }
+        bc->phaseNames[bc->phaseCount] = name;
+        if (!parseNumber(rep, &bc->phaseMs[bc->phaseCount++])) {
+            return false;
+        }
+    } while (nextMember(rep));
+    return expect(rep, '}');
+}
+
+/*
+ * parseCase:
+ *   Parse one case object, keeping the members perfcheck compares.
+ */
+static bool parseCase(struct report* rep, struct benchCase* bc)
+{
+    if (!expect(rep, '{')) {
+        return false;
+    }
+    do {
+        char* key = parseString(rep);
+        bool  ok  = key && expect(rep, ':');
+        if (ok && strcmp(key, "input") == 0) {
+            ok = (bc->input = parseString(rep)) != NULL;
+        }
+        else if (ok && strcmp(key, "backend") == 0) {
+            ok = (bc->backend = parseString(rep)) != NULL;
+        }
+        else if (ok && strcmp(key, "ok") == 0) {
+            skipSpace(rep);
+            bc->ok = strncmp(rep->pos, "true", 4) == 0;
+            ok     = skipValue(rep);
+        }
+        else if (ok && strcmp(key, "best_ms") == 0) {
+            ok = parseNumber(rep, &bc->bestMs);
+        }
+        else if (ok && strcmp(key, "median_ms") == 0) {
+            ok = parseNumber(rep, &bc->medianMs);
+        }
+        else if (ok && strcmp(key, "peak_rss_kb") == 0) {
+            ok = parseNumber(rep, &bc->peakRssKb);
+        }
+        else if (ok && strcmp(key, "phases_ms") == 0) {
+            ok = parsePhases(rep, bc);
+        }
+        else if (ok) {
+            ok = skipValue(rep);
+        }
+        free(key);
+        if (!ok) {
+            return false;
+        }
+    } while (nextMember(rep));
+    if (!expect(rep, '}')) {
+        return false;
+    }
+    if (!bc->input || !bc->backend) {
+        fprintf(stderr, "%s: case without input or backend\n", rep->path);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * loadReport:
+ *   Read and parse a squashelf-bench --json report.
+ */
+static bool loadReport(const char* path, struct report* rep)
+{
+    char*  text = readFile(path);
+    bool   ok   = false;
+    size_t cap  = 0;
+
+    rep->path  = path;
+    rep->pos   = text;
+    rep->cases = NULL;
+    rep->count = 0;
+    if (!text || !expect(rep, '[')) {
+        goto out;
+    }
+    if (skipSpace(rep) == ']') {
+        ok = true;
+        goto out;
+    }
+    do {
+        if (rep->count == cap) {
+            size_t            grown = cap ? 2 * cap : 16;
+            struct benchCase* more  = realloc(rep->cases,
+                                              grown * sizeof(*more));
+            if (!more) {
+                perror("realloc");
+                goto out;
+            }
+            rep->cases = more;
+            cap        = grown;
+        }
+        struct benchCase* bc = &rep->cases[rep->count++];
+        memset(bc, 0, sizeof(*bc));
+        if (!parseCase(rep, bc)) {
+            goto out;
+        }
+    } while (nextMember(rep));
+    ok = expect(rep, ']');
+
+out:
+    free(text);
+    rep->pos = NULL;
+    return ok;
+}
+
+/*
+ * freeReport:
+ *   Release the cases of a report.
+ */
+static void freeReport(struct report* rep)
+{
+    for (size_t i = 0; i < rep->count; i++) {
+        struct benchCase* bc = &rep->cases[i];
+        free(bc->input);
+        free(bc->backend);
+        for (size_t p = 0; p < bc->phaseCount; p++) {
+            free(bc->phaseNames[p]);
+        }
+    }
+    free(rep->cases);
+}
+
+/*
+ * findCase:
+ *   The case of rep with the same input and backend as bc, if any.
+ */
+static const struct benchCase* findCase(const struct report*    rep,
+                                        const struct benchCase* bc)
+{
+    for (size_t i = 0; i < rep->count; i++) {
+        if (strcmp(rep->cases[i].input, bc->input) == 0 &&
+            strcmp(rep->cases[i].backend, bc->backend) == 0) {
+            return &rep->cases[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * worstPhase:
+ *   Name of the phase whose time grew the most from base to now, or
+ *   NULL if none grew.
+ */
+static const char* worstPhase(const struct benchCase* base,
+                              const struct benchCase* now, double* growthMs)
+{
+    const char* worst = NULL;
+    *growthMs         = 0;
+    for (size_t p = 0; p < now->phaseCount; p++) {
+        for (size_t q = 0; q < base->phaseCount; q++) {
+            if (strcmp(now->phaseNames[p], base->phaseNames[q]) == 0 &&
+                now->phaseMs[p] - base->phaseMs[q] > *growthMs) {
+                worst     = now->phaseNames[p];
+                *growthMs = now->phaseMs[p] - base->phaseMs[q];
+            }
+        }
+    }
+    return worst;
+}
+
+/*
+ * inList:
+ *   Whether name is one of the comma-separated words of list.
+ */
+static bool inList(const char* list, const char* name)
+{
+    size_t len = strlen(name);
+    while (list && *list) {
+        const char* comma = strchr(list, ',');
+        size_t      word  = comma ? (size_t)(comma - list) : strlen(list);
+        if (word == len && strncmp(list, name, len) == 0) {
+            return true;
+        }
+        list = comma ? comma + 1 : NULL;
+    }
+    return false;
+}
+
+/*
+ * caseTimes:
+ *   The run times of a case to compare: the medians, or the fastest runs
+ *   with best or if either report is from before median_ms.
+ */
+static void caseTimes(const struct benchCase* base,
+                      const struct benchCase* now, bool best, double* baseMs,
+                      double* nowMs)
+{
+    bool useMedian = !best && base->medianMs > 0 && now->medianMs > 0;
+    *baseMs        = useMedian ? base->medianMs : base->bestMs;
+    *nowMs         = useMedian ? now->medianMs : now->bestMs;
+}
+
+static int compareDouble(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * hostDrift:
+ *   Median ratio of now to base run times over the cases ok in both, or
+ *   1 if there are none or the host got faster. A host that runs slow for
+ *   the whole of a report slows every case alike, which this takes out.
+ */
+static double hostDrift(const struct report* base, const struct report* now,
+                        bool best)
+{
+    size_t  count  = 0;
+    double* ratios = malloc((base->count ? base->count : 1) * sizeof(*ratios));
+    double  drift  = 1;
+    if (!ratios) {
+        return 1;
+    }
+    for (size_t i = 0; i < base->count; i++) {
+        const struct benchCase* b = &base->cases[i];
+        const struct benchCase* n = findCase(now, b);
+        double                  baseMs, nowMs;
+        if (!b->ok || !n || !n->ok) {
+            continue;
+        }
+        caseTimes(b, n, best, &baseMs, &nowMs);
+        if (baseMs > 0) {
+            ratios[count++] = nowMs / baseMs;
+        }
+    }
+    if (count) {
+        qsort(ratios, count, sizeof(*ratios), compareDouble);
+        drift = count % 2 ? ratios[count / 2]
+                          : (ratios[count / 2 - 1] + ratios[count / 2]) / 2;
+    }
+    free(ratios);
+    return drift > 1 ? drift : 1;
+}
+
+/*
+ * exceeds:
+ *   Whether now is worse than base by more than pct percent and by more
+ *   than floor.
+ */
+static bool exceeds(double base, double now, double pct, double floor)
+{
+    return now - base > floor && now > base * (1 + pct / 100);
+}
+
+int main(int argc, char* argv[])
+{
+    double      tolerance   = 10;
+    double      ioTolerance = -1; /* -t unless given */
+    const char* ioBackends  = NULL;
+    double      minMs       = 1;
+    double      minKb       = 1024;
+    bool        best        = false;
+    bool        drift       = false;
+    static const struct option longOptions[] = {
+        {"tolerance", required_argument, NULL, 't'},
+        {"io-tolerance", required_argument, NULL, 'T'},
+        {"io-backends", required_argument, NULL, 'i'},
+        {"min-ms", required_argument, NULL, 'm'},
+        {"min-kb", required_argument, NULL, 'k'},
+        {"best", no_argument, NULL, 'b'},
+        {"drift", no_argument, NULL, 'd'},
+        {NULL, 0, NULL, 0},
+    };
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "t:T:i:m:k:bd", longOptions,
+                              NULL)) != -1) {
+        char*   end;
+        double* value = opt == 't'   ? &tolerance
+                        : opt == 'T' ? &ioTolerance
+                        : opt == 'm' ? &minMs
+                                     : &minKb;
+        switch (opt) {
+        case 't':
+        case 'T':
+        case 'm':
+        case 'k':
+            *value = strtod(optarg, &end);
+            if (end == optarg || *end || *value < 0) {
+                fprintf(stderr, "Invalid value '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'i':
+            ioBackends = optarg;
+            break;
+        case 'b':
+            best = true;
+            break;
+        case 'd':
+            drift = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (ioTolerance < 0) {
+        ioTolerance = tolerance;
+    }
+    if (argc - optind != 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    struct report base;
+    struct report now;
+    if (!loadReport(argv[optind], &base)) {
+        freeReport(&base);
+        return 1;
+    }
+    if (!loadReport(argv[optind + 1], &now)) {
+        freeReport(&base);
+        freeReport(&now);
+        return 1;
+    }
+
+    double scale = drift ? hostDrift(&base, &now, best) : 1;
+    printf("Comparing %s run times\n", best ? "fastest" : "median");
+    if (scale > 1) {
+        printf("Host drift: the median case is %.1f%% slower; now_ms is "
+               "divided by %.3f\n",
+               (scale - 1) * 100, scale);
+    }
+    printf("%-32s %-16s %10s %10s %8s %10s %10s %8s\n", "input", "backend",
+           "base_ms", "now_ms", "change", "base_kb", "now_kb", "change");
+    size_t checked     = 0;
+    size_t regressions = 0;
+    for (size_t i = 0; i < base.count; i++) {
+        const struct benchCase* b = &base.cases[i];
+        const struct benchCase* n = findCase(&now, b);
+        if (!b->ok) {
+            continue; /* nothing to hold the case to */
+        }
+        checked++;
+        printf("%-32s %-16s", b->input, b->backend);
+        if (!n || !n->ok) {
+            printf(" %s\n", n ? "FAILED" : "MISSING");
+            regressions++;
+            continue;
+        }
+        double baseMs, nowMs;
+        caseTimes(b, n, best, &baseMs, &nowMs);
+        nowMs /= scale;
+        double pct    = inList(ioBackends, b->backend) ? ioTolerance
+                                                       : tolerance;
+        bool   slower = exceeds(baseMs, nowMs, pct, minMs);
+        bool   bigger = exceeds(b->peakRssKb, n->peakRssKb, tolerance, minKb);
+        printf(" %10.3f %10.3f %+7.1f%% %10.0f %10.0f %+7.1f%%", baseMs,
+               nowMs, baseMs > 0 ? (nowMs / baseMs - 1) * 100 : 0,
+               b->peakRssKb, n->peakRssKb,
+               b->peakRssKb > 0 ? (n->peakRssKb / b->peakRssKb - 1) * 100
+                                : 0);
+        if (slower || bigger) {
+            double      growth;
+            const char* phase = worstPhase(b, n, &growth);
+            printf("  REGRESSED (%s", slower ? "time" : "rss");
+            if (slower && bigger) {
+                printf(", rss");
+            }
+            if (slower && phase) {
+                printf("; %s +%.3f ms", phase, growth);
+            }
+            printf(")");
+            regressions++;
+        }
+        printf("\n");
+    }
+    for (size_t i = 0; i < now.count; i++) {
+        if (!findCase(&base, &now.cases[i])) {
+            printf("%-32s %-16s new, not checked\n", now.cases[i].input,
+                   now.cases[i].backend);
+        }
+    }
+    if (regressions) {
+        printf("%zu of %zu cases regressed (tolerance %.1f%%, %.1f%% for "
+               "I/O-bound backends, %.3f ms, %.0f KiB)\n",
+               regressions, checked, tolerance, ioTolerance, minMs, minKb);
+    }
+    else {
+        printf("No regressions in %zu cases\n", checked);
+    }
+
+    freeReport(&base);
+    freeReport(&now);
+    return regressions ? 1 : 0;
+}
@@ -0,0 +1,1327 @@
+/*
+ * selftest: check the library's hashes and digests, and the squashelf
+ * CLI given as the argument (`make check`).
+ *
+ * XXH64, CRC-32 and SHA-256 are held to published test vectors, and the
+ * PCLMULQDQ CRC-32 and SHA-NI SHA-256 paths, where the CPU has them, to
+ * the portable slicing-by-8 and C code over a range of lengths, buffer
+ * alignments and update splits. The library source is built in, so the
+ * internal digest functions and the run-time dispatch flags can be used
+ * directly. The CLI is run on small ELF64 inputs written here, in a
+ * scratch directory under $TMPDIR, and its outputs are checked against
+ * what the inputs say they should hold. Exits 1 if any check fails.
+ */
+#include "libsquashelf.c"
+
+#include <dirent.h>
+#include <signal.h>
+#include <ftw.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+/* Random test data; every length and offset below stays inside it */
+#define TEST_DATA (1UL << 20)
+
+/* XXH64 of sanityBuffer prefixes, from the xxHash sanity check */
+static const struct {
+    size_t   len;
+    uint64_t seed;
+    uint64_t hash;
+} xxh64Vectors[] = {
+    {0, 0, 0xef46db3751d8e999UL},
+    {0, 2654435761U, 0xac75fda2929b17efUL},
+    {1, 0, 0x4fce394cc88952d8UL},
+    {1, 2654435761U, 0x739840cb819fa723UL},
+    {14, 0, 0xcffa8db881bc3a3dUL},
+    {14, 2654435761U, 0x5b9611585efcc9cbUL},
+    {101, 0, 0x0eab543384f878adUL},
+    {101, 2654435761U, 0xcaa65939306f1e21UL},
+};
+
+/* CRC-32 and SHA-256 of short strings: the CRC-32 check value of
+   "123456789", the FIPS 180-2 SHA-256 examples and a few more */
+static const struct {
+    const char* text;
+    uint32_t    crc;
+    const char* sha256;
+} digestVectors[] = {
+    {"", 0x00000000,
+     "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"},
+    {"abc", 0x352441c2,
+     "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"},
+    {"123456789", 0xcbf43926,
+     "15e2b0d3c33891ebb0f1ef609ec419420c20e320ce94c65fbc8c3312448eb225"},
+    {"The quick brown fox jumps over the lazy dog", 0x414fa339,
+     "d7a8fbb307d7809469ca9abcb0082e4f8d5651e46d3cdb762d02d0bf37c9e592"},
+    {"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 0x171a3f5f,
+     "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"},
+};
+
+static int checks;
+static int failures;
+
+/*
+ * report:
+ *   Count a check and describe it if it failed.
+ */
+static void report(bool ok, const char* fmt, ...)
+{
+    checks++;
+    if (ok) {
+        return;
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(stderr, "FAIL: ");
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+    failures++;
+}
+
+/*
+ * digest:
+ *   CRC-32 and SHA-256 of len bytes at p, fed to digestUpdate in pieces
+ *   of at most split bytes, through the accelerated paths or not.
+ */
+static void digest(const unsigned char* p, size_t len, size_t split,
+                   bool accel, bool cpuClmul, bool cpuShaNi, uint32_t* crc,
+                   unsigned char sha256[32])
+{
+    struct digestState st;
+    digestInit(&st);
+    haveClmul = accel && cpuClmul;
+    haveShaNi = accel && cpuShaNi;
+    for (size_t done = 0; done < len;) {
+        size_t chunk = len - done < split ? len - done : split;
+        digestUpdate(&st, p + done, chunk);
+        done += chunk;
+    }
+    digestFinish(&st, crc, sha256);
+}
+
+static void toHex(const unsigned char sha256[32], char hex[65])
+{
+    for (int i = 0; i < 32; i++) {
+        sprintf(hex + 2 * i, "%02x", sha256[i]);
+    }
+}
+
+/*
+ * checkDigests:
+ *   The XXH64, CRC-32 and SHA-256 checks. Returns -1 if they could not
+ *   be run.
+ */
+static int checkDigests(void)
+{
+    /* digestInit runs the CPU check; keep what it found */
+    struct digestState probe;
+    digestInit(&probe);
+    bool cpuClmul = haveClmul;
+    bool cpuShaNi = haveShaNi;
+    printf("PCLMULQDQ CRC-32: %s\n", cpuClmul ? "tested" : "not available");
+    printf("SHA-NI SHA-256:   %s\n", cpuShaNi ? "tested" : "not available");
+
+    unsigned char sanity[101];
+    uint32_t      gen = 2654435761U;
+    for (size_t i = 0; i < sizeof(sanity); i++) {
+        sanity[i] = gen >> 24;
+        gen *= gen;
+    }
+    for (size_t i = 0; i < sizeof(xxh64Vectors) / sizeof(*xxh64Vectors);
+         i++) {
+        uint64_t h = squashelf_hash64(sanity, xxh64Vectors[i].len,
+                                      xxh64Vectors[i].seed);
+        report(h == xxh64Vectors[i].hash,
+               "XXH64 of %zu bytes, seed 0x%lx: 0x%016lx, expected 0x%016lx",
+               xxh64Vectors[i].len, xxh64Vectors[i].seed, h,
+               xxh64Vectors[i].hash);
+    }
+
+    /* Published vectors, on both paths, whole and a byte at a time */
+    for (size_t i = 0; i < sizeof(digestVectors) / sizeof(*digestVectors);
+         i++) {
+        const char* text = digestVectors[i].text;
+        for (int accel = 0; accel < 2; accel++) {
+            for (size_t split = 1; split <= 64; split += 63) {
+                uint32_t      crc;
+                unsigned char sha[32];
+                char          hex[65];
+                digest((const unsigned char*)text, strlen(text), split, accel,
+                       cpuClmul, cpuShaNi, &crc, sha);
+                toHex(sha, hex);
+                report(crc == digestVectors[i].crc,
+                       "CRC-32 of \"%s\" (%s, split %zu): 0x%08x, "
+                       "expected 0x%08x",
+                       text, accel ? "accelerated" : "portable", split, crc,
+                       digestVectors[i].crc);
+                report(strcmp(hex, digestVectors[i].sha256) == 0,
+                       "SHA-256 of \"%s\" (%s, split %zu): %s, expected %s",
+                       text, accel ? "accelerated" : "portable", split, hex,
+                       digestVectors[i].sha256);
+            }
+        }
+    }
+
+    unsigned char* data = malloc(TEST_DATA);
+    if (!data) {
+        perror("malloc test data");
+        return -1;
+    }
+
+    /* The FIPS 180-2 million 'a' vector, which also runs the CLMUL fold
+       loop over many blocks */
+    memset(data, 'a', 1000000);
+    for (int accel = 0; accel < 2; accel++) {
+        uint32_t      crc;
+        unsigned char sha[32];
+        char          hex[65];
+        digest(data, 1000000, 1000000, accel, cpuClmul, cpuShaNi, &crc, sha);
+        toHex(sha, hex);
+        report(crc == 0xdc25bfbc,
+               "CRC-32 of a million 'a' (%s): 0x%08x, expected 0xdc25bfbc",
+               accel ? "accelerated" : "portable", crc);
+        report(strcmp(hex, "cdc76e5c9914fb9281a1c7e284d73e67"
+                           "f1809a48a497200e046d39ccc7112cd0") == 0,
+               "SHA-256 of a million 'a' (%s): %s",
+               accel ? "accelerated" : "portable", hex);
+    }
+
+    /* Accelerated against portable: every length up to 512 at each
+       alignment within 16 bytes, whole and in 7-byte pieces, then longer
+       runs in pieces of each size */
+    uint64_t seed = 0x9e3779b97f4a7c15UL;
+    for (size_t i = 0; i < TEST_DATA; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        data[i] = seed >> 32;
+    }
+    static const size_t shortSplits[] = {7, TEST_DATA};
+    static const size_t longLens[]    = {1000, 4095,  4096,
+                                         4097, 65599, TEST_DATA - 16};
+    static const size_t longSplits[]  = {1, 63, 64, 65, 1000, TEST_DATA};
+    size_t              lenCount = 513 + sizeof(longLens) / sizeof(*longLens);
+    for (size_t l = 0; l < lenCount; l++) {
+        bool          isShort = l < 513;
+        size_t        len     = isShort ? l : longLens[l - 513];
+        const size_t* split   = isShort ? shortSplits : longSplits;
+        size_t        nSplit  = isShort ? 2 : 6;
+        for (size_t align = 0; align < (isShort ? 16 : 2); align++) {
+            for (size_t s = 0; s < nSplit; s++) {
+                uint32_t      crcA, crcP;
+                unsigned char shaA[32], shaP[32];
+                digest(data + align, len, split[s], true, cpuClmul, cpuShaNi,
+                       &crcA, shaA);
+                digest(data + align, len, split[s], false, cpuClmul,
+                       cpuShaNi, &crcP, shaP);
+                report(crcA == crcP,
+                       "CRC-32 of %zu bytes at +%zu, split %zu: accelerated "
+                       "0x%08x, portable 0x%08x",
+                       len, align, split[s], crcA, crcP);
+                report(memcmp(shaA, shaP, sizeof(shaA)) == 0,
+                       "SHA-256 of %zu bytes at +%zu, split %zu: accelerated "
+                       "and portable differ",
+                       len, align, split[s]);
+            }
+        }
+    }
+    free(data);
+    return 0;
+}
+
+/* One PT_LOAD of a test input; vaddr 0 means the same as lma */
+struct testSegment {
+    uint64_t lma;
+    uint64_t vaddr;
+    uint64_t filesz;
+    uint64_t memsz; /* 0 means filesz */
+    uint64_t align; /* 0 means 16 */
+};
+
+/* A test input as written, for checking outputs against */
+struct testInput {
+    unsigned char* bytes;
+    size_t         size;
+    size_t         phnum;
+    Elf64_Phdr     pht[64];
+};
+
+static const char* squashelfPath;
+static char        scratchDir[PATH_MAX / 2];
+
+/*
+ * scratchPath:
+ *   Path of name in the scratch directory, in one of a few rotating
+ *   static buffers.
+ */
+static const char* scratchPath(const char* name)
+{
+    static char paths[8][PATH_MAX];
+    static int  next;
+    char*       path = paths[next++ % 8];
+    snprintf(path, PATH_MAX, "%s/%s", scratchDir, name);
+    return path;
+}
+
+/*
+ * writeBytes:
+ *   Write size bytes to scratch file name. Returns 0 or -1.
+ */
+static int writeBytes(const char* name, const void* bytes, size_t size)
+{
+    int fd = open(scratchPath(name), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write(fd, bytes, size) != (ssize_t)size) {
+        perror("write test input");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return close(fd);
+}
+
+/*
+ * writeInput:
+ *   Write an ELF64 little-endian executable holding segs as its PHT, in
+ *   that order, each payload at the first offset after the previous one
+ *   congruent to its vaddr and filled from seed, and describe it in in.
+ *   Returns 0 or -1.
+ */
+static int writeInput(const char* name, const struct testSegment* segs,
+                      size_t count, uint64_t seed, struct testInput* in)
+{
+    uint64_t pos = sizeof(Elf64_Ehdr) + count * sizeof(Elf64_Phdr);
+    in->phnum    = count;
+    for (size_t i = 0; i < count; i++) {
+        Elf64_Phdr* ph = &in->pht[i];
+        memset(ph, 0, sizeof(*ph));
+        ph->p_type   = PT_LOAD;
+        ph->p_flags  = PF_R | PF_W;
+        ph->p_paddr  = segs[i].lma;
+        ph->p_vaddr  = segs[i].vaddr ? segs[i].vaddr : segs[i].lma;
+        ph->p_filesz = segs[i].filesz;
+        ph->p_memsz  = segs[i].memsz ? segs[i].memsz : segs[i].filesz;
+        ph->p_align  = segs[i].align ? segs[i].align : 16;
+        pos += (ph->p_vaddr - pos) & (ph->p_align - 1);
+        ph->p_offset = pos;
+        pos += ph->p_filesz;
+    }
+
+    in->size  = pos;
+    in->bytes = calloc(1, pos);
+    if (!in->bytes) {
+        perror("calloc test input");
+        return -1;
+    }
+    Elf64_Ehdr* eh = (Elf64_Ehdr*)in->bytes;
+    memcpy(eh->e_ident, ELFMAG, SELFMAG);
+    eh->e_ident[EI_CLASS]   = ELFCLASS64;
+    eh->e_ident[EI_DATA]    = ELFDATA2LSB;
+    eh->e_ident[EI_VERSION] = EV_CURRENT;
+    eh->e_type              = ET_EXEC;
+    eh->e_machine           = EM_ARM;
+    eh->e_version           = EV_CURRENT;
+    eh->e_entry             = count ? in->pht[0].p_vaddr : 0;
+    eh->e_phoff             = sizeof(Elf64_Ehdr);
+    eh->e_ehsize            = sizeof(Elf64_Ehdr);
+    eh->e_phentsize         = sizeof(Elf64_Phdr);
+    eh->e_phnum             = count;
+    eh->e_shentsize         = sizeof(Elf64_Shdr);
+    memcpy(in->bytes + eh->e_phoff, in->pht, count * sizeof(Elf64_Phdr));
+    for (size_t i = 0; i < count; i++) {
+        unsigned char* p = in->bytes + in->pht[i].p_offset;
+        for (uint64_t b = 0; b < in->pht[i].p_filesz; b++) {
+            seed ^= seed << 13;
+            seed ^= seed >> 7;
+            seed ^= seed << 17;
+            p[b] = seed >> 24;
+        }
+    }
+
+    return writeBytes(name, in->bytes, in->size);
+}
+
+/*
+ * readOutput:
+ *   The contents of scratch file name, malloc'd, or NULL (with *size 0)
+ *   if it cannot be read.
+ */
+static unsigned char* readOutput(const char* name, size_t* size)
+{
+    struct stat    st;
+    unsigned char* buf = NULL;
+    int            fd  = open(scratchPath(name), O_RDONLY);
+    *size              = 0;
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) == 0 && (buf = malloc(st.st_size + 1)) &&
+        read(fd, buf, st.st_size) == st.st_size) {
+        *size = st.st_size;
+    }
+    else {
+        free(buf);
+        buf = NULL;
+    }
+    close(fd);
+    return buf;
+}
+
+/*
+ * sameFiles:
+ *   Whether scratch files a and b both exist and hold the same bytes.
+ */
+static bool sameFiles(const char* a, const char* b)
+{
+    size_t         sizeA, sizeB;
+    unsigned char* bufA = readOutput(a, &sizeA);
+    unsigned char* bufB = readOutput(b, &sizeB);
+    bool           same = bufA && bufB && sizeA == sizeB &&
+                memcmp(bufA, bufB, sizeA) == 0;
+    free(bufA);
+    free(bufB);
+    return same;
+}
+
+/*
+ * spawn:
+ *   Start squashelf with the NULL-terminated args, its output and errors
+ *   sent to /dev/null. Returns its pid, or -1.
+ */
+static pid_t spawn(const char* const* args)
+{
+    const char* argv[64] = {squashelfPath};
+    size_t      argc     = 1;
+    while (*args && argc < 63) {
+        argv[argc++] = *args++;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        execv(squashelfPath, (char* const*)argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+/*
+ * squashArgs:
+ *   Run squashelf with the NULL-terminated args and return its exit
+ *   status, or -1 if it did not run to the end.
+ */
+static int squashArgs(const char* const* args)
+{
+    int   status;
+    pid_t pid = spawn(args);
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status)) {
+        return -1;
+    }
+    return WEXITSTATUS(status);
+}
+
+/*
+ * squash:
+ *   squashArgs with the NULL-terminated arguments that follow.
+ */
+static int squash(const char* arg, ...)
+{
+    const char* args[64];
+    size_t      count = 0;
+    va_list     ap;
+    va_start(ap, arg);
+    for (; arg && count < 63; arg = va_arg(ap, const char*)) {
+        args[count++] = arg;
+    }
+    va_end(ap);
+    args[count] = NULL;
+    return squashArgs(args);
+}
+
+/*
+ * serveRequest:
+ *   Send one request line on sock with the descriptors fds (passed as
+ *   SCM_RIGHTS), and read the reply line into reply.
+ */
+static bool serveRequest(int sock, const char* line, const int* fds,
+                         size_t fdCount, char* reply, size_t replySize)
+{
+    union {
+        char           buf[CMSG_SPACE(4 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec  iov = {(void*)line, strlen(line)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+    if (fdCount) {
+        msg.msg_control         = control.buf;
+        msg.msg_controllen      = CMSG_SPACE(fdCount * sizeof(int));
+        struct cmsghdr* c       = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level           = SOL_SOCKET;
+        c->cmsg_type            = SCM_RIGHTS;
+        c->cmsg_len             = CMSG_LEN(fdCount * sizeof(int));
+        memcpy(CMSG_DATA(c), fds, fdCount * sizeof(int));
+    }
+    if (sendmsg(sock, &msg, 0) != (ssize_t)strlen(line)) {
+        return false;
+    }
+    size_t len = 0;
+    while (len + 1 < replySize && recv(sock, reply + len, 1, 0) == 1 &&
+           reply[len] != '\n') {
+        len++;
+    }
+    reply[len] = '\0';
+    return len > 0;
+}
+
+/*
+ * loadedByte:
+ *   The byte at lma after loading the file bytes of every segment of in,
+ *   in PHT order, so later segments overwrite earlier ones. Returns false
+ *   if no segment loads lma.
+ */
+static bool loadedByte(const struct testInput* in, uint64_t lma,
+                       unsigned char* byte)
+{
+    bool found = false;
+    for (size_t i = 0; i < in->phnum; i++) {
+        const Elf64_Phdr* ph = &in->pht[i];
+        if (lma >= ph->p_paddr && lma - ph->p_paddr < ph->p_filesz) {
+            *byte = in->bytes[ph->p_offset + (lma - ph->p_paddr)];
+            found = true;
+        }
+    }
+    return found;
+}
+
+/*
+ * checkOverlap:
+ *   --check-overlap=fail refuses LMA overlaps and aliasing but not shared
+ *   VMAs, and resolve gives the image a sequential load would.
+ */
+static void checkOverlap(void)
+{
+    static const struct {
+        const char*        what;
+        struct testSegment segs[2];
+        int                status; /* expected with fail */
+    } cases[] = {
+        {"disjoint segments",
+         {{0x1000, 0, 0x100, 0, 0}, {0x1100, 0, 0x100, 0, 0}},
+         0},
+        {"LMA overlap",
+         {{0x1000, 0, 0x100, 0, 0}, {0x10ff, 0, 0x100, 0, 0}},
+         1},
+        {"bytes loaded into a relocated VMA",
+         {{0x5000, 0x6000, 0x100, 0, 0}, {0x6080, 0, 0x40, 0, 0}},
+         1},
+        {"overlays sharing a VMA",
+         {{0xa000, 0x9000, 0x100, 0, 0}, {0xb000, 0x9000, 0x100, 0, 0}},
+         0},
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        struct testInput in;
+        if (writeInput("overlap.elf", cases[i].segs, 2, 5, &in) != 0) {
+            report(false, "overlap: cannot write the input");
+            return;
+        }
+        free(in.bytes);
+        report(squash("--check-overlap=warn", scratchPath("overlap.elf"),
+                      scratchPath("overlap-out.elf"), NULL) == 0,
+               "overlap: warn refused %s", cases[i].what);
+        report(squash("--check-overlap=fail", scratchPath("overlap.elf"),
+                      scratchPath("overlap-out.elf"),
+                      NULL) == cases[i].status,
+               "overlap: fail %s %s", cases[i].status ? "passed" : "refused",
+               cases[i].what);
+    }
+
+    /* The last segment in the PHT wins: C inside A, B over A's tail */
+    static const struct testSegment segs[] = {
+        {0x1000, 0, 0x100, 0, 0},
+        {0x1080, 0, 0x100, 0, 0},
+        {0x1010, 0, 0x20, 0, 0},
+        {0x1200, 0, 0x40, 0, 0},
+    };
+    struct testInput in;
+    if (writeInput("resolve.elf", segs, 4, 6, &in) != 0) {
+        report(false, "overlap: cannot write the input");
+        return;
+    }
+    report(squash("--check-overlap=resolve", "--format=bin",
+                  "--gap-fill=0xa5", scratchPath("resolve.elf"),
+                  scratchPath("resolve.bin"), NULL) == 0,
+           "overlap: resolve failed");
+    size_t         size;
+    unsigned char* bin = readOutput("resolve.bin", &size);
+    bool           ok  = bin && size == 0x240;
+    for (size_t i = 0; ok && i < size; i++) {
+        unsigned char want;
+        ok = bin[i] == (loadedByte(&in, 0x1000 + i, &want) ? want : 0xa5);
+    }
+    report(ok, "overlap: resolved image differs from a sequential load");
+    free(bin);
+    free(in.bytes);
+
+    report(squash("--check-overlap=resolve", scratchPath("resolve.elf"),
+                  scratchPath("resolve.elf.out"), NULL) == 0 &&
+               squash("--check-overlap=fail", scratchPath("resolve.elf.out"),
+                      scratchPath("resolve-again.elf"), NULL) == 0,
+           "overlap: resolved ELF still overlaps");
+}
+
+/*
+ * checkWriters:
+ *   Every writer and copy engine writes the same bytes, mapped or not and
+ *   on any number of threads: all of them without an SHT, and all but
+ *   libelf (which adds section headers) with one.
+ */
+static void checkWriters(void)
+{
+    static const struct testSegment segs[] = {
+        {0x10000, 0, 0x3000, 0, 0x1000},
+        {0x20000, 0x30000, 0x1234, 0x2000, 0x1000},
+        {0x40000, 0, 0x10, 0x100, 0},
+        {0x50000, 0, 0x100000, 0, 0x10000},
+    };
+    static const char* const writers[][4] = {
+        {"--writer=libelf"},
+        {"--writer=libelf", "--no-mmap"},
+        {"--writer=direct"},
+        {"--writer=direct", "--copy=sendfile"},
+        {"--writer=direct", "--copy=buffered"},
+        {"--writer=direct", "--no-mmap"},
+        {"--writer=direct", "-j", "4"},
+        {"--writer=uring"},
+        {"--writer=uring", "--no-mmap"},
+    };
+    struct testInput in;
+    if (writeInput("writers.elf", segs, 4, 7, &in) != 0) {
+        report(false, "writers: cannot write the input");
+        return;
+    }
+    free(in.bytes);
+    for (int sht = 0; sht < 2; sht++) {
+        size_t first = sht ? 2 : 0; /* libelf's SHT is not direct's */
+        for (size_t i = first; i < sizeof(writers) / sizeof(writers[0]);
+             i++) {
+            const char* args[8];
+            size_t      argc = 0;
+            for (; argc < 4 && writers[i][argc]; argc++) {
+                args[argc] = writers[i][argc];
+            }
+            if (!sht) {
+                args[argc++] = "-n";
+            }
+            args[argc++] = scratchPath("writers.elf");
+            args[argc++] = scratchPath(i == first ? "writers.ref"
+                                                  : "writers.out");
+            args[argc]   = NULL;
+            report(squashArgs(args) == 0 &&
+                       (i == first || sameFiles("writers.out", "writers.ref")),
+                   "writers: %s%s%s%s differs from %s", writers[i][0],
+                   writers[i][1] ? " " : "",
+                   writers[i][1] ? writers[i][1] : "", sht ? "" : " -n",
+                   writers[first][0]);
+        }
+    }
+}
+
+/*
+ * hexByte:
+ *   The byte spelled by the two hex digits at p, or -1.
+ */
+static int hexByte(const unsigned char* p)
+{
+    int value = 0;
+    for (int i = 0; i < 2; i++) {
+        int c = p[i];
+        int d = c >= '0' && c <= '9'   ? c - '0'
+                : c >= 'A' && c <= 'F' ? c - 'A' + 10
+                                       : -1;
+        if (d < 0) {
+            return -1;
+        }
+        value = value * 16 + d;
+    }
+    return value;
+}
+
+/*
+ * sameHexImage:
+ *   Whether the Intel HEX or S-record output name decodes, with valid
+ *   checksums and line ends, into records in ascending disjoint order that
+ *   hold exactly bytes bytes, each the input's byte at its address.
+ */
+static bool sameHexImage(const char* name, const struct testInput* in,
+                         bool srec, uint64_t bytes)
+{
+    size_t         size;
+    unsigned char* text    = readOutput(name, &size);
+    bool           ok      = text != NULL;
+    bool           ended   = false;
+    uint64_t       upper   = 0;
+    uint64_t       next    = 0;
+    uint64_t       covered = 0;
+    size_t         pos     = 0;
+    while (ok && !ended && pos + 4 <= size) {
+        unsigned char  rec[256 + 5];
+        size_t         head  = srec ? 2 : 1;
+        int            count = hexByte(text + pos + head);
+        size_t         n     = srec ? count + 1 : count + 5;
+        unsigned       sum   = 0;
+        ok = text[pos] == (srec ? 'S' : ':') && count >= 0 &&
+             pos + head + 2 * n + 2 <= size;
+        for (size_t i = 0; ok && i < n; i++) {
+            int b = hexByte(text + pos + head + 2 * i);
+            ok    = b >= 0;
+            rec[i] = b;
+            sum += b;
+        }
+        ok = ok && (sum & 0xff) == (srec ? 0xff : 0) &&
+             memcmp(text + pos + head + 2 * n, "\r\n", 2) == 0;
+        if (!ok) {
+            break;
+        }
+
+        int                  type = srec ? text[pos + 1] - '0' : rec[3];
+        uint64_t             addr = 0;
+        const unsigned char* data = NULL;
+        size_t               len  = 0;
+        if (srec && type >= 1 && type <= 3) {
+            for (int i = 0; i <= type; i++) {
+                addr = addr << 8 | rec[1 + i];
+            }
+            data = rec + 2 + type;
+            len  = count - type - 2;
+        }
+        else if (srec) {
+            ended = type >= 7 && type <= 9;
+            ok    = ended || type == 0;
+        }
+        else if (type == 0x00) {
+            addr = upper << 16 | rec[1] << 8 | rec[2];
+            data = rec + 4;
+            len  = count;
+        }
+        else if (type == 0x04) {
+            upper = rec[4] << 8 | rec[5];
+        }
+        else {
+            ended = type == 0x01;
+            ok    = ended || type == 0x05;
+        }
+        ok = ok && (!data || addr >= next);
+        for (size_t i = 0; ok && i < len; i++) {
+            unsigned char want;
+            ok = loadedByte(in, addr + i, &want) && data[i] == want;
+        }
+        if (data) {
+            next = addr + len;
+            covered += len;
+        }
+        pos += head + 2 * n + 2;
+    }
+    free(text);
+    return ok && ended && pos == size && covered == bytes;
+}
+
+/*
+ * checkHex:
+ *   ihex and srec outputs decode back to the selected bytes, across a
+ *   64 KiB boundary and with every S-record address width.
+ */
+static void checkHex(void)
+{
+    static const struct testSegment segs[] = {
+        {0x100, 0, 0x30, 0, 0},
+        {0x1fff0, 0, 0x40, 0, 0},
+        {0x30000, 0, 0x123, 0x200, 0},
+        {0x1000010, 0, 0x20, 0, 0},
+    };
+    static const struct {
+        const char* range;
+        uint64_t    bytes;
+    } cases[] = {
+        {"0x0-0xffff", 0x30},
+        {"0x0-0xffffff", 0x30 + 0x40 + 0x123},
+        {"0x0-0xffffffff", 0x30 + 0x40 + 0x123 + 0x20},
+    };
+    struct testInput in;
+    if (writeInput("hex.elf", segs, 4, 8, &in) != 0) {
+        report(false, "hex: cannot write the input");
+        return;
+    }
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        for (int srec = 0; srec < 2; srec++) {
+            report(squash(srec ? "--format=srec" : "--format=ihex", "-r",
+                          cases[i].range, scratchPath("hex.elf"),
+                          scratchPath("hex.out"), NULL) == 0 &&
+                       sameHexImage("hex.out", &in, srec, cases[i].bytes),
+                   "hex: %s output for %s does not decode to the input",
+                   srec ? "srec" : "ihex", cases[i].range);
+        }
+    }
+    free(in.bytes);
+}
+
+/*
+ * checkBatch:
+ *   A --batch worker reuses one buffer arena for all its jobs; outputs
+ *   must not depend on what it held before, read with pread or mapped.
+ */
+static void checkBatch(void)
+{
+    static const struct testSegment large[] = {
+        {0x100000, 0, 0x300000, 0, 0x1000},
+        {0x400000, 0, 0x10, 0x1000, 0},
+    };
+    static const struct testSegment small[] = {
+        {0x1000, 0, 0x80, 0, 0},
+        {0x2000, 0, 0x3000, 0, 0x1000},
+    };
+    struct testInput in;
+    const char*      names[] = {"batch-0.elf", "batch-1.elf", "batch-2.elf"};
+    const char*      refs[]  = {"batch-0.ref", "batch-1.ref", "batch-2.ref"};
+    const char*      outs[]  = {"batch-0.out", "batch-1.out", "batch-2.out"};
+    for (int i = 0; i < 3; i++) {
+        if (writeInput(names[i], i == 1 ? small : large, 2, 9 + i, &in) !=
+            0) {
+            report(false, "batch: cannot write the input");
+            return;
+        }
+        free(in.bytes);
+        squash(scratchPath(names[i]), scratchPath(refs[i]), NULL);
+    }
+    for (int mapped = 0; mapped < 2; mapped++) {
+        char paths[6][PATH_MAX];
+        for (int i = 0; i < 3; i++) {
+            strcpy(paths[2 * i], scratchPath(names[i]));
+            strcpy(paths[2 * i + 1], scratchPath(outs[i]));
+        }
+        int status = squash("--batch", "--workers", "1",
+                            mapped ? "--writer=libelf" : "--no-mmap",
+                            paths[0], paths[1], paths[2], paths[3],
+                            paths[4], paths[5], NULL);
+        bool ok    = status == 0;
+        for (int i = 0; i < 3; i++) {
+            ok = ok && sameFiles(outs[i], refs[i]);
+        }
+        report(ok, "batch: %s outputs differ from single runs",
+               mapped ? "mapped" : "--no-mmap");
+    }
+}
+
+/*
+ * checkIncremental:
+ *   --incremental gives the output of a full write, from a separate
+ *   previous output (left as it was) or in place, and --verify accepts
+ *   full, incremental and bin outputs.
+ */
+static void checkIncremental(void)
+{
+    static const struct testSegment segs[] = {
+        {0x1000, 0, 0x2000, 0, 0x1000},
+        {0x4000, 0, 0x800, 0x1000, 0},
+        {0x8000, 0, 0x40000, 0, 0x1000},
+    };
+    struct testInput in;
+    if (writeInput("inc.elf", segs, 3, 12, &in) != 0) {
+        report(false, "incremental: cannot write the input");
+        return;
+    }
+    char input[PATH_MAX];
+    char changed[PATH_MAX];
+    char previous[PATH_MAX];
+    char output[PATH_MAX];
+    strcpy(input, scratchPath("inc.elf"));
+    strcpy(changed, scratchPath("inc-changed.elf"));
+    strcpy(previous, scratchPath("inc-prev.elf"));
+    strcpy(output, scratchPath("inc.out"));
+
+    /* The same input with a few bytes of the middle segment changed */
+    in.bytes[in.pht[1].p_offset + 0x123] ^= 0xff;
+    in.bytes[in.pht[1].p_offset + 0x7ff] ^= 0x01;
+    bool ok = writeBytes("inc-changed.elf", in.bytes, in.size) == 0;
+    free(in.bytes);
+    report(ok && squash(input, previous, NULL) == 0 &&
+               squash(input, scratchPath("inc-prev.ref"), NULL) == 0 &&
+               squash(changed, scratchPath("inc-full.elf"), NULL) == 0,
+           "incremental: cannot write the reference outputs");
+
+    report(squash("--verify", "--incremental", previous, changed, output,
+                  NULL) == 0 &&
+               sameFiles("inc.out", "inc-full.elf") &&
+               sameFiles("inc-prev.elf", "inc-prev.ref"),
+           "incremental: update from a previous output differs");
+    report(squash("--verify", "--incremental", previous, changed, previous,
+                  NULL) == 0 &&
+               sameFiles("inc-prev.elf", "inc-full.elf"),
+           "incremental: update in place differs");
+    report(squash("--verify", "--incremental", scratchPath("none.elf"),
+                  changed, output, NULL) == 0 &&
+               sameFiles("inc.out", "inc-full.elf"),
+           "incremental: full write without a previous output differs");
+
+    static const char* const verified[][2] = {
+        {"--writer=libelf"},
+        {"--writer=direct"},
+        {"--writer=uring"},
+        {"--format=bin"},
+        {"--layout=pack"},
+        {"--coalesce"},
+    };
+    for (size_t i = 0; i < sizeof(verified) / sizeof(verified[0]); i++) {
+        report(squash("--verify", verified[i][0], changed, output, NULL) == 0,
+               "incremental: --verify refused a %s output", verified[i][0]);
+    }
+}
+
+/*
+ * checkServe:
+ *   --serve with passed descriptors: a refused request must use up the
+ *   descriptors it carried, so the next request writes to its own.
+ */
+static void checkServe(void)
+{
+    static const struct testSegment segs[] = {
+        {0x1000, 0, 0x300, 0, 0},
+        {0x2000, 0, 0x80, 0x100, 0},
+    };
+    struct testInput in;
+    if (writeInput("serve.elf", segs, 2, 1, &in) != 0) {
+        report(false, "serve: cannot write the input");
+        return;
+    }
+    free(in.bytes);
+    report(squash(scratchPath("serve.elf"), scratchPath("serve-ref.elf"),
+                  NULL) == 0,
+           "serve: reference squash failed");
+
+    const char* socketPath = scratchPath("serve.sock");
+    pid_t       server     = spawn((const char*[]){"--serve", socketPath,
+                                                   "--workers", "1", NULL});
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strcpy(addr.sun_path, socketPath);
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    for (int tries = 0; sock >= 0 && tries < 500; tries++) {
+        if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+            break;
+        }
+        usleep(10000);
+    }
+
+    char reply[256] = "";
+    int  fds[2]     = {open(scratchPath("serve.elf"), O_RDONLY),
+                       open(scratchPath("serve-a.elf"),
+                            O_RDWR | O_CREAT | O_TRUNC, 0644)};
+    report(serveRequest(sock, "- - --bogus\n", fds, 2, reply, sizeof(reply)) &&
+               strncmp(reply, "error", 5) == 0,
+           "serve: bad option answered '%s', expected an error", reply);
+    close(fds[0]);
+    close(fds[1]);
+
+    fds[0] = open(scratchPath("serve.elf"), O_RDONLY);
+    fds[1] = open(scratchPath("serve-b.elf"), O_RDWR | O_CREAT | O_TRUNC,
+                  0644);
+    report(serveRequest(sock, "- -\n", fds, 2, reply, sizeof(reply)) &&
+               strcmp(reply, "ok") == 0,
+           "serve: request after a refused one answered '%s'", reply);
+    close(fds[0]);
+    close(fds[1]);
+
+    size_t         size;
+    unsigned char* a = readOutput("serve-a.elf", &size);
+    report(a && size == 0,
+           "serve: refused request's output holds %zu bytes", size);
+    free(a);
+    report(sameFiles("serve-b.elf", "serve-ref.elf"),
+           "serve: output differs from the CLI's");
+
+    if (sock >= 0) {
+        close(sock);
+    }
+    if (server > 0) {
+        kill(server, SIGTERM);
+        waitpid(server, NULL, 0);
+    }
+}
+
+/* A PT_LOAD expected in an output: its LMA and file size */
+struct testLoad {
+    uint64_t lma;
+    uint64_t filesz;
+};
+
+/*
+ * sameLoads:
+ *   Whether the ELF64 output name has exactly the PT_LOADs want, in that
+ *   order, each with vaddr equal to lma and the input's bytes at that LMA
+ *   as its payload.
+ */
+static bool sameLoads(const char* name, const struct testInput* in,
+                      const struct testLoad* want, size_t count)
+{
+    size_t         size;
+    unsigned char* out   = readOutput(name, &size);
+    size_t         found = 0;
+    bool           ok    = out && size >= sizeof(Elf64_Ehdr);
+    if (ok) {
+        const Elf64_Ehdr* eh = (const Elf64_Ehdr*)out;
+        ok = eh->e_phoff + eh->e_phnum * sizeof(Elf64_Phdr) <= size;
+        for (size_t i = 0; ok && i < eh->e_phnum; i++) {
+            const Elf64_Phdr* ph =
+                (const Elf64_Phdr*)(out + eh->e_phoff) + i;
+            if (ph->p_type != PT_LOAD) {
+                continue;
+            }
+            ok = found < count && ph->p_paddr == want[found].lma &&
+                 ph->p_vaddr == ph->p_paddr &&
+                 ph->p_filesz == want[found].filesz &&
+                 ph->p_offset + ph->p_filesz <= size;
+            /* The input payload holding this LMA */
+            const Elf64_Phdr* src = NULL;
+            for (size_t j = 0; ok && j < in->phnum; j++) {
+                if (in->pht[j].p_paddr <= ph->p_paddr &&
+                    ph->p_paddr + ph->p_filesz <=
+                        in->pht[j].p_paddr + in->pht[j].p_filesz) {
+                    src = &in->pht[j];
+                }
+            }
+            ok = ok && src &&
+                 memcmp(out + ph->p_offset,
+                        in->bytes + src->p_offset +
+                            (ph->p_paddr - src->p_paddr),
+                        ph->p_filesz) == 0;
+            found++;
+        }
+    }
+    free(out);
+    return ok && found == count;
+}
+
+/*
+ * checkRanges:
+ *   Range bounds are inclusive: a segment may end on maxLma, --clip keeps
+ *   the byte at maxLma, and ranges that touch merge into one.
+ */
+static void checkRanges(void)
+{
+    static const struct testSegment segs[] = {
+        {0x1000, 0, 0x100, 0, 0},
+        {0x2000, 0, 0x100, 0, 0},
+        {0x3000, 0, 0x200, 0, 0},
+        {0x8000, 0, 0x40, 0, 0},
+    };
+    /* Each case also keeps the segment at 0x8000, so none is empty */
+    static const struct {
+        const char*     what;
+        const char*     args[6];
+        struct testLoad want[4];
+        size_t          count;
+    } cases[] = {
+        {"segment ending on max",
+         {"-r", "0x1000-0x10ff"},
+         {{0x1000, 0x100}},
+         1},
+        {"segment one byte past max",
+         {"-r", "0x1000-0x10fe"},
+         {{0}},
+         0},
+        {"touching ranges",
+         {"-r", "0x3000-0x30ff", "-r", "0x3100-0x31ff"},
+         {{0x3000, 0x200}},
+         1},
+        {"ranges one byte apart",
+         {"-r", "0x3000-0x30ff", "-r", "0x3101-0x31ff"},
+         {{0}},
+         0},
+        {"clip ending on max",
+         {"--clip", "-r", "0x2080-0x20ff"},
+         {{0x2080, 0x80}},
+         1},
+        {"clip straddling max",
+         {"--clip", "-r", "0x1f00-0x207f"},
+         {{0x2000, 0x80}},
+         1},
+        {"clip straddling min",
+         {"--clip", "-r", "0x1080-0x1fff"},
+         {{0x1080, 0x80}},
+         1},
+        {"clip with touching ranges",
+         {"--clip", "-r", "0x3000-0x307f", "-r", "0x3080-0x30ff"},
+         {{0x3000, 0x100}},
+         1},
+        {"clip with ranges one byte apart",
+         {"--clip", "-r", "0x3000-0x307f", "-r", "0x3081-0x30ff"},
+         {{0x3000, 0x80}, {0x3081, 0x7f}},
+         2},
+        {"clip across segments",
+         {"--clip", "-r", "0x10ff-0x2000", "-r", "0x31fe-0x31ff"},
+         {{0x10ff, 1}, {0x2000, 1}, {0x31fe, 2}},
+         3},
+    };
+    struct testInput in;
+    if (writeInput("ranges.elf", segs, 4, 4, &in) != 0) {
+        report(false, "ranges: cannot write the input");
+        return;
+    }
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        const char*     args[12];
+        size_t          argc = 0;
+        struct testLoad want[5];
+        for (; argc < 6 && cases[i].args[argc]; argc++) {
+            args[argc] = cases[i].args[argc];
+        }
+        args[argc++] = "-r";
+        args[argc++] = "0x8000-0x803f";
+        args[argc++] = scratchPath("ranges.elf");
+        args[argc++] = scratchPath("ranges-out.elf");
+        args[argc]   = NULL;
+        memcpy(want, cases[i].want, cases[i].count * sizeof(*want));
+        want[cases[i].count] = (struct testLoad){0x8000, 0x40};
+        report(squashArgs(args) == 0 &&
+                   sameLoads("ranges-out.elf", &in, want,
+                             cases[i].count + 1),
+               "ranges: %s selects the wrong bytes", cases[i].what);
+    }
+    free(in.bytes);
+}
+
+/*
+ * checkPack:
+ *   --layout=pack leaves no padding between payloads, and still gives
+ *   every PT_LOAD a p_align its offset is congruent to p_vaddr modulo.
+ */
+static void checkPack(void)
+{
+    static const struct testSegment segs[] = {
+        {0x10000, 0, 0x1001, 0, 0x1000},
+        {0x20000, 0, 0x333, 0, 0x10000},
+        {0x30008, 0, 0x100, 0, 0x8},
+        {0x40000, 0, 0x40, 0x1000, 0x1000},
+    };
+    static const struct testLoad want[] = {
+        {0x10000, 0x1001},
+        {0x20000, 0x333},
+        {0x30008, 0x100},
+        {0x40000, 0x40},
+    };
+    struct testInput in;
+    if (writeInput("pack.elf", segs, 4, 13, &in) != 0) {
+        report(false, "pack: cannot write the input");
+        return;
+    }
+    report(squash("--verify", "--layout=pack", scratchPath("pack.elf"),
+                  scratchPath("pack.out"), NULL) == 0 &&
+               sameLoads("pack.out", &in, want, 4),
+           "pack: output does not hold the input's segments");
+
+    size_t            size;
+    unsigned char*    out = readOutput("pack.out", &size);
+    const Elf64_Ehdr* eh  = (const Elf64_Ehdr*)out;
+    bool              ok  = out && size >= sizeof(*eh) && eh->e_phnum == 4;
+    uint64_t          pos = ok ? eh->e_phoff + 4 * sizeof(Elf64_Phdr) : 0;
+    for (size_t i = 0; ok && i < 4; i++) {
+        const Elf64_Phdr* ph = (const Elf64_Phdr*)(out + eh->e_phoff) + i;
+        ok = ph->p_offset == pos && ph->p_align <= in.pht[i].p_align &&
+             (ph->p_align <= 1 ||
+              (ph->p_offset - ph->p_vaddr) % ph->p_align == 0);
+        pos += ph->p_filesz;
+    }
+    report(ok, "pack: a segment is padded or breaks its p_align");
+    free(out);
+    free(in.bytes);
+}
+
+/*
+ * checkCache:
+ *   --cache hits restore a file of their own and keep read-only entries,
+ *   so editing a restored output in place changes nothing else; outputs
+ *   with hard links of the user's are still written through.
+ */
+static void checkCache(void)
+{
+    static const struct testSegment segs[] = {
+        {0x4000, 0, 0x2000, 0, 0x1000},
+        {0x9000, 0, 0x40, 0x200, 0},
+    };
+    struct testInput in;
+    if (writeInput("cache.elf", segs, 2, 3, &in) != 0) {
+        report(false, "cache: cannot write the input");
+        return;
+    }
+    free(in.bytes);
+    char input[PATH_MAX];
+    char dir[PATH_MAX];
+    strcpy(input, scratchPath("cache.elf"));
+    strcpy(dir, scratchPath("cache"));
+    report(squash(input, scratchPath("cache-ref.elf"), NULL) == 0 &&
+               squash(input, scratchPath("cache-a.elf"), "--cache", dir,
+                      NULL) == 0 &&
+               squash(input, scratchPath("cache-b.elf"), "--cache", dir,
+                      NULL) == 0 &&
+               sameFiles("cache-a.elf", "cache-ref.elf") &&
+               sameFiles("cache-b.elf", "cache-ref.elf"),
+           "cache: outputs differ from the uncached one");
+
+    struct stat st;
+    report(stat(scratchPath("cache-b.elf"), &st) == 0 && st.st_nlink == 1,
+           "cache: restored output shares its inode");
+    DIR*           entries = opendir(dir);
+    struct dirent* de;
+    int            count = 0;
+    while (entries && (de = readdir(entries))) {
+        if (de->d_name[0] != '.') {
+            count++;
+            report(fstatat(dirfd(entries), de->d_name, &st, 0) == 0 &&
+                       (st.st_mode & 0222) == 0,
+                   "cache: entry %s is writable", de->d_name);
+        }
+    }
+    if (entries) {
+        closedir(entries);
+    }
+    report(count == 1, "cache: %d entries, expected 1", count);
+
+    int fd = open(scratchPath("cache-b.elf"), O_WRONLY);
+    report(fd >= 0 && pwrite(fd, "edit", 4, 0x40) == 4 && close(fd) == 0,
+           "cache: cannot edit the restored output");
+    report(squash(input, scratchPath("cache-c.elf"), "--cache", dir, NULL) ==
+                   0 &&
+               sameFiles("cache-a.elf", "cache-ref.elf") &&
+               sameFiles("cache-c.elf", "cache-ref.elf"),
+           "cache: editing a restored output changed the cache");
+
+    /* Outputs the cache did not make are written through, as always */
+    unlink(scratchPath("cache-link.elf"));
+    report(link(scratchPath("cache-b.elf"), scratchPath("cache-link.elf")) ==
+                   0 &&
+               squash(input, scratchPath("cache-b.elf"), NULL) == 0 &&
+               stat(scratchPath("cache-b.elf"), &st) == 0 &&
+               st.st_nlink == 2 &&
+               sameFiles("cache-link.elf", "cache-ref.elf"),
+           "cache: writing an output broke its hard link");
+}
+
+#ifdef SQUASHELF_HAVE_ZSTD
+/*
+ * writeZstd:
+ *   Compress the test input to scratch file name as one zstd frame, with
+ *   its content size in the frame header or, streamed, without.
+ */
+static bool writeZstd(const struct testInput* in, const char* name,
+                      bool contentSize)
+{
+    size_t         cap = ZSTD_compressBound(in->size);
+    unsigned char* buf = malloc(cap);
+    size_t         len = 0;
+    ZSTD_CCtx*     cx  = ZSTD_createCCtx();
+    if (buf && cx && contentSize) {
+        len = ZSTD_compressCCtx(cx, buf, cap, in->bytes, in->size, 3);
+    }
+    else if (buf && cx) {
+        /* Feeding the data before ending the frame leaves its size out */
+        ZSTD_outBuffer out = {buf, cap, 0};
+        ZSTD_inBuffer  src = {in->bytes, in->size, 0};
+        size_t         rc  = ZSTD_compressStream2(cx, &out, &src,
+                                                  ZSTD_e_continue);
+        ZSTD_inBuffer  end = {NULL, 0, 0};
+        while (!ZSTD_isError(rc) &&
+               (rc = ZSTD_compressStream2(cx, &out, &end, ZSTD_e_end))) {
+        }
+        len = ZSTD_isError(rc) ? rc : out.pos;
+    }
+    bool ok = buf && cx && !ZSTD_isError(len);
+    int  fd = ok ? open(scratchPath(name), O_WRONLY | O_CREAT | O_TRUNC, 0644)
+                 : -1;
+    ok      = fd >= 0 && write(fd, buf, len) == (ssize_t)len;
+    if (fd >= 0 && close(fd) != 0) {
+        ok = false;
+    }
+    ZSTD_freeCCtx(cx);
+    free(buf);
+    return ok;
+}
+
+/*
+ * checkZstdInput:
+ *   A .zst input, with and without frame content sizes, squashes to the
+ *   same output as the file it was compressed from.
+ */
+static void checkZstdInput(void)
+{
+    static const struct testSegment segs[] = {
+        {0x8000, 0, 0x4000, 0, 0x1000},
+        {0x10000, 0, 0x123, 0x400, 0},
+        {0x20000, 0, 0x10000, 0, 0x100},
+    };
+    struct testInput in;
+    if (writeInput("zstd.elf", segs, 3, 2, &in) != 0) {
+        report(false, "zstd: cannot write the input");
+        return;
+    }
+    squash(scratchPath("zstd.elf"), scratchPath("zstd-ref.elf"), NULL);
+    for (int sized = 0; sized < 2; sized++) {
+        report(writeZstd(&in, "zstd.elf.zst", sized) &&
+                   squash(scratchPath("zstd.elf.zst"),
+                          scratchPath("zstd-out.elf"), NULL) == 0 &&
+                   sameFiles("zstd-out.elf", "zstd-ref.elf"),
+               "zstd: input %s content size squashes differently",
+               sized ? "with" : "without");
+    }
+    free(in.bytes);
+}
+#endif
+
+static int removeEntry(const char* path, const struct stat* st, int flag,
+                       struct FTW* ftw)
+{
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+/*
+ * checkCli:
+ *   Run the CLI checks in a fresh scratch directory, removed afterwards.
+ */
+static void checkCli(void)
+{
+    const char* tmp = getenv("TMPDIR");
+    snprintf(scratchDir, sizeof(scratchDir), "%s/squashelf-selftest.XXXXXX",
+             tmp && *tmp ? tmp : "/tmp");
+    if (!mkdtemp(scratchDir)) {
+        report(false, "cannot create scratch directory %s", scratchDir);
+        return;
+    }
+    checkRanges();
+    checkOverlap();
+    checkWriters();
+    checkHex();
+    checkBatch();
+    checkIncremental();
+    checkPack();
+    checkServe();
+    checkCache();
+#ifdef SQUASHELF_HAVE_ZSTD
+    checkZstdInput();
+#endif
+    nftw(scratchDir, removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+int main(int argc, char* argv[])
+{
+    if (checkDigests() != 0) {
+        return 1;
+    }
+    if (argc > 1) {
+        squashelfPath = argv[1];
+        checkCli();
+    }
+    printf("%d checks, %d failed\n", checks, failures);
+    return failures ? 1 : 0;
+}
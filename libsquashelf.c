@@ -0,0 +1,7710 @@
+/*
+ * libsquashelf: PT_LOAD selection, LMA sorting, output layout and the
+ * libelf, direct and streaming writers behind the squashelf CLI.
+ */
+#define _GNU_SOURCE /* copy_file_range, qsort_r, fallocate */
+#include "libsquashelf.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libelf.h>
+#include <gelf.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stddef.h> /* offsetof */
+#include <stdarg.h> /* Needed for variadic macros */
+#include <stdbool.h> /* Needed for bool type */
+#include <pthread.h>
+#include <time.h>
+#if defined(__x86_64__)
+#include <immintrin.h> /* PCLMULQDQ and SHA-NI digests */
+#endif
+#ifdef SQUASHELF_HAVE_ZSTD
+#define ZSTD_STATIC_LINKING_ONLY /* ZSTD_decompressBound */
+#include <zstd.h>
+#endif
+#ifdef SQUASHELF_HAVE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+#ifdef SQUASHELF_HAVE_LZMA
+#include <lzma.h>
+#endif
+
+static int verbose = 0; /* set by squashelf_set_verbose; read by DEBUG_PRINT */
+
+/* Macro for verbose printing */
+#define DEBUG_PRINT(fmt, ...)                    \
+    do {                                         \
+        if (verbose)                             \
+            fprintf(stderr, fmt, ##__VA_ARGS__); \
+    } while (0)
+
+static const char* const writerNames[SQUASHELF_WRITER_COUNT] = {
+    "libelf",
+    "direct",
+    "uring",
+};
+
+static const char* const copyEngineNames[SQUASHELF_COPY_COUNT] = {
+    "copy_file_range",
+    "sendfile",
+    "buffered",
+};
+
+static const char* const formatNames[SQUASHELF_FORMAT_COUNT] = {
+    "elf",
+    "bin",
+    "ihex",
+    "srec",
+};
+
+static const char* const codecNames[SQUASHELF_CODEC_COUNT] = {
+    "none",
+    "zstd",
+    "lz4",
+};
+
+static const char* const layoutNames[SQUASHELF_LAYOUT_COUNT] = {
+    "plan",
+    "lma",
+    "pack",
+};
+
+static const char* const overlapNames[SQUASHELF_OVERLAP_COUNT] = {
+    "off",
+    "warn",
+    "fail",
+    "resolve",
+};
+
+static const char* const phaseNames[SQUASHELF_PHASE_COUNT] = {
+    "init",
+    "open",
+    "decode",
+    "begin",
+    "scan",
+    "filter",
+    "sort",
+    "check",
+    "layout",
+    "compress",
+    "read",
+    "associate",
+    "write",
+    "digest",
+    "verify",
+};
+
+/*
+ * phaseStart:
+ *   Current CLOCK_MONOTONIC time in nanoseconds, or 0 without stats so
+ *   untimed runs never read the clock.
+ */
+static uint64_t phaseStart(const struct squashelf_stats* stats)
+{
+    struct timespec now;
+    if (!stats || clock_gettime(CLOCK_MONOTONIC, &now) != 0) {
+        return 0;
+    }
+    return (uint64_t)now.tv_sec * 1000000000UL + (uint64_t)now.tv_nsec;
+}
+
+/*
+ * phaseEnd:
+ *   Charge the time since start to phase and return the current time, so
+ *   back-to-back phases can be timed with one clock read each.
+ */
+static uint64_t phaseEnd(struct squashelf_stats* stats, int phase,
+                         uint64_t start)
+{
+    uint64_t now = phaseStart(stats);
+    if (stats) {
+        stats->phaseNs[phase] += now - start;
+    }
+    return now;
+}
+
+/*
+ * outputLayout:
+ *   File layout of the squashed output. Segment payloads follow the PHT in
+ *   file order, which is LMA order unless the planner found a tighter one;
+ *   the optional SHT (a single NULL entry) goes last. Without coalescing
+ *   or reordering every kept segment is both a payload and a PHT entry,
+ *   and pht/phtOffsets alias the segment array and offsets; otherwise the
+ *   payloads of one entry are adjacent, and owner maps them to it.
+ */
+struct outputLayout {
+    size_t           ehdrSize;   /* file size of the ELF header */
+    size_t           phdrSize;   /* file size of one program header */
+    size_t           shdrSize;   /* file size of one section header */
+    const GElf_Phdr* pht;        /* output program headers, LMA order */
+    size_t           phnum;      /* entries in pht */
+    uint64_t*        phtOffsets; /* output p_offset of each pht entry */
+    uint64_t*        offsets;    /* output offset of each segment payload */
+    size_t*          owner;      /* pht entry of each payload, or NULL */
+    uint64_t         headerEnd;  /* end of the ELF header and PHT */
+    uint64_t         dataEnd;    /* end of the last segment payload */
+    uint64_t         sectionEnd; /* where an SHT would go, even with noSht */
+    uint64_t         shoff;      /* e_shoff, or 0 when the SHT is omitted */
+    uint64_t         fileSize;   /* total output size */
+};
+
+/*
+ * squashelf:
+ *   An opened input. When the whole file is addressable (a caller buffer
+ *   or an mmap of a regular file) libelf parses it through elf_memory and
+ *   payloads are copied straight out of data; otherwise libelf reads the
+ *   fd and payloads are fetched with pread. A compressed input is decoded
+ *   into data and has no fd.
+ */
+struct squashelf {
+    int                     fd;     /* input fd, or -1 for memory inputs */
+    bool                    ownsFd; /* opened by squashelf_open_file */
+    const unsigned char*    data;   /* whole input, or NULL */
+    uint64_t                size;   /* input size, when known (else 0) */
+    bool                    mapped; /* data is our own mmap of fd */
+    struct compressedInput* compressed; /* what data is decoded from */
+    Elf*                    elf;
+    GElf_Ehdr               ehdr;
+    int                     elfClass;
+    const struct phtCodec*  pht; /* for elfClass and e_ident[EI_DATA] */
+    size_t                  phdrCount;
+    GElf_Phdr*              phdrs; /* decoded PHT, from the first select */
+};
+
+/*
+ * packedEntry:
+ *   One PT_LOAD entry of compressed output: the bytes written for it (the
+ *   codec's output, or the entry's file bytes when they did not shrink)
+ *   and where they go.
+ */
+struct packedEntry {
+    const unsigned char* data;   /* bytes to write */
+    unsigned char*       owned;  /* data, when allocated for it */
+    uint64_t             csize;  /* bytes at data */
+    uint64_t             offset; /* output offset */
+    int                  codec;  /* enum squashelf_codec actually used */
+};
+
+/*
+ * packedLayout:
+ *   File layout of compressed output: the ELF header, the PHT (the
+ *   SQUASHELF_PT_INDEX entry first, then the PT_LOAD entries), the index,
+ *   the packed entries back to back, and the optional NULL SHT.
+ */
+struct packedLayout {
+    struct packedEntry* entries;     /* one per layout PHT entry, or NULL */
+    uint64_t            indexOffset; /* 8-byte aligned, after the PHT */
+    uint64_t            indexSize;
+    uint64_t            dataEnd;     /* end of the last packed entry */
+    uint64_t            shoff;       /* e_shoff, or 0 when the SHT is omitted */
+    uint64_t            fileSize;
+};
+
+/* Size of the index header and of one index entry in the file */
+#define PACKED_INDEX_HEADER 16
+#define PACKED_INDEX_ENTRY  48
+
+/*
+ * squashelf_image:
+ *   The segments one squashelf_select call kept, sorted by LMA, together
+ *   with their output layout and the options that picked them.
+ */
+struct squashelf_image {
+    const struct squashelf*  in;
+    struct squashelf_options opts;
+    GElf_Phdr*               phdrs;
+    size_t                   count;
+    struct outputLayout      layout;     /* ELF layout */
+    struct packedLayout      packed;     /* with opts.codec */
+    uint64_t                 outputSize; /* in opts.format */
+};
+
+/* Sort key of one program header: an address and where it came from */
+struct phdrKey {
+    uint64_t addr;
+    size_t   index;
+};
+
+/* Below this many entries sortKeys uses an insertion sort */
+#define RADIX_MIN 64
+
+/*
+ * sortKeys:
+ *   Order count keys by address, ascending, keeping equal addresses in
+ *   their current order. The keys are radix sorted a byte at a time,
+ *   skipping the bytes all addresses share, so the result is in either
+ *   keys or spare (of the same size); that one is returned.
+ */
+static struct phdrKey* sortKeys(struct phdrKey* keys, struct phdrKey* spare,
+                                size_t count)
+{
+    if (count < RADIX_MIN) {
+        for (size_t i = 1; i < count; i++) {
+            struct phdrKey key = keys[i];
+            size_t         j   = i;
+            for (; j > 0 && keys[j - 1].addr > key.addr; j--) {
+                keys[j] = keys[j - 1];
+            }
+            keys[j] = key;
+        }
+        return keys;
+    }
+
+    size_t histogram[8][256] = {{0}};
+    for (size_t i = 0; i < count; i++) {
+        for (int b = 0; b < 8; b++) {
+            histogram[b][(keys[i].addr >> (8 * b)) & 0xff]++;
+        }
+    }
+    for (int b = 0; b < 8; b++) {
+        size_t* counts = histogram[b];
+        if (counts[(keys[0].addr >> (8 * b)) & 0xff] == count) {
+            continue; /* every key has the same byte here */
+        }
+        size_t pos = 0;
+        for (int d = 0; d < 256; d++) {
+            size_t n  = counts[d];
+            counts[d] = pos;
+            pos += n;
+        }
+        for (size_t i = 0; i < count; i++) {
+            spare[counts[(keys[i].addr >> (8 * b)) & 0xff]++] = keys[i];
+        }
+        struct phdrKey* swap = keys;
+        keys                 = spare;
+        spare                = swap;
+    }
+    return keys;
+}
+
+/*
+ * sortPhdrs:
+ *   Order the count program headers in *phdrs by load address (p_paddr),
+ *   ascending, so segments land in increasing memory order; equal LMAs
+ *   keep their PHT order. Compact (LMA, index) keys are sorted and the
+ *   entries then gathered into a new array that replaces *phdrs. If order
+ *   is given, order[i] receives the old index of the new entry i.
+ */
+static int sortPhdrs(GElf_Phdr** phdrs, size_t count, size_t* order)
+{
+    struct phdrKey* keys   = malloc((count ? count : 1) * sizeof(*keys));
+    struct phdrKey* spare  = malloc((count ? count : 1) * sizeof(*spare));
+    GElf_Phdr*      sorted = malloc((count ? count : 1) * sizeof(*sorted));
+    int             rc     = -1;
+    if (!keys || !spare || !sorted) {
+        perror("malloc sort keys");
+        goto out;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        keys[i].addr  = (*phdrs)[i].p_paddr;
+        keys[i].index = i;
+    }
+    const struct phdrKey* result = sortKeys(keys, spare, count);
+    for (size_t i = 0; i < count; i++) {
+        sorted[i] = (*phdrs)[result[i].index];
+        if (order) {
+            order[i] = result[i].index;
+        }
+    }
+    free(*phdrs);
+    *phdrs = sorted;
+    sorted = NULL;
+    rc     = 0;
+
+out:
+    free(keys);
+    free(spare);
+    free(sorted);
+    return rc;
+}
+
+/* Overlap check findings, by kind */
+enum overlapKind {
+    OVERLAP_LMA,   /* file bytes of two segments at the same LMAs */
+    OVERLAP_VMA,   /* two segments sharing run-time addresses */
+    OVERLAP_ALIAS, /* a segment loaded where a relocated one runs */
+    OVERLAP_KINDS,
+};
+
+static const char* const overlapKindNames[OVERLAP_KINDS] = {
+    "LMA overlaps",
+    "VMA overlaps",
+    "LMA/VMA aliases",
+};
+
+/* Findings of each kind printed in full; the rest are only counted */
+#define OVERLAP_REPORT_MAX 16
+
+/* The address range [lo, hi) one segment occupies */
+struct span {
+    uint64_t lo;
+    uint64_t hi;
+    size_t   seg; /* index into the sorted phdrs */
+};
+
+/*
+ * spanEnd:
+ *   End of the size bytes at start, saturated at the top of the address
+ *   space.
+ */
+static uint64_t spanEnd(uint64_t start, uint64_t size)
+{
+    return size > UINT64_MAX - start ? UINT64_MAX : start + size;
+}
+
+/*
+ * reportOverlap:
+ *   Count one finding about segments a and b, which share bytes, and
+ *   print it unless enough of its kind have been. LMA overlaps that
+ *   are about to be resolved are only traced.
+ */
+static void reportOverlap(int mode, int kind, uint64_t* found,
+                          const GElf_Phdr* a, const GElf_Phdr* b,
+                          uint64_t bytes)
+{
+    bool        quiet =
+        kind == OVERLAP_LMA && mode == SQUASHELF_OVERLAP_RESOLVE;
+    const char* level = mode == SQUASHELF_OVERLAP_FAIL && kind != OVERLAP_VMA
+                            ? "Error"
+                            : "Warning";
+
+    found[kind]++;
+    if (quiet || found[kind] > OVERLAP_REPORT_MAX) {
+        DEBUG_PRINT("  Overlap: LMA 0x%lx (VMA 0x%lx) and LMA 0x%lx (VMA "
+                    "0x%lx), 0x%lx bytes\n",
+                    a->p_paddr, a->p_vaddr, b->p_paddr, b->p_vaddr, bytes);
+        return;
+    }
+    switch (kind) {
+        case OVERLAP_LMA:
+            fprintf(stderr,
+                    "%s: segments at LMA 0x%lx and 0x%lx overlap by 0x%lx "
+                    "bytes\n",
+                    level, a->p_paddr, b->p_paddr, bytes);
+            break;
+        case OVERLAP_VMA:
+            fprintf(stderr,
+                    "%s: segments at VMA 0x%lx and 0x%lx (LMA 0x%lx and "
+                    "0x%lx) share 0x%lx bytes of run-time addresses\n",
+                    level, a->p_vaddr, b->p_vaddr, a->p_paddr, b->p_paddr,
+                    bytes);
+            break;
+        default:
+            fprintf(stderr,
+                    "%s: segment at LMA 0x%lx is loaded into 0x%lx bytes the "
+                    "segment at LMA 0x%lx runs from (VMA 0x%lx)\n",
+                    level, a->p_paddr, bytes, b->p_paddr, b->p_vaddr);
+            break;
+    }
+}
+
+/*
+ * sortSpans:
+ *   Order count spans by start. Spans built from the LMA-sorted phdrs are
+ *   usually in order already (VMAs tend to follow LMAs), so they are only
+ *   sorted if they are not.
+ */
+static int sortSpans(struct span** spans, size_t count)
+{
+    size_t i = 1;
+    while (i < count && (*spans)[i - 1].lo <= (*spans)[i].lo) {
+        i++;
+    }
+    if (i >= count) {
+        return 0;
+    }
+
+    struct phdrKey* keys   = malloc(count * sizeof(*keys));
+    struct phdrKey* spare  = malloc(count * sizeof(*spare));
+    struct span*    sorted = malloc(count * sizeof(*sorted));
+    int             rc     = -1;
+    if (!keys || !spare || !sorted) {
+        perror("malloc overlap spans");
+        goto out;
+    }
+    for (i = 0; i < count; i++) {
+        keys[i].addr  = (*spans)[i].lo;
+        keys[i].index = i;
+    }
+    const struct phdrKey* result = sortKeys(keys, spare, count);
+    for (i = 0; i < count; i++) {
+        sorted[i] = (*spans)[result[i].index];
+    }
+    free(*spans);
+    *spans = sorted;
+    sorted = NULL;
+    rc     = 0;
+
+out:
+    free(keys);
+    free(spare);
+    free(sorted);
+    return rc;
+}
+
+/*
+ * Spans sorted by start, with the two furthest-reaching spans of every
+ * prefix: the spans that end after lo among those starting before hi are
+ * exactly the ones overlapping [lo, hi), and the furthest-reaching of
+ * them decides whether there is one. For a fixed set this answers what
+ * an interval tree would, from two flat arrays.
+ */
+struct spanIndex {
+    struct span* spans;
+    size_t       count;
+    size_t*      reach;  /* reach[i]: span ending last among 0..i */
+    size_t*      second; /* ... of the others, or SIZE_MAX */
+};
+
+/*
+ * buildSpanIndex:
+ *   Sort count spans (taking them over) and index their prefixes.
+ */
+static int buildSpanIndex(struct spanIndex* index, struct span* spans,
+                          size_t count)
+{
+    index->spans  = spans;
+    index->count  = count;
+    index->reach  = NULL;
+    index->second = NULL;
+    if (sortSpans(&index->spans, count) != 0) {
+        return -1;
+    }
+    index->reach  = malloc((count ? count : 1) * sizeof(size_t));
+    index->second = malloc((count ? count : 1) * sizeof(size_t));
+    if (!index->reach || !index->second) {
+        perror("malloc span index");
+        return -1;
+    }
+
+    size_t best = SIZE_MAX;
+    size_t next = SIZE_MAX;
+    for (size_t i = 0; i < count; i++) {
+        uint64_t hi = index->spans[i].hi;
+        if (best == SIZE_MAX || hi > index->spans[best].hi) {
+            next = best;
+            best = i;
+        }
+        else if (next == SIZE_MAX || hi > index->spans[next].hi) {
+            next = i;
+        }
+        index->reach[i]  = best;
+        index->second[i] = next;
+    }
+    return 0;
+}
+
+/*
+ * freeSpanIndex:
+ *   Free the spans of index and its prefix arrays.
+ */
+static void freeSpanIndex(struct spanIndex* index)
+{
+    free(index->spans);
+    free(index->reach);
+    free(index->second);
+}
+
+/*
+ * spanOverlap:
+ *   A span among the first prefix spans of index (those starting before
+ *   some hi) that overlaps [lo, hi) and does not belong to segment
+ *   exclude, as an index into index->spans; SIZE_MAX if there is none.
+ */
+static size_t spanOverlap(const struct spanIndex* index, size_t prefix,
+                          uint64_t lo, size_t exclude)
+{
+    if (prefix == 0) {
+        return SIZE_MAX;
+    }
+    size_t found = index->reach[prefix - 1];
+    if (index->spans[found].seg == exclude) {
+        found = index->second[prefix - 1];
+    }
+    if (found == SIZE_MAX || index->spans[found].hi <= lo) {
+        return SIZE_MAX;
+    }
+    return found;
+}
+
+/*
+ * spansBefore:
+ *   Number of spans of index that start before addr.
+ */
+static size_t spansBefore(const struct spanIndex* index, uint64_t addr)
+{
+    size_t lo = 0;
+    size_t hi = index->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (index->spans[mid].lo < addr) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* An entry of a max-heap: its priority and what it stands for */
+struct heapEntry {
+    size_t rank; /* resolveOverlaps: PHT position; planOffsets: hole size */
+    size_t span; /* index of the span or hole */
+};
+
+/*
+ * heapPush, heapPop:
+ *   Max-heap on rank over count entries.
+ */
+static void heapPush(struct heapEntry* heap, size_t* count,
+                     struct heapEntry entry)
+{
+    size_t i = (*count)++;
+    while (i > 0 && heap[(i - 1) / 2].rank < entry.rank) {
+        heap[i] = heap[(i - 1) / 2];
+        i       = (i - 1) / 2;
+    }
+    heap[i] = entry;
+}
+
+static void heapPop(struct heapEntry* heap, size_t* count)
+{
+    struct heapEntry last = heap[--(*count)];
+    size_t           i    = 0;
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= *count) {
+            break;
+        }
+        if (child + 1 < *count && heap[child + 1].rank > heap[child].rank) {
+            child++;
+        }
+        if (heap[child].rank <= last.rank) {
+            break;
+        }
+        heap[i] = heap[child];
+        i       = child;
+    }
+    if (*count) {
+        heap[i] = last;
+    }
+}
+
+/*
+ * resolveOverlaps:
+ *   Give every LMA claimed by several of the count sorted segments to the
+ *   one latest in the PHT (order holds their PHT positions), as loading
+ *   them in PHT order would, and cut the others down to the parts still
+ *   their own; a segment can split in several. The spans are the file
+ *   bytes of the segments that have some, in LMA order. A sweep over them
+ *   keeps the segments covering the current address in a heap by PHT
+ *   position, so the owner of every stretch is its top. A bss tail stays
+ *   with the part holding the segment's last file byte, if it survives.
+ */
+static int resolveOverlaps(GElf_Phdr** phdrs, size_t* count,
+                           const size_t* order, const struct span* spans,
+                           size_t spanCount)
+{
+    GElf_Phdr*        in    = *phdrs;
+    size_t            total = *count;
+    GElf_Phdr*        out   = malloc((2 * spanCount + total) * sizeof(*out));
+    struct heapEntry* heap  = malloc((spanCount ? spanCount : 1) *
+                                     sizeof(*heap));
+    if (!out || !heap) {
+        perror("malloc resolved segments");
+        free(out);
+        free(heap);
+        return -1;
+    }
+
+    size_t   kept    = 0;
+    size_t   next    = 0; /* next span to enter the heap */
+    size_t   active  = 0; /* heap entries */
+    size_t   bssOnly = 0; /* next input segment, for those without file data */
+    size_t   piece   = SIZE_MAX; /* segment out[kept - 1] was cut from */
+    uint64_t at      = 0;
+    while (next < spanCount || active) {
+        if (!active) {
+            at = spans[next].lo;
+        }
+        while (next < spanCount && spans[next].lo <= at) {
+            heapPush(heap, &active, (struct heapEntry){order[spans[next].seg],
+                                                       next});
+            next++;
+        }
+        while (active && spans[heap[0].span].hi <= at) {
+            heapPop(heap, &active);
+        }
+        if (!active) {
+            continue;
+        }
+
+        const struct span* owner = &spans[heap[0].span];
+        uint64_t           end   = owner->hi;
+        if (next < spanCount && spans[next].lo < end) {
+            end = spans[next].lo;
+        }
+
+        /* Segments without file data keep their place in LMA order */
+        for (; bssOnly < total && in[bssOnly].p_paddr <= at; bssOnly++) {
+            if (in[bssOnly].p_filesz == 0) {
+                out[kept++] = in[bssOnly];
+                piece       = SIZE_MAX;
+            }
+        }
+
+        const GElf_Phdr* ph   = &in[owner->seg];
+        GElf_Phdr*       last = &out[kept - 1];
+        if (piece == owner->seg && last->p_paddr + last->p_filesz == at) {
+            last->p_filesz += end - at; /* the same part carries on */
+        }
+        else {
+            uint64_t delta = at - ph->p_paddr;
+            out[kept]      = *ph;
+            last           = &out[kept++];
+            last->p_paddr  = at;
+            last->p_vaddr  = ph->p_vaddr + delta;
+            last->p_offset = ph->p_offset + delta;
+            last->p_filesz = end - at;
+            piece          = owner->seg;
+        }
+        last->p_memsz = last->p_filesz;
+        if (end == owner->hi) {
+            last->p_memsz = ph->p_memsz - (last->p_paddr - ph->p_paddr);
+        }
+        at = end;
+    }
+    for (; bssOnly < total; bssOnly++) {
+        if (in[bssOnly].p_filesz == 0) {
+            out[kept++] = in[bssOnly];
+        }
+    }
+    DEBUG_PRINT("Resolved LMA overlaps: %zu segments became %zu\n", total,
+                kept);
+
+    free(heap);
+    free(in);
+    *phdrs = out;
+    *count = kept;
+    return 0;
+}
+
+/*
+ * checkOverlaps:
+ *   The --check-overlap stage, on the count LMA-sorted segments in *phdrs
+ *   (order[i] is the PHT position of entry i): find segments whose file
+ *   bytes overlap in LMA, and, once those are resolved in that mode,
+ *   segments sharing VMAs and segments whose file bytes are loaded into
+ *   the run-time range of another, relocated one (whose startup copy
+ *   would overwrite them). Each finding names the segment and the one
+ *   reaching furthest into it, so every segment is reported at most once
+ *   per kind. Sorting aside, all of this is O(n log n). Adds the number
+ *   of findings to *found; fails in SQUASHELF_OVERLAP_FAIL mode if any
+ *   LMA conflict was found.
+ */
+static int checkOverlaps(const struct squashelf_options* opts,
+                         GElf_Phdr** phdrs, size_t* count, const size_t* order,
+                         uint64_t* found)
+{
+    uint64_t         counts[OVERLAP_KINDS] = {0};
+    struct span*     spans = malloc((*count ? *count : 1) * sizeof(*spans));
+    struct spanIndex index = {0};
+    size_t           n     = 0;
+    size_t           moved = 0; /* segments loaded away from their VMA */
+    int              rc    = -1;
+    if (!spans) {
+        perror("malloc overlap spans");
+        return -1;
+    }
+
+    /* LMA: the spans come sorted, so the one reaching furthest so far is
+       all that is needed */
+    size_t reach = SIZE_MAX;
+    for (size_t i = 0; i < *count; i++) {
+        const GElf_Phdr* ph = &(*phdrs)[i];
+        if (ph->p_filesz == 0) {
+            continue;
+        }
+        spans[n] = (struct span){ph->p_paddr, spanEnd(ph->p_paddr,
+                                                      ph->p_filesz), i};
+        if (reach != SIZE_MAX && spans[n].lo < spans[reach].hi) {
+            uint64_t hi = spans[n].hi < spans[reach].hi ? spans[n].hi
+                                                        : spans[reach].hi;
+            reportOverlap(opts->overlap, OVERLAP_LMA, counts,
+                          &(*phdrs)[spans[reach].seg], ph, hi - spans[n].lo);
+        }
+        if (reach == SIZE_MAX || spans[n].hi > spans[reach].hi) {
+            reach = n;
+        }
+        n++;
+    }
+    if (counts[OVERLAP_LMA] && opts->overlap == SQUASHELF_OVERLAP_RESOLVE) {
+        if (resolveOverlaps(phdrs, count, order, spans, n) != 0) {
+            goto out;
+        }
+        struct span* grown = realloc(spans, *count * sizeof(*spans));
+        if (!grown) {
+            perror("realloc overlap spans");
+            goto out;
+        }
+        spans = grown;
+    }
+    const GElf_Phdr* seg = *phdrs;
+
+    /* VMA: whole memory images, sorted by VMA if they are not already */
+    n = 0;
+    for (size_t i = 0; i < *count; i++) {
+        if (seg[i].p_memsz != 0) {
+            spans[n++] = (struct span){seg[i].p_vaddr,
+                                       spanEnd(seg[i].p_vaddr, seg[i].p_memsz),
+                                       i};
+        }
+        moved += seg[i].p_vaddr != seg[i].p_paddr;
+    }
+    if (buildSpanIndex(&index, spans, n) != 0) {
+        spans = NULL;
+        goto out;
+    }
+    spans = NULL;
+    for (size_t i = 1; i < index.count; i++) {
+        const struct span* cur   = &index.spans[i];
+        size_t             other = spanOverlap(&index, i, cur->lo, SIZE_MAX);
+        if (other == SIZE_MAX) {
+            continue;
+        }
+        const GElf_Phdr* a = &seg[index.spans[other].seg];
+        const GElf_Phdr* b = &seg[cur->seg];
+        /* Identity-mapped file bytes were already reported by LMA */
+        if (a->p_vaddr == a->p_paddr && b->p_vaddr == b->p_paddr &&
+            b->p_paddr < spanEnd(a->p_paddr, a->p_filesz) &&
+            b->p_filesz != 0) {
+            continue;
+        }
+        uint64_t hi = cur->hi < index.spans[other].hi ? cur->hi
+                                                      : index.spans[other].hi;
+        reportOverlap(opts->overlap, OVERLAP_VMA, counts, a, b, hi - cur->lo);
+    }
+
+    /* Aliasing: file bytes at LMAs inside the VMA range of another,
+       relocated segment */
+    if (moved) {
+        size_t relocated = 0;
+        for (size_t i = 0; i < index.count; i++) {
+            const GElf_Phdr* ph = &seg[index.spans[i].seg];
+            if (ph->p_vaddr != ph->p_paddr) {
+                index.spans[relocated++] = index.spans[i];
+            }
+        }
+        free(index.reach);
+        free(index.second);
+        if (buildSpanIndex(&index, index.spans, relocated) != 0) {
+            goto out;
+        }
+        for (size_t i = 0; i < *count; i++) {
+            if (seg[i].p_filesz == 0) {
+                continue;
+            }
+            uint64_t lo    = seg[i].p_paddr;
+            uint64_t hi    = spanEnd(lo, seg[i].p_filesz);
+            size_t   other = spanOverlap(&index, spansBefore(&index, hi), lo,
+                                         i);
+            if (other == SIZE_MAX) {
+                continue;
+            }
+            const struct span* runs = &index.spans[other];
+            uint64_t top = hi < runs->hi ? hi : runs->hi;
+            reportOverlap(opts->overlap, OVERLAP_ALIAS, counts, &seg[i],
+                          &seg[runs->seg],
+                          top - (lo > runs->lo ? lo : runs->lo));
+        }
+    }
+
+    for (int k = 0; k < OVERLAP_KINDS; k++) {
+        bool quiet = k == OVERLAP_LMA &&
+                     opts->overlap == SQUASHELF_OVERLAP_RESOLVE;
+        if (!quiet && counts[k] > OVERLAP_REPORT_MAX) {
+            fprintf(stderr, "... and %lu more %s\n",
+                    counts[k] - OVERLAP_REPORT_MAX, overlapKindNames[k]);
+        }
+        *found += counts[k];
+    }
+    DEBUG_PRINT("Overlap check: %lu LMA overlaps%s, %lu VMA overlaps, %lu "
+                "LMA/VMA aliases\n",
+                counts[OVERLAP_LMA],
+                opts->overlap == SQUASHELF_OVERLAP_RESOLVE ? " (resolved)"
+                                                           : "",
+                counts[OVERLAP_VMA], counts[OVERLAP_ALIAS]);
+    if (opts->overlap == SQUASHELF_OVERLAP_FAIL &&
+        counts[OVERLAP_LMA] + counts[OVERLAP_ALIAS] != 0) {
+        fprintf(stderr,
+                "Error: overlap check failed: %lu LMA overlaps, %lu LMA/VMA "
+                "aliases\n",
+                counts[OVERLAP_LMA], counts[OVERLAP_ALIAS]);
+        goto out;
+    }
+    rc = 0;
+
+out:
+    free(spans);
+    freeSpanIndex(&index);
+    return rc;
+}
+
+/*
+ * finishLayout:
+ *   Place the count segment payloads inside the PHT entries they belong to
+ *   (owner, or themselves without it) and the SHT after dataEnd, the end
+ *   of the last payload.
+ */
+static void finishLayout(const GElf_Phdr* phdrs, size_t count,
+                         const size_t* owner, int noSht, uint64_t dataEnd,
+                         struct outputLayout* layout)
+{
+    const GElf_Phdr* pht = layout->pht;
+
+    layout->dataEnd = dataEnd;
+    for (size_t i = 0; owner && i < count; i++) {
+        const GElf_Phdr* entry = &pht[owner[i]];
+        layout->offsets[i]     = layout->phtOffsets[owner[i]] +
+                             (phdrs[i].p_paddr - entry->p_paddr);
+    }
+
+    /* Section headers are word aligned (8 bytes for ELF64, 4 for ELF32) */
+    uint64_t shAlign   = layout->ehdrSize == sizeof(Elf64_Ehdr) ? 8 : 4;
+    layout->sectionEnd = (dataEnd + shAlign - 1) & ~(shAlign - 1);
+    if (noSht) {
+        layout->shoff    = 0;
+        layout->fileSize = layout->dataEnd;
+    }
+    else {
+        layout->shoff    = layout->sectionEnd;
+        layout->fileSize = layout->sectionEnd + layout->shdrSize;
+    }
+}
+
+/*
+ * computeLayout:
+ *   Assign an output file offset to each PHT entry (layout->pht, phnum and
+ *   phtOffsets must be set), in PHT order right after the PHT: each entry
+ *   at the first offset congruent to its p_vaddr modulo p_align, as
+ *   loaders require, or with pack at the very next byte. Then finish the
+ *   layout with finishLayout.
+ */
+static void computeLayout(int elfClass, const GElf_Phdr* phdrs, size_t count,
+                          const size_t* owner, int noSht, bool pack,
+                          struct outputLayout* layout)
+{
+    int              is64 = (elfClass == ELFCLASS64);
+    const GElf_Phdr* pht  = layout->pht;
+
+    layout->ehdrSize = is64 ? sizeof(Elf64_Ehdr) : sizeof(Elf32_Ehdr);
+    layout->phdrSize = is64 ? sizeof(Elf64_Phdr) : sizeof(Elf32_Phdr);
+    layout->shdrSize = is64 ? sizeof(Elf64_Shdr) : sizeof(Elf32_Shdr);
+
+    layout->headerEnd = layout->ehdrSize + layout->phnum * layout->phdrSize;
+    uint64_t pos      = layout->headerEnd;
+    for (size_t i = 0; i < layout->phnum; i++) {
+        uint64_t align = pht[i].p_align;
+        uint64_t off   = pos;
+        if (align > 1 && !pack) {
+            off += (pht[i].p_vaddr - pos) & (align - 1);
+        }
+        layout->phtOffsets[i] = off;
+        /* Empty segments get a valid offset but take up no room */
+        if (pht[i].p_filesz != 0) {
+            pos = off + pht[i].p_filesz;
+        }
+    }
+    finishLayout(phdrs, count, owner, noSht, pos, layout);
+}
+
+/*
+ * holePush:
+ *   Record the free bytes [lo, hi), if any, in planOffsets' heap.
+ */
+static void holePush(struct span* holes, size_t* holeCount,
+                     struct heapEntry* heap, size_t* heapCount, uint64_t lo,
+                     uint64_t hi)
+{
+    if (hi <= lo) {
+        return;
+    }
+    holes[*holeCount] = (struct span){lo, hi, 0};
+    heapPush(heap, heapCount, (struct heapEntry){hi - lo, (*holeCount)++});
+}
+
+/*
+ * planOffsets:
+ *   Place the phnum entries of pht from start on with as little padding as
+ *   the alignment rule allows, in any file order: the entries are taken by
+ *   decreasing p_align (then in PHT order) and each one goes into the
+ *   largest hole that earlier placements left, if it fits there at an
+ *   offset congruent to its p_vaddr, or else after the last one. Coarsely
+ *   aligned entries thus go first and the finer ones fill the padding in
+ *   front of them. Empty entries keep the offsets they have. Returns the
+ *   end of the data, or 0 on error.
+ */
+static uint64_t planOffsets(const GElf_Phdr* pht, size_t phnum, uint64_t start,
+                            uint64_t* offsets)
+{
+    struct phdrKey*   keys   = malloc(phnum * sizeof(*keys));
+    struct phdrKey*   spare  = malloc(phnum * sizeof(*spare));
+    struct span*      holes  = malloc((2 * phnum + 1) * sizeof(*holes));
+    struct heapEntry* heap   = malloc((2 * phnum + 1) * sizeof(*heap));
+    size_t            nHoles = 0;
+    size_t            nHeap  = 0;
+    uint64_t          pos    = start;
+    if (!keys || !spare || !holes || !heap) {
+        perror("malloc layout plan");
+        pos = 0;
+        goto out;
+    }
+
+    for (size_t i = 0; i < phnum; i++) {
+        keys[i].addr  = UINT64_MAX - (pht[i].p_align > 1 ? pht[i].p_align : 1);
+        keys[i].index = i;
+    }
+    const struct phdrKey* byAlign = sortKeys(keys, spare, phnum);
+    for (size_t k = 0; k < phnum; k++) {
+        const GElf_Phdr* ph   = &pht[byAlign[k].index];
+        uint64_t         mask = ph->p_align > 1 ? ph->p_align - 1 : 0;
+        if (ph->p_filesz == 0) {
+            continue;
+        }
+        if (nHeap) {
+            struct span hole = holes[heap[0].span];
+            uint64_t    off  = hole.lo + ((ph->p_vaddr - hole.lo) & mask);
+            if (off <= hole.hi && ph->p_filesz <= hole.hi - off) {
+                heapPop(heap, &nHeap);
+                holePush(holes, &nHoles, heap, &nHeap, hole.lo, off);
+                holePush(holes, &nHoles, heap, &nHeap, off + ph->p_filesz,
+                         hole.hi);
+                offsets[byAlign[k].index] = off;
+                continue;
+            }
+        }
+        uint64_t off = pos + ((ph->p_vaddr - pos) & mask);
+        holePush(holes, &nHoles, heap, &nHeap, pos, off);
+        offsets[byAlign[k].index] = off;
+        pos                       = off + ph->p_filesz;
+    }
+
+out:
+    free(keys);
+    free(spare);
+    free(holes);
+    free(heap);
+    return pos;
+}
+
+/*
+ * adoptPlan:
+ *   Switch layout over to the entry offsets in planned, which end at
+ *   dataEnd: give the PHT its own arrays if it still shares the payloads'
+ *   (owner is then made up), and put the count payloads in *phdrs and
+ *   owner into file order, one entry's payloads after another.
+ */
+static int adoptPlan(GElf_Phdr* phdrs, size_t count, size_t** owner,
+                     uint64_t* planned, uint64_t dataEnd, int noSht,
+                     struct outputLayout* layout)
+{
+    struct phdrKey* keys   = malloc(count * sizeof(*keys));
+    struct phdrKey* spare  = malloc(count * sizeof(*spare));
+    GElf_Phdr*      sorted = malloc(count * sizeof(*sorted));
+    size_t*         order  = malloc(count * sizeof(*order));
+    int             rc     = -1;
+    if (!keys || !spare || !sorted || !order) {
+        perror("malloc planned layout");
+        goto out;
+    }
+    if (!*owner) {
+        GElf_Phdr* pht = malloc(count * sizeof(*pht));
+        *owner         = malloc(count * sizeof(**owner));
+        if (!pht || !*owner) {
+            perror("malloc planned PHT");
+            free(pht);
+            goto out;
+        }
+        memcpy(pht, phdrs, count * sizeof(*pht));
+        for (size_t i = 0; i < count; i++) {
+            (*owner)[i] = i;
+        }
+        layout->pht        = pht;
+        layout->phtOffsets = planned;
+    }
+    else {
+        memcpy(layout->phtOffsets, planned,
+               layout->phnum * sizeof(*planned));
+        free(planned);
+    }
+    planned = NULL;
+
+    for (size_t i = 0; i < count; i++) {
+        keys[i].addr  = layout->phtOffsets[(*owner)[i]];
+        keys[i].index = i;
+    }
+    const struct phdrKey* byOffset = sortKeys(keys, spare, count);
+    for (size_t i = 0; i < count; i++) {
+        sorted[i] = phdrs[byOffset[i].index];
+        order[i]  = (*owner)[byOffset[i].index];
+    }
+    memcpy(phdrs, sorted, count * sizeof(*sorted));
+    memcpy(*owner, order, count * sizeof(*order));
+    finishLayout(phdrs, count, *owner, noSht, dataEnd, layout);
+    rc = 0;
+
+out:
+    free(planned);
+    free(keys);
+    free(spare);
+    free(sorted);
+    free(order);
+    return rc;
+}
+
+/*
+ * canCoalesce:
+ *   Whether segment ph can be folded into the PHT entry into that ends
+ *   just before it: same flags, the same VMA-LMA displacement, no overlap,
+ *   and at most maxGap bytes that would have to be zero-filled in the file
+ *   (a bss tail of the entry counts, since it becomes file-backed).
+ */
+static bool canCoalesce(const GElf_Phdr* into, const GElf_Phdr* ph,
+                        uint64_t maxGap)
+{
+    if (ph->p_flags != into->p_flags ||
+        ph->p_vaddr - into->p_vaddr != ph->p_paddr - into->p_paddr ||
+        ph->p_paddr < into->p_paddr + into->p_memsz) {
+        return false;
+    }
+    uint64_t from = ph->p_filesz ? into->p_paddr + into->p_filesz
+                                 : into->p_paddr + into->p_memsz;
+    return ph->p_paddr - from <= maxGap;
+}
+
+/*
+ * coalesceSegments:
+ *   Merge runs of the count sorted segments that canCoalesce into single
+ *   PHT entries, written to pht (room for count entries) with the entry of
+ *   each segment in owner. Gaps inside an entry are zero-filled in the
+ *   output. Segments that are also back to back in the input are fused
+ *   into one payload so they are copied in one go; *count is updated.
+ *   Returns the number of PHT entries.
+ */
+static size_t coalesceSegments(GElf_Phdr* phdrs, size_t* count, uint64_t maxGap,
+                               GElf_Phdr* pht, size_t* owner)
+{
+    size_t phnum = 0;
+    size_t kept  = 0;
+    for (size_t i = 0; i < *count; i++) {
+        GElf_Phdr ph = phdrs[i];
+        if (phnum == 0 || !canCoalesce(&pht[phnum - 1], &ph, maxGap)) {
+            pht[phnum++]   = ph;
+            owner[kept]    = phnum - 1;
+            phdrs[kept++]  = ph;
+            continue;
+        }
+
+        GElf_Phdr* entry   = &pht[phnum - 1];
+        uint64_t   fileEnd = ph.p_filesz ? ph.p_paddr + ph.p_filesz
+                                         : entry->p_paddr + entry->p_filesz;
+        uint64_t   memEnd  = ph.p_paddr + ph.p_memsz;
+        if (memEnd < fileEnd) {
+            memEnd = fileEnd;
+        }
+        entry->p_filesz    = fileEnd - entry->p_paddr;
+        entry->p_memsz     = memEnd - entry->p_paddr;
+        if (ph.p_align > entry->p_align) {
+            entry->p_align = ph.p_align;
+        }
+
+        GElf_Phdr* last = &phdrs[kept - 1];
+        if (ph.p_filesz && last->p_filesz &&
+            last->p_paddr + last->p_filesz == ph.p_paddr &&
+            last->p_offset + last->p_filesz == ph.p_offset) {
+            last->p_filesz += ph.p_filesz;
+            last->p_memsz = last->p_filesz;
+            continue;
+        }
+        owner[kept]   = phnum - 1;
+        phdrs[kept++] = ph;
+    }
+    *count = kept;
+    return phnum;
+}
+
+/*
+ * keepSht:
+ *   Whether the output needs its SHT although opts->noSht asks to drop
+ *   it: a PHT of PN_XNUM or more entries records its size in sh_info of
+ *   section 0.
+ */
+static bool keepSht(const struct squashelf_options* opts, size_t phnum)
+{
+    if (!opts->noSht || phnum < PN_XNUM) {
+        return false;
+    }
+    DEBUG_PRINT("Keeping the SHT for %zu program headers (PN_XNUM)\n", phnum);
+    return true;
+}
+
+/*
+ * packAlign:
+ *   Lower the p_align of each of the phnum packed entries of pht to what
+ *   its offset still honours: the largest power of two, up to the old
+ *   p_align, that p_offset - p_vaddr is a multiple of. The output then
+ *   keeps the ELF rule p_offset % p_align == p_vaddr % p_align.
+ */
+static void packAlign(GElf_Phdr* pht, size_t phnum, const uint64_t* offsets)
+{
+    for (size_t i = 0; i < phnum; i++) {
+        uint64_t skew = offsets[i] - pht[i].p_vaddr;
+        if (pht[i].p_align > 1 && (skew & (pht[i].p_align - 1)) != 0) {
+            DEBUG_PRINT("  Packed segment %zu (LMA 0x%lx): p_align 0x%lx -> "
+                        "0x%lx\n",
+                        i, pht[i].p_paddr, pht[i].p_align, skew & -skew);
+            pht[i].p_align = skew & -skew;
+        }
+    }
+}
+
+/*
+ * planLayout:
+ *   Coalesce the count sorted segments if opts asks for it, then allocate
+ *   and compute the output layout in opts->layout (LMA order for output
+ *   that is compressed or not ELF, which has its own). phdrs is left
+ *   holding the payloads to copy, in file order, and *count their number.
+ *   Plain ELF output is laid out per opts->layout (pack lowering p_align
+ *   where it has to) and its padding added to opts->stats. The layout must be released with freeLayout, also after
+ *   a failure.
+ */
+static int planLayout(int elfClass, GElf_Phdr* phdrs, size_t* count,
+                      const struct squashelf_options* opts,
+                      struct outputLayout* layout)
+{
+    bool plain = opts->format == SQUASHELF_FORMAT_ELF &&
+                 opts->codec == SQUASHELF_CODEC_NONE;
+    int  mode  = plain ? opts->layout : SQUASHELF_LAYOUT_LMA;
+    bool pack  = mode == SQUASHELF_LAYOUT_PACK;
+    int  noSht = opts->noSht;
+
+    layout->offsets = calloc(*count, sizeof(uint64_t));
+    if (!layout->offsets) {
+        perror("calloc layout offsets");
+        return -1;
+    }
+    layout->pht        = phdrs;
+    layout->phnum      = *count;
+    layout->phtOffsets = layout->offsets;
+
+    if (opts->coalesce) {
+        GElf_Phdr* pht  = malloc(*count * sizeof(*pht));
+        uint64_t*  offs = calloc(*count, sizeof(uint64_t));
+        layout->owner   = malloc(*count * sizeof(*layout->owner));
+        if (!pht || !offs || !layout->owner) {
+            perror("malloc coalesced PHT");
+            free(pht);
+            free(offs);
+            return -1;
+        }
+
+        /* The uncoalesced layout, only for the report below */
+        computeLayout(elfClass, phdrs, *count, NULL, noSht, pack, layout);
+        size_t   phnumBefore = layout->phnum;
+        uint64_t sizeBefore  = layout->fileSize;
+
+        layout->phnum = coalesceSegments(phdrs, count, opts->coalesceGap, pht,
+                                         layout->owner);
+        layout->pht        = pht;
+        layout->phtOffsets = offs;
+        noSht              = keepSht(opts, layout->phnum) ? 0 : noSht;
+        computeLayout(elfClass, phdrs, *count, layout->owner, noSht, pack,
+                      layout);
+        DEBUG_PRINT("Coalesced %zu PT_LOAD segments into %zu (max gap 0x%lx): "
+                    "%lu -> %lu bytes, %ld saved\n",
+                    phnumBefore, layout->phnum, opts->coalesceGap, sizeBefore,
+                    layout->fileSize,
+                    (long)sizeBefore - (long)layout->fileSize);
+    }
+    else {
+        noSht = keepSht(opts, layout->phnum) ? 0 : noSht;
+        computeLayout(elfClass, phdrs, *count, NULL, noSht, pack, layout);
+    }
+
+    /* What the entries would take in LMA order, for the report */
+    uint64_t entryBytes = 0;
+    for (size_t i = 0; i < layout->phnum; i++) {
+        entryBytes += layout->pht[i].p_filesz;
+    }
+    uint64_t lmaEnd = layout->dataEnd;
+    if (pack) {
+        uint64_t pos = layout->headerEnd;
+        for (size_t i = 0; i < layout->phnum; i++) {
+            uint64_t align = layout->pht[i].p_align;
+            if (layout->pht[i].p_filesz != 0) {
+                pos += align > 1 ? (layout->pht[i].p_vaddr - pos) & (align - 1)
+                                 : 0;
+                pos += layout->pht[i].p_filesz;
+            }
+        }
+        lmaEnd = pos;
+        packAlign((GElf_Phdr*)layout->pht, layout->phnum, layout->phtOffsets);
+    }
+    else if (mode == SQUASHELF_LAYOUT_PLAN && layout->phnum > 1) {
+        uint64_t* planned = malloc(layout->phnum * sizeof(*planned));
+        if (!planned) {
+            perror("malloc layout plan");
+            return -1;
+        }
+        memcpy(planned, layout->phtOffsets, layout->phnum * sizeof(*planned));
+        uint64_t plannedEnd = planOffsets(layout->pht, layout->phnum,
+                                          layout->headerEnd, planned);
+        if (plannedEnd == 0) {
+            free(planned);
+            return -1;
+        }
+        if (plannedEnd >= layout->dataEnd) {
+            free(planned); /* LMA order is as tight */
+        }
+        else if (adoptPlan(phdrs, *count, &layout->owner, planned, plannedEnd,
+                           noSht, layout) != 0) {
+            return -1;
+        }
+    }
+
+    uint64_t padding = layout->dataEnd - layout->headerEnd - entryBytes;
+    if (lmaEnd != layout->dataEnd) {
+        DEBUG_PRINT("Layout (%s): 0x%lx bytes of alignment padding, 0x%lx "
+                    "less than in LMA order\n",
+                    squashelf_layout_name(mode), padding,
+                    lmaEnd - layout->dataEnd);
+    }
+    if (opts->stats && plain) {
+        opts->stats->paddingBytes += padding;
+        opts->stats->paddingRemoved += lmaEnd - layout->dataEnd;
+    }
+
+    for (size_t i = 0; i < layout->phnum; i++) {
+        DEBUG_PRINT("  Segment %zu (LMA 0x%lx) -> output offset 0x%lx\n", i,
+                    layout->pht[i].p_paddr, layout->phtOffsets[i]);
+    }
+    DEBUG_PRINT("Computed output layout: %lu bytes\n", layout->fileSize);
+    return 0;
+}
+
+/*
+ * freeLayout:
+ *   Release what planLayout allocated.
+ */
+static void freeLayout(struct outputLayout* layout)
+{
+    if (layout->phtOffsets != layout->offsets) {
+        free((GElf_Phdr*)layout->pht);
+        free(layout->phtOffsets);
+    }
+    free(layout->offsets);
+    free(layout->owner);
+}
+
+/* Byte order conversions between the host and little or big-endian files */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define LE32(x) (x)
+#define LE64(x) (x)
+#define BE32(x) __builtin_bswap32(x)
+#define BE64(x) __builtin_bswap64(x)
+#else
+#define LE32(x) __builtin_bswap32(x)
+#define LE64(x) __builtin_bswap64(x)
+#define BE32(x) (x)
+#define BE64(x) (x)
+#endif
+
+/*
+ * phtCodec:
+ *   Conversion between a program header table in the file format of one
+ *   ELF class and byte order and GElf_Phdr entries. decode reads count
+ *   entries from raw; encode writes them to out, with p_offset taken
+ *   from offsets when that is not NULL. Both work on native Elf32_Phdr or
+ *   Elf64_Phdr records and swap bytes only for a foreign byte order.
+ */
+struct phtCodec {
+    size_t entSize;
+    void (*decode)(const unsigned char* raw, size_t count, GElf_Phdr* out);
+    void (*encode)(const GElf_Phdr* pht, const uint64_t* offsets,
+                   size_t count, unsigned char* out);
+};
+
+/*
+ * PHT_CODEC:
+ *   Define the decode and encode functions of phtCodec name for Phdr
+ *   records whose 32-bit fields convert with W and address-sized fields
+ *   with A. Host-order ELF64 records are laid out exactly like GElf_Phdr
+ *   and are copied whole.
+ */
+#define PHT_CODEC(name, Phdr, W, A)                                          \
+    static void name##Decode(const unsigned char* raw, size_t count,         \
+                             GElf_Phdr* out)                                 \
+    {                                                                        \
+        if (sizeof(Phdr) == sizeof(GElf_Phdr) && W(1U) == 1U) {              \
+            memcpy(out, raw, count * sizeof(Phdr));                          \
+            return;                                                          \
+        }                                                                    \
+        for (size_t i = 0; i < count; i++) {                                 \
+            Phdr ph;                                                         \
+            memcpy(&ph, raw + i * sizeof(ph), sizeof(ph));                   \
+            out[i].p_type   = W(ph.p_type);                                  \
+            out[i].p_flags  = W(ph.p_flags);                                 \
+            out[i].p_offset = A(ph.p_offset);                                \
+            out[i].p_vaddr  = A(ph.p_vaddr);                                 \
+            out[i].p_paddr  = A(ph.p_paddr);                                 \
+            out[i].p_filesz = A(ph.p_filesz);                                \
+            out[i].p_memsz  = A(ph.p_memsz);                                 \
+            out[i].p_align  = A(ph.p_align);                                 \
+        }                                                                    \
+    }                                                                        \
+    static void name##Encode(const GElf_Phdr* pht, const uint64_t* offsets,  \
+                             size_t count, unsigned char* out)               \
+    {                                                                        \
+        if (sizeof(Phdr) == sizeof(GElf_Phdr) && W(1U) == 1U) {              \
+            memcpy(out, pht, count * sizeof(Phdr));                          \
+            for (size_t i = 0; offsets && i < count; i++) {                  \
+                memcpy(out + i * sizeof(Phdr) + offsetof(Phdr, p_offset),    \
+                       &offsets[i], sizeof(offsets[i]));                     \
+            }                                                                \
+            return;                                                          \
+        }                                                                    \
+        for (size_t i = 0; i < count; i++) {                                 \
+            Phdr ph;                                                         \
+            ph.p_type   = W((uint32_t)pht[i].p_type);                        \
+            ph.p_flags  = W((uint32_t)pht[i].p_flags);                       \
+            ph.p_offset = A(offsets ? offsets[i] : pht[i].p_offset);         \
+            ph.p_vaddr  = A(pht[i].p_vaddr);                                 \
+            ph.p_paddr  = A(pht[i].p_paddr);                                 \
+            ph.p_filesz = A(pht[i].p_filesz);                                \
+            ph.p_memsz  = A(pht[i].p_memsz);                                 \
+            ph.p_align  = A(pht[i].p_align);                                 \
+            memcpy(out + i * sizeof(ph), &ph, sizeof(ph));                   \
+        }                                                                    \
+    }
+
+/* The 32-bit address fields of ELF32 are truncated by the conversion */
+#define LE32A(x) LE32((uint32_t)(x))
+#define BE32A(x) BE32((uint32_t)(x))
+PHT_CODEC(pht32le, Elf32_Phdr, LE32, LE32A)
+PHT_CODEC(pht32be, Elf32_Phdr, BE32, BE32A)
+PHT_CODEC(pht64le, Elf64_Phdr, LE32, LE64)
+PHT_CODEC(pht64be, Elf64_Phdr, BE32, BE64)
+
+static const struct phtCodec phtCodecs[2][2] = {
+    {{sizeof(Elf32_Phdr), pht32leDecode, pht32leEncode},
+     {sizeof(Elf32_Phdr), pht32beDecode, pht32beEncode}},
+    {{sizeof(Elf64_Phdr), pht64leDecode, pht64leEncode},
+     {sizeof(Elf64_Phdr), pht64beDecode, pht64beEncode}},
+};
+
+/*
+ * phtCodecFor:
+ *   The phtCodec for the class and byte order in e_ident of ehdr, or
+ *   NULL for values other than ELFCLASS32/64 and ELFDATA2LSB/MSB.
+ */
+static const struct phtCodec* phtCodecFor(const GElf_Ehdr* ehdr)
+{
+    unsigned elfClass = ehdr->e_ident[EI_CLASS];
+    unsigned encoding = ehdr->e_ident[EI_DATA];
+    if ((elfClass != ELFCLASS32 && elfClass != ELFCLASS64) ||
+        (encoding != ELFDATA2LSB && encoding != ELFDATA2MSB)) {
+        return NULL;
+    }
+    return &phtCodecs[elfClass == ELFCLASS64][encoding == ELFDATA2MSB];
+}
+
+/*
+ * encodeEhdr:
+ *   Convert an ELF header to its on-disk form (class and byte order taken
+ *   from e_ident) at out, which must hold layout->ehdrSize bytes.
+ */
+static int encodeEhdr(const GElf_Ehdr* ehdr, void* out)
+{
+    unsigned encoding = ehdr->e_ident[EI_DATA];
+    Elf_Data src      = {.d_type = ELF_T_EHDR, .d_version = EV_CURRENT};
+    Elf_Data dst      = {.d_buf = out, .d_version = EV_CURRENT};
+
+    if (ehdr->e_ident[EI_CLASS] == ELFCLASS64) {
+        Elf64_Ehdr native = *ehdr;
+        src.d_buf         = &native;
+        src.d_size = dst.d_size = sizeof(native);
+        return elf64_xlatetof(&dst, &src, encoding) ? 0 : -1;
+    }
+
+    Elf32_Ehdr native;
+    memcpy(native.e_ident, ehdr->e_ident, EI_NIDENT);
+    native.e_type      = ehdr->e_type;
+    native.e_machine   = ehdr->e_machine;
+    native.e_version   = ehdr->e_version;
+    native.e_entry     = ehdr->e_entry;
+    native.e_phoff     = ehdr->e_phoff;
+    native.e_shoff     = ehdr->e_shoff;
+    native.e_flags     = ehdr->e_flags;
+    native.e_ehsize    = ehdr->e_ehsize;
+    native.e_phentsize = ehdr->e_phentsize;
+    native.e_phnum     = ehdr->e_phnum;
+    native.e_shentsize = ehdr->e_shentsize;
+    native.e_shnum     = ehdr->e_shnum;
+    native.e_shstrndx  = ehdr->e_shstrndx;
+    src.d_buf          = &native;
+    src.d_size = dst.d_size = sizeof(native);
+    return elf32_xlatetof(&dst, &src, encoding) ? 0 : -1;
+}
+
+/*
+ * encodeShdr:
+ *   Convert one section header to its on-disk form at out.
+ */
+static int encodeShdr(int elfClass, unsigned encoding, const GElf_Shdr* sh,
+                      void* out)
+{
+    Elf_Data src = {.d_type = ELF_T_SHDR, .d_version = EV_CURRENT};
+    Elf_Data dst = {.d_buf = out, .d_version = EV_CURRENT};
+
+    if (elfClass == ELFCLASS64) {
+        Elf64_Shdr native = *sh;
+        src.d_buf         = &native;
+        src.d_size = dst.d_size = sizeof(native);
+        return elf64_xlatetof(&dst, &src, encoding) ? 0 : -1;
+    }
+
+    Elf32_Shdr native = {
+        .sh_name      = sh->sh_name,
+        .sh_type      = sh->sh_type,
+        .sh_flags     = sh->sh_flags,
+        .sh_addr      = sh->sh_addr,
+        .sh_offset    = sh->sh_offset,
+        .sh_size      = sh->sh_size,
+        .sh_link      = sh->sh_link,
+        .sh_info      = sh->sh_info,
+        .sh_addralign = sh->sh_addralign,
+        .sh_entsize   = sh->sh_entsize,
+    };
+    src.d_buf  = &native;
+    src.d_size = dst.d_size = sizeof(native);
+    return elf32_xlatetof(&dst, &src, encoding) ? 0 : -1;
+}
+
+/*
+ * buildOutputEhdr:
+ *   Derive the output ELF header from the input one and the layout.
+ */
+static void buildOutputEhdr(const GElf_Ehdr* in, int noSht,
+                            const struct outputLayout* layout,
+                            GElf_Ehdr* out)
+{
+    *out             = *in;
+    out->e_phoff     = layout->ehdrSize;
+    out->e_ehsize    = layout->ehdrSize;
+    out->e_phentsize = layout->phdrSize;
+    out->e_phnum     = layout->phnum < PN_XNUM ? layout->phnum : PN_XNUM;
+    out->e_shentsize = layout->shdrSize;
+    out->e_shoff     = layout->shoff;
+    out->e_shnum     = noSht ? 0 : 1;
+    out->e_shstrndx  = SHN_UNDEF;
+}
+
+/*
+ * encodeOutputHeaders:
+ *   Encode the output ELF header followed by the PHT (entries and their
+ *   offsets taken from the layout) into out, which must hold
+ *   layout->headerEnd bytes.
+ */
+static int encodeOutputHeaders(const GElf_Ehdr* inEhdr, int noSht,
+                               const struct outputLayout* layout,
+                               unsigned char* out)
+{
+    const struct phtCodec* codec = phtCodecFor(inEhdr);
+
+    GElf_Ehdr ehdr;
+    buildOutputEhdr(inEhdr, noSht, layout, &ehdr);
+    if (!codec || encodeEhdr(&ehdr, out) != 0) {
+        fprintf(stderr, "encode ELF header: %s\n", elf_errmsg(-1));
+        return -1;
+    }
+    codec->encode(layout->pht, layout->phtOffsets, layout->phnum,
+                  out + layout->ehdrSize);
+    return 0;
+}
+
+/*
+ * encodeNullShdr:
+ *   Encode the output's single NULL section header at out. It is all
+ *   zeros unless the PHT needs PN_XNUM, when sh_info holds the count.
+ */
+static int encodeNullShdr(const GElf_Ehdr* inEhdr,
+                          const struct outputLayout* layout,
+                          unsigned char* out)
+{
+    GElf_Shdr sh = {.sh_info = layout->phnum < PN_XNUM ? 0 : layout->phnum};
+    if (encodeShdr(inEhdr->e_ident[EI_CLASS], inEhdr->e_ident[EI_DATA], &sh,
+                   out) != 0) {
+        fprintf(stderr, "encode shdr[0]: %s\n", elf_errmsg(-1));
+        return -1;
+    }
+    return 0;
+}
+
+/* Buffered list of iovecs flushed to consecutive file offsets by pwritev */
+#define IOV_BATCH 1024 /* usual IOV_MAX on Linux */
+struct iovBatch {
+    int          fd;
+    off_t        offset; /* file offset of iov[0] */
+    int          count;
+    struct iovec iov[IOV_BATCH];
+};
+
+/*
+ * iovFlush:
+ *   Write out every queued iovec, retrying short writes.
+ */
+static int iovFlush(struct iovBatch* batch)
+{
+    struct iovec* iov = batch->iov;
+    int           cnt = batch->count;
+    while (cnt > 0) {
+        ssize_t n = pwritev(batch->fd, iov, cnt, batch->offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        batch->offset += n;
+        /* Drop fully written entries and trim a partially written one */
+        while (cnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    batch->count = 0;
+    return 0;
+}
+
+/*
+ * iovAppend:
+ *   Queue len bytes at buf for writing. A NULL buf queues zero padding.
+ */
+static int iovAppend(struct iovBatch* batch, const void* buf, size_t len)
+{
+    static const char zeros[65536];
+    while (len > 0) {
+        size_t chunk = len;
+        if (!buf && chunk > sizeof(zeros)) {
+            chunk = sizeof(zeros);
+        }
+        if (batch->count == IOV_BATCH && iovFlush(batch) != 0) {
+            return -1;
+        }
+        /* pwritev caps a single call at SSIZE_MAX bytes */
+        if (chunk > SSIZE_MAX / IOV_BATCH) {
+            chunk = SSIZE_MAX / IOV_BATCH;
+        }
+        batch->iov[batch->count].iov_base = buf ? (void*)buf : (void*)zeros;
+        batch->iov[batch->count].iov_len  = chunk;
+        batch->count++;
+        len -= chunk;
+        if (buf) {
+            buf = (const char*)buf + chunk;
+        }
+    }
+    return 0;
+}
+
+/*
+ * copyUnsupported:
+ *   Whether a copy_file_range/sendfile failure means "not possible for
+ *   these files" (so a slower engine should take over) rather than a real
+ *   I/O error.
+ */
+static bool copyUnsupported(int err)
+{
+    return err == ENOSYS || err == EXDEV || err == EINVAL ||
+           err == EOPNOTSUPP || err == ENOTSUP || err == EBADF;
+}
+
+/*
+ * pwriteAll:
+ *   pwrite that retries until len bytes are written.
+ */
+static int pwriteAll(int fd, const void* buf, size_t len, off_t offset)
+{
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf = (const char*)buf + n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/*
+ * preadAll:
+ *   pread that retries until len bytes are read. Running into the end of
+ *   the file fails with EIO.
+ */
+static int preadAll(int fd, void* buf, size_t len, off_t offset)
+{
+    while (len > 0) {
+        ssize_t n = pread(fd, buf, len, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            errno = EIO;
+            return -1;
+        }
+        buf = (char*)buf + n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/*
+ * copySegment:
+ *   Copy len input bytes at inOff to outOff in the output using *engine,
+ *   stepping *engine down the fallback chain when the current one is not
+ *   supported. The engine that finished the copy is left in *engine so
+ *   later segments start there. With sharedFd set other threads write to
+ *   the same output, so sendfile (which depends on the file position) is
+ *   skipped.
+ */
+static int copySegment(enum squashelf_copy* engine, int inputFd,
+                       const void* inputMap, uint64_t inOff, int outputFd,
+                       uint64_t outOff, uint64_t len, bool sharedFd)
+{
+    const size_t maxChunk   = 1UL << 30; /* keep each syscall well < 2 GiB */
+    const size_t bounceSize = 1UL << 20;
+    char*        bounce     = NULL;
+    uint64_t     done       = 0;
+    int          rc         = -1;
+
+    while (done < len) {
+        size_t  chunk = len - done < maxChunk ? len - done : maxChunk;
+        ssize_t n;
+        if (sharedFd && *engine == SQUASHELF_COPY_SENDFILE) {
+            *engine = SQUASHELF_COPY_BUFFERED;
+        }
+        switch (*engine) {
+            case SQUASHELF_COPY_FILE_RANGE: {
+                loff_t in  = inOff + done;
+                loff_t out = outOff + done;
+                n = copy_file_range(inputFd, &in, outputFd, &out, chunk, 0);
+            } break;
+            case SQUASHELF_COPY_SENDFILE: {
+                /* sendfile writes at the output's file position */
+                off_t in = inOff + done;
+                n        = -1;
+                if (lseek(outputFd, outOff + done, SEEK_SET) >= 0) {
+                    n = sendfile(outputFd, inputFd, &in, chunk);
+                }
+            } break;
+            default:
+                if (inputMap) {
+                    n = pwriteAll(outputFd,
+                                  (const char*)inputMap + inOff + done, chunk,
+                                  outOff + done) == 0
+                            ? (ssize_t)chunk
+                            : -1;
+                    break;
+                }
+                if (!bounce && !(bounce = malloc(bounceSize))) {
+                    perror("malloc bounce buffer");
+                    goto out;
+                }
+                if (chunk > bounceSize) {
+                    chunk = bounceSize;
+                }
+                n = pread(inputFd, bounce, chunk, inOff + done);
+                if (n > 0 &&
+                    pwriteAll(outputFd, bounce, n, outOff + done) != 0) {
+                    n = -1;
+                }
+                break;
+        }
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (*engine != SQUASHELF_COPY_BUFFERED && copyUnsupported(errno)) {
+                DEBUG_PRINT("  %s unavailable (%s); falling back to %s\n",
+                            copyEngineNames[*engine], strerror(errno),
+                            copyEngineNames[*engine + 1]);
+                *engine = *engine + 1;
+                errno   = 0;
+                continue;
+            }
+            perror(copyEngineNames[*engine]);
+            goto out;
+        }
+        if (n == 0) {
+            fprintf(stderr,
+                    "Error: input ends inside segment data at offset 0x%lx\n",
+                    inOff + done);
+            errno = EIO;
+            goto out;
+        }
+        done += n;
+    }
+    rc = 0;
+
+out:
+    free(bounce);
+    return rc;
+}
+
+/*
+ * zeroPrefix:
+ *   Number of leading zero bytes in the len bytes at p. Scans 64 bytes
+ *   per step with SSE2 (always present on x86-64), then words and bytes.
+ */
+static size_t zeroPrefix(const unsigned char* p, size_t len)
+{
+    size_t i = 0;
+#if defined(__x86_64__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 64 <= len; i += 64) {
+        __m128i v = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128((const __m128i*)(p + i)),
+                         _mm_loadu_si128((const __m128i*)(p + i + 16))),
+            _mm_or_si128(_mm_loadu_si128((const __m128i*)(p + i + 32)),
+                         _mm_loadu_si128((const __m128i*)(p + i + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xffff) {
+            break;
+        }
+    }
+#endif
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, p + i, sizeof(word));
+        if (word != 0) {
+            break;
+        }
+    }
+    while (i < len && p[i] == 0) {
+        i++;
+    }
+    return i;
+}
+
+/*
+ * zeroSuffix:
+ *   Number of trailing zero bytes in the len bytes at p, scanned
+ *   backwards like zeroPrefix.
+ */
+static size_t zeroSuffix(const unsigned char* p, size_t len)
+{
+    size_t n = len; /* bytes before the zero tail found so far */
+#if defined(__x86_64__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; n >= 64; n -= 64) {
+        const unsigned char* q = p + n - 64;
+        __m128i              v = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128((const __m128i*)q),
+                         _mm_loadu_si128((const __m128i*)(q + 16))),
+            _mm_or_si128(_mm_loadu_si128((const __m128i*)(q + 32)),
+                         _mm_loadu_si128((const __m128i*)(q + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xffff) {
+            break;
+        }
+    }
+#endif
+    for (; n >= 8; n -= 8) {
+        uint64_t word;
+        memcpy(&word, p + n - 8, sizeof(word));
+        if (word != 0) {
+            break;
+        }
+    }
+    while (n > 0 && p[n - 1] == 0) {
+        n--;
+    }
+    return len - n;
+}
+
+/* Sparse output leaves holes in whole blocks of this size */
+#define SPARSE_BLOCK 4096UL
+
+/*
+ * sparseSource:
+ *   Where findZeroRun reads payload bytes: the input mapping, or fd with
+ *   pread into buf. With an fd, SEEK_DATA finds holes of a sparse input
+ *   without reading them; the last answer is kept in [holeStart, holeEnd)
+ *   and [dataStart, dataEnd).
+ */
+struct sparseSource {
+    int                  fd;
+    const unsigned char* map;
+    bool                 seek; /* SEEK_DATA works on fd */
+    uint64_t             holeStart;
+    uint64_t             holeEnd;
+    uint64_t             dataStart;
+    uint64_t             dataEnd;
+    unsigned char        buf[SPARSE_BLOCK];
+};
+
+static void sparseSourceInit(struct sparseSource* src, int fd,
+                             const void* map)
+{
+    src->fd        = fd;
+    src->map       = map;
+    src->seek      = fd >= 0;
+    src->holeStart = src->holeEnd = 0;
+    src->dataStart = src->dataEnd = 0;
+}
+
+/*
+ * inputHole:
+ *   Whether the len bytes at offset of the input lie in a hole, by
+ *   SEEK_DATA/SEEK_HOLE. Returns 1, 0 if they (may) hold data, or -1.
+ */
+static int inputHole(struct sparseSource* src, uint64_t offset, uint64_t len)
+{
+    if (!src->seek) {
+        return 0;
+    }
+    if (offset >= src->holeStart && offset + len <= src->holeEnd) {
+        return 1;
+    }
+    if (offset >= src->dataStart && offset < src->dataEnd) {
+        return 0;
+    }
+    off_t data = lseek(src->fd, offset, SEEK_DATA);
+    if (data < 0 && errno == ENXIO) {
+        data = UINT64_MAX >> 1; /* only a hole up to the end of the file */
+    }
+    else if (data < 0) {
+        DEBUG_PRINT("SEEK_DATA unsupported (%s); scanning instead\n",
+                    strerror(errno));
+        src->seek = false;
+        return 0;
+    }
+    if ((uint64_t)data > offset) {
+        src->holeStart = offset;
+        src->holeEnd   = data;
+        return offset + len <= (uint64_t)data;
+    }
+    off_t hole = lseek(src->fd, offset, SEEK_HOLE);
+    if (hole < 0) {
+        perror("lseek SEEK_HOLE");
+        return -1;
+    }
+    src->dataStart = offset;
+    src->dataEnd   = hole;
+    return 0;
+}
+
+/*
+ * blockIsZero:
+ *   Whether the len (at most SPARSE_BLOCK) input bytes at offset are all
+ *   zero. Returns 1, 0 or -1 on a read error.
+ */
+static int blockIsZero(struct sparseSource* src, uint64_t offset, size_t len)
+{
+    int hole = inputHole(src, offset, len);
+    if (hole != 0) {
+        return hole;
+    }
+    if (src->map) {
+        return zeroPrefix(src->map + offset, len) == len;
+    }
+    if (preadAll(src->fd, src->buf, len, offset) != 0) {
+        perror("pread segment data");
+        return -1;
+    }
+    return zeroPrefix(src->buf, len) == len;
+}
+
+/*
+ * findZeroRun:
+ *   Find the first run of zeros in bytes [from, len) of a payload (at
+ *   inOff in the input, outOff in the output) that covers at least one
+ *   whole SPARSE_BLOCK of the output, and set [*runStart, *runEnd)
+ *   (relative to the payload) to the whole blocks it covers. Both are
+ *   len if there is no such run.
+ */
+static int findZeroRun(struct sparseSource* src, uint64_t inOff,
+                       uint64_t outOff, uint64_t from, uint64_t len,
+                       uint64_t* runStart, uint64_t* runEnd)
+{
+    uint64_t block =
+        ((outOff + from + SPARSE_BLOCK - 1) & ~(SPARSE_BLOCK - 1)) - outOff;
+    uint64_t start = len;
+    for (; block + SPARSE_BLOCK <= len; block += SPARSE_BLOCK) {
+        int zero = blockIsZero(src, inOff + block, SPARSE_BLOCK);
+        if (zero < 0) {
+            return -1;
+        }
+        if (zero && start == len) {
+            start = block;
+        }
+        else if (!zero && start != len) {
+            break;
+        }
+    }
+    *runStart = start;
+    *runEnd   = start == len ? len : block;
+    return 0;
+}
+
+/*
+ * blockSpan:
+ *   The whole SPARSE_BLOCKs of the output range [from, to), as
+ *   [*start, *end): the part of an unwritten range that is a hole.
+ *   Returns whether there are any.
+ */
+static bool blockSpan(uint64_t from, uint64_t to, uint64_t* start,
+                      uint64_t* end)
+{
+    *start = (from + SPARSE_BLOCK - 1) & ~(SPARSE_BLOCK - 1);
+    *end   = to & ~(SPARSE_BLOCK - 1);
+    return *end > *start;
+}
+
+/*
+ * copySparse:
+ *   copySegment, except that whole output blocks of zeros are skipped so
+ *   they stay holes in the (initially empty) output; their size is added
+ *   to *skipped.
+ */
+static int copySparse(enum squashelf_copy* engine, int inputFd,
+                      const void* inputMap, uint64_t inOff, int outputFd,
+                      uint64_t outOff, uint64_t len, bool sharedFd,
+                      uint64_t* skipped)
+{
+    struct sparseSource* src = malloc(sizeof(*src));
+    uint64_t             pos = 0;
+    int                  rc  = -1;
+    if (!src) {
+        perror("malloc sparse scan");
+        return -1;
+    }
+    sparseSourceInit(src, inputFd, inputMap);
+    while (pos < len) {
+        uint64_t runStart;
+        uint64_t runEnd;
+        if (findZeroRun(src, inOff, outOff, pos, len, &runStart, &runEnd) !=
+            0) {
+            goto out;
+        }
+        if (runStart > pos &&
+            copySegment(engine, inputFd, inputMap, inOff + pos, outputFd,
+                        outOff + pos, runStart - pos, sharedFd) != 0) {
+            goto out;
+        }
+        *skipped += runEnd - runStart;
+        pos = runEnd;
+    }
+    rc = 0;
+
+out:
+    free(src);
+    return rc;
+}
+
+/* Parallel payload copy: segments split into fixed-size chunks */
+#define COPY_TASK_CHUNK (8UL << 20)
+
+/* One chunk of one segment */
+struct copyTask {
+    size_t   segment; /* index into the sorted phdrs */
+    uint64_t inOff;
+    uint64_t outOff;
+    uint64_t len;
+    int      engine;  /* enum squashelf_copy that completed the chunk */
+    uint64_t skipped; /* zero bytes left as holes (sparse copies) */
+};
+
+/* Work list shared by the copy threads */
+struct copyPool {
+    struct copyTask* tasks;
+    size_t           count;
+    size_t           next; /* index of the next unclaimed task */
+    int              failed;
+    int              inputFd;
+    int              outputFd;
+    const void*      inputMap;
+    enum squashelf_copy  engine; /* engine each thread starts with */
+    bool             sparse; /* copy with copySparse */
+    pthread_mutex_t  lock;
+};
+
+/*
+ * copyWorker:
+ *   Copy thread: claim chunks until the list is drained or a copy fails.
+ *   Each thread keeps its own position in the engine fallback chain.
+ */
+static void* copyWorker(void* arg)
+{
+    struct copyPool* pool   = arg;
+    enum squashelf_copy  engine = pool->engine;
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        size_t index = pool->failed ? pool->count : pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (index >= pool->count) {
+            return NULL;
+        }
+
+        struct copyTask* task = &pool->tasks[index];
+        int              rc   =
+            pool->sparse
+                ? copySparse(&engine, pool->inputFd, pool->inputMap,
+                             task->inOff, pool->outputFd, task->outOff,
+                             task->len, true, &task->skipped)
+                : copySegment(&engine, pool->inputFd, pool->inputMap,
+                              task->inOff, pool->outputFd, task->outOff,
+                              task->len, true);
+        if (rc != 0) {
+            fprintf(stderr, "Error: copying segment %zu chunk at input 0x%lx "
+                            "failed\n",
+                    task->segment, task->inOff);
+            pthread_mutex_lock(&pool->lock);
+            pool->failed = 1;
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        task->engine = engine;
+    }
+}
+
+/*
+ * copyParallel:
+ *   Copy every segment payload to its output offset on `jobs` threads.
+ *   Segments are cut into COPY_TASK_CHUNK pieces so one large segment
+ *   still keeps several requests in flight. Per-engine chunk counts are
+ *   added to engineUse, and with sparse the bytes left as holes to
+ *   *skipped.
+ */
+static int copyParallel(int outputFd, int inputFd, const void* inputMap,
+                        const GElf_Phdr* phdrs, size_t count,
+                        const struct outputLayout* layout,
+                        enum squashelf_copy engine, int jobs,
+                        size_t* engineUse, bool sparse, uint64_t* skipped)
+{
+    struct copyPool pool = {
+        .inputFd  = inputFd,
+        .outputFd = outputFd,
+        .inputMap = inputMap,
+        .engine   = engine,
+        .sparse   = sparse,
+        .lock     = PTHREAD_MUTEX_INITIALIZER,
+    };
+
+    size_t taskCount = 0;
+    for (size_t i = 0; i < count; i++) {
+        taskCount +=
+            (phdrs[i].p_filesz + COPY_TASK_CHUNK - 1) / COPY_TASK_CHUNK;
+    }
+    pool.tasks = calloc(taskCount ? taskCount : 1, sizeof(*pool.tasks));
+    if (!pool.tasks) {
+        perror("calloc copy tasks");
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        for (uint64_t done = 0; done < phdrs[i].p_filesz;
+             done += COPY_TASK_CHUNK) {
+            struct copyTask* task = &pool.tasks[pool.count++];
+            uint64_t         left = phdrs[i].p_filesz - done;
+            task->segment         = i;
+            task->inOff           = phdrs[i].p_offset + done;
+            task->outOff          = layout->offsets[i] + done;
+            task->len = left < COPY_TASK_CHUNK ? left : COPY_TASK_CHUNK;
+        }
+    }
+
+    if ((size_t)jobs > pool.count) {
+        jobs = pool.count ? (int)pool.count : 1;
+    }
+    DEBUG_PRINT("Copying %zu chunks on %d threads\n", pool.count, jobs);
+
+    pthread_t* threads = calloc(jobs, sizeof(*threads));
+    int        started = 0;
+    if (threads) {
+        for (; started < jobs; started++) {
+            int err =
+                pthread_create(&threads[started], NULL, copyWorker, &pool);
+            if (err != 0) {
+                fprintf(stderr, "pthread_create: %s\n", strerror(err));
+                break;
+            }
+        }
+    }
+    if (started == 0) {
+        copyWorker(&pool); /* no threads at all: copy inline */
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    if (!pool.failed) {
+        for (size_t i = 0; i < pool.count; i++) {
+            engineUse[pool.tasks[i].engine]++;
+            *skipped += pool.tasks[i].skipped;
+        }
+    }
+    free(pool.tasks);
+    return pool.failed ? -1 : 0;
+}
+
+/*
+ * io_uring payload copy, driven through the raw syscalls so the build
+ * needs nothing beyond the kernel headers. Payloads are cut into
+ * URING_CHUNK pieces; each piece owns one slot of a fixed buffer pool
+ * registered with the ring while it is in flight.
+ */
+#define URING_DEPTH 32 /* chunks in flight */
+#define URING_CHUNK (512UL << 10)
+
+/* The mapped submission and completion rings */
+struct uring {
+    int                  fd;
+    unsigned*            sqTail;
+    unsigned             sqMask;
+    unsigned*            cqHead;
+    unsigned*            cqTail;
+    unsigned             cqMask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void*                sqRing;
+    size_t               sqRingSize;
+    void*                cqRing; /* sqRing with IORING_FEAT_SINGLE_MMAP */
+    size_t               cqRingSize;
+    size_t               sqesSize;
+    unsigned             tail;   /* next SQE, published by uringSubmit */
+    unsigned             queued; /* SQEs not yet taken by the kernel */
+};
+
+/* One chunk on the ring: a linked read and write, or a write alone */
+struct uringSlot {
+    size_t   segment;
+    uint64_t inOff;
+    uint64_t outOff;
+    uint32_t len;
+    int      waiting; /* completions still due */
+    bool     failed;  /* some request came back short or failed */
+};
+
+/*
+ * uringClose:
+ *   Unmap the rings and close the ring fd, which also drops any
+ *   registered buffers.
+ */
+static void uringClose(struct uring* ring)
+{
+    if (ring->sqes && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqesSize);
+    }
+    if (ring->cqRing && ring->cqRing != MAP_FAILED &&
+        ring->cqRing != ring->sqRing) {
+        munmap(ring->cqRing, ring->cqRingSize);
+    }
+    if (ring->sqRing && ring->sqRing != MAP_FAILED) {
+        munmap(ring->sqRing, ring->sqRingSize);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+}
+
+/*
+ * uringOpen:
+ *   Set up a ring with room for `entries` submissions and map it. Fails
+ *   with errno set (ENOSYS on kernels without io_uring, EPERM where it is
+ *   disabled) and everything released.
+ */
+static int uringOpen(struct uring* ring, unsigned entries)
+{
+    struct io_uring_params p;
+    memset(ring, 0, sizeof(*ring));
+    memset(&p, 0, sizeof(p));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0) {
+        return -1;
+    }
+
+    ring->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cqRingSize =
+        p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqesSize   = p.sq_entries * sizeof(struct io_uring_sqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cqRingSize > ring->sqRingSize) {
+            ring->sqRingSize = ring->cqRingSize;
+        }
+        ring->cqRingSize = ring->sqRingSize;
+    }
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    if (ring->sqRing == MAP_FAILED) {
+        goto fail;
+    }
+    ring->cqRing = (p.features & IORING_FEAT_SINGLE_MMAP)
+                       ? ring->sqRing
+                       : mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, ring->fd,
+                              IORING_OFF_CQ_RING);
+    if (ring->cqRing == MAP_FAILED) {
+        goto fail;
+    }
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        goto fail;
+    }
+
+    char*     sq    = ring->sqRing;
+    char*     cq    = ring->cqRing;
+    unsigned* array = (unsigned*)(sq + p.sq_off.array);
+    ring->sqTail    = (unsigned*)(sq + p.sq_off.tail);
+    ring->sqMask    = *(unsigned*)(sq + p.sq_off.ring_mask);
+    ring->cqHead    = (unsigned*)(cq + p.cq_off.head);
+    ring->cqTail    = (unsigned*)(cq + p.cq_off.tail);
+    ring->cqMask    = *(unsigned*)(cq + p.cq_off.ring_mask);
+    ring->cqes      = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    ring->tail      = *ring->sqTail;
+    /* SQEs are used in ring order, so the index array never changes */
+    for (unsigned i = 0; i < p.sq_entries; i++) {
+        array[i] = i;
+    }
+    return 0;
+
+fail:;
+    int err = errno;
+    uringClose(ring);
+    errno = err;
+    return -1;
+}
+
+/*
+ * uringSqe:
+ *   Next free submission entry, cleared. The caller never queues more
+ *   than the ring holds, so there always is one.
+ */
+static struct io_uring_sqe* uringSqe(struct uring* ring)
+{
+    struct io_uring_sqe* sqe = &ring->sqes[ring->tail & ring->sqMask];
+    ring->tail++;
+    ring->queued++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/*
+ * uringSubmit:
+ *   Hand the queued entries to the kernel and wait for `wait`
+ *   completions, in one io_uring_enter.
+ */
+static int uringSubmit(struct uring* ring, unsigned wait)
+{
+    __atomic_store_n(ring->sqTail, ring->tail, __ATOMIC_RELEASE);
+    for (;;) {
+        long n = syscall(__NR_io_uring_enter, ring->fd, ring->queued, wait,
+                         IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        ring->queued -= (unsigned)n;
+        return 0;
+    }
+}
+
+/*
+ * copyUring:
+ *   Copy every segment payload to its output offset through an io_uring.
+ *   With an input fd each chunk is a READ_FIXED into its slot's registered
+ *   buffer linked to a WRITE_FIXED from it, so the kernel starts the write
+ *   as soon as the read lands; a memory input is written from memory. All
+ *   free slots are refilled before each io_uring_enter, which then waits
+ *   for half of the requests in flight, so one call submits and reaps a
+ *   batch and the ring never drains. A chunk that comes back short is redone
+ *   with pread/pwrite. Returns 1 without writing anything when the ring
+ *   or its buffers cannot be set up, so the caller can fall back to the
+ *   copy engines.
+ */
+static int copyUring(int outputFd, int inputFd, const void* inputMap,
+                     const GElf_Phdr* phdrs, size_t count,
+                     const struct outputLayout* layout,
+                     struct squashelf_stats* stats)
+{
+    const size_t     poolSize = URING_DEPTH * URING_CHUNK;
+    bool             linked   = inputFd >= 0;
+    struct uring     ring;
+    struct uringSlot slots[URING_DEPTH];
+    int              freeSlots[URING_DEPTH];
+    int              freeCount = URING_DEPTH;
+    unsigned char*   pool      = MAP_FAILED;
+    unsigned         inflight  = 0; /* requests not yet completed */
+    size_t           segment   = 0;
+    uint64_t         segDone   = 0;
+    bool             failed    = false;
+    uint64_t         requests = 0, calls = 0, depthSum = 0, depthMax = 0;
+    uint64_t         bytes = 0;
+    uint64_t         start;
+    int              rc = 1;
+
+    if (uringOpen(&ring, 2 * URING_DEPTH) != 0) {
+        DEBUG_PRINT("io_uring unavailable (%s); using the copy engines\n",
+                    strerror(errno));
+        return 1;
+    }
+    if (linked) {
+        struct iovec iov[URING_DEPTH];
+        pool = mmap(NULL, poolSize, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (pool == MAP_FAILED) {
+            DEBUG_PRINT("io_uring buffer pool: %s; using the copy engines\n",
+                        strerror(errno));
+            goto out;
+        }
+        for (int s = 0; s < URING_DEPTH; s++) {
+            iov[s].iov_base = pool + s * URING_CHUNK;
+            iov[s].iov_len  = URING_CHUNK;
+        }
+        if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS,
+                    iov, URING_DEPTH) != 0) {
+            /* Typically RLIMIT_MEMLOCK on kernels that still charge it */
+            DEBUG_PRINT("io_uring buffer registration failed (%s); using the "
+                        "copy engines\n",
+                        strerror(errno));
+            goto out;
+        }
+    }
+    for (int s = 0; s < URING_DEPTH; s++) {
+        freeSlots[s] = URING_DEPTH - 1 - s;
+    }
+
+    rc    = -1;
+    start = phaseStart(stats);
+    for (;;) {
+        /* Give every free slot the next chunk, unless a chunk failed */
+        while (freeCount > 0 && !failed) {
+            while (segment < count && segDone >= phdrs[segment].p_filesz) {
+                segment++;
+                segDone = 0;
+            }
+            if (segment == count) {
+                break;
+            }
+            uint64_t          left = phdrs[segment].p_filesz - segDone;
+            int               s    = freeSlots[--freeCount];
+            struct uringSlot* slot = &slots[s];
+            slot->segment          = segment;
+            slot->inOff            = phdrs[segment].p_offset + segDone;
+            slot->outOff           = layout->offsets[segment] + segDone;
+            slot->len    = left < URING_CHUNK ? (uint32_t)left : URING_CHUNK;
+            slot->failed = false;
+            segDone += slot->len;
+
+            struct io_uring_sqe* sqe = uringSqe(&ring);
+            if (linked) {
+                sqe->opcode    = IORING_OP_READ_FIXED;
+                sqe->flags     = IOSQE_IO_LINK;
+                sqe->fd        = inputFd;
+                sqe->addr      = (uintptr_t)(pool + s * URING_CHUNK);
+                sqe->len       = slot->len;
+                sqe->off       = slot->inOff;
+                sqe->buf_index = s;
+                sqe->user_data = 2 * (uint64_t)s;
+                sqe             = uringSqe(&ring);
+                sqe->opcode     = IORING_OP_WRITE_FIXED;
+                sqe->addr       = (uintptr_t)(pool + s * URING_CHUNK);
+                sqe->buf_index  = s;
+                slot->waiting   = 2;
+            }
+            else {
+                sqe->opcode   = IORING_OP_WRITE;
+                sqe->addr     = (uintptr_t)inputMap + slot->inOff;
+                slot->waiting = 1;
+            }
+            sqe->fd        = outputFd;
+            sqe->len       = slot->len;
+            sqe->off       = slot->outOff;
+            sqe->user_data = 2 * (uint64_t)s + 1;
+            inflight += slot->waiting;
+            requests += slot->waiting;
+        }
+        if (inflight == 0) {
+            break;
+        }
+
+        /* Reap half the ring per call while chunks remain, then the rest */
+        bool     more = !failed && segment < count;
+        unsigned wait = more && inflight > 1 ? inflight / 2 : inflight;
+        if (uringSubmit(&ring, wait) != 0) {
+            perror("io_uring_enter");
+            goto out;
+        }
+        calls++;
+        depthSum += inflight;
+        if (inflight > depthMax) {
+            depthMax = inflight;
+        }
+
+        unsigned head = *ring.cqHead;
+        unsigned tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const struct io_uring_cqe* cqe  = &ring.cqes[head & ring.cqMask];
+            int                        s    = (int)(cqe->user_data / 2);
+            struct uringSlot*          slot = &slots[s];
+            inflight--;
+            /* A short read also cancels its linked write (-ECANCELED) */
+            if (cqe->res != (int32_t)slot->len) {
+                slot->failed = true;
+            }
+            if (--slot->waiting > 0) {
+                continue;
+            }
+            if (slot->failed && !failed) {
+                unsigned char* buf = linked ? pool + s * URING_CHUNK : NULL;
+                const void*    src =
+                    linked ? (const void*)buf
+                           : (const char*)inputMap + slot->inOff;
+                DEBUG_PRINT("  io_uring chunk at input 0x%lx came back short; "
+                            "copying it again\n",
+                            slot->inOff);
+                if ((linked &&
+                     preadAll(inputFd, buf, slot->len, slot->inOff) != 0) ||
+                    pwriteAll(outputFd, src, slot->len, slot->outOff) != 0) {
+                    fprintf(stderr, "Error: copying segment %zu chunk at "
+                                    "input 0x%lx failed: %s\n",
+                            slot->segment, slot->inOff, strerror(errno));
+                    failed = true;
+                }
+            }
+            bytes += slot->len;
+            freeSlots[freeCount++] = s;
+        }
+        __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+    }
+    if (!failed) {
+        rc = 0;
+    }
+    if (stats) {
+        stats->uringRequests += requests;
+        stats->uringCalls += calls;
+        stats->uringDepthSum += depthSum;
+        if (depthMax > stats->uringDepthMax) {
+            stats->uringDepthMax = depthMax;
+        }
+        stats->uringBytes += bytes;
+        stats->uringNs += phaseStart(stats) - start;
+    }
+    DEBUG_PRINT("io_uring: %lu requests in %lu calls, up to %lu in flight\n",
+                requests, calls, depthMax);
+
+out:
+    /* Closing the ring waits out anything still in flight after an error */
+    uringClose(&ring);
+    if (pool != MAP_FAILED) {
+        munmap(pool, poolSize);
+    }
+    return rc;
+}
+
+/*
+ * skipPadding:
+ *   Sparse output: leave the padding [from, to) unwritten, flushing what
+ *   is queued and resuming the batch at to, and add the whole blocks it
+ *   spans to *skipped.
+ */
+static int skipPadding(struct iovBatch* batch, uint64_t from, uint64_t to,
+                       uint64_t* skipped)
+{
+    uint64_t start;
+    uint64_t end;
+    if (iovFlush(batch) != 0) {
+        return -1;
+    }
+    batch->offset = to;
+    if (blockSpan(from, to, &start, &end)) {
+        *skipped += end - start;
+    }
+    return 0;
+}
+
+/*
+ * writeDirect:
+ *   Emit the whole output without libelf: header, PHT, padded payloads and
+ *   the optional NULL SHT. Headers and padding are queued as pwritev
+ *   batches; each payload is moved by the copy engine, starting from
+ *   `engine`. Buffered payloads from the input mapping join the pwritev
+ *   stream directly. With jobs > 1 the payloads are instead copied by
+ *   copyParallel once the headers and padding are out, and with uring by
+ *   copyUring (copyParallel when no ring can be set up). With sparse,
+ *   the padding and whole blocks of zeros in the payloads (see
+ *   copySparse) are not written, the whole blocks of both are added to
+ *   *skipped, and the file is extended to its full size at the end in
+ *   case it ends in a hole.
+ */
+static int writeDirect(int outputFd, int inputFd, const void* inputMap,
+                       const GElf_Ehdr* inEhdr, const GElf_Phdr* phdrs,
+                       size_t count, int noSht,
+                       const struct outputLayout* layout,
+                       enum squashelf_copy engine, int jobs, bool uring,
+                       bool sparse, uint64_t* skipped,
+                       struct squashelf_stats* stats)
+{
+    bool            deferred = jobs > 1 || uring; /* payloads after headers */
+    size_t          hdrSize  = layout->headerEnd;
+    unsigned char*  headers  = calloc(1, hdrSize + layout->shdrSize);
+    struct iovBatch batch    = {.fd = outputFd};
+    size_t          engineUse[SQUASHELF_COPY_COUNT] = {0};
+    int             rc                           = -1;
+
+    if (!headers) {
+        perror("calloc output headers");
+        return -1;
+    }
+
+    if (encodeOutputHeaders(inEhdr, noSht, layout, headers) != 0 ||
+        (!noSht && encodeNullShdr(inEhdr, layout, headers + hdrSize) != 0)) {
+        goto out;
+    }
+    if (iovAppend(&batch, headers, hdrSize) != 0) {
+        goto write_error;
+    }
+
+    uint64_t pos = hdrSize;
+    for (size_t i = 0; i < count; i++) {
+        const GElf_Phdr* seg = &phdrs[i];
+        if (seg->p_filesz == 0) {
+            continue;
+        }
+        if (sparse) {
+            if (skipPadding(&batch, pos, layout->offsets[i], skipped) != 0) {
+                goto write_error;
+            }
+        }
+        else if (iovAppend(&batch, NULL, layout->offsets[i] - pos) != 0) {
+            goto write_error;
+        }
+        pos = layout->offsets[i] + seg->p_filesz;
+
+        if (deferred) {
+            /* Leave the payload's range to the copy threads or the ring */
+            if (iovFlush(&batch) != 0) {
+                goto write_error;
+            }
+            batch.offset = pos;
+            continue;
+        }
+        if (engine == SQUASHELF_COPY_BUFFERED && inputMap && !sparse) {
+            if (iovAppend(&batch, (const char*)inputMap + seg->p_offset,
+                          seg->p_filesz) != 0) {
+                goto write_error;
+            }
+        }
+        else {
+            /* Payload goes around the batch; resume queueing after it */
+            if (iovFlush(&batch) != 0) {
+                goto write_error;
+            }
+            if ((sparse ? copySparse(&engine, inputFd, inputMap,
+                                     seg->p_offset, outputFd,
+                                     layout->offsets[i], seg->p_filesz, false,
+                                     skipped)
+                        : copySegment(&engine, inputFd, inputMap,
+                                      seg->p_offset, outputFd,
+                                      layout->offsets[i], seg->p_filesz,
+                                      false)) != 0) {
+                fprintf(stderr, "Error: copying segment %zu failed\n", i);
+                goto out;
+            }
+            batch.offset = pos;
+        }
+        engineUse[engine]++;
+        DEBUG_PRINT("  Segment %zu: copied 0x%lx bytes via %s\n", i,
+                    seg->p_filesz, copyEngineNames[engine]);
+    }
+
+    if (!noSht) {
+        if ((sparse ? skipPadding(&batch, pos, layout->shoff, skipped)
+                    : iovAppend(&batch, NULL, layout->shoff - pos)) != 0 ||
+            iovAppend(&batch, headers + hdrSize, layout->shdrSize) != 0) {
+            goto write_error;
+        }
+    }
+    if (iovFlush(&batch) != 0) {
+        goto write_error;
+    }
+    if (uring) {
+        int ringRc = copyUring(outputFd, inputFd, inputMap, phdrs, count,
+                               layout, stats);
+        if (ringRc < 0) {
+            goto out;
+        }
+        uring = ringRc == 0;
+    }
+    if (deferred && !uring &&
+        copyParallel(outputFd, inputFd, inputMap, phdrs, count, layout,
+                     engine, jobs, engineUse, sparse, skipped) != 0) {
+        goto out;
+    }
+    struct stat st;
+    if (sparse && fstat(outputFd, &st) == 0 && S_ISREG(st.st_mode) &&
+        (uint64_t)st.st_size < layout->fileSize &&
+        ftruncate(outputFd, layout->fileSize) != 0) {
+        perror("ftruncate output");
+        goto out;
+    }
+    if (uring) {
+        rc = 0;
+        goto out;
+    }
+    DEBUG_PRINT("Copy engines used%s: %s %zu, %s %zu, %s %zu\n",
+                deferred ? " (chunks)" : "",
+                copyEngineNames[SQUASHELF_COPY_FILE_RANGE],
+                engineUse[SQUASHELF_COPY_FILE_RANGE],
+                copyEngineNames[SQUASHELF_COPY_SENDFILE],
+                engineUse[SQUASHELF_COPY_SENDFILE],
+                copyEngineNames[SQUASHELF_COPY_BUFFERED],
+                engineUse[SQUASHELF_COPY_BUFFERED]);
+    rc = 0;
+    goto out;
+
+write_error:
+    perror("pwritev output");
+out:
+    free(headers);
+    return rc;
+}
+
+/*
+ * rangeSet:
+ *   The LMA filter of one selection: every range from the options,
+ *   sorted by minLma with overlapping and touching ranges merged, so the
+ *   only candidate for a segment is found by binary search.
+ */
+struct rangeSet {
+    struct squashelf_range* ranges;
+    size_t                  count;
+    bool                    active; /* filter at all */
+};
+
+/*
+ * compareRange:
+ *   qsort comparator ordering ranges by minLma.
+ */
+static int compareRange(const void* a, const void* b)
+{
+    const struct squashelf_range* ra = a;
+    const struct squashelf_range* rb = b;
+    return ra->minLma < rb->minLma ? -1 : ra->minLma > rb->minLma;
+}
+
+/*
+ * buildRangeSet:
+ *   Collect opts' single range and range array into set.
+ */
+static int buildRangeSet(const struct squashelf_options* opts,
+                         struct rangeSet*                set)
+{
+    size_t total = opts->rangeCount + (opts->hasRange ? 1 : 0);
+
+    memset(set, 0, sizeof(*set));
+    if (total == 0) {
+        return 0;
+    }
+    set->ranges = malloc(total * sizeof(*set->ranges));
+    if (!set->ranges) {
+        perror("malloc ranges");
+        return -1;
+    }
+    set->active = true;
+    if (opts->hasRange) {
+        set->ranges[0] = (struct squashelf_range){opts->minLma, opts->maxLma};
+    }
+    memcpy(set->ranges + (opts->hasRange ? 1 : 0), opts->ranges,
+           opts->rangeCount * sizeof(*opts->ranges));
+    qsort(set->ranges, total, sizeof(*set->ranges), compareRange);
+
+    /* maxLma is the last byte in the range, so ranges one byte apart
+       touch */
+    for (size_t i = 0; i < total; i++) {
+        struct squashelf_range  r    = set->ranges[i];
+        struct squashelf_range* last =
+            set->count ? &set->ranges[set->count - 1] : NULL;
+        if (last && (last->maxLma == UINT64_MAX ||
+                     r.minLma <= last->maxLma + 1)) {
+            if (r.maxLma > last->maxLma) {
+                last->maxLma = r.maxLma;
+            }
+            continue;
+        }
+        set->ranges[set->count++] = r;
+    }
+    for (size_t i = 0; i < set->count; i++) {
+        DEBUG_PRINT("Range filter: 0x%lx - 0x%lx\n", set->ranges[i].minLma,
+                    set->ranges[i].maxLma);
+    }
+    return 0;
+}
+
+/*
+ * rangeSetFind:
+ *   The range that could hold an interval starting at lma: the last one
+ *   with minLma <= lma, or NULL.
+ */
+static const struct squashelf_range* rangeSetFind(const struct rangeSet* set,
+                                                  uint64_t               lma)
+{
+    size_t lo = 0;
+    size_t hi = set->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (set->ranges[mid].minLma <= lma) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo ? &set->ranges[lo - 1] : NULL;
+}
+
+/*
+ * selectSegment:
+ *   Decide whether program header `index` goes into the output: it must be
+ *   PT_LOAD, non-empty unless zero-size segments are allowed, and inside
+ *   one of the LMA ranges if any are set (with clipping, filterSegments
+ *   checks the ranges instead).
+ */
+static bool selectSegment(const struct squashelf_options* opts,
+                          const struct rangeSet* ranges, size_t index,
+                          const GElf_Phdr* ph)
+{
+    if (ph->p_type != PT_LOAD) {
+        DEBUG_PRINT("  Skipping segment %zu (type %u)\n", index, ph->p_type);
+        return false;
+    }
+
+    /* Skip segments with zero filesz unless explicitly allowed */
+    if (ph->p_filesz == 0 && !opts->allowZeroSizeSeg) {
+        DEBUG_PRINT("  Skipping segment %zu (LMA 0x%lx) - "
+                    "zero filesz\n",
+                    index, ph->p_paddr);
+        return false;
+    }
+
+    /* Apply range filter if specified */
+    if (ranges->active && !opts->clip) {
+        uint64_t segmentEnd = ph->p_paddr + ph->p_memsz - 1;
+        const struct squashelf_range* range =
+            rangeSetFind(ranges, ph->p_paddr);
+        /* Skip segments that aren't fully contained within a range */
+        if (!range || segmentEnd > range->maxLma) {
+            DEBUG_PRINT("  Skipping segment %zu (LMA 0x%lx - 0x%lx) - "
+                        "outside the range filter\n",
+                        index, ph->p_paddr, segmentEnd);
+            return false;
+        }
+    }
+    DEBUG_PRINT("  Keeping segment %zu (LMA 0x%lx, size 0x%lx/0x%lx, "
+                "offset 0x%lx, align %lu)\n",
+                index, ph->p_paddr, ph->p_filesz, ph->p_memsz, ph->p_offset,
+                ph->p_align);
+    return true;
+}
+
+/*
+ * clipSegment:
+ *   Append to out the parts of ph that lie inside the ranges, each with
+ *   its addresses, file offset and sizes moved in by the same amount, so
+ *   only the overlapping bytes are copied. A bss tail stays bss; a part
+ *   that ends up with no file data is dropped unless zero-size segments
+ *   are allowed.
+ */
+static int clipSegment(const struct squashelf_options* opts,
+                       const struct rangeSet* ranges, size_t index,
+                       const GElf_Phdr* ph, GElf_Phdr** out, size_t* count,
+                       size_t* capacity)
+{
+    uint64_t last = ph->p_paddr + ph->p_memsz - 1; /* last byte */
+    if (ph->p_memsz == 0) {
+        last = ph->p_paddr; /* an empty segment is clipped as a point */
+    }
+
+    /* Clipping keeps the bytes in [minLma, maxLma], as containment does */
+    const struct squashelf_range* range = rangeSetFind(ranges, ph->p_paddr);
+    const struct squashelf_range* end   = ranges->ranges + ranges->count;
+    if (!range || range->maxLma < ph->p_paddr) {
+        range = range ? range + 1 : ranges->ranges;
+    }
+    for (; range < end && range->minLma <= last; range++) {
+        uint64_t  lo    = ph->p_paddr > range->minLma ? ph->p_paddr
+                                                      : range->minLma;
+        uint64_t  hi    = last < range->maxLma ? last : range->maxLma;
+        uint64_t  delta = lo - ph->p_paddr;
+        GElf_Phdr part  = *ph;
+
+        part.p_paddr  = lo;
+        part.p_vaddr  = ph->p_vaddr + delta;
+        part.p_memsz  = ph->p_memsz ? hi - lo + 1 : 0;
+        part.p_filesz = 0;
+        part.p_offset = ph->p_offset + (delta < ph->p_filesz ? delta
+                                                             : ph->p_filesz);
+        if (delta < ph->p_filesz) {
+            part.p_filesz = ph->p_filesz - delta < part.p_memsz
+                                ? ph->p_filesz - delta
+                                : part.p_memsz;
+        }
+        if (part.p_filesz == 0 && !opts->allowZeroSizeSeg) {
+            continue;
+        }
+
+        if (*count == *capacity) {
+            size_t     newCap = *capacity ? *capacity * 2 : 64;
+            GElf_Phdr* grown  = realloc(*out, newCap * sizeof(**out));
+            if (!grown) {
+                perror("realloc clipped segments");
+                return -1;
+            }
+            *out      = grown;
+            *capacity = newCap;
+        }
+        (*out)[(*count)++] = part;
+        if (delta != 0 || part.p_memsz != ph->p_memsz) {
+            DEBUG_PRINT("  Clipped segment %zu to LMA 0x%lx - 0x%lx (size "
+                        "0x%lx/0x%lx, offset 0x%lx)\n",
+                        index, lo, hi, part.p_filesz, part.p_memsz,
+                        part.p_offset);
+        }
+    }
+    return 0;
+}
+
+/*
+ * filterSegments:
+ *   Replace the *count program headers in *phdrs with the ones selected
+ *   for output, adding their file sizes to *payloadBytes. Kept entries
+ *   are compacted in place; clipping can split one segment into several,
+ *   so it builds a new array. inputSize, when known, bounds the file data
+ *   of every kept segment, and a kept segment's p_align must be 0, 1 or
+ *   a power of two.
+ */
+static int filterSegments(const struct squashelf_options* opts,
+                          const struct rangeSet* ranges, uint64_t inputSize,
+                          GElf_Phdr** phdrs, size_t* count,
+                          uint64_t* payloadBytes)
+{
+    bool       clip     = opts->clip && ranges->active;
+    GElf_Phdr* in       = *phdrs;
+    GElf_Phdr* out      = clip ? NULL : in;
+    size_t     total    = *count;
+    size_t     kept     = 0;
+    size_t     capacity = clip ? 0 : total;
+
+    for (size_t i = 0; i < total; i++) {
+        GElf_Phdr ph = in[i];
+        if (!selectSegment(opts, ranges, i, &ph)) {
+            continue;
+        }
+        if (inputSize && ph.p_filesz != 0 &&
+            (ph.p_offset > inputSize ||
+             ph.p_filesz > inputSize - ph.p_offset)) {
+            fprintf(stderr,
+                    "Error: segment %zu (offset 0x%lx, size 0x%lx) "
+                    "extends past end of input\n",
+                    i, ph.p_offset, ph.p_filesz);
+            goto fail;
+        }
+        /* The layout code masks with p_align - 1; 0 and 1 mean none */
+        if (ph.p_align > 1 && (ph.p_align & (ph.p_align - 1)) != 0) {
+            fprintf(stderr,
+                    "Error: segment %zu (LMA 0x%lx) has p_align 0x%lx, "
+                    "which is not a power of two\n",
+                    i, ph.p_paddr, ph.p_align);
+            goto fail;
+        }
+        if (!clip) {
+            out[kept++] = ph;
+        }
+        else if (clipSegment(opts, ranges, i, &ph, &out, &kept, &capacity) !=
+                 0) {
+            goto fail;
+        }
+    }
+
+    for (size_t i = 0; i < kept; i++) {
+        *payloadBytes += out[i].p_filesz;
+    }
+    if (clip) {
+        free(in);
+        *phdrs = out;
+    }
+    *count = kept;
+    return 0;
+
+fail:
+    if (clip) {
+        free(out);
+    }
+    return -1;
+}
+
+/*
+ * decodeEhdr:
+ *   Convert an on-disk ELF header (class and byte order from its e_ident)
+ *   into a GElf_Ehdr.
+ */
+static int decodeEhdr(const unsigned char* raw, GElf_Ehdr* out)
+{
+    unsigned encoding = raw[EI_DATA];
+    Elf_Data src      = {.d_buf     = (void*)raw,
+                         .d_type    = ELF_T_EHDR,
+                         .d_version = EV_CURRENT};
+    Elf_Data dst      = {.d_version = EV_CURRENT};
+
+    if (raw[EI_CLASS] == ELFCLASS64) {
+        dst.d_buf  = out;
+        src.d_size = dst.d_size = sizeof(Elf64_Ehdr);
+        return elf64_xlatetom(&dst, &src, encoding) ? 0 : -1;
+    }
+
+    Elf32_Ehdr native;
+    dst.d_buf  = &native;
+    src.d_size = dst.d_size = sizeof(native);
+    if (!elf32_xlatetom(&dst, &src, encoding)) {
+        return -1;
+    }
+    memcpy(out->e_ident, native.e_ident, EI_NIDENT);
+    out->e_type      = native.e_type;
+    out->e_machine   = native.e_machine;
+    out->e_version   = native.e_version;
+    out->e_entry     = native.e_entry;
+    out->e_phoff     = native.e_phoff;
+    out->e_shoff     = native.e_shoff;
+    out->e_flags     = native.e_flags;
+    out->e_ehsize    = native.e_ehsize;
+    out->e_phentsize = native.e_phentsize;
+    out->e_phnum     = native.e_phnum;
+    out->e_shentsize = native.e_shentsize;
+    out->e_shnum     = native.e_shnum;
+    out->e_shstrndx  = native.e_shstrndx;
+    return 0;
+}
+
+/*
+ * readFull:
+ *   read() until len bytes arrive or the input ends. Returns the number of
+ *   bytes read (short only at end of input) or -1 on error.
+ */
+static ssize_t readFull(int fd, void* buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, (char*)buf + done, len - done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+/*
+ * writeAll:
+ *   write() that retries until len bytes are out. A NULL buf writes zeros.
+ */
+static int writeAll(int fd, const void* buf, uint64_t len)
+{
+    static const char zeros[65536];
+    while (len > 0) {
+        size_t  chunk = buf || len < sizeof(zeros) ? len : sizeof(zeros);
+        ssize_t n     = write(fd, buf ? buf : zeros, chunk);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        len -= n;
+        if (buf) {
+            buf = (const char*)buf + n;
+        }
+    }
+    return 0;
+}
+
+/* Streaming mode reads the input sequentially in chunks of this size */
+#define STREAM_CHUNK (1UL << 20)
+
+/* Progress of one kept segment while streaming */
+struct streamSegment {
+    uint64_t received; /* payload bytes seen so far (always a prefix) */
+    char*    buffer;   /* payload held back until the segment's turn */
+};
+
+/*
+ * streamState:
+ *   Sequential squash in progress. Input bytes arrive in file order and
+ *   the output is written strictly front to back, so a segment whose data
+ *   shows up before its turn in LMA order is held in a buffer until every
+ *   segment ahead of it has been written.
+ */
+struct streamState {
+    int                        outputFd;
+    const GElf_Phdr*           phdrs;    /* kept segments in output order */
+    size_t                     count;
+    const struct outputLayout* layout;
+    struct streamSegment*      segs;
+    size_t*                    byOffset; /* segment indices by p_offset */
+    size_t                     active;   /* first byOffset entry not done */
+    size_t                     next;     /* next segment to write out */
+    uint64_t                   outPos;   /* bytes written so far */
+    uint64_t                   buffered; /* bytes held in segment buffers */
+    uint64_t                   peak;     /* high-water mark of buffered */
+    uint64_t                   limit;    /* cap on buffered */
+};
+
+/*
+ * streamAdvance:
+ *   Write out every segment whose turn has come and whose data is
+ *   complete, then the padding and any held-back prefix of the first one
+ *   that is still waiting for input.
+ */
+static int streamAdvance(struct streamState* st)
+{
+    while (st->next < st->count) {
+        const GElf_Phdr*      ph = &st->phdrs[st->next];
+        struct streamSegment* ss = &st->segs[st->next];
+        if (ph->p_filesz == 0) {
+            st->next++;
+            continue;
+        }
+        uint64_t start = st->layout->offsets[st->next];
+        if (st->outPos < start) {
+            if (writeAll(st->outputFd, NULL, start - st->outPos) != 0) {
+                perror("write output");
+                return -1;
+            }
+            st->outPos = start;
+        }
+        if (ss->buffer) {
+            if (writeAll(st->outputFd, ss->buffer, ss->received) != 0) {
+                perror("write output");
+                return -1;
+            }
+            st->outPos += ss->received;
+            st->buffered -= ph->p_filesz;
+            free(ss->buffer);
+            ss->buffer = NULL;
+        }
+        if (ss->received < ph->p_filesz) {
+            return 0; /* rest of it is written as it arrives */
+        }
+        st->next++;
+    }
+    return 0;
+}
+
+/*
+ * streamFeed:
+ *   Hand the input bytes [offset, offset + len) to every segment that
+ *   covers them: written straight through for the segment currently being
+ *   output, buffered for segments that come later.
+ */
+static int streamFeed(struct streamState* st, uint64_t offset,
+                      const char* data, size_t len)
+{
+    uint64_t end = offset + len;
+    for (size_t k = st->active; k < st->count; k++) {
+        size_t                i  = st->byOffset[k];
+        const GElf_Phdr*      ph = &st->phdrs[i];
+        struct streamSegment* ss = &st->segs[i];
+        if (ph->p_offset >= end) {
+            break; /* sorted by offset: nothing further is in this chunk */
+        }
+        uint64_t from = ph->p_offset + ss->received;
+        uint64_t to   = ph->p_offset + ph->p_filesz;
+        if (from < offset) {
+            from = offset;
+        }
+        if (to > end) {
+            to = end;
+        }
+        if (from >= to) {
+            continue;
+        }
+
+        const char* bytes = data + (from - offset);
+        if (i == st->next && !ss->buffer) {
+            if (writeAll(st->outputFd, bytes, to - from) != 0) {
+                perror("write output");
+                return -1;
+            }
+            st->outPos += to - from;
+        }
+        else {
+            if (!ss->buffer) {
+                if (st->buffered + ph->p_filesz > st->limit) {
+                    fprintf(stderr,
+                            "Error: reordering segment %zu (LMA 0x%lx) would "
+                            "buffer more than %lu bytes; raise "
+                            "--stream-buffer\n",
+                            i, ph->p_paddr, st->limit);
+                    return -1;
+                }
+                ss->buffer = malloc(ph->p_filesz);
+                if (!ss->buffer) {
+                    perror("malloc segment buffer");
+                    return -1;
+                }
+                st->buffered += ph->p_filesz;
+                if (st->buffered > st->peak) {
+                    st->peak = st->buffered;
+                }
+                DEBUG_PRINT("  Buffering segment %zu (0x%lx bytes) until its "
+                            "turn\n",
+                            i, ph->p_filesz);
+            }
+            memcpy(ss->buffer + ss->received, bytes, to - from);
+        }
+        ss->received += to - from;
+        if (streamAdvance(st) != 0) {
+            return -1;
+        }
+    }
+
+    /* Retire segments at the front whose data has all arrived */
+    while (st->active < st->count) {
+        size_t i = st->byOffset[st->active];
+        if (st->segs[i].received < st->phdrs[i].p_filesz) {
+            break;
+        }
+        st->active++;
+    }
+    return 0;
+}
+
+/*
+ * compareOffsetIndex:
+ *   qsort_r comparator ordering segment indices by the input file offset
+ *   of the phdrs array passed as arg.
+ */
+static int compareOffsetIndex(const void* a, const void* b, void* arg)
+{
+    const GElf_Phdr* phdrs = arg;
+    uint64_t         oa    = phdrs[*(const size_t*)a].p_offset;
+    uint64_t         ob    = phdrs[*(const size_t*)b].p_offset;
+    return oa < ob ? -1 : oa > ob;
+}
+
+/*
+ * squashelf_stream:
+ *   Squash with sequential I/O only, for pipes. The ELF header and PHT are
+ *   read first and the complete output header and PHT are written before
+ *   any payload. The input is then read once, front to back, holding back
+ *   only segments that arrive ahead of their LMA turn (bounded by
+ *   opts->streamBufferLimit).
+ */
+int squashelf_stream(int inputFd, int outputFd,
+                     const struct squashelf_options* opts)
+{
+    unsigned char*       prefix       = NULL; /* input bytes [0, phEnd) */
+    unsigned char*       headers      = NULL;
+    char*                chunk        = NULL;
+    GElf_Phdr*           phdrs        = NULL;
+    struct streamState   st           = {0};
+    struct outputLayout  layout       = {0};
+    struct rangeSet      ranges       = {0};
+    size_t*              order        = NULL; /* PHT positions, to resolve */
+    int                  rc           = -1;
+    const unsigned char  magic[SELFMAG] = {ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3};
+    struct squashelf_stats* stats = opts->stats;
+    uint64_t                t     = phaseStart(stats);
+
+    DEBUG_PRINT("Streaming mode: sequential input and output.\n");
+    if (opts->codec != SQUASHELF_CODEC_NONE) {
+        fprintf(stderr, "Error: compressed output cannot be streamed\n");
+        goto out;
+    }
+    if (opts->sparse || opts->trimZeros) {
+        fprintf(stderr, "Error: sparse or trimmed output cannot be streamed\n");
+        goto out;
+    }
+
+    /* ELF header: e_ident first, since it decides the header size */
+    prefix = malloc(sizeof(Elf64_Ehdr));
+    if (!prefix) {
+        perror("malloc ELF header");
+        goto out;
+    }
+    if (readFull(inputFd, prefix, EI_NIDENT) != EI_NIDENT ||
+        memcmp(prefix, magic, SELFMAG) != 0) {
+        fprintf(stderr, "Input is not an ELF file\n");
+        goto out;
+    }
+    int elfClass = prefix[EI_CLASS];
+    if (elfClass != ELFCLASS32 && elfClass != ELFCLASS64) {
+        fprintf(stderr, "Unsupported ELF class: %d\n", elfClass);
+        goto out;
+    }
+    if (prefix[EI_DATA] != ELFDATA2LSB && prefix[EI_DATA] != ELFDATA2MSB) {
+        fprintf(stderr, "Unsupported ELF data encoding: %d\n",
+                prefix[EI_DATA]);
+        goto out;
+    }
+    size_t ehdrSize =
+        elfClass == ELFCLASS64 ? sizeof(Elf64_Ehdr) : sizeof(Elf32_Ehdr);
+    size_t phdrSize =
+        elfClass == ELFCLASS64 ? sizeof(Elf64_Phdr) : sizeof(Elf32_Phdr);
+    GElf_Ehdr elfHeader;
+    if (readFull(inputFd, prefix + EI_NIDENT, ehdrSize - EI_NIDENT) !=
+            (ssize_t)(ehdrSize - EI_NIDENT) ||
+        decodeEhdr(prefix, &elfHeader) != 0) {
+        fprintf(stderr, "Truncated or invalid ELF header\n");
+        goto out;
+    }
+    DEBUG_PRINT("Detected ELF class: %s\n",
+                elfClass == ELFCLASS32 ? "ELF32" : "ELF64");
+
+    if (elfHeader.e_phnum == PN_XNUM) {
+        /* The real count lives in section 0, normally at the very end */
+        fprintf(stderr, "PN_XNUM program header counts are not supported "
+                        "when streaming\n");
+        goto out;
+    }
+    if (elfHeader.e_phnum != 0 && elfHeader.e_phentsize != phdrSize) {
+        fprintf(stderr, "Unexpected program header size %u\n",
+                elfHeader.e_phentsize);
+        goto out;
+    }
+    t = phaseEnd(stats, SQUASHELF_PHASE_BEGIN, t);
+
+    /* Everything up to the end of the PHT is kept: it may also be part of
+       a segment (the first PT_LOAD commonly starts at offset 0) */
+    size_t phdrCount = elfHeader.e_phnum;
+    uint64_t phEnd   = elfHeader.e_phoff + phdrCount * phdrSize;
+    if (phEnd < ehdrSize) {
+        phEnd = ehdrSize;
+    }
+    if (phEnd > opts->streamBufferLimit) {
+        fprintf(stderr, "Error: PHT ends at 0x%lx, beyond the %lu byte "
+                        "stream buffer\n",
+                phEnd, opts->streamBufferLimit);
+        goto out;
+    }
+    unsigned char* grown = realloc(prefix, phEnd);
+    if (!grown) {
+        perror("realloc input prefix");
+        goto out;
+    }
+    prefix = grown;
+    if (readFull(inputFd, prefix + ehdrSize, phEnd - ehdrSize) !=
+        (ssize_t)(phEnd - ehdrSize)) {
+        fprintf(stderr, "Input ends inside the program header table\n");
+        goto out;
+    }
+    DEBUG_PRINT("Read input ELF header and PHT: %zu program headers\n",
+                phdrCount);
+
+    phdrs            = malloc((phdrCount ? phdrCount : 1) * sizeof(*phdrs));
+    size_t loadCount = 0;
+    if (!phdrs) {
+        perror("malloc phdrs");
+        goto out;
+    }
+    phtCodecFor(&elfHeader)->decode(prefix + elfHeader.e_phoff, phdrCount,
+                                    phdrs);
+    t = phaseEnd(stats, SQUASHELF_PHASE_SCAN, t);
+
+    uint64_t payloadBytes = 0;
+    loadCount             = phdrCount;
+    if (buildRangeSet(opts, &ranges) != 0 ||
+        filterSegments(opts, &ranges, 0, &phdrs, &loadCount, &payloadBytes) !=
+            0) {
+        goto out;
+    }
+    t = phaseEnd(stats, SQUASHELF_PHASE_FILTER, t);
+    DEBUG_PRINT("Found %zu PT_LOAD segments matching criteria.\n", loadCount);
+    if (loadCount == 0) {
+        fprintf(stderr, "No PT_LOAD segments found\n");
+        goto out;
+    }
+    if (stats) {
+        stats->segmentsScanned += phdrCount;
+        stats->segmentsKept    += loadCount;
+        stats->payloadBytes    += payloadBytes;
+    }
+    if (opts->overlap == SQUASHELF_OVERLAP_RESOLVE) {
+        order = malloc(loadCount * sizeof(*order));
+        if (!order) {
+            perror("malloc PHT order");
+            goto out;
+        }
+    }
+    if (sortPhdrs(&phdrs, loadCount, order) != 0) {
+        goto out;
+    }
+    t = phaseEnd(stats, SQUASHELF_PHASE_SORT, t);
+    DEBUG_PRINT("Sorted PT_LOAD segments by LMA.\n");
+
+    if (opts->overlap != SQUASHELF_OVERLAP_OFF) {
+        uint64_t found = 0;
+        if (checkOverlaps(opts, &phdrs, &loadCount, order, &found) != 0) {
+            goto out;
+        }
+        t = phaseEnd(stats, SQUASHELF_PHASE_CHECK, t);
+        if (stats) {
+            stats->overlaps += found;
+        }
+    }
+
+    if (planLayout(elfClass, phdrs, &loadCount, opts, &layout) != 0) {
+        goto out;
+    }
+    t = phaseEnd(stats, SQUASHELF_PHASE_LAYOUT, t);
+    st.segs     = calloc(loadCount, sizeof(*st.segs));
+    st.byOffset = malloc(loadCount * sizeof(*st.byOffset));
+    if (!st.segs || !st.byOffset) {
+        perror("calloc stream state");
+        goto out;
+    }
+
+    /* Header and PHT go out before any payload byte */
+    size_t hdrSize = layout.headerEnd;
+    headers        = calloc(1, hdrSize + layout.shdrSize);
+    if (!headers) {
+        perror("calloc output headers");
+        goto out;
+    }
+    if (encodeOutputHeaders(&elfHeader, opts->noSht, &layout, headers) != 0) {
+        goto out;
+    }
+    if (writeAll(outputFd, headers, hdrSize) != 0) {
+        perror("write output headers");
+        goto out;
+    }
+
+    for (size_t i = 0; i < loadCount; i++) {
+        st.byOffset[i] = i;
+    }
+    qsort_r(st.byOffset, loadCount, sizeof(size_t), compareOffsetIndex, phdrs);
+    st.outputFd = outputFd;
+    st.phdrs    = phdrs;
+    st.count    = loadCount;
+    st.layout   = &layout;
+    st.outPos   = hdrSize;
+    st.limit    = opts->streamBufferLimit;
+
+    /* Payloads: the header prefix first, then the rest of the input */
+    if (streamAdvance(&st) != 0 || streamFeed(&st, 0, (char*)prefix, phEnd)) {
+        goto out;
+    }
+    chunk = malloc(STREAM_CHUNK);
+    if (!chunk) {
+        perror("malloc stream chunk");
+        goto out;
+    }
+    uint64_t inPos = phEnd;
+    while (st.active < st.count) {
+        ssize_t n = readFull(inputFd, chunk, STREAM_CHUNK);
+        if (n < 0) {
+            perror("read input");
+            goto out;
+        }
+        if (n == 0) {
+            fprintf(stderr,
+                    "Error: input ended at offset 0x%lx before all segment "
+                    "data was read\n",
+                    inPos);
+            goto out;
+        }
+        if (streamFeed(&st, inPos, chunk, n) != 0) {
+            goto out;
+        }
+        inPos += n;
+    }
+    if (streamAdvance(&st) != 0) {
+        goto out;
+    }
+
+    if (!opts->noSht) {
+        /* The single NULL section header is all zeros */
+        if (writeAll(outputFd, NULL, layout.shoff - st.outPos) != 0 ||
+            writeAll(outputFd, headers + hdrSize, layout.shdrSize) != 0) {
+            perror("write output SHT");
+            goto out;
+        }
+    }
+    DEBUG_PRINT("Streamed output: %lu bytes, peak reorder buffer %lu bytes\n",
+                layout.fileSize, st.peak);
+    phaseEnd(stats, SQUASHELF_PHASE_WRITE, t);
+    if (stats) {
+        stats->outputBytes += layout.fileSize;
+    }
+
+    /* Drain a piped input so the producer doesn't see EPIPE */
+    struct stat inputStat;
+    if (fstat(inputFd, &inputStat) == 0 && !S_ISREG(inputStat.st_mode)) {
+        while (readFull(inputFd, chunk, STREAM_CHUNK) > 0) {
+        }
+    }
+    rc = 0;
+
+out:
+    for (size_t i = 0; st.segs && i < st.count; i++) {
+        free(st.segs[i].buffer);
+    }
+    free(st.segs);
+    free(st.byOffset);
+    freeLayout(&layout);
+    free(ranges.ranges);
+    free(order);
+    free(headers);
+    free(chunk);
+    free(phdrs);
+    free(prefix);
+    return rc;
+}
+
+/* Arena memory comes in blocks of at least this size */
+#define ARENA_BLOCK (1UL << 20)
+
+/* Blocks this large get a mapping of their own, backed by huge pages */
+#define ARENA_HUGE      (32UL << 20)
+#define ARENA_HUGE_PAGE (2UL << 20)
+
+/* One block of an arena; blocks are chained newest first */
+struct arenaBlock {
+    struct arenaBlock* next;
+    unsigned char*     data;
+    size_t             size; /* usable bytes at data */
+    size_t             used;
+    size_t             mapped; /* length of data's own mapping, or 0 */
+};
+
+/* Small blocks keep their data right after the header, 16-byte aligned */
+#define ARENA_HEADER ((sizeof(struct arenaBlock) + 15) & ~(size_t)15)
+
+struct squashelf_arena {
+    struct arenaBlock* blocks;
+};
+
+/*
+ * arenaNewBlock:
+ *   Add a block of at least size bytes to the arena. Small blocks are
+ *   malloc'd; from ARENA_HUGE up the data is mapped on a huge-page
+ *   boundary and madvise'd MADV_HUGEPAGE, so filling it takes one fault
+ *   per 2 MiB instead of per 4 KiB.
+ */
+static struct arenaBlock* arenaNewBlock(struct squashelf_arena* arena,
+                                        size_t                  size)
+{
+    struct arenaBlock* b;
+    if (size < ARENA_HUGE) {
+        if (!(b = malloc(ARENA_HEADER + size))) {
+            return NULL;
+        }
+        b->data   = (unsigned char*)b + ARENA_HEADER;
+        b->mapped = 0;
+    }
+    else {
+        size_t len = (size + ARENA_HUGE_PAGE - 1) & ~(ARENA_HUGE_PAGE - 1);
+        if (!(b = malloc(sizeof(*b)))) {
+            return NULL;
+        }
+        /* Over-map by one huge page and trim to an aligned window */
+        unsigned char* map = mmap(NULL, len + ARENA_HUGE_PAGE,
+                                  PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED) {
+            free(b);
+            return NULL;
+        }
+        unsigned char* start =
+            (unsigned char*)(((uintptr_t)map + ARENA_HUGE_PAGE - 1) &
+                             ~(uintptr_t)(ARENA_HUGE_PAGE - 1));
+        if (start > map) {
+            munmap(map, start - map);
+        }
+        munmap(start + len, map + ARENA_HUGE_PAGE - start);
+#ifdef MADV_HUGEPAGE
+        madvise(start, len, MADV_HUGEPAGE); /* a hint; fine if refused */
+#endif
+        b->data   = start;
+        b->mapped = len;
+        size      = len;
+    }
+    b->next       = arena->blocks;
+    b->size       = size;
+    b->used       = 0;
+    arena->blocks = b;
+    return b;
+}
+
+/*
+ * arenaFreeBlock:
+ *   Release one block and its data.
+ */
+static void arenaFreeBlock(struct arenaBlock* b)
+{
+    if (b->mapped) {
+        munmap(b->data, b->mapped);
+    }
+    free(b);
+}
+
+/*
+ * arenaAlloc:
+ *   Carve size bytes out of the first block with room, adding a new block
+ *   (ARENA_BLOCK, or exactly size if larger) when none has.
+ */
+static void* arenaAlloc(struct squashelf_arena* arena, size_t size)
+{
+    size = (size + 15) & ~(size_t)15; /* keep later carvings aligned */
+    for (struct arenaBlock* b = arena->blocks; b; b = b->next) {
+        if (b->size - b->used >= size) {
+            void* p = b->data + b->used;
+            b->used += size;
+            return p;
+        }
+    }
+
+    struct arenaBlock* b =
+        arenaNewBlock(arena, size > ARENA_BLOCK ? size : ARENA_BLOCK);
+    if (!b) {
+        return NULL;
+    }
+    b->used = size;
+    return b->data;
+}
+
+/*
+ * arenaReserve:
+ *   A block with size contiguous free bytes, for a caller that carves
+ *   several buffers out of it and then hands them all back at once by
+ *   restoring its used count. Idle blocks too small for the request are
+ *   dropped first, so an arena reused across inputs stays about the size
+ *   of the largest one instead of growing with every new maximum.
+ */
+static struct arenaBlock* arenaReserve(struct squashelf_arena* arena,
+                                       size_t                  size)
+{
+    for (struct arenaBlock* b = arena->blocks; b; b = b->next) {
+        if (b->size - b->used >= size) {
+            return b;
+        }
+    }
+    for (struct arenaBlock** link = &arena->blocks; *link;) {
+        struct arenaBlock* b = *link;
+        if (b->used == 0) {
+            *link = b->next;
+            arenaFreeBlock(b);
+        }
+        else {
+            link = &b->next;
+        }
+    }
+    return arenaNewBlock(arena, size > ARENA_BLOCK ? size : ARENA_BLOCK);
+}
+
+squashelf_arena_t* squashelf_arena_new(void)
+{
+    return calloc(1, sizeof(struct squashelf_arena));
+}
+
+void squashelf_arena_reset(squashelf_arena_t* arena)
+{
+    for (struct arenaBlock* b = arena->blocks; b; b = b->next) {
+        b->used = 0;
+    }
+}
+
+void squashelf_arena_free(squashelf_arena_t* arena)
+{
+    if (!arena) {
+        return;
+    }
+    while (arena->blocks) {
+        struct arenaBlock* next = arena->blocks->next;
+        arenaFreeBlock(arena->blocks);
+        arena->blocks = next;
+    }
+    free(arena);
+}
+
+/*
+ * writeLibelf:
+ *   Emit the output through libelf: one section per non-empty payload,
+ *   pinned over the segment's range of the precomputed layout with
+ *   ELF_F_LAYOUT. libelf insists on an SHT once sections exist, so with
+ *   noSht it is cut off again afterwards and the ELF header rewritten.
+ */
+static int writeLibelf(const struct squashelf_image* image, int outputFd)
+{
+    const struct squashelf*    in        = image->in;
+    const GElf_Phdr*           phdrs     = image->phdrs;
+    size_t                     loadCount = image->count;
+    const struct outputLayout* layout    = &image->layout;
+    int                        noSht     = image->opts.noSht;
+    GElf_Ehdr                  elfHeader = in->ehdr;
+    Elf*                       outputElf = NULL;
+    int                        rc        = -1;
+    struct squashelf_stats*    stats     = image->opts.stats;
+    uint64_t                   t         = phaseStart(stats);
+    uint64_t                   readNs    = 0; /* pread time inside the loop */
+    struct squashelf_arena*    arena     = image->opts.arena;
+    struct squashelf_arena*    ownArena  = NULL;
+    struct arenaBlock*         buffers   = NULL; /* holds every payload read */
+    size_t                     mark      = 0;    /* its use before this run */
+
+    (void)elf_errno(); /* only errors raised from here on fail the write */
+
+    /* Without a mapping the payloads are read into one arena block sized
+       for all of them, and go back in one step at the end */
+    if (!in->data) {
+        uint64_t total = 0;
+        for (size_t i = 0; i < loadCount; i++) {
+            total += (phdrs[i].p_filesz + 15) & ~(uint64_t)15;
+        }
+        if (total > SIZE_MAX) {
+            fprintf(stderr, "Error: segment data too large to buffer\n");
+            return -1;
+        }
+        if (total > 0) {
+            if ((!arena && !(arena = ownArena = squashelf_arena_new())) ||
+                !(buffers = arenaReserve(arena, total))) {
+                perror("allocate segment buffers");
+                squashelf_arena_free(ownArena);
+                return -1;
+            }
+            mark = buffers->used;
+            DEBUG_PRINT("Segment buffers: %lu bytes in one%s arena block\n",
+                        total, buffers->mapped ? " huge-page" : "");
+        }
+    }
+
+    /* Create ELF descriptor for the output */
+    outputElf = elf_begin(outputFd, ELF_C_WRITE, NULL);
+    if (!outputElf) {
+        fprintf(stderr, "elf_begin(output): %s\n", elf_errmsg(-1));
+        goto cleanup_error;
+    }
+    DEBUG_PRINT("Created output ELF descriptor.\n");
+
+    /* Create new ELF header matching input class */
+    if (!gelf_newehdr(outputElf, in->elfClass)) {
+        fprintf(stderr, "gelf_newehdr: %s\n", elf_errmsg(-1));
+        /* Consider if continuing makes sense, maybe just log if verbose */
+    }
+    DEBUG_PRINT("Created new ELF header for output file (class %s).\n",
+                in->elfClass == ELFCLASS32 ? "ELF32" : "ELF64");
+
+    /* Update program header count and clear section info */
+    elfHeader.e_phnum    = layout->phnum;
+    elfHeader.e_shoff    = 0;
+    elfHeader.e_shnum    = 0;
+    elfHeader.e_shstrndx = SHN_UNDEF;
+    if (!gelf_update_ehdr(outputElf, &elfHeader)) {
+        fprintf(stderr, "gelf_update_ehdr: %s\n", elf_errmsg(-1));
+    }
+    DEBUG_PRINT("Updated output ELF header: phnum=%zu, shoff=0, shnum=0, "
+                "shstrndx=SHN_UNDEF\n",
+                layout->phnum);
+
+    /* Read segment data and associate with output ELF using sections/data */
+    DEBUG_PRINT("Associating segment data with output ELF...\n");
+    for (size_t i = 0; i < loadCount; i++) {
+        GElf_Phdr seg = phdrs[i]; /* Use the sorted phdr */
+
+        /* Skip segments with zero file size */
+        if (seg.p_filesz == 0) {
+            DEBUG_PRINT("  Segment %zu has zero filesz, skipping data "
+                        "association\n",
+                        i);
+            continue;
+        }
+
+        void* buffer;
+        if (in->data) {
+            /* Point straight into the input image; nothing to free later */
+            buffer = (char*)in->data + seg.p_offset;
+        }
+        else {
+            /* Carve the segment's buffer out of the reserved block */
+            buffer = buffers->data + buffers->used;
+            buffers->used += (seg.p_filesz + 15) & ~(uint64_t)15;
+
+            /* Read segment data from input file */
+            uint64_t readStart = phaseStart(stats);
+            ssize_t  bytes_read =
+                pread(in->fd, buffer, seg.p_filesz, seg.p_offset);
+            readNs += phaseStart(stats) - readStart;
+            if (bytes_read < 0) {
+                perror("pread segment data");
+                goto cleanup_error;
+            }
+            else if ((size_t)bytes_read != seg.p_filesz) {
+                fprintf(stderr,
+                        "Warning: short read for segment %zu (expected %lu, "
+                        "got %zd)\n",
+                        i, seg.p_filesz, bytes_read);
+                /* Continue with potentially partial data, but adjust size?
+                   For simplicity, we'll error out on short reads for now. */
+                fprintf(stderr, "Error: Short read encountered. Aborting.\n");
+                goto cleanup_error;
+            }
+        }
+
+        /* Create a new section for this segment's data */
+        Elf_Scn* scn = elf_newscn(outputElf);
+        if (!scn) {
+            fprintf(stderr, "elf_newscn[%zu]: %s\n", i, elf_errmsg(-1));
+            goto cleanup_error;
+        }
+
+        /* Create a new data descriptor for the section */
+        Elf_Data* data = elf_newdata(scn);
+        if (!data) {
+            fprintf(stderr, "elf_newdata[%zu]: %s\n", i, elf_errmsg(-1));
+            goto cleanup_error;
+        }
+
+        /* Fill the data descriptor. Placement comes from the precomputed
+           layout (ELF_F_LAYOUT below), so no extra alignment is needed. */
+        data->d_align = 1;
+        data->d_buf   = buffer; /* libelf reads it during elf_update */
+        data->d_size  = seg.p_filesz; /* Use actual filesz */
+        data->d_type  = ELF_T_BYTE;
+        data->d_off   = 0LL; /* Offset within the section */
+
+        /* We don't need elf_flagdata(data, ELF_C_SET, ELF_F_DIRTY) because
+           elf_newdata implicitly marks the section containing the data
+           descriptor as dirty. elf_update will write it. */
+
+        /* Pin the section over the segment's output range. libelf never
+           touches phdr offsets, so this is what keeps the PHT and the
+           payload placement in agreement. */
+        GElf_Shdr shdr;
+        if (!gelf_getshdr(scn, &shdr)) {
+            fprintf(stderr, "gelf_getshdr[%zu]: %s\n", i, elf_errmsg(-1));
+            goto cleanup_error;
+        }
+        shdr.sh_offset = layout->offsets[i];
+        shdr.sh_size   = seg.p_filesz;
+        if (!gelf_update_shdr(scn, &shdr)) {
+            fprintf(stderr, "gelf_update_shdr[%zu]: %s\n", i, elf_errmsg(-1));
+            goto cleanup_error;
+        }
+
+        DEBUG_PRINT("  Associated data for segment %zu: size=0x%lx, "
+                    "offset=0x%lx\n",
+                    i, seg.p_filesz, layout->offsets[i]);
+    }
+    DEBUG_PRINT("Finished associating segment data.\n");
+
+    /* Update ELF header section info based on noSht flag *before* final
+       update; get the potentially updated header first */
+    if (!gelf_getehdr(outputElf, &elfHeader)) {
+        fprintf(stderr, "gelf_getehdr(out pre-final): %s\n", elf_errmsg(-1));
+        goto cleanup_error;
+    }
+
+    /* With ELF_F_LAYOUT the header offsets are ours to fill in. libelf
+       always emits an SHT once sections exist, so it goes after the last
+       payload even with noSht and is cut off again below. */
+    elfHeader.e_phoff = layout->ehdrSize;
+    elfHeader.e_shoff = layout->sectionEnd;
+    if (noSht) {
+        DEBUG_PRINT("Configuring output ELF for no SHT.\n");
+        elfHeader.e_shnum    = 0;
+        elfHeader.e_shstrndx = SHN_UNDEF;
+    }
+    if (!gelf_update_ehdr(outputElf, &elfHeader)) {
+        fprintf(stderr, "gelf_update_ehdr (layout): %s\n", elf_errmsg(-1));
+        goto cleanup_error;
+    }
+    elf_flagelf(outputElf, ELF_C_SET, ELF_F_LAYOUT);
+
+    if (!noSht) {
+        DEBUG_PRINT("Adding NULL section header as final section.\n");
+        Elf_Scn* nullScn = elf_newscn(outputElf); /* Add NULL section */
+        if (!nullScn) {
+            fprintf(stderr, "elf_newscn(NULL): %s\n", elf_errmsg(-1));
+            goto cleanup_error;
+        }
+        /* GElf_Shdr is automatically SHT_NULL initialized by elf_newscn */
+        /* elf_update will set the correct e_shnum and e_shstrndx (usually 0
+           for NULL string table) */
+        /* Under ELF_F_LAYOUT an empty section left at offset 0 makes
+           libelf zero-fill over the ELF header; park it at the end. */
+        GElf_Shdr nullShdr;
+        if (!gelf_getshdr(nullScn, &nullShdr)) {
+            fprintf(stderr, "gelf_getshdr(NULL): %s\n", elf_errmsg(-1));
+            goto cleanup_error;
+        }
+        nullShdr.sh_offset = layout->dataEnd;
+        if (!gelf_update_shdr(nullScn, &nullShdr)) {
+            fprintf(stderr, "gelf_update_shdr(NULL): %s\n", elf_errmsg(-1));
+            goto cleanup_error;
+        }
+        DEBUG_PRINT(
+            "NULL section added; elf_update will finalize SHT info.\n");
+    }
+
+    /* Reserve space for the new program header table. This comes after
+       the sections, since a PN_XNUM count lives in section 0's sh_info
+       and libelf needs that section to exist. */
+    if (!gelf_newphdr(outputElf, layout->phnum)) {
+        fprintf(stderr, "gelf_newphdr: %s\n", elf_errmsg(-1));
+        /* Handle error */
+    }
+    DEBUG_PRINT("Reserved space for %zu program headers in output PHT.\n",
+                layout->phnum);
+
+    /* Write each sorted PT_LOAD entry into the new PHT */
+    for (size_t i = 0; i < layout->phnum; i++) {
+        GElf_Phdr ph = layout->pht[i];
+        ph.p_offset  = layout->phtOffsets[i];
+        if (!gelf_update_phdr(outputElf, i, &ph)) {
+            fprintf(stderr, "gelf_update_phdr[%zu]: %s\n", i, elf_errmsg(-1));
+        }
+    }
+
+    /* Everything up to here but the preads was building the output */
+    if (stats) {
+        uint64_t now = phaseStart(stats);
+        stats->phaseNs[SQUASHELF_PHASE_READ]      += readNs;
+        stats->phaseNs[SQUASHELF_PHASE_ASSOCIATE] += now - t - readNs;
+        t = now;
+    }
+
+    /* Finalize all updates (offsets, sizes, data writing) */
+    DEBUG_PRINT("Finalizing output ELF file (layout and data write)...\n");
+    off_t final_size = elf_update(outputElf, ELF_C_WRITE);
+    if (final_size < 0) {
+        fprintf(stderr, "elf_update final: %s\n", elf_errmsg(-1));
+        goto cleanup_error;
+    }
+    DEBUG_PRINT("Output ELF file finalized. Final size: %ld bytes\n",
+                final_size);
+
+    if (noSht) {
+        /* Drop the SHT libelf insisted on writing and point the header
+           away from it */
+        unsigned char rawEhdr[sizeof(Elf64_Ehdr)];
+        GElf_Ehdr     finalHeader;
+        buildOutputEhdr(&in->ehdr, noSht, layout, &finalHeader);
+        if (encodeEhdr(&finalHeader, rawEhdr) != 0) {
+            fprintf(stderr, "encode ELF header: %s\n", elf_errmsg(-1));
+            goto cleanup_error;
+        }
+        if (elf_end(outputElf) != 0) {
+            fprintf(stderr, "elf_end(output): %s\n", elf_errmsg(-1));
+        }
+        outputElf = NULL;
+        if (ftruncate(outputFd, layout->dataEnd) != 0 ||
+            pwrite(outputFd, rawEhdr, layout->ehdrSize, 0) !=
+                (ssize_t)layout->ehdrSize) {
+            perror("strip SHT from output");
+            goto cleanup_error;
+        }
+        DEBUG_PRINT("Stripped SHT. Final size: %lu bytes\n", layout->dataEnd);
+    }
+    phaseEnd(stats, SQUASHELF_PHASE_WRITE, t);
+
+    rc = 0;
+
+cleanup_error:; /* Label for centralized cleanup */
+    /* libelf errors reported above without bailing out still fail the run */
+    if (elf_errno() != 0) {
+        rc = -1;
+    }
+
+    /* Clean up handles and memory */
+    elf_end(outputElf);
+    if (buffers) {
+        buffers->used = mark; /* every segment buffer at once */
+    }
+    squashelf_arena_free(ownArena);
+    return rc;
+}
+
+/*
+ * writeMem:
+ *   Build the direct writer's output in out, which holds
+ *   layout.fileSize bytes: headers, zero padding, payloads copied from
+ *   the input image or read with pread, and the all-zero NULL SHT.
+ */
+static int writeMem(const struct squashelf_image* image, unsigned char* out)
+{
+    const struct squashelf*    in      = image->in;
+    const struct outputLayout* layout  = &image->layout;
+
+    if (encodeOutputHeaders(&in->ehdr, image->opts.noSht, layout, out) != 0) {
+        return -1;
+    }
+
+    uint64_t pos = layout->headerEnd;
+    for (size_t i = 0; i < image->count; i++) {
+        const GElf_Phdr* seg = &image->phdrs[i];
+        if (seg->p_filesz == 0) {
+            continue;
+        }
+        memset(out + pos, 0, layout->offsets[i] - pos);
+        pos = layout->offsets[i];
+
+        if (in->data) {
+            memcpy(out + pos, in->data + seg->p_offset, seg->p_filesz);
+            pos += seg->p_filesz;
+            continue;
+        }
+        for (uint64_t done = 0; done < seg->p_filesz;) {
+            ssize_t n = pread(in->fd, out + pos, seg->p_filesz - done,
+                              seg->p_offset + done);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                perror("pread segment data");
+                return -1;
+            }
+            if (n == 0) {
+                fprintf(stderr,
+                        "Error: input ends inside segment data at offset "
+                        "0x%lx\n",
+                        seg->p_offset + done);
+                return -1;
+            }
+            done += n;
+            pos += n;
+        }
+    }
+
+    /* Trailing padding, then the single NULL section header */
+    memset(out + pos, 0, layout->fileSize - pos);
+    if (!image->opts.noSht &&
+        encodeNullShdr(&in->ehdr, layout, out + layout->shoff) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Sequential writers (bin, ihex, srec) buffer their output this much */
+#define SINK_BUFFER (64UL << 10)
+
+/*
+ * outputSink:
+ *   Destination of the sequential writers: an fd (buffered here), a
+ *   memory block that holds the whole output, or nothing at all when the
+ *   writer only runs to measure the output size.
+ */
+struct outputSink {
+    int            fd;      /* write here, or -1 */
+    unsigned char* mem;     /* or store here */
+    bool           measure; /* neither: only count bytes in pos */
+    uint64_t       pos;     /* bytes produced so far */
+    size_t         used;    /* bytes pending in buf */
+    unsigned char  buf[SINK_BUFFER];
+};
+
+/*
+ * sinkFlush:
+ *   Hand the buffered bytes to the sink's fd.
+ */
+static int sinkFlush(struct outputSink* sink)
+{
+    if (sink->used && writeAll(sink->fd, sink->buf, sink->used) != 0) {
+        perror("write output");
+        return -1;
+    }
+    sink->used = 0;
+    return 0;
+}
+
+/*
+ * sinkReserve:
+ *   Room for the next len (<= SINK_BUFFER) output bytes, for the caller to
+ *   fill in. When measuring, a scratch area that is simply discarded.
+ */
+static unsigned char* sinkReserve(struct outputSink* sink, size_t len)
+{
+    unsigned char* p;
+    if (sink->measure) {
+        p = sink->buf;
+    }
+    else if (sink->mem) {
+        p = sink->mem + sink->pos;
+    }
+    else {
+        if (sink->used + len > SINK_BUFFER && sinkFlush(sink) != 0) {
+            return NULL;
+        }
+        p = sink->buf + sink->used;
+        sink->used += len;
+    }
+    sink->pos += len;
+    return p;
+}
+
+/*
+ * sinkWrite:
+ *   Append len bytes at data. Large writes to an fd bypass the buffer.
+ */
+static int sinkWrite(struct outputSink* sink, const void* data, uint64_t len)
+{
+    if (sink->measure || sink->mem) {
+        if (sink->mem) {
+            memcpy(sink->mem + sink->pos, data, len);
+        }
+        sink->pos += len;
+        return 0;
+    }
+    if (sink->used + len > SINK_BUFFER) {
+        if (sinkFlush(sink) != 0) {
+            return -1;
+        }
+        if (len >= SINK_BUFFER) {
+            if (writeAll(sink->fd, data, len) != 0) {
+                perror("write output");
+                return -1;
+            }
+            sink->pos += len;
+            return 0;
+        }
+    }
+    memcpy(sink->buf + sink->used, data, len);
+    sink->used += len;
+    sink->pos += len;
+    return 0;
+}
+
+/*
+ * sinkFill:
+ *   Append len copies of byte.
+ */
+static int sinkFill(struct outputSink* sink, int byte, uint64_t len)
+{
+    if (sink->measure) {
+        sink->pos += len;
+        return 0;
+    }
+    while (len > 0) {
+        size_t         chunk = len < SINK_BUFFER ? len : SINK_BUFFER;
+        unsigned char* p     = sinkReserve(sink, chunk);
+        if (!p) {
+            return -1;
+        }
+        memset(p, byte, chunk);
+        len -= chunk;
+    }
+    return 0;
+}
+
+/* Inputs without a mapping are read in windows of this size */
+#define PAYLOAD_WINDOW (1UL << 20)
+
+/*
+ * payloadReader:
+ *   Sequential access to segment payloads for the bin/ihex/srec writers:
+ *   straight from the input image when it is in memory, otherwise through
+ *   a window refilled with pread.
+ */
+struct payloadReader {
+    const struct squashelf* in;
+    unsigned char*          window;
+    uint64_t                start; /* input offset of window[0] */
+    uint64_t                end;   /* input offset past the valid bytes */
+};
+
+/*
+ * payloadAt:
+ *   Pointer to len (<= PAYLOAD_WINDOW) input bytes at offset.
+ */
+static const unsigned char* payloadAt(struct payloadReader* r,
+                                      uint64_t offset, size_t len)
+{
+    if (r->in->data) {
+        return r->in->data + offset;
+    }
+    if (offset < r->start || offset + len > r->end) {
+        if (!r->window && !(r->window = malloc(PAYLOAD_WINDOW))) {
+            perror("malloc payload window");
+            return NULL;
+        }
+        size_t got = 0;
+        while (got < PAYLOAD_WINDOW) {
+            ssize_t n = pread(r->in->fd, r->window + got,
+                              PAYLOAD_WINDOW - got, offset + got);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                perror("pread segment data");
+                return NULL;
+            }
+            if (n == 0) {
+                break;
+            }
+            got += n;
+        }
+        if (got < len) {
+            fprintf(stderr,
+                    "Error: input ends inside segment data at offset 0x%lx\n",
+                    offset + got);
+            return NULL;
+        }
+        r->start = offset;
+        r->end   = offset + got;
+    }
+    return r->window + (offset - r->start);
+}
+
+/*
+ * writeBin:
+ *   Flat binary: the payloads laid out by LMA starting at the lowest one,
+ *   with the gaps between them filled with opts.gapFill. Select has
+ *   already rejected overlapping segments.
+ */
+static int writeBin(const struct squashelf_image* image,
+                    struct outputSink*            sink)
+{
+    struct payloadReader reader = {.in = image->in};
+    bool                 first  = true;
+    uint64_t             lma    = 0; /* LMA of the next output byte */
+    int                  rc     = -1;
+
+    for (size_t i = 0; i < image->count; i++) {
+        const GElf_Phdr* seg = &image->phdrs[i];
+        if (seg->p_filesz == 0) {
+            continue;
+        }
+        if (!first && sinkFill(sink, image->opts.gapFill,
+                               seg->p_paddr - lma) != 0) {
+            goto out;
+        }
+        first = false;
+        lma   = seg->p_paddr + seg->p_filesz;
+
+        for (uint64_t done = 0; done < seg->p_filesz && !sink->measure;) {
+            uint64_t left  = seg->p_filesz - done;
+            size_t   chunk = !image->in->data && left > PAYLOAD_WINDOW
+                                 ? PAYLOAD_WINDOW
+                                 : left;
+            const unsigned char* bytes =
+                payloadAt(&reader, seg->p_offset + done, chunk);
+            if (!bytes || sinkWrite(sink, bytes, chunk) != 0) {
+                goto out;
+            }
+            done += chunk;
+        }
+        if (sink->measure) {
+            sink->pos += seg->p_filesz;
+        }
+    }
+    rc = 0;
+
+out:
+    free(reader.window);
+    return rc;
+}
+
+/* Data bytes per ihex/srec record, as objcopy emits them */
+#define HEX_RECORD_DATA 16
+
+/* Two uppercase hex digits for every byte value, indexed by 2 * byte */
+#define HEX_ROW(h)                                                           \
+    h "0" h "1" h "2" h "3" h "4" h "5" h "6" h "7" h "8" h "9" h "A" h "B" \
+        h "C" h "D" h "E" h "F"
+static const char hexPairs[] = HEX_ROW("0") HEX_ROW("1") HEX_ROW("2")
+    HEX_ROW("3") HEX_ROW("4") HEX_ROW("5") HEX_ROW("6") HEX_ROW("7")
+    HEX_ROW("8") HEX_ROW("9") HEX_ROW("A") HEX_ROW("B") HEX_ROW("C")
+    HEX_ROW("D") HEX_ROW("E") HEX_ROW("F");
+
+/*
+ * hexBytes:
+ *   Encode len bytes as hex digits at out; returns the byte sum for the
+ *   record checksum.
+ */
+static unsigned hexBytes(unsigned char* out, const unsigned char* bytes,
+                         size_t len)
+{
+    unsigned sum = 0;
+    for (size_t i = 0; i < len; i++) {
+        memcpy(out + 2 * i, hexPairs + 2 * bytes[i], 2);
+        sum += bytes[i];
+    }
+    return sum;
+}
+
+/* Size of an Intel HEX record with len data bytes, CRLF included */
+#define IHEX_RECORD_SIZE(len) (13 + 2 * (len))
+
+/*
+ * ihexRecord:
+ *   Append one ":LLAAAATT<data>CC" record.
+ */
+static int ihexRecord(struct outputSink* sink, unsigned type, unsigned addr,
+                      const unsigned char* data, size_t len)
+{
+    unsigned char* p = sinkReserve(sink, IHEX_RECORD_SIZE(len));
+    if (!p) {
+        return -1;
+    }
+    if (sink->measure) {
+        return 0;
+    }
+    unsigned char head[4] = {len, (addr >> 8) & 0xff, addr & 0xff, type};
+    p[0]                  = ':';
+    unsigned sum          = hexBytes(p + 1, head, sizeof(head));
+    sum += hexBytes(p + 9, data, len);
+    unsigned char check = -sum;
+    hexBytes(p + 9 + 2 * len, &check, 1);
+    p[11 + 2 * len] = '\r';
+    p[12 + 2 * len] = '\n';
+    return 0;
+}
+
+/*
+ * writeIhex:
+ *   Intel HEX: data records of up to HEX_RECORD_DATA bytes, never crossing
+ *   a 64 KiB boundary, with an extended linear address record whenever the
+ *   upper 16 address bits change. A non-zero e_entry becomes a start
+ *   linear address record before the end-of-file record.
+ */
+static int writeIhex(const struct squashelf_image* image,
+                     struct outputSink*            sink)
+{
+    struct payloadReader reader = {.in = image->in};
+    uint64_t             upper  = UINT64_MAX; /* current address bits 31:16 */
+    int                  rc     = -1;
+
+    for (size_t i = 0; i < image->count; i++) {
+        const GElf_Phdr* seg = &image->phdrs[i];
+        for (uint64_t done = 0; done < seg->p_filesz;) {
+            uint64_t addr = seg->p_paddr + done;
+            uint64_t len  = seg->p_filesz - done;
+            if (len > HEX_RECORD_DATA) {
+                len = HEX_RECORD_DATA;
+            }
+            if (len > 0x10000 - (addr & 0xffff)) {
+                len = 0x10000 - (addr & 0xffff);
+            }
+            if (addr >> 16 != upper) {
+                upper                 = addr >> 16;
+                unsigned char ela[2] = {upper >> 8, upper & 0xff};
+                if (ihexRecord(sink, 0x04, 0, ela, 2) != 0) {
+                    goto out;
+                }
+            }
+            const unsigned char* bytes = NULL;
+            if (!sink->measure &&
+                !(bytes = payloadAt(&reader, seg->p_offset + done, len))) {
+                goto out;
+            }
+            if (ihexRecord(sink, 0x00, addr & 0xffff, bytes, len) != 0) {
+                goto out;
+            }
+            done += len;
+        }
+    }
+
+    uint64_t entry = image->in->ehdr.e_entry;
+    if (entry != 0) {
+        unsigned char sla[4] = {entry >> 24, (entry >> 16) & 0xff,
+                                (entry >> 8) & 0xff, entry & 0xff};
+        if (ihexRecord(sink, 0x05, 0, sla, 4) != 0) {
+            goto out;
+        }
+    }
+    rc = ihexRecord(sink, 0x01, 0, NULL, 0);
+
+out:
+    free(reader.window);
+    return rc;
+}
+
+/* Size of an S-record with addrLen address and len data bytes, CRLF included */
+#define SREC_RECORD_SIZE(addrLen, len) (8 + 2 * (addrLen) + 2 * (len))
+
+/*
+ * srecRecord:
+ *   Append one "StCC<address><data>KK" record.
+ */
+static int srecRecord(struct outputSink* sink, unsigned type, size_t addrLen,
+                      uint64_t addr, const unsigned char* data, size_t len)
+{
+    unsigned char* p = sinkReserve(sink, SREC_RECORD_SIZE(addrLen, len));
+    if (!p) {
+        return -1;
+    }
+    if (sink->measure) {
+        return 0;
+    }
+    unsigned char head[5] = {addrLen + len + 1};
+    for (size_t i = 0; i < addrLen; i++) {
+        head[1 + i] = addr >> (8 * (addrLen - 1 - i));
+    }
+    p[0]         = 'S';
+    p[1]         = '0' + type;
+    unsigned sum = hexBytes(p + 2, head, 1 + addrLen);
+    sum += hexBytes(p + 4 + 2 * addrLen, data, len);
+    unsigned char check = ~sum;
+    hexBytes(p + 4 + 2 * addrLen + 2 * len, &check, 1);
+    p[6 + 2 * addrLen + 2 * len] = '\r';
+    p[7 + 2 * addrLen + 2 * len] = '\n';
+    return 0;
+}
+
+/*
+ * writeSrec:
+ *   Motorola S-records: an empty S0 header, data records of up to
+ *   HEX_RECORD_DATA bytes and the matching termination record carrying
+ *   e_entry. The narrowest record type (S1/S2/S3 with S9/S8/S7) that
+ *   holds every address is used.
+ */
+static int writeSrec(const struct squashelf_image* image,
+                     struct outputSink*            sink)
+{
+    struct payloadReader reader = {.in = image->in};
+    uint64_t             top    = image->in->ehdr.e_entry;
+    int                  rc     = -1;
+
+    for (size_t i = 0; i < image->count; i++) {
+        const GElf_Phdr* seg = &image->phdrs[i];
+        if (seg->p_filesz != 0 && seg->p_paddr + seg->p_filesz - 1 > top) {
+            top = seg->p_paddr + seg->p_filesz - 1;
+        }
+    }
+    size_t addrLen = top > 0xffffff ? 4 : top > 0xffff ? 3 : 2;
+
+    if (srecRecord(sink, 0, 2, 0, NULL, 0) != 0) {
+        goto out;
+    }
+    for (size_t i = 0; i < image->count; i++) {
+        const GElf_Phdr* seg = &image->phdrs[i];
+        for (uint64_t done = 0; done < seg->p_filesz;) {
+            uint64_t len = seg->p_filesz - done;
+            if (len > HEX_RECORD_DATA) {
+                len = HEX_RECORD_DATA;
+            }
+            const unsigned char* bytes = NULL;
+            if (!sink->measure &&
+                !(bytes = payloadAt(&reader, seg->p_offset + done, len))) {
+                goto out;
+            }
+            if (srecRecord(sink, addrLen - 1, addrLen, seg->p_paddr + done,
+                           bytes, len) != 0) {
+                goto out;
+            }
+            done += len;
+        }
+    }
+    rc = srecRecord(sink, 11 - addrLen, addrLen, image->in->ehdr.e_entry,
+                    NULL, 0);
+
+out:
+    free(reader.window);
+    return rc;
+}
+
+/*
+ * writeFormatted:
+ *   Run the bin, ihex or srec writer for image into fd, or into mem when
+ *   fd is -1, or with neither only to measure. The bytes produced are
+ *   stored in *size if it is not NULL.
+ */
+static int writeFormatted(const struct squashelf_image* image, int fd,
+                          unsigned char* mem, uint64_t* size)
+{
+    struct outputSink* sink = malloc(sizeof(*sink));
+    int                rc;
+    if (!sink) {
+        perror("malloc output sink");
+        return -1;
+    }
+    *sink = (struct outputSink){
+        .fd      = fd,
+        .mem     = mem,
+        .measure = fd < 0 && !mem,
+    };
+
+    switch (image->opts.format) {
+        case SQUASHELF_FORMAT_BIN:
+            rc = writeBin(image, sink);
+            break;
+        case SQUASHELF_FORMAT_IHEX:
+            rc = writeIhex(image, sink);
+            break;
+        default:
+            rc = writeSrec(image, sink);
+            break;
+    }
+    if (rc == 0 && fd >= 0) {
+        rc = sinkFlush(sink);
+    }
+    if (size) {
+        *size = sink->pos;
+    }
+    free(sink);
+    return rc;
+}
+
+/*
+ * checkFormat:
+ *   Whether the selected segments can be expressed in opts.format: ihex
+ *   and srec carry 32-bit addresses, and a flat binary has no room for
+ *   two segments claiming the same bytes.
+ */
+static bool checkFormat(const struct squashelf_image* image)
+{
+    int      format = image->opts.format;
+    uint64_t lmaEnd = 0; /* end of the previous non-empty segment */
+    for (size_t i = 0; i < image->count; i++) {
+        const GElf_Phdr* seg = &image->phdrs[i];
+        if (seg->p_filesz == 0) {
+            continue;
+        }
+        uint64_t end = seg->p_paddr + seg->p_filesz;
+        if ((format == SQUASHELF_FORMAT_IHEX ||
+             format == SQUASHELF_FORMAT_SREC) &&
+            (end < seg->p_paddr || end > 1ULL << 32)) {
+            fprintf(stderr,
+                    "Error: segment at LMA 0x%lx does not fit in the 32-bit "
+                    "address space of %s output\n",
+                    seg->p_paddr, squashelf_format_name(format));
+            return false;
+        }
+        if (format == SQUASHELF_FORMAT_BIN && seg->p_paddr < lmaEnd) {
+            fprintf(stderr,
+                    "Error: segment at LMA 0x%lx overlaps the one before it; "
+                    "cannot write a flat binary\n",
+                    seg->p_paddr);
+            return false;
+        }
+        lmaEnd = end;
+    }
+    if ((format == SQUASHELF_FORMAT_IHEX ||
+         format == SQUASHELF_FORMAT_SREC) &&
+        image->in->ehdr.e_entry > UINT32_MAX) {
+        fprintf(stderr,
+                "Error: entry point 0x%lx does not fit in %s output\n",
+                image->in->ehdr.e_entry, squashelf_format_name(format));
+        return false;
+    }
+    return true;
+}
+
+/* XXH64 primes */
+#define HASH_P1 0x9e3779b185ebca87UL
+#define HASH_P2 0xc2b2ae3d27d4eb4fUL
+#define HASH_P3 0x165667b19e3779f9UL
+#define HASH_P4 0x85ebca77c2b2ae63UL
+#define HASH_P5 0x27d4eb2f165667c5UL
+
+/*
+ * hashRead64, hashRead32:
+ *   Unaligned little-endian loads, whatever the host byte order, so a
+ *   hash is the same on every machine.
+ */
+static uint64_t hashRead64(const unsigned char* p)
+{
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) {
+        v = v << 8 | p[i];
+    }
+    return v;
+}
+
+static uint64_t hashRead32(const unsigned char* p)
+{
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 |
+           (uint64_t)p[3] << 24;
+}
+
+static uint64_t hashRotl(uint64_t v, int bits)
+{
+    return v << bits | v >> (64 - bits);
+}
+
+static uint64_t hashRound(uint64_t acc, uint64_t input)
+{
+    return hashRotl(acc + input * HASH_P2, 31) * HASH_P1;
+}
+
+static uint64_t hashMerge(uint64_t acc, uint64_t lane)
+{
+    return (acc ^ hashRound(0, lane)) * HASH_P1 + HASH_P4;
+}
+
+uint64_t squashelf_hash64(const void* buf, size_t len, uint64_t seed)
+{
+    const unsigned char* p   = buf;
+    const unsigned char* end = p + len;
+    uint64_t             h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + HASH_P1 + HASH_P2;
+        uint64_t v2 = seed + HASH_P2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - HASH_P1;
+        for (; end - p >= 32; p += 32) {
+            v1 = hashRound(v1, hashRead64(p));
+            v2 = hashRound(v2, hashRead64(p + 8));
+            v3 = hashRound(v3, hashRead64(p + 16));
+            v4 = hashRound(v4, hashRead64(p + 24));
+        }
+        h = hashRotl(v1, 1) + hashRotl(v2, 7) + hashRotl(v3, 12) +
+            hashRotl(v4, 18);
+        h = hashMerge(h, v1);
+        h = hashMerge(h, v2);
+        h = hashMerge(h, v3);
+        h = hashMerge(h, v4);
+    }
+    else {
+        h = seed + HASH_P5;
+    }
+    h += len;
+
+    for (; end - p >= 8; p += 8) {
+        h ^= hashRound(0, hashRead64(p));
+        h = hashRotl(h, 27) * HASH_P1 + HASH_P4;
+    }
+    if (end - p >= 4) {
+        h ^= hashRead32(p) * HASH_P1;
+        h = hashRotl(h, 23) * HASH_P2 + HASH_P3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * HASH_P5;
+        h = hashRotl(h, 11) * HASH_P1;
+    }
+
+    h ^= h >> 33;
+    h *= HASH_P2;
+    h ^= h >> 29;
+    h *= HASH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+/*
+ * CRC-32 (the zlib/IEEE 802.3 one: reflected, polynomial 0xedb88320) and
+ * SHA-256 of output segments. Both have a portable version and, on
+ * x86-64, one using PCLMULQDQ or the SHA extensions, picked once at run
+ * time from what the CPU supports.
+ */
+static uint32_t       crcTable[8][256]; /* slicing-by-8 */
+static pthread_once_t crcOnce = PTHREAD_ONCE_INIT;
+
+/*
+ * crcInit:
+ *   Build the slicing-by-8 tables: crcTable[k][b] is the CRC of byte b
+ *   followed by k zero bytes.
+ */
+static void crcInit(void)
+{
+    for (uint32_t b = 0; b < 256; b++) {
+        uint32_t c = b;
+        for (int i = 0; i < 8; i++) {
+            c = c & 1 ? (c >> 1) ^ 0xedb88320 : c >> 1;
+        }
+        crcTable[0][b] = c;
+    }
+    for (uint32_t b = 0; b < 256; b++) {
+        for (int k = 1; k < 8; k++) {
+            uint32_t c     = crcTable[k - 1][b];
+            crcTable[k][b] = (c >> 8) ^ crcTable[0][c & 0xff];
+        }
+    }
+}
+
+/*
+ * crcTableUpdate:
+ *   Portable CRC-32 of len bytes, continuing from the (inverted) state
+ *   crc, eight bytes per step.
+ */
+static uint32_t crcTableUpdate(uint32_t crc, const unsigned char* p,
+                               size_t len)
+{
+    for (; len >= 8; p += 8, len -= 8) {
+        uint32_t lo = crc ^ (uint32_t)hashRead32(p);
+        uint32_t hi = (uint32_t)hashRead32(p + 4);
+        crc         = crcTable[7][lo & 0xff] ^ crcTable[6][(lo >> 8) & 0xff] ^
+              crcTable[5][(lo >> 16) & 0xff] ^ crcTable[4][lo >> 24] ^
+              crcTable[3][hi & 0xff] ^ crcTable[2][(hi >> 8) & 0xff] ^
+              crcTable[1][(hi >> 16) & 0xff] ^ crcTable[0][hi >> 24];
+    }
+    for (; len > 0; p++, len--) {
+        crc = (crc >> 8) ^ crcTable[0][(crc ^ *p) & 0xff];
+    }
+    return crc;
+}
+
+static const uint32_t sha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static uint32_t sha256Rotr(uint32_t v, int bits)
+{
+    return v >> bits | v << (32 - bits);
+}
+
+/*
+ * sha256Blocks:
+ *   Portable SHA-256 compression of blocks 64-byte blocks into state.
+ */
+static void sha256Blocks(uint32_t state[8], const unsigned char* p,
+                         size_t blocks)
+{
+    for (; blocks > 0; blocks--, p += 64) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 |
+                   (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = sha256Rotr(w[i - 15], 7) ^
+                          sha256Rotr(w[i - 15], 18) ^ w[i - 15] >> 3;
+            uint32_t s1 = sha256Rotr(w[i - 2], 17) ^
+                          sha256Rotr(w[i - 2], 19) ^ w[i - 2] >> 10;
+            w[i]        = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t s1 = sha256Rotr(e, 6) ^ sha256Rotr(e, 11) ^
+                          sha256Rotr(e, 25);
+            uint32_t t1 = h + s1 + ((e & f) ^ (~e & g)) + sha256K[i] + w[i];
+            uint32_t s0 = sha256Rotr(a, 2) ^ sha256Rotr(a, 13) ^
+                          sha256Rotr(a, 22);
+            uint32_t t2 = s0 + ((a & b) ^ (a & c) ^ (b & c));
+            h           = g;
+            g           = f;
+            f           = e;
+            e           = d + t1;
+            d           = c;
+            c           = b;
+            b           = a;
+            a           = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#if defined(__x86_64__)
+/*
+ * crcClmulUpdate:
+ *   CRC-32 by carry-less multiplication: fold 64 bytes per step into four
+ *   128-bit lanes, fold those into one, then Barrett-reduce to 32 bits
+ *   (Intel's "Fast CRC Computation for Generic Polynomials Using
+ *   PCLMULQDQ"). Needs len >= 64; returns the state after len & ~15
+ *   bytes, leaving the tail to the caller.
+ */
+__attribute__((target("pclmul,sse4.1"))) static uint32_t
+crcClmulUpdate(uint32_t crc, const unsigned char* p, size_t len)
+{
+    const __m128i k1k2 = _mm_set_epi64x(0x1c6e41596, 0x154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x0ccaa009e, 0x1751997d0);
+    const __m128i k5   = _mm_set_epi64x(0, 0x163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x1f7011641, 0x1db710641);
+    const __m128i mask = _mm_set_epi32(0, 0, 0, -1);
+
+    __m128i x1 = _mm_loadu_si128((const __m128i*)p);
+    __m128i x2 = _mm_loadu_si128((const __m128i*)(p + 16));
+    __m128i x3 = _mm_loadu_si128((const __m128i*)(p + 32));
+    __m128i x4 = _mm_loadu_si128((const __m128i*)(p + 48));
+    x1         = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    for (p += 64, len -= 64; len >= 64; p += 64, len -= 64) {
+#define CRC_FOLD(x, k, next)                                         \
+    _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00),    \
+                                _mm_clmulepi64_si128(x, k, 0x11)),   \
+                  next)
+        x1 = CRC_FOLD(x1, k1k2, _mm_loadu_si128((const __m128i*)p));
+        x2 = CRC_FOLD(x2, k1k2, _mm_loadu_si128((const __m128i*)(p + 16)));
+        x3 = CRC_FOLD(x3, k1k2, _mm_loadu_si128((const __m128i*)(p + 32)));
+        x4 = CRC_FOLD(x4, k1k2, _mm_loadu_si128((const __m128i*)(p + 48)));
+    }
+    x1 = CRC_FOLD(x1, k3k4, x2);
+    x1 = CRC_FOLD(x1, k3k4, x3);
+    x1 = CRC_FOLD(x1, k3k4, x4);
+    for (; len >= 16; p += 16, len -= 16) {
+        x1 = CRC_FOLD(x1, k3k4, _mm_loadu_si128((const __m128i*)p));
+    }
+#undef CRC_FOLD
+
+    /* 128 -> 64 bits, appending the 32 zero bits of the CRC */
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8),
+                       _mm_clmulepi64_si128(x1, k3k4, 0x10));
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 4),
+                       _mm_clmulepi64_si128(_mm_and_si128(x1, mask), k5,
+                                            0x00));
+
+    /* Barrett reduction 64 -> 32 bits */
+    __m128i t = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), poly, 0x10);
+    t         = _mm_clmulepi64_si128(_mm_and_si128(t, mask), poly, 0x00);
+    return (uint32_t)_mm_extract_epi32(_mm_xor_si128(x1, t), 1);
+}
+
+/*
+ * sha256ShaNiBlocks:
+ *   SHA-256 compression with the SHA extensions, four rounds per pair of
+ *   sha256rnds2 and the message schedule from sha256msg1/msg2.
+ */
+__attribute__((target("sha,ssse3,sse4.1"))) static void
+sha256ShaNiBlocks(uint32_t state[8], const unsigned char* p, size_t blocks)
+{
+    const __m128i swap =
+        _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    /* state is ABCD EFGH; the instructions take ABEF and CDGH */
+    __m128i abcd  = _mm_shuffle_epi32(_mm_loadu_si128((__m128i*)state), 0xb1);
+    __m128i efgh  = _mm_shuffle_epi32(_mm_loadu_si128((__m128i*)&state[4]),
+                                      0x1b);
+    __m128i abef  = _mm_alignr_epi8(abcd, efgh, 8);
+    __m128i cdgh  = _mm_blend_epi16(efgh, abcd, 0xf0);
+
+    for (; blocks > 0; blocks--, p += 64) {
+        __m128i saveAbef = abef;
+        __m128i saveCdgh = cdgh;
+        __m128i w[4];
+        for (int g = 0; g < 16; g++) {
+            /* w[g & 3] goes from W[4g-16..4g-13] to W[4g..4g+3] */
+            if (g < 4) {
+                w[g] = _mm_shuffle_epi8(
+                    _mm_loadu_si128((const __m128i*)(p + 16 * g)), swap);
+            }
+            else {
+                __m128i s = _mm_sha256msg1_epu32(w[g & 3], w[(g + 1) & 3]);
+                s         = _mm_add_epi32(
+                    s, _mm_alignr_epi8(w[(g + 3) & 3], w[(g + 2) & 3], 4));
+                w[g & 3] = _mm_sha256msg2_epu32(s, w[(g + 3) & 3]);
+            }
+            __m128i k = _mm_add_epi32(
+                w[g & 3], _mm_loadu_si128((const __m128i*)&sha256K[4 * g]));
+            cdgh = _mm_sha256rnds2_epu32(cdgh, abef, k);
+            abef = _mm_sha256rnds2_epu32(abef, cdgh,
+                                         _mm_shuffle_epi32(k, 0x0e));
+        }
+        abef = _mm_add_epi32(abef, saveAbef);
+        cdgh = _mm_add_epi32(cdgh, saveCdgh);
+    }
+
+    __m128i feba = _mm_shuffle_epi32(abef, 0x1b);
+    __m128i dchg = _mm_shuffle_epi32(cdgh, 0xb1);
+    _mm_storeu_si128((__m128i*)state, _mm_blend_epi16(feba, dchg, 0xf0));
+    _mm_storeu_si128((__m128i*)&state[4], _mm_alignr_epi8(dchg, feba, 8));
+}
+#endif
+
+static bool           haveClmul = false;
+static bool           haveShaNi = false;
+static pthread_once_t cpuOnce   = PTHREAD_ONCE_INIT;
+
+/*
+ * cpuInit:
+ *   Check once for the instructions the accelerated digests use.
+ */
+static void cpuInit(void)
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    haveClmul = __builtin_cpu_supports("pclmul") &&
+                __builtin_cpu_supports("sse4.1");
+    haveShaNi = __builtin_cpu_supports("sha") &&
+                __builtin_cpu_supports("sse4.1");
+#endif
+}
+
+/*
+ * digestState:
+ *   A CRC-32 and a SHA-256 computed together over one byte stream.
+ */
+struct digestState {
+    uint32_t      crc; /* inverted */
+    uint32_t      sha[8];
+    uint64_t      total;
+    unsigned char block[64]; /* partial SHA-256 block */
+    size_t        blockLen;
+};
+
+static void digestInit(struct digestState* st)
+{
+    static const uint32_t shaInit[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                        0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                        0x1f83d9ab, 0x5be0cd19};
+    pthread_once(&crcOnce, crcInit);
+    pthread_once(&cpuOnce, cpuInit);
+    memset(st, 0, sizeof(*st));
+    st->crc = 0xffffffff;
+    memcpy(st->sha, shaInit, sizeof(shaInit));
+}
+
+static void digestCrc(struct digestState* st, const unsigned char* p,
+                      size_t len)
+{
+#if defined(__x86_64__)
+    if (haveClmul && len >= 64) {
+        st->crc = crcClmulUpdate(st->crc, p, len);
+        p += len & ~(size_t)15;
+        len &= 15;
+    }
+#endif
+    st->crc = crcTableUpdate(st->crc, p, len);
+}
+
+static void digestSha(struct digestState* st, const unsigned char* p,
+                      size_t blocks)
+{
+#if defined(__x86_64__)
+    if (haveShaNi) {
+        sha256ShaNiBlocks(st->sha, p, blocks);
+        return;
+    }
+#endif
+    sha256Blocks(st->sha, p, blocks);
+}
+
+/*
+ * digestUpdate:
+ *   Add len bytes to both digests.
+ */
+static void digestUpdate(struct digestState* st, const void* buf, size_t len)
+{
+    const unsigned char* p = buf;
+    digestCrc(st, p, len);
+    st->total += len;
+
+    if (st->blockLen) {
+        size_t take = 64 - st->blockLen < len ? 64 - st->blockLen : len;
+        memcpy(st->block + st->blockLen, p, take);
+        st->blockLen += take;
+        p += take;
+        len -= take;
+        if (st->blockLen < 64) {
+            return;
+        }
+        digestSha(st, st->block, 1);
+        st->blockLen = 0;
+    }
+    if (len >= 64) {
+        digestSha(st, p, len / 64);
+        p += len & ~(size_t)63;
+        len &= 63;
+    }
+    memcpy(st->block, p, len);
+    st->blockLen = len;
+}
+
+/*
+ * digestFinish:
+ *   Pad the SHA-256 stream and store both results.
+ */
+static void digestFinish(struct digestState* st, uint32_t* crc,
+                         unsigned char sha256[32])
+{
+    uint64_t bits = st->total * 8;
+    *crc          = ~st->crc;
+
+    st->block[st->blockLen++] = 0x80;
+    if (st->blockLen > 56) {
+        memset(st->block + st->blockLen, 0, 64 - st->blockLen);
+        digestSha(st, st->block, 1);
+        st->blockLen = 0;
+    }
+    memset(st->block + st->blockLen, 0, 56 - st->blockLen);
+    for (int i = 0; i < 8; i++) {
+        st->block[56 + i] = bits >> (56 - 8 * i);
+    }
+    digestSha(st, st->block, 1);
+    for (int i = 0; i < 8; i++) {
+        sha256[4 * i]     = st->sha[i] >> 24;
+        sha256[4 * i + 1] = st->sha[i] >> 16;
+        sha256[4 * i + 2] = st->sha[i] >> 8;
+        sha256[4 * i + 3] = st->sha[i];
+    }
+}
+
+/*
+ * payloadEntry:
+ *   The layout PHT entry payload i belongs to.
+ */
+static size_t payloadEntry(const struct outputLayout* layout, size_t i)
+{
+    return layout->owner ? layout->owner[i] : i;
+}
+
+/*
+ * entryPayloads:
+ *   Index of the first payload of each layout PHT entry, in a malloc'd
+ *   array of phnum + 1 (the last one is the payload count). The payloads
+ *   of an entry are adjacent, in file order.
+ */
+static size_t* entryPayloads(const struct squashelf_image* image)
+{
+    const struct outputLayout* layout = &image->layout;
+    size_t* first = malloc((layout->phnum + 1) * sizeof(*first));
+    if (!first) {
+        perror("malloc payload index");
+        return NULL;
+    }
+    for (size_t i = image->count; i-- > 0;) {
+        first[payloadEntry(layout, i)] = i;
+    }
+    first[layout->phnum] = image->count;
+    return first;
+}
+
+/*
+ * loadEntry:
+ *   Gather the file bytes of PHT entry e (payloads from index first on,
+ *   zeros between them) into out, which holds its p_filesz bytes.
+ */
+static int loadEntry(const struct squashelf_image* image, size_t e,
+                     size_t first, unsigned char* out)
+{
+    const struct squashelf*    in     = image->in;
+    const struct outputLayout* layout = &image->layout;
+    uint64_t                   start  = layout->phtOffsets[e];
+    uint64_t                   end    = start + layout->pht[e].p_filesz;
+
+    memset(out, 0, end - start);
+    for (size_t i = first;
+         i < image->count && payloadEntry(layout, i) == e; i++) {
+        const GElf_Phdr* seg = &image->phdrs[i];
+        if (seg->p_filesz == 0) {
+            continue;
+        }
+        unsigned char* dst = out + (layout->offsets[i] - start);
+        if (in->data) {
+            memcpy(dst, in->data + seg->p_offset, seg->p_filesz);
+        }
+        else if (preadAll(in->fd, dst, seg->p_filesz, seg->p_offset) != 0) {
+            perror("pread segment data");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * codecCompress:
+ *   Compress size bytes at src with codec into a malloc'd *out of *outSize
+ *   bytes. Returns 0, 1 if the codec cannot take the input (it is then
+ *   stored as is), or -1 on error.
+ */
+static int codecCompress(int codec, int level, const unsigned char* src,
+                         uint64_t size, unsigned char** out,
+                         uint64_t* outSize)
+{
+    unsigned char* dst;
+#if !defined(SQUASHELF_HAVE_ZSTD) && !defined(SQUASHELF_HAVE_LZ4)
+    (void)level; /* built without any codec */
+    (void)src;
+    (void)size;
+    (void)out;
+    (void)outSize;
+    (void)dst;
+#endif
+
+    switch (codec) {
+#ifdef SQUASHELF_HAVE_ZSTD
+        case SQUASHELF_CODEC_ZSTD: {
+            size_t cap = ZSTD_compressBound(size);
+            if (!(dst = malloc(cap))) {
+                perror("malloc zstd output");
+                return -1;
+            }
+            size_t n = ZSTD_compress(dst, cap, src, size,
+                                     level ? level : ZSTD_CLEVEL_DEFAULT);
+            if (ZSTD_isError(n)) {
+                fprintf(stderr, "zstd: %s\n", ZSTD_getErrorName(n));
+                free(dst);
+                return -1;
+            }
+            *out     = dst;
+            *outSize = n;
+            return 0;
+        }
+#endif
+#ifdef SQUASHELF_HAVE_LZ4
+        case SQUASHELF_CODEC_LZ4: {
+            if (size > LZ4_MAX_INPUT_SIZE) {
+                return 1; /* more than one LZ4 block can hold */
+            }
+            int cap = LZ4_compressBound((int)size);
+            if (!(dst = malloc(cap))) {
+                perror("malloc lz4 output");
+                return -1;
+            }
+            int n = level > 0 ? LZ4_compress_HC((const char*)src, (char*)dst,
+                                                (int)size, cap, level)
+                              : LZ4_compress_default((const char*)src,
+                                                     (char*)dst, (int)size,
+                                                     cap);
+            if (n <= 0) {
+                fprintf(stderr, "LZ4 compression failed\n");
+                free(dst);
+                return -1;
+            }
+            *out     = dst;
+            *outSize = n;
+            return 0;
+        }
+#endif
+        default:
+            return 1;
+    }
+}
+
+/*
+ * packEntry:
+ *   Compress PHT entry e, whose payloads start at index first, into
+ *   image->packed.entries[e]. An entry that does not shrink is stored:
+ *   straight from the input mapping when it is a single payload there,
+ *   else from the buffer it was gathered in.
+ */
+static int packEntry(struct squashelf_image* image, size_t e, size_t first)
+{
+    const struct squashelf*    in     = image->in;
+    const struct outputLayout* layout = &image->layout;
+    const GElf_Phdr*           entry  = &layout->pht[e];
+    struct packedEntry*        out    = &image->packed.entries[e];
+    uint64_t                   size   = entry->p_filesz;
+    const unsigned char*       src;
+    unsigned char*             raw    = NULL;
+    unsigned char*             packed = NULL;
+    uint64_t                   csize  = 0;
+
+    out->codec = SQUASHELF_CODEC_NONE;
+    if (size == 0) {
+        return 0;
+    }
+    if (in->data && first < image->count &&
+        layout->offsets[first] == layout->phtOffsets[e] &&
+        image->phdrs[first].p_filesz == size) {
+        src = in->data + image->phdrs[first].p_offset;
+    }
+    else {
+        if (!(raw = malloc(size))) {
+            perror("malloc segment buffer");
+            return -1;
+        }
+        if (loadEntry(image, e, first, raw) != 0) {
+            free(raw);
+            return -1;
+        }
+        src = raw;
+    }
+
+    int rc = codecCompress(image->opts.codec, image->opts.codecLevel, src,
+                           size, &packed, &csize);
+    if (rc < 0) {
+        free(raw);
+        return -1;
+    }
+    if (rc == 0 && csize < size) {
+        free(raw);
+        unsigned char* fit = realloc(packed, csize);
+        if (fit) {
+            packed = fit;
+        }
+        out->owned = packed;
+        out->data  = packed;
+        out->csize = csize;
+        out->codec = image->opts.codec;
+        return 0;
+    }
+    free(packed);
+    out->owned = raw;
+    out->data  = src;
+    out->csize = size;
+    return 0;
+}
+
+/* Work list shared by the compression threads */
+struct packPool {
+    struct squashelf_image* image;
+    const size_t*           first; /* first payload of each PHT entry */
+    size_t                  next;  /* index of the next unclaimed entry */
+    int                     failed;
+    pthread_mutex_t         lock;
+};
+
+/*
+ * packWorker:
+ *   Compression thread: claim PHT entries until the list is drained or
+ *   one fails.
+ */
+static void* packWorker(void* arg)
+{
+    struct packPool* pool  = arg;
+    size_t           phnum = pool->image->layout.phnum;
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        size_t e = pool->failed ? phnum : pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (e >= phnum) {
+            break;
+        }
+        if (packEntry(pool->image, e, pool->first[e]) != 0) {
+            pthread_mutex_lock(&pool->lock);
+            pool->failed = 1;
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * packImage:
+ *   Compress every PHT entry of the image with opts.codec, entries spread
+ *   over opts.jobs threads, and lay out the compressed output.
+ */
+static int packImage(struct squashelf_image* image)
+{
+    const struct outputLayout* layout  = &image->layout;
+    struct packedLayout*       packed  = &image->packed;
+    size_t                     threads = image->opts.jobs > 1
+                                             ? (size_t)image->opts.jobs
+                                             : 0;
+    struct packPool            pool    = {.image = image,
+                                          .lock  = PTHREAD_MUTEX_INITIALIZER};
+    pthread_t*                 tids    = NULL;
+    int                        rc      = -1;
+
+    if (layout->phnum + 1 >= PN_XNUM) {
+        fprintf(stderr, "Error: %zu segments leave no room in the PHT for "
+                        "the compression index\n",
+                layout->phnum);
+        return -1;
+    }
+    if (threads > layout->phnum) {
+        threads = layout->phnum;
+    }
+    packed->entries = calloc(layout->phnum, sizeof(*packed->entries));
+    size_t* first   = entryPayloads(image);
+    if (!packed->entries || !first ||
+        (threads && !(tids = calloc(threads, sizeof(*tids))))) {
+        perror("calloc compression pool");
+        goto out;
+    }
+    pool.first = first;
+
+    size_t started = 0;
+    for (; started < threads; started++) {
+        if (pthread_create(&tids[started], NULL, packWorker, &pool) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        packWorker(&pool); /* no threads at all: compress inline */
+    }
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    if (pool.failed) {
+        goto out;
+    }
+
+    uint64_t headerEnd   = layout->ehdrSize + (layout->phnum + 1) *
+                                                  layout->phdrSize;
+    uint64_t rawBytes    = 0;
+    packed->indexOffset  = (headerEnd + 7) & ~7UL;
+    packed->indexSize    = PACKED_INDEX_HEADER +
+                        layout->phnum * PACKED_INDEX_ENTRY;
+    uint64_t pos         = packed->indexOffset + packed->indexSize;
+    for (size_t e = 0; e < layout->phnum; e++) {
+        packed->entries[e].offset = pos;
+        pos += packed->entries[e].csize;
+        rawBytes += layout->pht[e].p_filesz;
+    }
+    packed->dataEnd = pos;
+
+    uint64_t shAlign = layout->shdrSize == sizeof(Elf64_Shdr) ? 8 : 4;
+    if (image->opts.noSht) {
+        packed->shoff    = 0;
+        packed->fileSize = pos;
+    }
+    else {
+        packed->shoff    = (pos + shAlign - 1) & ~(shAlign - 1);
+        packed->fileSize = packed->shoff + layout->shdrSize;
+    }
+    DEBUG_PRINT("Compressed %zu PT_LOAD entries with %s: %lu -> %lu bytes\n",
+                layout->phnum, codecNames[image->opts.codec], rawBytes,
+                packed->dataEnd - packed->indexOffset - packed->indexSize);
+    rc = 0;
+
+out:
+    free(tids);
+    free(first);
+    return rc;
+}
+
+/*
+ * putWord:
+ *   Store the low bytes bytes of v at p in the given ELF data encoding.
+ */
+static void putWord(unsigned char* p, uint64_t v, size_t bytes,
+                    unsigned encoding)
+{
+    for (size_t i = 0; i < bytes; i++) {
+        size_t shift = encoding == ELFDATA2MSB ? bytes - 1 - i : i;
+        p[i]         = v >> (8 * shift);
+    }
+}
+
+/*
+ * getWord:
+ *   Load a bytes-long unsigned value at p stored in the given ELF data
+ *   encoding.
+ */
+static uint64_t getWord(const unsigned char* p, size_t bytes,
+                        unsigned encoding)
+{
+    uint64_t v = 0;
+    for (size_t i = 0; i < bytes; i++) {
+        size_t shift = encoding == ELFDATA2MSB ? bytes - 1 - i : i;
+        v |= (uint64_t)p[i] << (8 * shift);
+    }
+    return v;
+}
+
+/*
+ * encodePackedHeaders:
+ *   Encode the ELF header, PHT and index of compressed output into out,
+ *   which must hold packed.indexOffset + packed.indexSize zeroed bytes.
+ */
+static int encodePackedHeaders(const struct squashelf_image* image,
+                               unsigned char* out)
+{
+    const struct squashelf*    in       = image->in;
+    const struct outputLayout* layout   = &image->layout;
+    const struct packedLayout* packed   = &image->packed;
+    unsigned                   encoding = in->ehdr.e_ident[EI_DATA];
+
+    GElf_Ehdr ehdr;
+    buildOutputEhdr(&in->ehdr, image->opts.noSht, layout, &ehdr);
+    ehdr.e_phnum = layout->phnum + 1;
+    ehdr.e_shoff = packed->shoff;
+    if (encodeEhdr(&ehdr, out) != 0) {
+        fprintf(stderr, "encode ELF header: %s\n", elf_errmsg(-1));
+        return -1;
+    }
+
+    GElf_Phdr index = {
+        .p_type   = SQUASHELF_PT_INDEX,
+        .p_offset = packed->indexOffset,
+        .p_filesz = packed->indexSize,
+        .p_memsz  = packed->indexSize,
+        .p_flags  = PF_R,
+        .p_align  = 8,
+    };
+    unsigned char* ph = out + layout->ehdrSize;
+    in->pht->encode(&index, NULL, 1, ph);
+
+    unsigned char* idx = out + packed->indexOffset;
+    memcpy(idx, "SQZI", 4);
+    putWord(idx + 4, SQUASHELF_INDEX_VERSION, 2, encoding);
+    putWord(idx + 6, PACKED_INDEX_ENTRY, 2, encoding);
+    putWord(idx + 8, layout->phnum, 4, encoding);
+    for (size_t e = 0; e < layout->phnum; e++) {
+        const struct packedEntry* pe    = &packed->entries[e];
+        GElf_Phdr                 entry = layout->pht[e];
+        unsigned char*            rec   = idx + PACKED_INDEX_HEADER +
+                                 e * PACKED_INDEX_ENTRY;
+        putWord(rec, entry.p_paddr, 8, encoding);
+        putWord(rec + 8, entry.p_memsz, 8, encoding);
+        putWord(rec + 16, pe->offset, 8, encoding);
+        putWord(rec + 24, pe->csize, 8, encoding);
+        putWord(rec + 32, entry.p_filesz, 8, encoding);
+        putWord(rec + 40, pe->codec, 4, encoding);
+        putWord(rec + 44, entry.p_flags, 4, encoding);
+
+        /* The data is only in the index; loaders see an all-bss PT_LOAD */
+        entry.p_offset = pe->offset;
+        entry.p_filesz = 0;
+        ph += layout->phdrSize;
+        in->pht->encode(&entry, NULL, 1, ph);
+    }
+    return 0;
+}
+
+/*
+ * writePacked:
+ *   Write compressed output to fd, or with fd < 0 build it in mem
+ *   (holding packed.fileSize bytes).
+ */
+static int writePacked(const struct squashelf_image* image, int fd,
+                       unsigned char* mem)
+{
+    const struct packedLayout* packed   = &image->packed;
+    size_t                     headSize = packed->indexOffset +
+                                          packed->indexSize;
+    unsigned char*             head     = mem;
+    struct iovBatch*           batch    = NULL;
+    int                        rc       = -1;
+
+    if (mem) {
+        memset(mem, 0, headSize);
+    }
+    else if (!(head = calloc(1, headSize)) ||
+             !(batch = malloc(sizeof(*batch)))) {
+        perror("malloc output headers");
+        goto out;
+    }
+    if (encodePackedHeaders(image, head) != 0) {
+        goto out;
+    }
+
+    if (mem) {
+        for (size_t e = 0; e < image->layout.phnum; e++) {
+            const struct packedEntry* pe = &packed->entries[e];
+            memcpy(mem + pe->offset, pe->data, pe->csize);
+        }
+        /* Trailing padding and the single NULL section header */
+        memset(mem + packed->dataEnd, 0, packed->fileSize - packed->dataEnd);
+        rc = 0;
+        goto out;
+    }
+
+    batch->fd     = fd;
+    batch->offset = 0;
+    batch->count  = 0;
+    if (iovAppend(batch, head, headSize) != 0) {
+        goto write_error;
+    }
+    for (size_t e = 0; e < image->layout.phnum; e++) {
+        const struct packedEntry* pe = &packed->entries[e];
+        if (iovAppend(batch, pe->data, pe->csize) != 0) {
+            goto write_error;
+        }
+    }
+    if (iovAppend(batch, NULL, packed->fileSize - packed->dataEnd) != 0 ||
+        iovFlush(batch) != 0) {
+        goto write_error;
+    }
+    rc = 0;
+    goto out;
+
+write_error:
+    perror("pwritev output");
+out:
+    if (!mem) {
+        free(head);
+    }
+    free(batch);
+    return rc;
+}
+
+void squashelf_options_init(struct squashelf_options* opts)
+{
+    *opts = (struct squashelf_options){
+        .useMmap           = 1, /* mmap regular-file inputs */
+        .writer            = SQUASHELF_WRITER_LIBELF,
+        .copyStart         = SQUASHELF_COPY_FILE_RANGE, /* first engine tried */
+        .jobs              = 1,
+        .streamBufferLimit = 256UL << 20,
+        .format            = SQUASHELF_FORMAT_ELF,
+    };
+}
+
+void squashelf_set_verbose(int enable)
+{
+    verbose = enable;
+}
+
+const char* squashelf_writer_name(int writer)
+{
+    if (writer < 0 || writer >= SQUASHELF_WRITER_COUNT) {
+        return NULL;
+    }
+    return writerNames[writer];
+}
+
+const char* squashelf_copy_name(int engine)
+{
+    if (engine < 0 || engine >= SQUASHELF_COPY_COUNT) {
+        return NULL;
+    }
+    return copyEngineNames[engine];
+}
+
+const char* squashelf_format_name(int format)
+{
+    if (format < 0 || format >= SQUASHELF_FORMAT_COUNT) {
+        return NULL;
+    }
+    return formatNames[format];
+}
+
+const char* squashelf_codec_name(int codec)
+{
+    if (codec < 0 || codec >= SQUASHELF_CODEC_COUNT) {
+        return NULL;
+    }
+    return codecNames[codec];
+}
+
+int squashelf_codec_available(int codec)
+{
+    switch (codec) {
+        case SQUASHELF_CODEC_NONE:
+#ifdef SQUASHELF_HAVE_ZSTD
+        case SQUASHELF_CODEC_ZSTD:
+#endif
+#ifdef SQUASHELF_HAVE_LZ4
+        case SQUASHELF_CODEC_LZ4:
+#endif
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+const char* squashelf_layout_name(int layout)
+{
+    if (layout < 0 || layout >= SQUASHELF_LAYOUT_COUNT) {
+        return NULL;
+    }
+    return layoutNames[layout];
+}
+
+const char* squashelf_overlap_name(int mode)
+{
+    if (mode < 0 || mode >= SQUASHELF_OVERLAP_COUNT) {
+        return NULL;
+    }
+    return overlapNames[mode];
+}
+
+const char* squashelf_phase_name(int phase)
+{
+    if (phase < 0 || phase >= SQUASHELF_PHASE_COUNT) {
+        return NULL;
+    }
+    return phaseNames[phase];
+}
+
+/* Compressed input formats, recognised by their magic */
+enum inputCodec {
+    INPUT_ZSTD,
+    INPUT_XZ,
+};
+
+static const char* const inputCodecNames[] = {
+    "zstd",
+    "xz",
+};
+
+/*
+ * inputFrame:
+ *   One independently decodable piece of a compressed input: a zstd frame
+ *   or an xz block.
+ */
+struct inputFrame {
+    uint64_t offset;  /* uncompressed offset */
+    uint64_t size;    /* uncompressed bytes */
+    uint64_t coffset; /* offset in the compressed file */
+    uint64_t csize;   /* compressed bytes (xz: block header included) */
+    uint32_t check;   /* xz: integrity check of the block's stream */
+    bool     decoded;
+};
+
+/*
+ * compressedInput:
+ *   A .zst or .xz input, decoded into an anonymous mapping of its
+ *   uncompressed size as the data is needed: the ELF, program and section
+ *   headers when it is opened, the selected segments in squashelf_select,
+ *   one frame at a time, so pages of frames never decoded are never
+ *   touched. An input that cannot be split into frames of known size is
+ *   decoded in full when it is opened.
+ */
+struct compressedInput {
+    int                  codec;      /* enum inputCodec */
+    int                  fd;         /* the compressed file */
+    const unsigned char* file;       /* mapping of fd */
+    uint64_t             fileSize;
+    unsigned char*       data;       /* uncompressed image */
+    uint64_t             size;
+    uint64_t             mapSize;    /* bytes mapped at data */
+    struct inputFrame*   frames;     /* in offset order */
+    size_t               frameCount;
+    size_t               decoded;    /* frames decoded so far */
+};
+
+#if defined(SQUASHELF_HAVE_ZSTD) || defined(SQUASHELF_HAVE_LZMA)
+/*
+ * addFrame:
+ *   Append a frame to z->frames, growing the array as needed.
+ */
+static int addFrame(struct compressedInput* z, const struct inputFrame* frame,
+                    size_t* cap)
+{
+    if (z->frameCount == *cap) {
+        size_t             grown = *cap ? *cap * 2 : 16;
+        struct inputFrame* more  = realloc(z->frames, grown * sizeof(*more));
+        if (!more) {
+            perror("realloc input frames");
+            return -1;
+        }
+        z->frames = more;
+        *cap      = grown;
+    }
+    z->frames[z->frameCount++] = *frame;
+    return 0;
+}
+#endif
+
+/* Magic numbers of the zstd frame formats */
+#define ZSTD_FRAME_MAGIC     0xfd2fb528U
+#define ZSTD_SKIPPABLE_MAGIC 0x184d2a50U /* low 4 bits are free */
+#define ZSTD_SEEKABLE_MAGIC  0x8f92eab1U /* seek table footer */
+
+#ifdef SQUASHELF_HAVE_ZSTD
+/*
+ * zstdSeekTable:
+ *   Take the frames from the seek table of the zstd seekable format (a
+ *   trailing skippable frame listing every frame's compressed and
+ *   uncompressed size). Returns 0, 1 if there is no usable table, or -1.
+ */
+static int zstdSeekTable(struct compressedInput* z)
+{
+    const unsigned char* f    = z->file;
+    uint64_t             size = z->fileSize;
+    size_t               cap  = 0;
+
+    if (size < 17 || getWord(f + size - 4, 4, ELFDATA2LSB) !=
+                         ZSTD_SEEKABLE_MAGIC) {
+        return 1;
+    }
+    uint64_t count     = getWord(f + size - 9, 4, ELFDATA2LSB);
+    size_t   entrySize = f[size - 5] & 0x80 ? 12 : 8; /* with checksums */
+    uint64_t table     = 8 + count * entrySize + 9;
+    if (table > size) {
+        return 1;
+    }
+
+    struct inputFrame    frame = {0};
+    const unsigned char* entry = f + size - 9 - count * entrySize;
+    for (uint64_t i = 0; i < count; i++, entry += entrySize) {
+        frame.csize = getWord(entry, 4, ELFDATA2LSB);
+        frame.size  = getWord(entry + 4, 4, ELFDATA2LSB);
+        if (frame.size && addFrame(z, &frame, &cap) != 0) {
+            return -1;
+        }
+        frame.coffset += frame.csize;
+        frame.offset += frame.size;
+    }
+    if (frame.coffset != size - table) {
+        DEBUG_PRINT("zstd seek table does not match the file; ignoring it\n");
+        free(z->frames);
+        z->frames     = NULL;
+        z->frameCount = 0;
+        return 1;
+    }
+    z->size = frame.offset;
+    return 0;
+}
+
+/*
+ * zstdFrames:
+ *   Find the frames of a zstd input: from its seek table if it has one,
+ *   else by walking the frame headers. Returns 0, 1 if some frame does
+ *   not record its uncompressed size (the input is then decoded in
+ *   full), or -1 if the input is corrupt.
+ */
+static int zstdFrames(struct compressedInput* z)
+{
+    int rc = zstdSeekTable(z);
+    if (rc <= 0) {
+        return rc;
+    }
+
+    struct inputFrame frame = {0};
+    size_t            cap   = 0;
+    while (frame.coffset < z->fileSize) {
+        const unsigned char* p    = z->file + frame.coffset;
+        uint64_t             left = z->fileSize - frame.coffset;
+        size_t               n    = ZSTD_findFrameCompressedSize(p, left);
+        if (ZSTD_isError(n)) {
+            fprintf(stderr, "zstd input at offset 0x%lx: %s\n", frame.coffset,
+                    ZSTD_getErrorName(n));
+            return -1;
+        }
+        if ((getWord(p, 4, ELFDATA2LSB) & ~0xfU) != ZSTD_SKIPPABLE_MAGIC) {
+            unsigned long long content = ZSTD_getFrameContentSize(p, left);
+            if (content == ZSTD_CONTENTSIZE_UNKNOWN ||
+                content == ZSTD_CONTENTSIZE_ERROR) {
+                free(z->frames);
+                z->frames     = NULL;
+                z->frameCount = 0;
+                return 1;
+            }
+            frame.csize = n;
+            frame.size  = content;
+            if (frame.size && addFrame(z, &frame, &cap) != 0) {
+                return -1;
+            }
+            frame.offset += frame.size;
+        }
+        frame.coffset += n;
+    }
+    z->size = frame.offset;
+    return 0;
+}
+#endif /* SQUASHELF_HAVE_ZSTD */
+
+#ifdef SQUASHELF_HAVE_LZMA
+/*
+ * xzFrames:
+ *   Find the blocks of an xz input from the indexes of its streams, read
+ *   from the end of the file backwards like xz --list does.
+ */
+static int xzFrames(struct compressedInput* z)
+{
+    const unsigned char* f     = z->file;
+    uint64_t             end   = z->fileSize;
+    lzma_index*          index = NULL;
+    int                  rc    = -1;
+
+    while (end > 0) {
+        /* Stream padding: a multiple of four zero bytes */
+        uint64_t padding = 0;
+        while (end - padding >= 4 &&
+               getWord(f + end - padding - 4, 4, ELFDATA2LSB) == 0) {
+            padding += 4;
+        }
+        end -= padding;
+
+        lzma_stream_flags footer;
+        lzma_stream_flags header;
+        if (end < 2 * LZMA_STREAM_HEADER_SIZE ||
+            lzma_stream_footer_decode(&footer, f + end -
+                                                   LZMA_STREAM_HEADER_SIZE) !=
+                LZMA_OK ||
+            footer.backward_size > end - 2 * LZMA_STREAM_HEADER_SIZE) {
+            fprintf(stderr, "xz input: bad stream footer\n");
+            goto out;
+        }
+
+        lzma_index* stream   = NULL;
+        uint64_t    memlimit = UINT64_MAX;
+        size_t      pos      = 0;
+        uint64_t    start    = end - LZMA_STREAM_HEADER_SIZE -
+                         footer.backward_size;
+        if (lzma_index_buffer_decode(&stream, &memlimit, NULL, f + start, &pos,
+                                     footer.backward_size) != LZMA_OK) {
+            fprintf(stderr, "xz input: bad stream index\n");
+            goto out;
+        }
+        uint64_t streamSize = lzma_index_stream_size(stream);
+        if (streamSize > end ||
+            lzma_stream_header_decode(&header, f + end - streamSize) !=
+                LZMA_OK ||
+            lzma_stream_flags_compare(&header, &footer) != LZMA_OK ||
+            lzma_index_stream_flags(stream, &footer) != LZMA_OK ||
+            lzma_index_stream_padding(stream, padding) != LZMA_OK ||
+            (index && lzma_index_cat(stream, index, NULL) != LZMA_OK)) {
+            fprintf(stderr, "xz input: bad stream header\n");
+            lzma_index_end(stream, NULL);
+            goto out;
+        }
+        index = stream; /* now covers this stream and the ones after it */
+        end -= streamSize;
+    }
+    if (!index) {
+        fprintf(stderr, "xz input: no streams\n");
+        goto out;
+    }
+
+    lzma_index_iter   iter;
+    struct inputFrame frame = {0};
+    size_t            cap   = 0;
+    lzma_index_iter_init(&iter, index);
+    while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_NONEMPTY_BLOCK)) {
+        frame.offset  = iter.block.uncompressed_file_offset;
+        frame.size    = iter.block.uncompressed_size;
+        frame.coffset = iter.block.compressed_file_offset;
+        frame.csize   = iter.block.total_size;
+        frame.check   = iter.stream.flags->check;
+        if (addFrame(z, &frame, &cap) != 0) {
+            goto out;
+        }
+    }
+    z->size = lzma_index_uncompressed_size(index);
+    rc      = 0;
+
+out:
+    lzma_index_end(index, NULL);
+    return rc;
+}
+#endif /* SQUASHELF_HAVE_LZMA */
+
+/*
+ * decodeFrame:
+ *   Decompress one frame into its place in z->data.
+ */
+static int decodeFrame(struct compressedInput* z, struct inputFrame* frame)
+{
+    const unsigned char* in  = z->file + frame->coffset;
+    unsigned char*       out = z->data + frame->offset;
+
+    switch (z->codec) {
+#ifdef SQUASHELF_HAVE_ZSTD
+        case INPUT_ZSTD: {
+            size_t n = ZSTD_decompress(out, frame->size, in, frame->csize);
+            if (ZSTD_isError(n) || n != frame->size) {
+                fprintf(stderr, "zstd input frame at offset 0x%lx: %s\n",
+                        frame->coffset,
+                        ZSTD_isError(n) ? ZSTD_getErrorName(n)
+                                        : "wrong decoded size");
+                return -1;
+            }
+            break;
+        }
+#endif
+#ifdef SQUASHELF_HAVE_LZMA
+        case INPUT_XZ: {
+            lzma_filter filters[LZMA_FILTERS_MAX + 1];
+            lzma_block  block  = {.version = 1,
+                                  .check   = frame->check,
+                                  .filters = filters};
+            size_t      inPos  = 0;
+            size_t      outPos = 0;
+            block.header_size  = lzma_block_header_size_decode(in[0]);
+            if (block.header_size > frame->csize ||
+                lzma_block_header_decode(&block, NULL, in) != LZMA_OK) {
+                fprintf(stderr, "xz input block at offset 0x%lx: bad header\n",
+                        frame->coffset);
+                return -1;
+            }
+            inPos        = block.header_size;
+            lzma_ret ret = lzma_block_buffer_decode(&block, NULL, in, &inPos,
+                                                    frame->csize, out, &outPos,
+                                                    frame->size);
+            for (size_t i = 0; filters[i].id != LZMA_VLI_UNKNOWN; i++) {
+                free(filters[i].options);
+            }
+            if (ret != LZMA_OK || outPos != frame->size) {
+                fprintf(stderr, "xz input block at offset 0x%lx: decode "
+                                "error %d\n",
+                        frame->coffset, (int)ret);
+                return -1;
+            }
+            break;
+        }
+#endif
+        default:
+            (void)in;
+            (void)out;
+            return -1;
+    }
+    frame->decoded = true;
+    z->decoded++;
+    return 0;
+}
+
+/*
+ * inputFetch:
+ *   Make sure the len bytes at offset of a compressed input are decoded.
+ *   A no-op for other inputs and for bytes past the end, which the bounds
+ *   checks reject later anyway.
+ */
+static int inputFetch(const struct squashelf* in, uint64_t offset,
+                      uint64_t len)
+{
+    struct compressedInput* z = in->compressed;
+    if (!z || offset >= z->size) {
+        return 0;
+    }
+    uint64_t end = len > z->size - offset ? z->size : offset + len;
+
+    /* First frame ending after offset */
+    size_t lo = 0;
+    size_t hi = z->frameCount;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (z->frames[mid].offset + z->frames[mid].size <= offset) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    for (size_t i = lo; i < z->frameCount && z->frames[i].offset < end; i++) {
+        if (!z->frames[i].decoded && decodeFrame(z, &z->frames[i]) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * fetchHeaders:
+ *   Decode the parts of a compressed input that libelf reads when it is
+ *   opened: the ELF header, the PHT and the SHT (whose first entry holds
+ *   the real counts when they overflow the ELF header). Malformed headers
+ *   are left for openElf to report.
+ */
+static int fetchHeaders(const struct squashelf* in)
+{
+    const unsigned char* raw = in->data;
+    GElf_Ehdr            ehdr;
+
+    if (inputFetch(in, 0, sizeof(Elf64_Ehdr)) != 0) {
+        return -1;
+    }
+    if (in->size < sizeof(Elf64_Ehdr) ||
+        (raw[EI_CLASS] != ELFCLASS32 && raw[EI_CLASS] != ELFCLASS64) ||
+        decodeEhdr(raw, &ehdr) != 0) {
+        return 0;
+    }
+
+    int      is64  = raw[EI_CLASS] == ELFCLASS64;
+    unsigned enc   = raw[EI_DATA];
+    uint64_t phnum = ehdr.e_phnum;
+    uint64_t shnum = ehdr.e_shnum;
+    if (ehdr.e_shoff) {
+        if (inputFetch(in, ehdr.e_shoff, ehdr.e_shentsize) != 0) {
+            return -1;
+        }
+        size_t shdrSize = is64 ? sizeof(Elf64_Shdr) : sizeof(Elf32_Shdr);
+        if (ehdr.e_shoff <= in->size - shdrSize) {
+            const unsigned char* sh = raw + ehdr.e_shoff;
+            if (shnum == 0) {
+                shnum = is64 ? getWord(sh + 32, 8, enc)
+                             : getWord(sh + 20, 4, enc);
+            }
+            if (phnum == PN_XNUM) {
+                phnum = getWord(sh + (is64 ? 44 : 28), 4, enc);
+            }
+        }
+    }
+    if (inputFetch(in, ehdr.e_phoff, phnum * ehdr.e_phentsize) != 0 ||
+        (ehdr.e_shoff &&
+         inputFetch(in, ehdr.e_shoff, shnum * ehdr.e_shentsize) != 0)) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * freeCompressed:
+ *   Unmap and free a compressed input (but leave its fd open).
+ */
+static void freeCompressed(struct compressedInput* z)
+{
+    if (!z) {
+        return;
+    }
+    DEBUG_PRINT("Compressed input: decoded %zu of %zu %s frames\n", z->decoded,
+                z->frameCount, inputCodecNames[z->codec]);
+    if (z->data) {
+        munmap(z->data, z->mapSize);
+    }
+    if (z->file) {
+        munmap((void*)z->file, z->fileSize);
+    }
+    free(z->frames);
+    free(z);
+}
+
+/*
+ * openCompressed:
+ *   Set up in (whose fd is a regular file of fileSize bytes that starts
+ *   with the magic of codec) to read its decompressed contents from
+ *   in->data. Returns 0 or -1; in must then be released with
+ *   squashelf_close.
+ */
+static int openCompressed(struct squashelf* in, int codec, uint64_t fileSize)
+{
+    struct compressedInput* z = calloc(1, sizeof(*z));
+    if (!z) {
+        perror("calloc compressed input");
+        return -1;
+    }
+    z->codec    = codec;
+    z->fd       = in->fd;
+    z->fileSize = fileSize;
+
+    void* file = mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, in->fd, 0);
+    if (file == MAP_FAILED) {
+        perror("mmap compressed input");
+        free(z);
+        return -1;
+    }
+    z->file = file;
+
+    int rc = -1;
+    switch (codec) {
+#ifdef SQUASHELF_HAVE_ZSTD
+        case INPUT_ZSTD:
+            rc = zstdFrames(z);
+            break;
+#endif
+#ifdef SQUASHELF_HAVE_LZMA
+        case INPUT_XZ:
+            rc = xzFrames(z);
+            break;
+#endif
+        default:
+            fprintf(stderr,
+                    "Error: input is %s-compressed, but squashelf was built "
+                    "without %s support\n",
+                    inputCodecNames[codec], inputCodecNames[codec]);
+            break;
+    }
+    if (rc < 0) {
+        goto fail;
+    }
+
+    /* Reserve the whole image; pages are only backed once decoded into */
+    z->mapSize = z->size ? z->size : 1;
+#ifdef SQUASHELF_HAVE_ZSTD
+    if (rc == 1) {
+        unsigned long long bound = ZSTD_decompressBound(z->file, fileSize);
+        if (bound == ZSTD_CONTENTSIZE_ERROR) {
+            fprintf(stderr, "zstd input: corrupt frame\n");
+            goto fail;
+        }
+        z->mapSize = bound ? bound : 1;
+    }
+#endif
+    void* data = mmap(NULL, z->mapSize, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (data == MAP_FAILED) {
+        perror("mmap decompressed input");
+        goto fail;
+    }
+    z->data = data;
+#ifdef SQUASHELF_HAVE_ZSTD
+    if (rc == 1) {
+        /* No frame map: the only option is to decode everything now */
+        size_t n = ZSTD_decompress(z->data, z->mapSize, z->file, fileSize);
+        if (ZSTD_isError(n)) {
+            fprintf(stderr, "zstd input: %s\n", ZSTD_getErrorName(n));
+            goto fail;
+        }
+        struct inputFrame whole = {.size    = n,
+                                   .csize   = fileSize,
+                                   .decoded = true};
+        size_t            cap   = 0;
+        if (addFrame(z, &whole, &cap) != 0) {
+            goto fail;
+        }
+        z->size    = n;
+        z->decoded = 1;
+        DEBUG_PRINT("zstd input without frame sizes: decoded in full\n");
+    }
+#endif
+
+    in->compressed = z;
+    in->data       = z->data;
+    in->size       = z->size;
+    in->fd         = -1;
+    DEBUG_PRINT("%s-compressed input: %lu bytes in %zu frames, %lu "
+                "uncompressed\n",
+                inputCodecNames[codec], fileSize, z->frameCount, z->size);
+    return fetchHeaders(in);
+
+fail:
+    freeCompressed(z);
+    return -1;
+}
+
+/*
+ * inputCodec:
+ *   The compressed format whose magic the input starts with, or -1.
+ */
+static int inputCodec(int fd)
+{
+    static const unsigned char xzMagic[6] = {0xfd, '7', 'z', 'X', 'Z', 0};
+    unsigned char              magic[6];
+    if (preadAll(fd, magic, sizeof(magic), 0) != 0) {
+        return -1;
+    }
+    uint32_t word = getWord(magic, 4, ELFDATA2LSB);
+    if (word == ZSTD_FRAME_MAGIC || (word & ~0xfU) == ZSTD_SKIPPABLE_MAGIC) {
+        return INPUT_ZSTD;
+    }
+    if (memcmp(magic, xzMagic, sizeof(xzMagic)) == 0) {
+        return INPUT_XZ;
+    }
+    return -1;
+}
+
+static pthread_once_t libelfOnce  = PTHREAD_ONCE_INIT;
+static bool           libelfReady = false;
+
+/*
+ * libelfInit:
+ *   One-time elf_version handshake, done on the first open.
+ */
+static void libelfInit(void)
+{
+    libelfReady = elf_version(EV_CURRENT) != EV_NONE;
+    if (!libelfReady) {
+        fprintf(stderr, "libelf init failed: %s\n", elf_errmsg(-1));
+    }
+    DEBUG_PRINT("Initialized libelf library.\n");
+}
+
+/*
+ * openElf:
+ *   Second half of every squashelf_open_*: parse the ELF and program
+ *   header count of an input whose fd/data fields are set. Frees in and
+ *   returns NULL on failure.
+ */
+static squashelf_t* openElf(struct squashelf* in, struct squashelf_stats* stats)
+{
+    uint64_t t = phaseStart(stats);
+    pthread_once(&libelfOnce, libelfInit);
+    t = phaseEnd(stats, SQUASHELF_PHASE_INIT, t);
+    if (!libelfReady) {
+        goto fail;
+    }
+
+    /* Create ELF descriptor over the whole input, or from the fd */
+    in->elf = in->data ? elf_memory((char*)in->data, in->size)
+                       : elf_begin(in->fd, ELF_C_READ, NULL);
+    if (!in->elf) {
+        fprintf(stderr, "elf_begin(input): %s\n", elf_errmsg(-1));
+        goto fail;
+    }
+    DEBUG_PRINT("Created ELF descriptor for input file.\n");
+
+    /* Determine 32- vs 64-bit ELF class */
+    in->elfClass = gelf_getclass(in->elf);
+    if (in->elfClass != ELFCLASS32 && in->elfClass != ELFCLASS64) {
+        fprintf(stderr, "Unsupported ELF class: %d\n", in->elfClass);
+        goto fail;
+    }
+    DEBUG_PRINT("Detected ELF class: %s\n",
+                in->elfClass == ELFCLASS32 ? "ELF32" : "ELF64");
+
+    /* Read the ELF header into a generic GElf_Ehdr */
+    if (!gelf_getehdr(in->elf, &in->ehdr)) {
+        fprintf(stderr, "gelf_getehdr: %s\n", elf_errmsg(-1));
+        goto fail;
+    }
+    DEBUG_PRINT("Read input ELF header. Program header count: %u\n",
+                in->ehdr.e_phnum);
+    in->pht = phtCodecFor(&in->ehdr);
+    if (!in->pht) {
+        fprintf(stderr, "Unsupported ELF data encoding: %d\n",
+                in->ehdr.e_ident[EI_DATA]);
+        goto fail;
+    }
+
+    /* Count how many program headers exist in the file */
+    if (elf_getphdrnum(in->elf, &in->phdrCount) != 0) {
+        fprintf(stderr, "elf_getphdrnum: %s\n", elf_errmsg(-1));
+        goto fail;
+    }
+    DEBUG_PRINT("Confirmed program header count: %zu\n", in->phdrCount);
+    phaseEnd(stats, SQUASHELF_PHASE_BEGIN, t);
+    return in;
+
+fail:
+    squashelf_close(in);
+    return NULL;
+}
+
+squashelf_t* squashelf_open_mem(const void* buf, size_t size,
+                                const struct squashelf_options* opts)
+{
+    (void)opts; /* nothing to choose for an input already in memory */
+    struct squashelf* in = calloc(1, sizeof(*in));
+    if (!in) {
+        perror("calloc input");
+        return NULL;
+    }
+    in->fd   = -1;
+    in->data = buf;
+    in->size = size;
+    DEBUG_PRINT("Using in-memory input (%zu bytes).\n", size);
+    return openElf(in, opts ? opts->stats : NULL);
+}
+
+squashelf_t* squashelf_open_fd(int fd, const struct squashelf_options* opts)
+{
+    struct squashelf_options defaults;
+    if (!opts) {
+        squashelf_options_init(&defaults);
+        opts = &defaults;
+    }
+
+    uint64_t t = phaseStart(opts->stats);
+
+    struct squashelf* in = calloc(1, sizeof(*in));
+    if (!in) {
+        perror("calloc input");
+        return NULL;
+    }
+    in->fd = fd;
+
+    /*
+     * Map regular-file inputs once so segment data can be handed to the
+     * writers directly from the page cache instead of being copied into a
+     * private buffer per segment. Falls back to pread if the mapping fails.
+     */
+    struct stat inputStat;
+    if (fstat(fd, &inputStat) != 0) {
+        perror("fstat inputFile");
+        free(in);
+        return NULL;
+    }
+    if (S_ISREG(inputStat.st_mode)) {
+        in->size = (uint64_t)inputStat.st_size;
+    }
+    int codec = S_ISREG(inputStat.st_mode) ? inputCodec(fd) : -1;
+    if (codec >= 0) {
+        /* Compressed inputs are always decoded into memory */
+        uint64_t tDecode = phaseEnd(opts->stats, SQUASHELF_PHASE_OPEN, t);
+        if (openCompressed(in, codec, in->size) != 0) {
+            squashelf_close(in);
+            return NULL;
+        }
+        phaseEnd(opts->stats, SQUASHELF_PHASE_DECODE, tDecode);
+        return openElf(in, opts->stats);
+    }
+    if (opts->useMmap && S_ISREG(inputStat.st_mode) && inputStat.st_size > 0) {
+        void* map = mmap(NULL, in->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            DEBUG_PRINT("mmap input failed (%s); falling back to pread.\n",
+                        strerror(errno));
+        }
+        else {
+            /* Payloads are copied out front to back during the write */
+            madvise(map, in->size, MADV_SEQUENTIAL);
+            in->data   = map;
+            in->mapped = true;
+            DEBUG_PRINT("Mapped input file (%lu bytes).\n", in->size);
+        }
+    }
+    phaseEnd(opts->stats, SQUASHELF_PHASE_OPEN, t);
+    return openElf(in, opts->stats);
+}
+
+squashelf_t* squashelf_open_file(const char* path,
+                                 const struct squashelf_options* opts)
+{
+    struct squashelf_stats* stats = opts ? opts->stats : NULL;
+    uint64_t                t     = phaseStart(stats);
+
+    /* Open input ELF file for reading */
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("open inputFile");
+        return NULL;
+    }
+    phaseEnd(stats, SQUASHELF_PHASE_OPEN, t);
+    DEBUG_PRINT("Opened input file: %s (fd: %d)\n", path, fd);
+
+    struct squashelf* in = squashelf_open_fd(fd, opts);
+    if (!in) {
+        close(fd);
+        return NULL;
+    }
+    in->ownsFd = true;
+    return in;
+}
+
+void squashelf_close(squashelf_t* in)
+{
+    if (!in) {
+        return;
+    }
+    elf_end(in->elf);
+    if (in->mapped) {
+        munmap((void*)in->data, in->size);
+    }
+    if (in->ownsFd) {
+        close(in->compressed ? in->compressed->fd : in->fd);
+    }
+    freeCompressed(in->compressed);
+    free(in->phdrs);
+    free(in);
+}
+
+/*
+ * readPhdrs:
+ *   Fill phdrs with the in->phdrCount program headers of the input,
+ *   decoded by in->pht straight from the input image, or after a single
+ *   pread of the table. Tables with an unusual entry size go through
+ *   gelf_getphdr.
+ */
+static int readPhdrs(const struct squashelf* in, GElf_Phdr* phdrs)
+{
+    size_t   count    = in->phdrCount;
+    size_t   entSize  = in->pht->entSize;
+    uint64_t tableEnd = in->ehdr.e_phoff + (uint64_t)count * entSize;
+
+    if (count == 0) {
+        return 0;
+    }
+    if (in->ehdr.e_phentsize != entSize || !in->size ||
+        in->ehdr.e_phoff > in->size || tableEnd > in->size) {
+        for (size_t i = 0; i < count; i++) {
+            if (!gelf_getphdr(in->elf, i, &phdrs[i])) {
+                fprintf(stderr, "gelf_getphdr[%zu]: %s\n", i, elf_errmsg(-1));
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    if (in->data) {
+        in->pht->decode(in->data + in->ehdr.e_phoff, count, phdrs);
+        return 0;
+    }
+    unsigned char* raw = malloc(count * entSize);
+    if (!raw) {
+        perror("malloc PHT");
+        return -1;
+    }
+    if (preadAll(in->fd, raw, count * entSize, in->ehdr.e_phoff) != 0) {
+        perror("pread PHT");
+        free(raw);
+        return -1;
+    }
+    in->pht->decode(raw, count, phdrs);
+    free(raw);
+    return 0;
+}
+
+/*
+ * trimZeroTail:
+ *   Cut the trailing zero bytes off a segment's file image. The loader
+ *   zero-fills p_filesz..p_memsz anyway, so the segment loads the same
+ *   while the zeros leave the output. Returns the bytes cut, or -1 on a
+ *   read error.
+ */
+static int64_t trimZeroTail(const struct squashelf* in, GElf_Phdr* seg)
+{
+    enum { CHUNK = 64 * 1024 };
+    unsigned char* buf = NULL;
+    uint64_t       end = seg->p_filesz; /* bytes before the zero tail */
+
+    if (!in->data && !(buf = malloc(CHUNK))) {
+        perror("malloc trim");
+        return -1;
+    }
+    while (end > 0) {
+        size_t               len = end < CHUNK ? (size_t)end : CHUNK;
+        const unsigned char* p;
+        if (in->data) {
+            p = in->data + seg->p_offset + end - len;
+        }
+        else {
+            if (preadAll(in->fd, buf, len, seg->p_offset + end - len) != 0) {
+                perror("pread trim");
+                free(buf);
+                return -1;
+            }
+            p = buf;
+        }
+        size_t zeros = zeroSuffix(p, len);
+        end -= zeros;
+        if (zeros < len) {
+            break;
+        }
+    }
+    free(buf);
+
+    int64_t cut   = (int64_t)(seg->p_filesz - end);
+    seg->p_filesz = end;
+    return cut;
+}
+
+squashelf_image_t* squashelf_select(squashelf_t*                    in,
+                                    const struct squashelf_options* opts)
+{
+    struct squashelf_options defaults;
+    if (!opts) {
+        squashelf_options_init(&defaults);
+        opts = &defaults;
+    }
+
+    struct squashelf_image* image  = calloc(1, sizeof(*image));
+    struct rangeSet         ranges = {0};
+    size_t*                 order  = NULL; /* PHT positions, to resolve */
+    if (!image) {
+        perror("calloc image");
+        return NULL;
+    }
+    image->in              = in;
+    image->opts            = *opts;
+    image->opts.ranges     = NULL; /* the caller's array may go away */
+    image->opts.rangeCount = 0;
+
+    /* Allocate array to hold all PT_LOAD entries */
+    image->phdrs = malloc((in->phdrCount ? in->phdrCount : 1) *
+                          sizeof(GElf_Phdr));
+    if (!image->phdrs) {
+        perror("malloc phdrs");
+        goto fail;
+    }
+
+    struct squashelf_stats* stats = opts->stats;
+    uint64_t                t     = phaseStart(stats);
+
+    /* Read the whole input PHT, then keep only the selected PT_LOAD
+       entries. It is decoded once per input and copied for later
+       selections. */
+    if (!in->phdrs) {
+        in->phdrs = malloc((in->phdrCount ? in->phdrCount : 1) *
+                           sizeof(GElf_Phdr));
+        if (!in->phdrs) {
+            perror("malloc input PHT");
+            goto fail;
+        }
+        if (readPhdrs(in, in->phdrs) != 0) {
+            free(in->phdrs);
+            in->phdrs = NULL;
+            goto fail;
+        }
+    }
+    memcpy(image->phdrs, in->phdrs, in->phdrCount * sizeof(GElf_Phdr));
+    t = phaseEnd(stats, SQUASHELF_PHASE_SCAN, t);
+
+    uint64_t payloadBytes = 0;
+    image->count          = in->phdrCount;
+    if (buildRangeSet(opts, &ranges) != 0 ||
+        filterSegments(opts, &ranges, in->size, &image->phdrs, &image->count,
+                       &payloadBytes) != 0) {
+        goto fail;
+    }
+    t = phaseEnd(stats, SQUASHELF_PHASE_FILTER, t);
+    DEBUG_PRINT("Found %zu PT_LOAD segments matching criteria.\n",
+                image->count);
+    if (image->count == 0) {
+        fprintf(stderr, "No PT_LOAD segments found\n");
+        goto fail;
+    }
+    if (stats) {
+        stats->segmentsScanned += in->phdrCount;
+        stats->segmentsKept    += image->count;
+        stats->payloadBytes    += payloadBytes;
+    }
+
+    /* Sort the loadable segments by their LMA (p_paddr) */
+    if (opts->overlap == SQUASHELF_OVERLAP_RESOLVE) {
+        order = malloc(image->count * sizeof(*order));
+        if (!order) {
+            perror("malloc PHT order");
+            goto fail;
+        }
+    }
+    if (sortPhdrs(&image->phdrs, image->count, order) != 0) {
+        goto fail;
+    }
+    t = phaseEnd(stats, SQUASHELF_PHASE_SORT, t);
+    DEBUG_PRINT("Sorted PT_LOAD segments by LMA.\n");
+
+    if (opts->overlap != SQUASHELF_OVERLAP_OFF) {
+        uint64_t found = 0;
+        if (checkOverlaps(opts, &image->phdrs, &image->count, order, &found) !=
+            0) {
+            goto fail;
+        }
+        t = phaseEnd(stats, SQUASHELF_PHASE_CHECK, t);
+        if (stats) {
+            stats->overlaps += found;
+        }
+    }
+
+    if (opts->planOnly && (opts->trimZeros ||
+                           opts->codec != SQUASHELF_CODEC_NONE)) {
+        fprintf(stderr, "Error: %s needs the segment data, so it cannot be "
+                        "planned\n",
+                opts->trimZeros ? "trimming zeros" : "compression");
+        goto fail;
+    }
+
+    /* Decode just the kept payloads of a compressed input */
+    if (in->compressed && !opts->planOnly) {
+        for (size_t i = 0; i < image->count; i++) {
+            if (inputFetch(in, image->phdrs[i].p_offset,
+                           image->phdrs[i].p_filesz) != 0) {
+                goto fail;
+            }
+        }
+        t = phaseEnd(stats, SQUASHELF_PHASE_DECODE, t);
+    }
+
+    if (opts->trimZeros) {
+        if (opts->format != SQUASHELF_FORMAT_ELF) {
+            fprintf(stderr, "Error: only ELF output can have zeros trimmed\n");
+            goto fail;
+        }
+        uint64_t trimmed = 0;
+        for (size_t i = 0; i < image->count; i++) {
+            int64_t cut = trimZeroTail(in, &image->phdrs[i]);
+            if (cut < 0) {
+                goto fail;
+            }
+            trimmed += (uint64_t)cut;
+        }
+        t = phaseEnd(stats, SQUASHELF_PHASE_FILTER, t);
+        DEBUG_PRINT("Trimmed %lu trailing zero bytes into bss\n", trimmed);
+        if (stats) {
+            stats->trimmedBytes += trimmed;
+        }
+    }
+    if (opts->sparse && (opts->format != SQUASHELF_FORMAT_ELF ||
+                         opts->codec != SQUASHELF_CODEC_NONE)) {
+        fprintf(stderr, "Error: only uncompressed ELF output can be sparse\n");
+        goto fail;
+    }
+
+    /* Compute where each segment's payload lands in the output file */
+    if (planLayout(in->elfClass, image->phdrs, &image->count, opts,
+                   &image->layout) != 0) {
+        goto fail;
+    }
+    if (image->opts.noSht && image->layout.shoff != 0) {
+        image->opts.noSht = 0; /* planLayout kept it for PN_XNUM */
+    }
+
+    image->outputSize = image->layout.fileSize;
+    if (opts->format != SQUASHELF_FORMAT_ELF) {
+        if (opts->codec != SQUASHELF_CODEC_NONE) {
+            fprintf(stderr, "Error: only ELF output can be compressed\n");
+            goto fail;
+        }
+        if (!checkFormat(image) ||
+            writeFormatted(image, -1, NULL, &image->outputSize) != 0) {
+            goto fail;
+        }
+        DEBUG_PRINT("%s output: %lu bytes\n", formatNames[opts->format],
+                    image->outputSize);
+    }
+    t = phaseEnd(stats, SQUASHELF_PHASE_LAYOUT, t);
+
+    if (opts->codec != SQUASHELF_CODEC_NONE) {
+        if (!squashelf_codec_available(opts->codec)) {
+            const char* name = squashelf_codec_name(opts->codec);
+            fprintf(stderr, "Error: squashelf was built without %s support\n",
+                    name ? name : "this codec's");
+            goto fail;
+        }
+        if (packImage(image) != 0) {
+            goto fail;
+        }
+        image->outputSize = image->packed.fileSize;
+        phaseEnd(stats, SQUASHELF_PHASE_COMPRESS, t);
+    }
+    free(ranges.ranges);
+    free(order);
+    return image;
+
+fail:
+    free(ranges.ranges);
+    free(order);
+    squashelf_image_free(image);
+    return NULL;
+}
+
+void squashelf_image_free(squashelf_image_t* image)
+{
+    if (!image) {
+        return;
+    }
+    for (size_t e = 0; image->packed.entries && e < image->layout.phnum;
+         e++) {
+        free(image->packed.entries[e].owned);
+    }
+    free(image->packed.entries);
+    freeLayout(&image->layout);
+    free(image->phdrs);
+    free(image);
+}
+
+/*
+ * libelfSections:
+ *   Whether squashelf_write_fd goes through libelf and leaves its
+ *   sections in the output: uncompressed ELF with an SHT. Sets *sections
+ *   to the number of those, one per non-empty payload.
+ */
+static bool libelfSections(const struct squashelf_image* image,
+                           size_t*                       sections)
+{
+    *sections = 0;
+    if (image->opts.format != SQUASHELF_FORMAT_ELF || image->packed.entries ||
+        image->opts.writer != SQUASHELF_WRITER_LIBELF || image->opts.noSht) {
+        return false;
+    }
+    for (size_t i = 0; i < image->count; i++) {
+        *sections += image->phdrs[i].p_filesz != 0;
+    }
+    return true;
+}
+
+/*
+ * writtenSize:
+ *   Size of the output squashelf_write_fd makes, and in *shtBytes (when
+ *   set) the section headers at its end. That is image->outputSize, what
+ *   squashelf_write_mem and the other writers produce with at most the
+ *   NULL section header, except that libelf's SHT after sectionEnd also
+ *   holds a header per section, framed by the NULL section 0 and the
+ *   empty one parked at dataEnd (see encodeUpdateFrame).
+ */
+static uint64_t writtenSize(const struct squashelf_image* image,
+                            uint64_t*                     shtBytes)
+{
+    const struct outputLayout* layout = &image->layout;
+    size_t                     sections;
+    uint64_t                   sht  = 0;
+    uint64_t                   size = image->outputSize;
+
+    if (libelfSections(image, &sections)) {
+        sht  = (sections + 2) * layout->shdrSize;
+        size = layout->sectionEnd + sht;
+    }
+    else if (image->opts.format == SQUASHELF_FORMAT_ELF &&
+             !image->opts.noSht) {
+        sht = layout->shdrSize;
+    }
+    if (shtBytes) {
+        *shtBytes = sht;
+    }
+    return size;
+}
+
+uint64_t squashelf_image_size(const squashelf_image_t* image)
+{
+    return writtenSize(image, NULL);
+}
+
+size_t squashelf_image_segments(const squashelf_image_t* image)
+{
+    return image->layout.phnum;
+}
+
+uint64_t squashelf_image_headers(const squashelf_image_t* image)
+{
+    return image->opts.format == SQUASHELF_FORMAT_ELF
+               ? image->layout.headerEnd
+               : 0;
+}
+
+uint64_t squashelf_image_sht(const squashelf_image_t* image)
+{
+    uint64_t sht;
+    writtenSize(image, &sht);
+    return sht;
+}
+
+int squashelf_image_entries(const squashelf_image_t* image,
+                            struct squashelf_entry*  entries)
+{
+    const struct outputLayout* layout = &image->layout;
+    int                        format = image->opts.format;
+
+    if (image->packed.entries) {
+        fprintf(stderr, "Error: compressed output has no plain layout\n");
+        errno = EINVAL;
+        return -1;
+    }
+    for (size_t e = 0; e < layout->phnum; e++) {
+        const GElf_Phdr* ph = &layout->pht[e];
+        entries[e]          = (struct squashelf_entry){
+            .lma    = ph->p_paddr,
+            .vma    = ph->p_vaddr,
+            .offset =
+                format == SQUASHELF_FORMAT_ELF ? layout->phtOffsets[e] : 0,
+            .size   = ph->p_filesz,
+            .memsz  = ph->p_memsz,
+            .flags  = ph->p_flags,
+        };
+    }
+
+    if (format == SQUASHELF_FORMAT_ELF) {
+        /* Payloads are in file order; a gap counts against the entry it
+           leads into, unless it lies inside a coalesced one */
+        uint64_t end  = layout->headerEnd;
+        size_t   prev = SIZE_MAX;
+        for (size_t i = 0; i < image->count; i++) {
+            size_t e = payloadEntry(layout, i);
+            if (image->phdrs[i].p_filesz == 0) {
+                continue;
+            }
+            if (e != prev) {
+                entries[e].padding += layout->offsets[i] - end;
+            }
+            end  = layout->offsets[i] + image->phdrs[i].p_filesz;
+            prev = e;
+        }
+    }
+    else if (format == SQUASHELF_FORMAT_BIN) {
+        /* LMA order, from the lowest LMA with data, gaps filled */
+        bool     first = true;
+        uint64_t base  = 0;
+        uint64_t end   = 0;
+        for (size_t e = 0; e < layout->phnum; e++) {
+            if (entries[e].size == 0) {
+                continue;
+            }
+            if (first) {
+                base  = entries[e].lma;
+                end   = base;
+                first = false;
+            }
+            entries[e].offset  = entries[e].lma - base;
+            entries[e].padding = entries[e].lma - end;
+            end                = entries[e].lma + entries[e].size;
+        }
+    }
+    return 0;
+}
+
+/*
+ * planned:
+ *   Whether image was selected with planOnly, and so cannot be written;
+ *   if so, says why.
+ */
+static bool planned(const struct squashelf_image* image)
+{
+    if (image->opts.planOnly) {
+        fprintf(stderr, "Error: a planOnly image cannot be written\n");
+        errno = EINVAL;
+        return true;
+    }
+    return false;
+}
+
+/*
+ * punchRange:
+ *   Punch a hole over len output bytes at offset and add them to
+ *   *punched. Returns 1, quietly, if the filesystem cannot punch holes.
+ */
+static int punchRange(int fd, uint64_t offset, uint64_t len,
+                      uint64_t* punched)
+{
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset,
+                  len) == 0) {
+        *punched += len;
+        return 0;
+    }
+    if (errno == EOPNOTSUPP || errno == ENOSYS) {
+        DEBUG_PRINT("Cannot punch holes in the output (%s)\n",
+                    strerror(errno));
+        return 1;
+    }
+    perror("fallocate output");
+    return -1;
+}
+
+/*
+ * punchZeroRuns:
+ *   Sparse output of the libelf writer, which writes every byte: punch
+ *   holes over the whole blocks of the padding before each payload and of
+ *   zeros in the payloads afterwards, adding their size to *punched. A
+ *   filesystem that cannot punch holes is left as it is.
+ */
+static int punchZeroRuns(const struct squashelf_image* image, int fd,
+                         uint64_t* punched)
+{
+    const struct squashelf*    in     = image->in;
+    const struct outputLayout* layout = &image->layout;
+    struct sparseSource*       src    = malloc(sizeof(*src));
+    uint64_t                   end    = layout->headerEnd; /* last payload */
+    int                        rc     = -1;
+    if (!src) {
+        perror("malloc sparse scan");
+        return -1;
+    }
+    sparseSourceInit(src, in->fd, in->data);
+
+    for (size_t i = 0; i < image->count; i++) {
+        const GElf_Phdr* seg = &image->phdrs[i];
+        uint64_t         padStart;
+        uint64_t         padEnd;
+        int              punch;
+        if (seg->p_filesz == 0) {
+            continue;
+        }
+        if (blockSpan(end, layout->offsets[i], &padStart, &padEnd) &&
+            (punch = punchRange(fd, padStart, padEnd - padStart, punched)) !=
+                0) {
+            rc = punch > 0 ? 0 : -1;
+            goto out;
+        }
+        end = layout->offsets[i] + seg->p_filesz;
+
+        for (uint64_t pos = 0; pos < seg->p_filesz;) {
+            uint64_t runStart;
+            uint64_t runEnd;
+            if (findZeroRun(src, seg->p_offset, layout->offsets[i], pos,
+                            seg->p_filesz, &runStart, &runEnd) != 0) {
+                goto out;
+            }
+            if (runEnd > runStart &&
+                (punch = punchRange(fd, layout->offsets[i] + runStart,
+                                    runEnd - runStart, punched)) != 0) {
+                rc = punch > 0 ? 0 : -1;
+                goto out;
+            }
+            pos = runEnd;
+        }
+    }
+    rc = 0;
+
+out:
+    free(src);
+    return rc;
+}
+
+int squashelf_write_fd(const squashelf_image_t* image, int fd)
+{
+    const struct squashelf* in    = image->in;
+    struct squashelf_stats* stats = image->opts.stats;
+    uint64_t                t     = phaseStart(stats);
+    uint64_t                holes = 0; /* sparse output bytes not written */
+    int                     rc;
+
+    if (planned(image)) {
+        return -1;
+    }
+    if (image->opts.format != SQUASHELF_FORMAT_ELF) {
+        rc = writeFormatted(image, fd, NULL, NULL);
+        phaseEnd(stats, SQUASHELF_PHASE_WRITE, t);
+    }
+    else if (image->packed.entries) {
+        rc = writePacked(image, fd, NULL);
+        phaseEnd(stats, SQUASHELF_PHASE_WRITE, t);
+    }
+    else if (image->opts.writer == SQUASHELF_WRITER_LIBELF) {
+        rc = writeLibelf(image, fd); /* times its own phases */
+        if (rc == 0 && image->opts.sparse) {
+            t  = phaseStart(stats);
+            rc = punchZeroRuns(image, fd, &holes);
+            phaseEnd(stats, SQUASHELF_PHASE_WRITE, t);
+        }
+    }
+    else {
+        /* A memory input has no fd for the in-kernel engines to read from */
+        enum squashelf_copy engine =
+            in->fd < 0 ? SQUASHELF_COPY_BUFFERED : image->opts.copyStart;
+        rc = writeDirect(fd, in->fd, in->data, &in->ehdr, image->phdrs,
+                         image->count, image->opts.noSht, &image->layout,
+                         engine, image->opts.jobs,
+                         image->opts.writer == SQUASHELF_WRITER_URING &&
+                             !image->opts.sparse,
+                         image->opts.sparse, &holes, stats);
+        phaseEnd(stats, SQUASHELF_PHASE_WRITE, t);
+        if (rc == 0) {
+            DEBUG_PRINT("Wrote output directly. Final size: %lu bytes\n",
+                        image->layout.fileSize);
+        }
+    }
+    if (rc == 0 && image->opts.sparse) {
+        DEBUG_PRINT("Sparse output: %lu zero bytes left as holes\n", holes);
+    }
+    if (rc == 0 && stats) {
+        stats->outputBytes += writtenSize(image, NULL);
+        stats->sparseBytes += holes;
+    }
+    return rc;
+}
+
+/* Bytes of segment data digested per step */
+#define DIGEST_CHUNK (1UL << 20)
+
+static const unsigned char digestZeroBlock[64 << 10];
+
+/*
+ * digestZeros:
+ *   Add len zero bytes (the padding inside a coalesced entry).
+ */
+static void digestZeros(struct digestState* st, uint64_t len)
+{
+    while (len > 0) {
+        size_t chunk = len < sizeof(digestZeroBlock) ? len
+                                                     : sizeof(digestZeroBlock);
+        digestUpdate(st, digestZeroBlock, chunk);
+        len -= chunk;
+    }
+}
+
+/* Work list shared by the digest threads */
+struct digestPool {
+    const struct squashelf_image* image;
+    struct squashelf_digest*      digests;
+    const size_t*   first;  /* first payload of each PHT entry */
+    size_t          next;   /* index of the next unclaimed entry */
+    int             failed;
+    pthread_mutex_t lock;
+};
+
+/*
+ * digestEntry:
+ *   Digest the file bytes of PHT entry e, whose payloads start at index
+ *   first: each payload, read from the input mapping or with pread into
+ *   buf (DIGEST_CHUNK bytes), and the zeros between them.
+ */
+static int digestEntry(const struct squashelf_image* image, size_t e,
+                       size_t first, unsigned char* buf,
+                       struct squashelf_digest* out)
+{
+    const struct squashelf*    in     = image->in;
+    const struct outputLayout* layout = &image->layout;
+    const GElf_Phdr*           entry  = &layout->pht[e];
+    uint64_t                   end    = layout->phtOffsets[e] + entry->p_filesz;
+    uint64_t                   pos    = layout->phtOffsets[e];
+    struct digestState         st;
+
+    digestInit(&st);
+    for (size_t i = first;
+         i < image->count && payloadEntry(layout, i) == e; i++) {
+        const GElf_Phdr* seg = &image->phdrs[i];
+        if (seg->p_filesz == 0) {
+            continue;
+        }
+        digestZeros(&st, layout->offsets[i] - pos);
+        for (uint64_t done = 0; done < seg->p_filesz;) {
+            uint64_t left  = seg->p_filesz - done;
+            size_t   chunk = left < DIGEST_CHUNK ? left : DIGEST_CHUNK;
+            if (in->data) {
+                digestUpdate(&st, in->data + seg->p_offset + done, chunk);
+            }
+            else if (preadAll(in->fd, buf, chunk, seg->p_offset + done) == 0) {
+                digestUpdate(&st, buf, chunk);
+            }
+            else {
+                perror("pread segment data");
+                return -1;
+            }
+            done += chunk;
+        }
+        pos = layout->offsets[i] + seg->p_filesz;
+    }
+    digestZeros(&st, end - pos);
+
+    out->lma    = entry->p_paddr;
+    out->vma    = entry->p_vaddr;
+    out->offset = image->packed.entries ? image->packed.entries[e].offset
+                                        : layout->phtOffsets[e];
+    out->size   = entry->p_filesz;
+    out->memsz  = entry->p_memsz;
+    out->flags  = entry->p_flags;
+    digestFinish(&st, &out->crc32, out->sha256);
+    return 0;
+}
+
+/*
+ * digestWorker:
+ *   Digest thread: claim PHT entries until the list is drained or one
+ *   fails.
+ */
+static void* digestWorker(void* arg)
+{
+    struct digestPool* pool = arg;
+    unsigned char*     buf  = NULL;
+    if (!pool->image->in->data && !(buf = malloc(DIGEST_CHUNK))) {
+        perror("malloc digest buffer");
+        pthread_mutex_lock(&pool->lock);
+        pool->failed = 1;
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
+    }
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        size_t e = pool->failed ? pool->image->layout.phnum : pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (e >= pool->image->layout.phnum) {
+            break;
+        }
+        if (digestEntry(pool->image, e, pool->first[e], buf,
+                        &pool->digests[e]) != 0) {
+            pthread_mutex_lock(&pool->lock);
+            pool->failed = 1;
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+/*
+ * digestRun:
+ *   Fill digests for every PHT entry of the image on opts.jobs threads.
+ *   With fd >= 0 the output is written to it at the same time (at least
+ *   one digest thread then runs beside the write), so the segments are
+ *   hashed while they are copied instead of by reading the output again.
+ *   The digest phase is the time not hidden behind the write.
+ */
+static int digestRun(const struct squashelf_image* image, int fd,
+                     struct squashelf_digest* digests)
+{
+    struct squashelf_stats* stats   = image->opts.stats;
+    size_t                  threads = image->opts.jobs > 1
+                                          ? (size_t)image->opts.jobs
+                                          : fd >= 0;
+    struct digestPool       pool    = {.image   = image,
+                                       .digests = digests,
+                                       .lock    = PTHREAD_MUTEX_INITIALIZER};
+    pthread_t*              tids    = NULL;
+    size_t*                 first   = entryPayloads(image);
+    int                     rc      = -1;
+
+    if (!first || (threads && !(tids = calloc(threads, sizeof(*tids))))) {
+        perror("malloc digest pool");
+        free(first);
+        return -1;
+    }
+    pool.first = first;
+
+    size_t started = 0;
+    for (; started < threads; started++) {
+        if (pthread_create(&tids[started], NULL, digestWorker, &pool) != 0) {
+            break;
+        }
+    }
+    int writeRc = fd >= 0 ? squashelf_write_fd(image, fd) : 0;
+    uint64_t t  = phaseStart(stats);
+    if (started == 0) {
+        digestWorker(&pool); /* no threads at all: digest inline */
+    }
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    phaseEnd(stats, SQUASHELF_PHASE_DIGEST, t);
+    if (writeRc == 0 && !pool.failed) {
+        rc = 0;
+    }
+
+    free(tids);
+    free(first);
+    return rc;
+}
+
+int squashelf_digest_image(const squashelf_image_t* image,
+                           struct squashelf_digest* digests)
+{
+    return planned(image) ? -1 : digestRun(image, -1, digests);
+}
+
+int squashelf_write_fd_digests(const squashelf_image_t* image, int fd,
+                               struct squashelf_digest* digests)
+{
+    return planned(image) ? -1 : digestRun(image, fd, digests);
+}
+
+/* Bytes compared per read when checking an earlier output */
+#define UPDATE_CHUNK (1UL << 20)
+
+/*
+ * rangeMatches:
+ *   Compare the len bytes at offset of fd with what should be there:
+ *   expect if set, else the bytes at srcOffset of srcFd if that is open,
+ *   else zeros. buf holds 2 * UPDATE_CHUNK bytes. Returns 1 if they are
+ *   equal, 0 if not and -1 on a read error.
+ */
+static int rangeMatches(int fd, uint64_t offset, uint64_t len,
+                        const unsigned char* expect, int srcFd,
+                        uint64_t srcOffset, unsigned char* buf)
+{
+    unsigned char* want = buf + UPDATE_CHUNK;
+    for (uint64_t done = 0; done < len;) {
+        size_t chunk = len - done < UPDATE_CHUNK ? len - done : UPDATE_CHUNK;
+        if (preadAll(fd, buf, chunk, offset + done) != 0) {
+            return -1;
+        }
+        const unsigned char* cmp = want;
+        if (expect) {
+            cmp = expect + done;
+        }
+        else if (srcFd >= 0) {
+            if (preadAll(srcFd, want, chunk, srcOffset + done) != 0) {
+                return -1;
+            }
+        }
+        else {
+            memset(want, 0, chunk);
+        }
+        if (memcmp(buf, cmp, chunk) != 0) {
+            return 0;
+        }
+        done += chunk;
+    }
+    return 1;
+}
+
+/*
+ * encodeUpdateFrame:
+ *   Encode what a full ELF write of the image puts around the payloads:
+ *   the headers (layout->headerEnd bytes) and everything after the last
+ *   payload (tailSize bytes from layout->dataEnd). With an SHT the libelf
+ *   writer leaves one section per non-empty payload in it, framed by the
+ *   NULL section 0 and the empty one parked at dataEnd.
+ */
+static int encodeUpdateFrame(const struct squashelf_image* image,
+                             bool libelfSht, size_t sections,
+                             unsigned char* headers, unsigned char* tail)
+{
+    const struct squashelf*    in       = image->in;
+    const struct outputLayout* layout   = &image->layout;
+    unsigned                   encoding = in->ehdr.e_ident[EI_DATA];
+
+    if (encodeOutputHeaders(&in->ehdr, image->opts.noSht, layout, headers) !=
+        0) {
+        return -1;
+    }
+    if (!libelfSht) {
+        /* zero padding, then the NULL SHT if any */
+        return image->opts.noSht
+                   ? 0
+                   : encodeNullShdr(&in->ehdr, layout,
+                                    tail + (layout->shoff - layout->dataEnd));
+    }
+
+    /* libelf moves a section count past SHN_LORESERVE into sh_size of
+       section 0, as it does a PN_XNUM program header count into sh_info */
+    GElf_Ehdr ehdr;
+    GElf_Shdr first = {0};
+    buildOutputEhdr(&in->ehdr, 0, layout, &ehdr);
+    if (sections + 2 < SHN_LORESERVE) {
+        ehdr.e_shnum = sections + 2;
+    }
+    else {
+        ehdr.e_shnum  = 0;
+        first.sh_size = sections + 2;
+    }
+    if (layout->phnum >= PN_XNUM) {
+        first.sh_info = layout->phnum;
+    }
+    if (encodeEhdr(&ehdr, headers) != 0) {
+        fprintf(stderr, "encode ELF header: %s\n", elf_errmsg(-1));
+        return -1;
+    }
+
+    unsigned char* sht = tail + (layout->sectionEnd - layout->dataEnd);
+    size_t         k   = 1;
+    if (encodeShdr(in->elfClass, encoding, &first, sht) != 0) {
+        fprintf(stderr, "encode shdr[0]: %s\n", elf_errmsg(-1));
+        return -1;
+    }
+    for (size_t i = 0; i < image->count; i++) {
+        if (image->phdrs[i].p_filesz == 0) {
+            continue;
+        }
+        GElf_Shdr sh = {.sh_offset = layout->offsets[i],
+                        .sh_size   = image->phdrs[i].p_filesz};
+        if (encodeShdr(in->elfClass, encoding, &sh,
+                       sht + k++ * layout->shdrSize) != 0) {
+            fprintf(stderr, "encode shdr[%zu]: %s\n", k - 1, elf_errmsg(-1));
+            return -1;
+        }
+    }
+    GElf_Shdr parked = {.sh_offset = layout->dataEnd};
+    if (encodeShdr(in->elfClass, encoding, &parked,
+                   sht + k * layout->shdrSize) != 0) {
+        fprintf(stderr, "encode shdr[%zu]: %s\n", k, elf_errmsg(-1));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * encodeFrame:
+ *   Allocate and encode the frame of the image's ELF output, for the
+ *   writer it selects: *headers gets layout->headerEnd bytes, *tail the
+ *   bytes from layout->dataEnd to *fileSize, the end of the file. The
+ *   caller frees both, also on failure.
+ */
+static int encodeFrame(const struct squashelf_image* image,
+                       unsigned char** headers, unsigned char** tail,
+                       uint64_t* fileSize)
+{
+    const struct outputLayout* layout    = &image->layout;
+    size_t                     sections;
+    bool                       libelfSht = libelfSections(image, &sections);
+
+    *fileSize = writtenSize(image, NULL);
+    *headers  = calloc(1, layout->headerEnd);
+    *tail     = calloc(1, *fileSize - layout->dataEnd + 1);
+    if (!*headers || !*tail) {
+        perror("malloc output frame");
+        return -1;
+    }
+    return encodeUpdateFrame(image, libelfSht, sections, *headers, *tail);
+}
+
+int squashelf_update_fd(const squashelf_image_t* image, int fd,
+                        size_t* rewritten)
+{
+    const struct squashelf*    in       = image->in;
+    const struct outputLayout* layout   = &image->layout;
+    struct squashelf_stats*    stats    = image->opts.stats;
+    uint64_t                   t        = phaseStart(stats);
+    unsigned char*             headers  = NULL;
+    unsigned char*             tail     = NULL;
+    unsigned char*             buf      = NULL;
+    uint64_t                   fileSize = 0;
+    uint64_t                   written  = 0;
+    int                        rc       = -1;
+    struct stat                st;
+
+    *rewritten = 0;
+    if (planned(image)) {
+        return -1;
+    }
+    if (image->opts.format != SQUASHELF_FORMAT_ELF || image->packed.entries) {
+        DEBUG_PRINT("In-place update needs uncompressed ELF output; "
+                    "rewriting in full\n");
+        return 1;
+    }
+    if (fstat(fd, &st) != 0) {
+        perror("fstat output");
+        return -1;
+    }
+    if (encodeFrame(image, &headers, &tail, &fileSize) != 0) {
+        goto out;
+    }
+    if ((uint64_t)st.st_size != fileSize) {
+        DEBUG_PRINT("Output size changes (%lu -> %lu bytes); rewriting in "
+                    "full\n",
+                    (uint64_t)st.st_size, fileSize);
+        rc = 1;
+        goto out;
+    }
+    if (!(buf = malloc(2 * UPDATE_CHUNK))) {
+        perror("malloc update buffers");
+        goto out;
+    }
+    uint64_t tailSize = fileSize - layout->dataEnd;
+
+    /* Everything but the payloads has to be what a full write would
+       produce, or the layout changed */
+    int      same = rangeMatches(fd, 0, layout->headerEnd, headers, -1, 0, buf);
+    uint64_t pos  = layout->headerEnd;
+    for (size_t i = 0; same == 1 && i < image->count; i++) {
+        if (image->phdrs[i].p_filesz == 0) {
+            continue;
+        }
+        same = rangeMatches(fd, pos, layout->offsets[i] - pos, NULL, -1, 0,
+                            buf);
+        pos  = layout->offsets[i] + image->phdrs[i].p_filesz;
+    }
+    if (same == 1) {
+        same = rangeMatches(fd, layout->dataEnd, tailSize, tail, -1, 0, buf);
+    }
+    if (same < 0) {
+        perror("read output");
+        goto out;
+    }
+    if (same == 0) {
+        DEBUG_PRINT("Output layout changes; rewriting in full\n");
+        rc = 1;
+        goto out;
+    }
+
+    /* Then rewrite only the payloads that differ */
+    enum squashelf_copy engine =
+        in->fd < 0 ? SQUASHELF_COPY_BUFFERED : image->opts.copyStart;
+    for (size_t i = 0; i < image->count; i++) {
+        const GElf_Phdr* seg = &image->phdrs[i];
+        if (seg->p_filesz == 0) {
+            continue;
+        }
+        same = rangeMatches(fd, layout->offsets[i], seg->p_filesz,
+                            in->data ? in->data + seg->p_offset : NULL,
+                            in->data ? -1 : in->fd, seg->p_offset, buf);
+        if (same < 0) {
+            perror("compare segment data");
+            goto out;
+        }
+        if (same) {
+            continue;
+        }
+        if (copySegment(&engine, in->fd, in->data, seg->p_offset, fd,
+                        layout->offsets[i], seg->p_filesz, false) != 0) {
+            fprintf(stderr, "Error: copying segment %zu failed\n", i);
+            goto out;
+        }
+        DEBUG_PRINT("  Segment %zu (LMA 0x%lx): rewrote 0x%lx bytes at "
+                    "0x%lx\n",
+                    i, seg->p_paddr, seg->p_filesz, layout->offsets[i]);
+        (*rewritten)++;
+        written += seg->p_filesz;
+    }
+    rc = 0;
+    if (stats) {
+        stats->outputBytes += written;
+    }
+
+out:
+    free(headers);
+    free(tail);
+    free(buf);
+    phaseEnd(stats, SQUASHELF_PHASE_WRITE, t);
+    return rc;
+}
+
+/* Most output bytes one verify task compares */
+#define VERIFY_CHUNK (4UL << 20)
+
+/* Bytes located at a time after memcmp found a chunk to differ */
+#define VERIFY_BLOCK 4096
+
+/* A stretch of the output and what it has to hold */
+struct verifySpan {
+    uint64_t             offset;    /* in the output */
+    size_t               len;       /* at most VERIFY_CHUNK */
+    const unsigned char* expect;    /* these bytes, if set */
+    bool                 fromInput; /* else the input's from source */
+    uint64_t             source;
+    size_t               segment;   /* for fromInput: index in phdrs */
+    unsigned char        fill;      /* else len copies of fill */
+    const char*          what;      /* for the report */
+};
+
+/* Spans of one verify run, claimed in output order by its threads */
+struct verifyPool {
+    const struct squashelf_image* image;
+    const unsigned char*          output; /* the mapped output */
+    struct verifySpan*            spans;
+    size_t                        count;
+    size_t                        next;   /* first unclaimed span */
+    uint64_t                      first;  /* lowest differing offset */
+    size_t                        where;  /* its span */
+    int                           failed;
+    pthread_mutex_t               lock;
+};
+
+/*
+ * addVerifySpans:
+ *   Append the len bytes from offset in the output that span describes,
+ *   cut into VERIFY_CHUNK pieces so large payloads and gaps are shared
+ *   out among the threads.
+ */
+static int addVerifySpans(struct verifySpan** spans, size_t* count,
+                          size_t* capacity, uint64_t offset, uint64_t len,
+                          const struct verifySpan* span)
+{
+    for (uint64_t done = 0; done < len;) {
+        if (*count == *capacity) {
+            size_t             grown = *capacity ? 2 * *capacity : 64;
+            struct verifySpan* more  = realloc(*spans, grown * sizeof(*more));
+            if (!more) {
+                perror("realloc verify spans");
+                return -1;
+            }
+            *spans    = more;
+            *capacity = grown;
+        }
+        struct verifySpan* piece = &(*spans)[(*count)++];
+        *piece                   = *span;
+        piece->offset            = offset + done;
+        piece->len    = len - done < VERIFY_CHUNK ? len - done : VERIFY_CHUNK;
+        piece->expect = span->expect ? span->expect + done : NULL;
+        piece->source = span->source + done;
+        done += piece->len;
+    }
+    return 0;
+}
+
+/*
+ * verifySpans:
+ *   The spans an uncompressed ELF (headers and trailer from encodeFrame)
+ *   or bin output of the image is made of, in output order. The padding
+ *   between ELF payloads is zeros, the gaps in bin output gapFill.
+ */
+static int verifySpans(const struct squashelf_image* image,
+                       const unsigned char* headers, const unsigned char* tail,
+                       uint64_t fileSize, struct verifySpan** spans,
+                       size_t* count)
+{
+    const struct outputLayout* layout   = &image->layout;
+    bool                       elf      = image->opts.format ==
+                                          SQUASHELF_FORMAT_ELF;
+    size_t                     capacity = 0;
+    bool                       first    = true;
+    uint64_t                   pos      = 0;
+    uint64_t                   lmaEnd   = 0;
+
+    *spans = NULL;
+    *count = 0;
+    if (elf) {
+        struct verifySpan frame = {.expect = headers, .what = "headers"};
+        if (addVerifySpans(spans, count, &capacity, 0, layout->headerEnd,
+                           &frame) != 0) {
+            return -1;
+        }
+        pos = layout->headerEnd;
+    }
+    for (size_t i = 0; i < image->count; i++) {
+        const GElf_Phdr* seg = &image->phdrs[i];
+        if (seg->p_filesz == 0) {
+            continue;
+        }
+        uint64_t          at  = elf     ? layout->offsets[i]
+                                : first ? pos
+                                        : pos + seg->p_paddr - lmaEnd;
+        struct verifySpan gap = {.fill = elf ? 0 : image->opts.gapFill,
+                                 .what = elf ? "padding" : "gap fill"};
+        struct verifySpan payload = {.fromInput = true,
+                                     .source    = seg->p_offset,
+                                     .segment   = i,
+                                     .what      = "segment data"};
+        if (addVerifySpans(spans, count, &capacity, pos, at - pos, &gap) != 0 ||
+            addVerifySpans(spans, count, &capacity, at, seg->p_filesz,
+                           &payload) != 0) {
+            return -1;
+        }
+        first  = false;
+        pos    = at + seg->p_filesz;
+        lmaEnd = seg->p_paddr + seg->p_filesz;
+    }
+    if (elf) {
+        struct verifySpan trailer = {.expect = tail,
+                                     .what   = "section headers"};
+        if (addVerifySpans(spans, count, &capacity, layout->dataEnd,
+                           fileSize - layout->dataEnd, &trailer) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * firstDiff:
+ *   Index of the first of len bytes where have and want differ, or len.
+ *   One memcmp (vectorised in any current libc) settles the common case
+ *   of a match; only a chunk that differs is searched, block by block.
+ */
+static size_t firstDiff(const unsigned char* have, const unsigned char* want,
+                        size_t len)
+{
+    if (memcmp(have, want, len) == 0) {
+        return len;
+    }
+    size_t pos = 0;
+    while (len - pos > VERIFY_BLOCK &&
+           memcmp(have + pos, want + pos, VERIFY_BLOCK) == 0) {
+        pos += VERIFY_BLOCK;
+    }
+    while (have[pos] == want[pos]) {
+        pos++;
+    }
+    return pos;
+}
+
+/*
+ * firstNotFill:
+ *   Index of the first of len bytes that is not fill, or len. Comparing
+ *   the bytes with themselves one further on keeps this a memcmp too.
+ */
+static size_t firstNotFill(const unsigned char* have, unsigned char fill,
+                           size_t len)
+{
+    if (len == 0 ||
+        (have[0] == fill && memcmp(have, have + 1, len - 1) == 0)) {
+        return len;
+    }
+    size_t pos = 0;
+    while (have[pos] == fill) {
+        pos++;
+    }
+    return pos;
+}
+
+/*
+ * verifyWorker:
+ *   Verify thread: claim spans in output order and compare each with
+ *   what it has to hold, until they are all claimed, one fails, or the
+ *   rest all lie past a difference already found.
+ */
+static void* verifyWorker(void* arg)
+{
+    struct verifyPool*      pool = arg;
+    const struct squashelf* in   = pool->image->in;
+    unsigned char*          buf  = NULL;
+    if (!in->data && !(buf = malloc(VERIFY_CHUNK))) {
+        perror("malloc verify buffer");
+        pthread_mutex_lock(&pool->lock);
+        pool->failed = 1;
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
+    }
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        size_t s = pool->failed ? pool->count : pool->next++;
+        bool   stop = s >= pool->count || pool->spans[s].offset > pool->first;
+        pthread_mutex_unlock(&pool->lock);
+        if (stop) {
+            break;
+        }
+
+        const struct verifySpan* span = &pool->spans[s];
+        const unsigned char*     have = pool->output + span->offset;
+        size_t                   diff;
+        if (span->expect) {
+            diff = firstDiff(have, span->expect, span->len);
+        }
+        else if (!span->fromInput) {
+            diff = firstNotFill(have, span->fill, span->len);
+        }
+        else if (in->data) {
+            diff = firstDiff(have, in->data + span->source, span->len);
+        }
+        else if (preadAll(in->fd, buf, span->len, span->source) == 0) {
+            diff = firstDiff(have, buf, span->len);
+        }
+        else {
+            perror("pread segment data");
+            pthread_mutex_lock(&pool->lock);
+            pool->failed = 1;
+            pthread_mutex_unlock(&pool->lock);
+            continue;
+        }
+        if (diff < span->len) {
+            pthread_mutex_lock(&pool->lock);
+            if (span->offset + diff < pool->first) {
+                pool->first = span->offset + diff;
+                pool->where = s;
+            }
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+int squashelf_verify_fd(const squashelf_image_t* image, int fd,
+                        uint64_t* mismatch)
+{
+    struct squashelf_stats* stats    = image->opts.stats;
+    uint64_t                t        = phaseStart(stats);
+    unsigned char*          headers  = NULL;
+    unsigned char*          tail     = NULL;
+    uint64_t                fileSize = writtenSize(image, NULL);
+    void*                   map      = MAP_FAILED;
+    pthread_t*              tids     = NULL;
+    size_t                  started  = 0;
+    struct verifyPool       pool     = {.image = image,
+                                        .first = UINT64_MAX,
+                                        .lock  = PTHREAD_MUTEX_INITIALIZER};
+    int                     rc       = -1;
+    struct stat             st;
+
+    if (mismatch) {
+        *mismatch = UINT64_MAX;
+    }
+    if (planned(image)) {
+        return -1;
+    }
+    if ((image->opts.format != SQUASHELF_FORMAT_ELF &&
+         image->opts.format != SQUASHELF_FORMAT_BIN) ||
+        image->packed.entries) {
+        fprintf(stderr, "Error: only uncompressed ELF and bin output can be "
+                        "verified\n");
+        errno = EINVAL;
+        return -1;
+    }
+    if (image->opts.format == SQUASHELF_FORMAT_ELF &&
+        encodeFrame(image, &headers, &tail, &fileSize) != 0) {
+        goto out;
+    }
+    if (verifySpans(image, headers, tail, fileSize, &pool.spans,
+                    &pool.count) != 0) {
+        goto out;
+    }
+    if (fstat(fd, &st) != 0) {
+        perror("fstat output");
+        goto out;
+    }
+    if ((uint64_t)st.st_size != fileSize) {
+        fprintf(stderr, "Error: output is %lu bytes, expected %lu\n",
+                (uint64_t)st.st_size, fileSize);
+        if (mismatch) {
+            *mismatch = (uint64_t)st.st_size < fileSize ? (uint64_t)st.st_size
+                                                        : fileSize;
+        }
+        rc = 1;
+        goto out;
+    }
+    if (fileSize &&
+        (map = mmap(NULL, fileSize, PROT_READ, MAP_SHARED, fd, 0)) ==
+            MAP_FAILED) {
+        perror("mmap output");
+        goto out;
+    }
+    pool.output = map;
+
+    /* One thread per span at most; with none started, verify inline */
+    long   cpus    = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t threads = image->opts.jobs > 1 ? (size_t)image->opts.jobs
+                     : cpus > 1           ? (size_t)cpus
+                                          : 1;
+    if (threads > pool.count) {
+        threads = pool.count;
+    }
+    if (threads > 1 && !(tids = calloc(threads, sizeof(*tids)))) {
+        perror("malloc verify pool");
+        goto out;
+    }
+    for (; threads > 1 && started < threads; started++) {
+        if (pthread_create(&tids[started], NULL, verifyWorker, &pool) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        verifyWorker(&pool);
+    }
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    if (pool.failed) {
+        goto out;
+    }
+    rc = 0;
+    if (pool.first != UINT64_MAX) {
+        const struct verifySpan* span = &pool.spans[pool.where];
+        if (span->fromInput) {
+            const GElf_Phdr* seg  = &image->phdrs[span->segment];
+            uint64_t         into = span->source + (pool.first - span->offset) -
+                                    seg->p_offset;
+            fprintf(stderr, "Error: output differs from the input at offset "
+                            "0x%lx: LMA 0x%lx, input offset 0x%lx\n",
+                    pool.first, seg->p_paddr + into, seg->p_offset + into);
+        }
+        else {
+            fprintf(stderr, "Error: output differs at offset 0x%lx, in the "
+                            "%s\n",
+                    pool.first, span->what);
+        }
+        if (mismatch) {
+            *mismatch = pool.first;
+        }
+        rc = 1;
+    }
+    else {
+        DEBUG_PRINT("Verified %lu output bytes on %zu threads\n", fileSize,
+                    started ? started : 1);
+    }
+
+out:
+    if (map != MAP_FAILED) {
+        munmap(map, fileSize);
+    }
+    free(tids);
+    free(pool.spans);
+    free(headers);
+    free(tail);
+    phaseEnd(stats, SQUASHELF_PHASE_VERIFY, t);
+    return rc;
+}
+
+int squashelf_write_mem(const squashelf_image_t* image,
+                        squashelf_arena_t* arena, void** buf, size_t* size)
+{
+    uint64_t       need = image->outputSize;
+    unsigned char* out;
+
+    if (planned(image)) {
+        return -1;
+    }
+    if (need > SIZE_MAX) {
+        errno = EFBIG;
+        return -1;
+    }
+    if (arena) {
+        out = arenaAlloc(arena, need);
+        if (!out) {
+            perror("allocate output buffer");
+            return -1;
+        }
+    }
+    else {
+        if (!*buf || *size < need) {
+            *size = need; /* let the caller retry with a big enough buffer */
+            errno = ENOSPC;
+            return -1;
+        }
+        out = *buf;
+    }
+
+    struct squashelf_stats* stats = image->opts.stats;
+    uint64_t                t     = phaseStart(stats);
+    if (image->opts.format != SQUASHELF_FORMAT_ELF) {
+        if (writeFormatted(image, -1, out, NULL) != 0) {
+            return -1;
+        }
+    }
+    else if (image->packed.entries) {
+        if (writePacked(image, -1, out) != 0) {
+            return -1;
+        }
+    }
+    else if (writeMem(image, out) != 0) {
+        return -1;
+    }
+    phaseEnd(stats, SQUASHELF_PHASE_WRITE, t);
+    if (stats) {
+        stats->outputBytes += need;
+    }
+    *buf  = out;
+    *size = need;
+    return 0;
+}
@@ -0,0 +1,418 @@
+/*
+ * libsquashelf: the squashelf core as a C library.
+ *
+ * Typical use:
+ *
+ *   struct squashelf_options opts;
+ *   squashelf_options_init(&opts);
+ *   opts.noSht = 1;
+ *
+ *   squashelf_t*       in  = squashelf_open_mem(buf, size, &opts);
+ *   squashelf_image_t* img = squashelf_select(in, &opts);
+ *   squashelf_write_fd(img, fd);          (or squashelf_write_mem)
+ *   squashelf_image_free(img);
+ *   squashelf_close(in);
+ *
+ * One input can be selected several times (e.g. once per LMA range); an
+ * image stays valid until it is freed or its input is closed. Separate
+ * handles may be used from separate threads, and images of one input
+ * may be written from several threads at once, but opening and
+ * selecting from one input must not run concurrently. Diagnostics are
+ * printed to stderr, like the command-line tool does.
+ */
+#ifndef LIBSQUASHELF_H
+#define LIBSQUASHELF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Output backends */
+enum squashelf_writer {
+    SQUASHELF_WRITER_LIBELF, /* build the output through libelf's ELF_C_WRITE */
+    SQUASHELF_WRITER_DIRECT, /* compute the layout here and pwritev the file */
+    SQUASHELF_WRITER_URING,  /* direct, with payloads batched on an io_uring */
+    SQUASHELF_WRITER_COUNT,
+};
+
+/*
+ * Segment copy engines used by the direct writer, in fallback order: each
+ * one that turns out to be unsupported for the given pair of files hands
+ * over to the next.
+ */
+enum squashelf_copy {
+    SQUASHELF_COPY_FILE_RANGE, /* in-kernel copy, reflinks where supported */
+    SQUASHELF_COPY_SENDFILE,   /* in-kernel copy through the page cache */
+    SQUASHELF_COPY_BUFFERED,   /* pwrite from memory, or pread+pwrite */
+    SQUASHELF_COPY_COUNT,
+};
+
+/* Output file formats */
+enum squashelf_format {
+    SQUASHELF_FORMAT_ELF,  /* squashed ELF (the writer option applies) */
+    SQUASHELF_FORMAT_BIN,  /* flat image from the lowest LMA, gaps filled */
+    SQUASHELF_FORMAT_IHEX, /* Intel HEX, 32-bit extended linear addresses */
+    SQUASHELF_FORMAT_SREC, /* Motorola S-records, S1/S2/S3 by address range */
+    SQUASHELF_FORMAT_COUNT,
+};
+
+/*
+ * How ELF output places segment payloads after the PHT. Program headers
+ * stay in LMA order either way; only the file offsets differ.
+ */
+enum squashelf_layout {
+    SQUASHELF_LAYOUT_PLAN, /* least alignment padding, in any file order */
+    SQUASHELF_LAYOUT_LMA,  /* in LMA order, each at its next aligned offset */
+    SQUASHELF_LAYOUT_PACK, /* back to back in LMA order, p_align lowered */
+    SQUASHELF_LAYOUT_COUNT,
+};
+
+/*
+ * What squashelf_select and squashelf_stream do about selected segments
+ * whose file bytes claim the same LMAs, and about aliasing: segments
+ * sharing run-time (VMA) addresses, or one loaded where another runs.
+ */
+enum squashelf_overlap {
+    SQUASHELF_OVERLAP_OFF,     /* no check */
+    SQUASHELF_OVERLAP_WARN,    /* report overlaps and aliasing */
+    SQUASHELF_OVERLAP_FAIL,    /* ... and fail on LMA conflicts */
+    SQUASHELF_OVERLAP_RESOLVE, /* on overlapping LMAs later PHT entries win */
+    SQUASHELF_OVERLAP_COUNT,
+};
+
+/*
+ * Segment payload codecs of compressed ELF output. Each one is only
+ * available if squashelf was built with its library (see the Makefile);
+ * _NONE marks a payload stored as is because it did not shrink.
+ */
+enum squashelf_codec {
+    SQUASHELF_CODEC_NONE,
+    SQUASHELF_CODEC_ZSTD, /* one zstd frame */
+    SQUASHELF_CODEC_LZ4,  /* one raw LZ4 block (size from the index) */
+    SQUASHELF_CODEC_COUNT,
+};
+
+/*
+ * Compressed ELF output keeps the PT_LOAD entries (with p_filesz 0 and
+ * p_offset at the segment's compressed bytes) and adds a first program
+ * header of this type, pointing at an index right after the PHT: a
+ * header of "SQZI", version (u16, 1), entry size (u16, 48) and entry
+ * count (u32) plus 4 reserved bytes, then one entry per PT_LOAD in PHT
+ * order. All fields are in the ELF's byte order.
+ */
+#define SQUASHELF_PT_INDEX      0x6353515a /* in the PT_LOOS-PT_HIOS range */
+#define SQUASHELF_INDEX_VERSION 1
+
+struct squashelf_index_entry {
+    uint64_t lma;    /* p_paddr: where the bytes go */
+    uint64_t memsz;  /* p_memsz: zero-fill up to here */
+    uint64_t offset; /* file offset of the compressed bytes */
+    uint64_t csize;  /* compressed bytes */
+    uint64_t size;   /* bytes they expand to (the segment's file bytes) */
+    uint32_t codec;  /* enum squashelf_codec */
+    uint32_t flags;  /* p_flags */
+};
+
+/* Phases timed into struct squashelf_stats, in the order they run */
+enum squashelf_phase {
+    SQUASHELF_PHASE_INIT,      /* one-time libelf handshake */
+    SQUASHELF_PHASE_OPEN,      /* open, fstat and mmap of the input */
+    SQUASHELF_PHASE_DECODE,    /* decompressing .zst/.xz input on demand */
+    SQUASHELF_PHASE_BEGIN,     /* elf_begin/elf_memory and the ELF header */
+    SQUASHELF_PHASE_SCAN,      /* reading the input PHT */
+    SQUASHELF_PHASE_FILTER,    /* PT_LOAD/range selection and bounds checks */
+    SQUASHELF_PHASE_SORT,      /* LMA sort */
+    SQUASHELF_PHASE_CHECK,     /* overlap and aliasing check */
+    SQUASHELF_PHASE_LAYOUT,    /* coalescing and output offsets */
+    SQUASHELF_PHASE_COMPRESS,  /* compressing payloads for codec output */
+    SQUASHELF_PHASE_READ,      /* pread of segment payloads */
+    SQUASHELF_PHASE_ASSOCIATE, /* building libelf sections over payloads */
+    SQUASHELF_PHASE_WRITE,     /* elf_update, direct copy or format output */
+    SQUASHELF_PHASE_DIGEST,    /* segment hashing not overlapped by the write */
+    SQUASHELF_PHASE_VERIFY,    /* comparing the written output with the input */
+    SQUASHELF_PHASE_COUNT,
+};
+
+/*
+ * Counters collected when squashelf_options.stats is set. Everything but
+ * uringDepthMax is added to, so one struct can total several runs; zero
+ * it for one run.
+ */
+struct squashelf_stats {
+    uint64_t phaseNs[SQUASHELF_PHASE_COUNT]; /* CLOCK_MONOTONIC time */
+    uint64_t segmentsScanned; /* input program headers read */
+    uint64_t segmentsKept;    /* PT_LOAD segments selected */
+    uint64_t payloadBytes;    /* p_filesz of the selected segments */
+    uint64_t outputBytes;     /* bytes of output produced */
+    uint64_t sparseBytes;     /* zero output bytes left as holes (sparse) */
+    uint64_t trimmedBytes;    /* trailing zeros turned into bss (trimZeros) */
+    uint64_t overlaps;        /* conflicts found by the overlap check */
+    uint64_t paddingBytes;    /* alignment padding between ELF payloads */
+    uint64_t paddingRemoved;  /* ... saved over the LMA-order layout */
+    uint64_t uringRequests;   /* reads and writes submitted to the io_uring */
+    uint64_t uringCalls;      /* io_uring_enter calls */
+    uint64_t uringDepthSum;   /* requests in flight, summed over each call */
+    uint64_t uringDepthMax;   /* most requests in flight at once (a max) */
+    uint64_t uringBytes;      /* payload bytes copied through the ring */
+    uint64_t uringNs;         /* time from the first submit to the last reap */
+};
+
+/* An LMA window: a segment fits if it starts at or above minLma and its
+   last byte is at or below maxLma */
+struct squashelf_range {
+    uint64_t minLma;
+    uint64_t maxLma;
+};
+
+/* Settings that control how one input file is squashed */
+struct squashelf_options {
+    int      noSht;
+    int      hasRange; /* keep only segments within minLma-maxLma ... */
+    int      allowZeroSizeSeg;
+    uint64_t minLma;
+    uint64_t maxLma;
+    /* ... or within the union of that and these ranges, which may be
+       unsorted and overlapping; only read by select and stream */
+    const struct squashelf_range* ranges;
+    size_t                        rangeCount;
+    int      clip;      /* trim segments to the ranges, don't drop them */
+    int      useMmap;   /* map regular-file inputs instead of pread */
+    int      writer;    /* enum squashelf_writer */
+    int      copyStart; /* enum squashelf_copy the direct writer starts at */
+    int      jobs;      /* threads for the direct writer's payload copy */
+    /* Arena for the libelf writer's segment buffers when the input is not
+       mapped, so callers squashing many files reuse one; NULL makes each
+       write use a private one. Not to be shared by concurrent writes. */
+    struct squashelf_arena* arena;
+    uint64_t streamBufferLimit; /* max bytes held back in streaming mode */
+    int      format;  /* enum squashelf_format */
+    int      gapFill; /* bin: byte value written between segments */
+    int      layout;      /* enum squashelf_layout of uncompressed ELF */
+    int      coalesce;    /* merge nearby compatible PT_LOAD segments */
+    uint64_t coalesceGap; /* max bytes zero-filled to merge two segments */
+    int      sparse;     /* write_fd: leave zero payload blocks as holes */
+    int      trimZeros;  /* cut trailing zeros of segments into bss */
+    int      overlap;    /* enum squashelf_overlap: check LMAs and VMAs */
+    int      codec;      /* enum squashelf_codec: compress ELF payloads */
+    int      codecLevel; /* codec compression level, 0 for its default */
+    int      planOnly;   /* select: lay out without touching segment data */
+    struct squashelf_stats* stats; /* if set, timings are added here */
+};
+
+/* CRC-32 and SHA-256 of one output program header's file bytes */
+struct squashelf_digest {
+    uint64_t      lma;    /* p_paddr */
+    uint64_t      vma;    /* p_vaddr */
+    uint64_t      offset; /* p_offset in the ELF output */
+    uint64_t      size;   /* p_filesz: the bytes digested */
+    uint64_t      memsz;
+    uint32_t      flags;  /* p_flags */
+    uint32_t      crc32;  /* the zlib / IEEE 802.3 CRC-32 */
+    unsigned char sha256[32];
+};
+
+/* Placement of one output program header, from squashelf_image_entries */
+struct squashelf_entry {
+    uint64_t lma;     /* p_paddr */
+    uint64_t vma;     /* p_vaddr */
+    uint64_t offset;  /* where its bytes start in ELF or bin output */
+    uint64_t size;    /* p_filesz */
+    uint64_t memsz;
+    uint64_t padding; /* fill bytes right before it in ELF or bin output */
+    uint32_t flags;   /* p_flags */
+};
+
+typedef struct squashelf       squashelf_t;       /* a parsed input ELF */
+typedef struct squashelf_image squashelf_image_t; /* selected, laid out */
+typedef struct squashelf_arena squashelf_arena_t; /* output memory pool */
+
+/* Fill opts with the command-line defaults. */
+void squashelf_options_init(struct squashelf_options* opts);
+
+/* Enable or disable verbose tracing to stderr (off by default). */
+void squashelf_set_verbose(int verbose);
+
+/* Name of a writer ("libelf", "direct", "uring"), or NULL if out of range. */
+const char* squashelf_writer_name(int writer);
+
+/* Name of a copy engine ("copy_file_range", ...), or NULL if out of range. */
+const char* squashelf_copy_name(int engine);
+
+/* Name of an output format ("elf", "bin", ...), or NULL if out of range. */
+const char* squashelf_format_name(int format);
+
+/* Name of a codec ("none", "zstd", "lz4"), or NULL if out of range. */
+const char* squashelf_codec_name(int codec);
+
+/* Whether this build can compress with codec. */
+int squashelf_codec_available(int codec);
+
+/* Name of a layout ("plan", "lma", "pack"), or NULL if out of range. */
+const char* squashelf_layout_name(int layout);
+
+/* Name of an overlap mode ("off", "warn", ...), or NULL if out of range. */
+const char* squashelf_overlap_name(int mode);
+
+/* Name of a phase ("init", "open", ...), or NULL if out of range. */
+const char* squashelf_phase_name(int phase);
+
+/*
+ * Open an input ELF. _mem uses the caller's buffer in place (it must stay
+ * valid and unchanged until squashelf_close); _fd maps regular files when
+ * opts->useMmap is set and otherwise reads with pread (the fd stays owned
+ * by the caller); _file opens path itself. opts may be NULL for defaults.
+ * A regular file that starts with zstd or xz magic is decoded into
+ * anonymous memory instead: its headers when it is opened and, one frame
+ * or block at a time, only the parts squashelf_select needs for the
+ * segments it keeps (see the README for which files split into frames).
+ * Each returns NULL on failure.
+ */
+squashelf_t* squashelf_open_mem(const void* buf, size_t size,
+                                const struct squashelf_options* opts);
+squashelf_t* squashelf_open_fd(int fd, const struct squashelf_options* opts);
+squashelf_t* squashelf_open_file(const char* path,
+                                 const struct squashelf_options* opts);
+void         squashelf_close(squashelf_t* in);
+
+/*
+ * Pick the PT_LOAD segments that opts selects, sort them by LMA and lay
+ * out the output in opts->format. With opts->codec, every PT_LOAD entry
+ * of the ELF output is compressed here (on opts->jobs threads), so the
+ * size is known up front. opts->overlap checks the sorted segments before
+ * anything else and can trim them so no LMA is claimed twice. Returns
+ * NULL (after printing why) if nothing is selected, the overlap check
+ * fails, the segments cannot be represented in the format (overlaps in
+ * bin, addresses past 4 GiB in ihex/srec), or on error. The input PHT is
+ * decoded on the first call and kept for later ones. With opts->planOnly
+ * no segment data is read or decoded (so opts->codec and trimZeros, which
+ * need it, are refused); the image then only serves the size and entry
+ * queries below and cannot be written.
+ */
+squashelf_image_t* squashelf_select(squashelf_t*                    in,
+                                    const struct squashelf_options* opts);
+void               squashelf_image_free(squashelf_image_t* image);
+
+/*
+ * Exact size in bytes of the output squashelf_write_fd produces with the
+ * selected writer. (squashelf_write_mem, which never uses libelf, reports
+ * its own size.)
+ */
+uint64_t squashelf_image_size(const squashelf_image_t* image);
+
+/* Number of PT_LOAD program headers in the output. */
+size_t squashelf_image_segments(const squashelf_image_t* image);
+
+/* Bytes of ELF header and PHT that ELF output starts with (0 otherwise). */
+uint64_t squashelf_image_headers(const squashelf_image_t* image);
+
+/* Bytes of section headers that ELF output ends with (0 without an SHT). */
+uint64_t squashelf_image_sht(const squashelf_image_t* image);
+
+/*
+ * Fill entries (squashelf_image_segments of them, in PHT order) with the
+ * placement of each output program header. Offsets and padding are file
+ * positions in ELF output and positions from the lowest LMA in bin; they
+ * are 0 for ihex and srec. The padding of entries in PHT order need not
+ * be adjacent in the file, where the layout may order them differently.
+ * Not for compressed output. Returns 0 or -1.
+ */
+int squashelf_image_entries(const squashelf_image_t* image,
+                            struct squashelf_entry*  entries);
+
+/*
+ * Write the output to a seekable, empty fd (e.g. opened with O_TRUNC;
+ * the libelf writer also wants O_RDWR) starting at offset 0, with the
+ * backend chosen by the image's options (compressed output always has
+ * the direct layout). The bin, ihex and srec formats
+ * are written strictly sequentially, so any writable fd (a pipe too)
+ * works for them. Returns 0 or -1.
+ */
+int squashelf_write_fd(const squashelf_image_t* image, int fd);
+
+/*
+ * Fill digests (squashelf_image_segments entries, in PHT order) with the
+ * CRC-32 and SHA-256 of each output program header's file bytes, zero
+ * padding between coalesced segments included. The data is read from the
+ * input, on opts->jobs threads; entries are hashed in parallel, each one
+ * on a single thread. _write_fd_digests does the same while writing the
+ * output as squashelf_write_fd does, so the hashing overlaps the write
+ * instead of reading the output back. For compressed output the bytes
+ * digested are the uncompressed ones and offset is where their
+ * compressed form starts. Returns 0 or -1.
+ */
+int squashelf_digest_image(const squashelf_image_t* image,
+                           struct squashelf_digest* digests);
+int squashelf_write_fd_digests(const squashelf_image_t* image, int fd,
+                               struct squashelf_digest* digests);
+
+/*
+ * Bring an earlier ELF output of the same image up to date in place: fd
+ * (open for reading and writing) must hold what squashelf_write_fd wrote
+ * with the same writer and layout. The headers, padding and SHT are
+ * checked against that layout, then only the payloads whose bytes differ
+ * are rewritten; *rewritten receives their number. Returns 0 when fd is
+ * up to date, 1 if its layout differs (or the format is not ELF) and it
+ * was left untouched for a full write, or -1 on error, which can leave
+ * fd partly updated. Compressed output is always rewritten in full.
+ */
+int squashelf_update_fd(const squashelf_image_t* image, int fd,
+                        size_t* rewritten);
+
+/*
+ * Check that fd (open for reading) holds exactly what squashelf_write_fd
+ * or _update_fd writes for the image. The output is mapped and, on
+ * opts->jobs threads (one per online CPU if jobs is 1), every payload is
+ * compared with its bytes in the input and the headers, padding and SHT
+ * with what the writer puts there. Uncompressed ELF and bin output only.
+ * Returns 0 if fd matches, 1 if not, after reporting the first byte that
+ * differs (its output offset goes to *mismatch if that is set), or -1 on
+ * error.
+ */
+int squashelf_verify_fd(const squashelf_image_t* image, int fd,
+                        uint64_t* mismatch);
+
+/*
+ * Write the output to memory (ELF always with the direct layout). With an
+ * arena, *buf and *size receive a block carved from it; without one,
+ * *buf must point at a caller buffer of *size bytes, and *size is set to
+ * the bytes used. Returns 0 or -1; if the caller buffer is too small,
+ * errno is ENOSPC and *size holds the size needed.
+ */
+int squashelf_write_mem(const squashelf_image_t* image,
+                        squashelf_arena_t* arena, void** buf, size_t* size);
+
+/*
+ * Squash with sequential I/O only (pipes): reads inputFd front to back
+ * and writes outputFd strictly in order. Neither fd is closed. Compressed,
+ * sparse and trimmed output (opts->codec, sparse, trimZeros) need the
+ * whole input or a seekable output and are not available here.
+ * Returns 0 or -1.
+ */
+int squashelf_stream(int inputFd, int outputFd,
+                     const struct squashelf_options* opts);
+
+/*
+ * Arena for squashelf_write_mem output and, through opts->arena, the
+ * libelf writer's segment buffers (handed back when each write ends).
+ * Blocks carved from it stay valid until squashelf_arena_reset (which
+ * keeps the memory for reuse) or squashelf_arena_free. Large blocks are
+ * backed by transparent huge pages where the kernel allows.
+ */
+squashelf_arena_t* squashelf_arena_new(void);
+void               squashelf_arena_reset(squashelf_arena_t* arena);
+void               squashelf_arena_free(squashelf_arena_t* arena);
+
+/*
+ * XXH64 of len bytes at buf: a fast non-cryptographic 64-bit hash, the
+ * same on every host. Used to key cached outputs.
+ */
+uint64_t squashelf_hash64(const void* buf, size_t len, uint64_t seed);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBSQUASHELF_H */
@@ -1,125 +1,3117 @@
+#define _GNU_SOURCE /* copy_file_range */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <libelf.h>
-#include <gelf.h>
 #include <string.h>
 #include <errno.h>
-#include <sys/stat.h>
-#include <sys/types.h>
 #include <getopt.h>
 #include <stdint.h>
 #include <stdarg.h> /* Needed for variadic macros */
 #include <stdbool.h> /* Needed for bool type */
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <linux/fs.h> /* FICLONE */
+#include <dirent.h>
+#include <limits.h>
+#include <libgen.h>
+
+#include "libsquashelf.h"
+
+static int verbose = 0; /* set by -v; read by DEBUG_PRINT */
+static int verify  = 0; /* set by --verify; read where outputs are written */
+
+/* Macro for verbose printing */
+#define DEBUG_PRINT(fmt, ...)                    \
+    do {                                         \
+        if (verbose)                             \
+            fprintf(stderr, fmt, ##__VA_ARGS__); \
+    } while (0)
+
+/* Long-only options (values outside the short-option character range) */
+enum {
+    OPT_NO_MMAP = 256,
+    OPT_WRITER,
+    OPT_COPY,
+    OPT_BATCH,
+    OPT_WORKERS,
+    OPT_STREAM_BUFFER,
+    OPT_FORMAT,
+    OPT_GAP_FILL,
+    OPT_COALESCE,
+    OPT_STATS,
+    OPT_RANGES,
+    OPT_SPLIT,
+    OPT_CLIP,
+    OPT_CACHE,
+    OPT_CACHE_SIZE,
+    OPT_INCREMENTAL,
+    OPT_MANIFEST,
+    OPT_COMPRESS,
+    OPT_SPARSE,
+    OPT_TRIM_ZEROS,
+    OPT_CHECK_OVERLAP,
+    OPT_LAYOUT,
+    OPT_PACK,
+    OPT_SERVE,
+    OPT_INPUT_CACHE,
+    OPT_PLAN,
+    OPT_VERIFY,
+};
+
+/* One --range argument: an LMA window, optionally tagged with a region */
+struct namedRange {
+    char*                  region; /* NULL for a plain filter range */
+    struct squashelf_range range;
+};
+
+/* One -o argument: where the segments of a region go */
+struct regionOutput {
+    char* region;
+    char* outputFile;
+};
+
+/* --stats and --plan report formats */
+enum {
+    STATS_OFF,
+    STATS_TEXT,
+    STATS_JSON,
+};
+
+/*
+ * processSample:
+ *   Process-wide counters read at the start and end of a run for --stats.
+ *   The I/O counters come from /proc/self/io, so they include the reads
+ *   and writes libelf does internally; haveIo is false where it is
+ *   missing. The values predate the read that fetched them, so a later
+ *   sample also counts that one read of ioRead bytes.
+ */
+struct processSample {
+    uint64_t      ns;     /* CLOCK_MONOTONIC */
+    bool          haveIo;
+    uint64_t      rchar;  /* bytes passed to read-type syscalls */
+    uint64_t      wchar;  /* bytes passed to write-type syscalls */
+    uint64_t      syscr;  /* read, pread, sendfile, copy_file_range, ... */
+    uint64_t      syscw;  /* write, pwritev, sendfile, copy_file_range, ... */
+    uint64_t      ioRead; /* bytes of the read that fetched these values */
+    struct rusage usage;
+};
+
+/*
+ * outputCache:
+ *   The --cache directory. Each entry is a complete output named after
+ *   its cache key, and its mtime records when it was last used, which is
+ *   what eviction goes by. The counters are reported by --stats.
+ */
+struct outputCache {
+    const char*     dir;      /* NULL when caching is off */
+    uint64_t        maxBytes; /* evict down to this after each store */
+    pthread_mutex_t lock;     /* guards the counters and eviction */
+    uint64_t        hits;
+    uint64_t        misses;
+    uint64_t        evictions;
+    uint64_t        tmpSerial; /* names temporary entries */
+};
+
+static struct outputCache cache = {
+    .maxBytes = 1UL << 30,
+    .lock     = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/*
+ * Bumped whenever the output for the same input and options changes, or
+ * entries made by an earlier version cannot be trusted
+ */
+#define CACHE_VERSION 4
+
+/* Room for a cache key: two 64-bit hashes and the input size in hex */
+#define CACHE_KEY_SIZE 64
+
+/*
+ * usage:
+ *   Print the command-line synopsis to stderr.
+ */
+static void usage(const char* prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-n | --nosht] [-r | --range [region=]min-max]... "
+            "[--ranges FILE] [--clip] "
+            "[-v | --verbose] [-z | --zero-size-segments] [--no-mmap] "
+            "[--writer=libelf|direct|uring] "
+            "[--copy=copy_file_range|sendfile|buffered] [-j | --jobs N] "
+            "[--stream-buffer SIZE] [--format=elf|bin|ihex|srec] "
+            "[--gap-fill BYTE] [--coalesce[=MAXGAP]] [--stats[=json]] "
+            "[--cache DIR] [--cache-size SIZE] [--incremental PREVIOUS] "
+            "[--manifest FILE] [--compress=zstd|lz4[:LEVEL]] "
+            "[--sparse] [--trim-zeros] [--check-overlap[=warn|fail|resolve]] "
+            "[--layout=plan|lma|pack] [--pack] [--verify] "
+            "<input.elf|-> <output|->\n"
+            "       %s {-r region=min-max... -o region=output... | "
+            "--split FILE} [--workers N] [options] <input.elf>\n"
+            "       %s --batch[=manifest] [--workers N] [options] "
+            "[<input.elf> <output.elf>]...\n"
+            "       %s --serve SOCKET [--workers N] [--input-cache N] "
+            "[options]\n"
+            "       %s --plan[=json] [options] <input.elf> [<output>]\n",
+            prog, prog, prog, prog, prog);
+}
+
+/*
+ * parseRange:
+ *   Parse "min-max" (each bound decimal or 0x-prefixed hex) into *minLma
+ *   and *maxLma. Prints a diagnostic and returns -1 on malformed input.
+ */
+static int parseRange(const char* str, uint64_t* minLma, uint64_t* maxLma)
+{
+    /* Parse the range string (e.g., "0xA00000000-0xB0000000") */
+    const char* dashPos = strchr(str, '-');
+    if (!dashPos) {
+        fprintf(stderr, "Invalid range format. Expected: min-max\n");
+        return -1;
+    }
+
+    /* Check for hex or decimal format and convert */
+    const char* minStr = str;
+    const char* maxStr = dashPos + 1;
+    if (strncmp(minStr, "0x", 2) == 0 || strncmp(minStr, "0X", 2) == 0) {
+        *minLma = strtoull(minStr, NULL, 16);
+    }
+    else {
+        *minLma = strtoull(minStr, NULL, 10);
+    }
+
+    if (strncmp(maxStr, "0x", 2) == 0 || strncmp(maxStr, "0X", 2) == 0) {
+        *maxLma = strtoull(maxStr, NULL, 16);
+    }
+    else {
+        *maxLma = strtoull(maxStr, NULL, 10);
+    }
+
+    if (*minLma >= *maxLma) {
+        fprintf(stderr, "Invalid range: min must be less than max\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * growArray:
+ *   Make room for one more element of size bytes in *items, which holds
+ *   count of *capacity slots.
+ */
+static int growArray(void** items, size_t* capacity, size_t count,
+                     size_t size)
+{
+    if (count < *capacity) {
+        return 0;
+    }
+    size_t newCap = *capacity ? *capacity * 2 : 16;
+    void*  grown  = realloc(*items, newCap * size);
+    if (!grown) {
+        perror("realloc");
+        return -1;
+    }
+    *items    = grown;
+    *capacity = newCap;
+    return 0;
+}
+
+/*
+ * addRange:
+ *   Parse a --range argument, "min-max" or "region=min-max", and append
+ *   it to *ranges.
+ */
+static int addRange(const char* arg, struct namedRange** ranges,
+                    size_t* count, size_t* capacity)
+{
+    if (growArray((void**)ranges, capacity, *count, sizeof(**ranges)) != 0) {
+        return -1;
+    }
+    struct namedRange* entry = &(*ranges)[*count];
+    const char*        eq    = strchr(arg, '=');
+    entry->region            = NULL;
+    if (eq) {
+        if (eq == arg) {
+            fprintf(stderr, "Empty region name in range '%s'\n", arg);
+            return -1;
+        }
+        entry->region = strndup(arg, eq - arg);
+        if (!entry->region) {
+            perror("strndup region");
+            return -1;
+        }
+        arg = eq + 1;
+    }
+    if (parseRange(arg, &entry->range.minLma, &entry->range.maxLma) != 0) {
+        free(entry->region);
+        return -1;
+    }
+    (*count)++;
+    return 0;
+}
+
+/*
+ * addOutput:
+ *   Send region (regionLen bytes of it) to outputFile. A region listed
+ *   again must name the same file.
+ */
+static int addOutput(const char* region, size_t regionLen,
+                     const char* outputFile, struct regionOutput** outputs,
+                     size_t* count, size_t* capacity)
+{
+    for (size_t i = 0; i < *count; i++) {
+        if (strlen((*outputs)[i].region) == regionLen &&
+            strncmp((*outputs)[i].region, region, regionLen) == 0) {
+            if (strcmp((*outputs)[i].outputFile, outputFile) == 0) {
+                return 0;
+            }
+            fprintf(stderr, "Region '%.*s' has two outputs\n",
+                    (int)regionLen, region);
+            return -1;
+        }
+    }
+    if (growArray((void**)outputs, capacity, *count, sizeof(**outputs)) !=
+        0) {
+        return -1;
+    }
+    struct regionOutput* entry = &(*outputs)[*count];
+    entry->region              = strndup(region, regionLen);
+    entry->outputFile          = strdup(outputFile);
+    if (!entry->region || !entry->outputFile) {
+        perror("strdup output");
+        free(entry->region);
+        free(entry->outputFile);
+        return -1;
+    }
+    (*count)++;
+    return 0;
+}
+
+/*
+ * loadSplits:
+ *   Read a --split list ("-" for stdin): "min-max output" per line, '#'
+ *   starting a comment. Each output becomes a region named after it, so
+ *   lines that repeat an output add ranges to it.
+ */
+static int loadSplits(const char* splitFile, struct namedRange** ranges,
+                      size_t* rangeCount, size_t* rangeCap,
+                      struct regionOutput** outputs, size_t* outputCount,
+                      size_t* outputCap)
+{
+    FILE* fp = strcmp(splitFile, "-") == 0 ? stdin : fopen(splitFile, "r");
+    if (!fp) {
+        perror("open split list");
+        return -1;
+    }
+
+    char*  line    = NULL;
+    size_t lineCap = 0;
+    size_t lineNo  = 0;
+    int    rc      = -1;
+    while (getline(&line, &lineCap, fp) >= 0) {
+        lineNo++;
+        char* hash = strchr(line, '#');
+        if (hash) {
+            *hash = '\0';
+        }
+
+        char* save;
+        char* range  = strtok_r(line, " \t\r\n", &save);
+        char* output = strtok_r(NULL, " \t\r\n", &save);
+        if (!range) {
+            continue; /* blank or comment-only line */
+        }
+        if (!output || strtok_r(NULL, " \t\r\n", &save) ||
+            strchr(range, '=') || strcmp(output, "-") == 0) {
+            fprintf(stderr, "%s:%zu: expected \"min-max output\"\n",
+                    splitFile, lineNo);
+            goto out;
+        }
+        if (addRange(range, ranges, rangeCount, rangeCap) != 0 ||
+            addOutput(output, strlen(output), output, outputs, outputCount,
+                      outputCap) != 0) {
+            fprintf(stderr, "%s:%zu: bad entry\n", splitFile, lineNo);
+            goto out;
+        }
+        (*ranges)[*rangeCount - 1].region = strdup(output);
+        if (!(*ranges)[*rangeCount - 1].region) {
+            perror("strdup region");
+            goto out;
+        }
+    }
+    if (ferror(fp)) {
+        perror("read split list");
+        goto out;
+    }
+    rc = 0;
+
+out:
+    free(line);
+    if (fp != stdin) {
+        fclose(fp);
+    }
+    return rc;
+}
+
+/*
+ * loadRanges:
+ *   Read --range arguments from a file ("-" for stdin): one per line,
+ *   with '#' starting a comment.
+ */
+static int loadRanges(const char* rangesFile, struct namedRange** ranges,
+                      size_t* count, size_t* capacity)
+{
+    FILE* fp = strcmp(rangesFile, "-") == 0 ? stdin : fopen(rangesFile, "r");
+    if (!fp) {
+        perror("open ranges file");
+        return -1;
+    }
+
+    char*  line    = NULL;
+    size_t lineCap = 0;
+    size_t lineNo  = 0;
+    int    rc      = -1;
+    while (getline(&line, &lineCap, fp) >= 0) {
+        lineNo++;
+        char* hash = strchr(line, '#');
+        if (hash) {
+            *hash = '\0';
+        }
+
+        char* save;
+        char* range = strtok_r(line, " \t\r\n", &save);
+        if (!range) {
+            continue; /* blank or comment-only line */
+        }
+        if (strtok_r(NULL, " \t\r\n", &save) ||
+            addRange(range, ranges, count, capacity) != 0) {
+            fprintf(stderr, "%s:%zu: expected \"[region=]min-max\"\n",
+                    rangesFile, lineNo);
+            goto out;
+        }
+    }
+    if (ferror(fp)) {
+        perror("read ranges file");
+        goto out;
+    }
+    rc = 0;
+
+out:
+    free(line);
+    if (fp != stdin) {
+        fclose(fp);
+    }
+    return rc;
+}
+
+/*
+ * parseSize:
+ *   Parse a byte count with an optional K, M or G (binary) suffix.
+ */
+static int parseSize(const char* str, uint64_t* size)
+{
+    char*    end;
+    uint64_t value = strtoull(str, &end, 0);
+    if (end == str) {
+        return -1;
+    }
+    switch (*end) {
+        case 'k':
+        case 'K':
+            value <<= 10;
+            end++;
+            break;
+        case 'm':
+        case 'M':
+            value <<= 20;
+            end++;
+            break;
+        case 'g':
+        case 'G':
+            value <<= 30;
+            end++;
+            break;
+        default:
+            break;
+    }
+    if (*end != '\0') {
+        return -1;
+    }
+    *size = value;
+    return 0;
+}
+
+/*
+ * parseCodec:
+ *   Parse "codec[:level]" for --compress. Levels are 1-22 for zstd and
+ *   1-12 (LZ4 HC) for lz4; without one the codec's default is used.
+ */
+static int parseCodec(const char* str, int* codec, int* level)
+{
+    static const int maxLevel[SQUASHELF_CODEC_COUNT] = {
+        [SQUASHELF_CODEC_ZSTD] = 22,
+        [SQUASHELF_CODEC_LZ4]  = 12,
+    };
+    const char* colon = strchr(str, ':');
+    size_t      len   = colon ? (size_t)(colon - str) : strlen(str);
+
+    for (*codec = SQUASHELF_CODEC_NONE + 1; *codec < SQUASHELF_CODEC_COUNT;
+         (*codec)++) {
+        const char* name = squashelf_codec_name(*codec);
+        if (strlen(name) == len && strncmp(str, name, len) == 0) {
+            break;
+        }
+    }
+    if (*codec == SQUASHELF_CODEC_COUNT) {
+        return -1;
+    }
+    *level = 0;
+    if (colon) {
+        char* end;
+        long  value = strtol(colon + 1, &end, 10);
+        if (end == colon + 1 || *end != '\0' || value < 1 ||
+            value > maxLevel[*codec]) {
+            return -1;
+        }
+        *level = (int)value;
+    }
+    return 0;
+}
+
+/*
+ * sampleProcess:
+ *   Read the monotonic clock, /proc/self/io and getrusage into sample.
+ */
+static void sampleProcess(struct processSample* sample)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    memset(sample, 0, sizeof(*sample));
+    sample->ns = (uint64_t)now.tv_sec * 1000000000UL + (uint64_t)now.tv_nsec;
+    getrusage(RUSAGE_SELF, &sample->usage);
+
+    char    text[512];
+    int     fd = open("/proc/self/io", O_RDONLY);
+    ssize_t n  = fd < 0 ? -1 : read(fd, text, sizeof(text) - 1);
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (n <= 0) {
+        return;
+    }
+    text[n] = '\0';
+
+    static const char* const names[] = {"rchar:", "wchar:", "syscr:",
+                                        "syscw:"};
+    uint64_t* fields[] = {&sample->rchar, &sample->wchar, &sample->syscr,
+                          &sample->syscw};
+    int       found    = 0;
+    for (int i = 0; i < 4; i++) {
+        const char* at = strstr(text, names[i]);
+        found += at && sscanf(at + strlen(names[i]), "%lu", fields[i]) == 1;
+    }
+    sample->ioRead = n;
+    sample->haveIo = found == 4;
+}
+
+/*
+ * printJsonString:
+ *   Write s to fp as a JSON string literal.
+ */
+static void printJsonString(FILE* fp, const char* s)
+{
+    fputc('"', fp);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            fprintf(fp, "\\%c", c);
+        }
+        else if (c < 0x20) {
+            fprintf(fp, "\\u%04x", c);
+        }
+        else {
+            fputc(c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+/*
+ * timevalMs:
+ *   A struct timeval as milliseconds.
+ */
+static double timevalMs(const struct timeval* tv)
+{
+    return tv->tv_sec * 1e3 + tv->tv_usec / 1e3;
+}
+
+/*
+ * printStats:
+ *   Report --stats to stderr: the library's phase times and counters,
+ *   then what the process did between the two samples. label names the
+ *   run (the input file, or "batch"). Phase times of batch jobs are
+ *   summed over all workers, so they can exceed the wall time.
+ */
+static void printStats(int format, const char* label, int status,
+                       const struct squashelf_stats* stats,
+                       const struct processSample* start,
+                       const struct processSample* end)
+{
+    double wallMs = (end->ns - start->ns) / 1e6;
+    double userMs = timevalMs(&end->usage.ru_utime) -
+                    timevalMs(&start->usage.ru_utime);
+    double sysMs  = timevalMs(&end->usage.ru_stime) -
+                    timevalMs(&start->usage.ru_stime);
+    long   minflt = end->usage.ru_minflt - start->usage.ru_minflt;
+    long   majflt = end->usage.ru_majflt - start->usage.ru_majflt;
+    char   host[256] = "";
+
+    /* Leave out the read of /proc/self/io that took the start sample */
+    uint64_t bytesRead = end->rchar - start->rchar - start->ioRead;
+    uint64_t readCalls = end->syscr - start->syscr - 1;
+    double   uringMiBs = 0; /* bandwidth of the io_uring payload copy */
+    if (stats->uringNs) {
+        uringMiBs = stats->uringBytes / 1048576.0 / (stats->uringNs / 1e9);
+    }
+    gethostname(host, sizeof(host) - 1);
+
+    if (format == STATS_TEXT) {
+        fprintf(stderr, "squashelf stats for %s on %s (%s):\n", label, host,
+                status == EXIT_SUCCESS ? "ok" : "failed");
+        for (int p = 0; p < SQUASHELF_PHASE_COUNT; p++) {
+            fprintf(stderr, "  %-10s %12.3f ms\n", squashelf_phase_name(p),
+                    stats->phaseNs[p] / 1e6);
+        }
+        fprintf(stderr, "  %-10s %12.3f ms (user %.3f, sys %.3f)\n", "total",
+                wallMs, userMs, sysMs);
+        fprintf(stderr,
+                "  segments   %lu scanned, %lu kept\n"
+                "  payload    %lu bytes, output %lu bytes\n",
+                stats->segmentsScanned, stats->segmentsKept,
+                stats->payloadBytes, stats->outputBytes);
+        if (stats->sparseBytes || stats->trimmedBytes) {
+            fprintf(stderr, "  zeros      %lu bytes as holes, %lu into bss\n",
+                    stats->sparseBytes, stats->trimmedBytes);
+        }
+        if (stats->overlaps) {
+            fprintf(stderr, "  overlaps   %lu found\n", stats->overlaps);
+        }
+        if (stats->paddingBytes || stats->paddingRemoved) {
+            fprintf(stderr, "  padding    %lu bytes, %lu removed\n",
+                    stats->paddingBytes, stats->paddingRemoved);
+        }
+        if (stats->uringCalls) {
+            fprintf(stderr,
+                    "  io_uring   %lu requests in %lu calls, depth %.1f avg, "
+                    "%lu max, %.1f MiB/s\n",
+                    stats->uringRequests, stats->uringCalls,
+                    (double)stats->uringDepthSum / stats->uringCalls,
+                    stats->uringDepthMax, uringMiBs);
+        }
+        if (end->haveIo) {
+            fprintf(stderr,
+                    "  read       %lu bytes in %lu syscalls\n"
+                    "  written    %lu bytes in %lu syscalls\n",
+                    bytesRead, readCalls, end->wchar - start->wchar,
+                    end->syscw - start->syscw);
+        }
+        if (cache.dir) {
+            fprintf(stderr, "  cache      %lu hits, %lu misses, %lu evicted\n",
+                    cache.hits, cache.misses, cache.evictions);
+        }
+        fprintf(stderr,
+                "  faults     %ld minor, %ld major\n"
+                "  peak RSS   %ld KiB\n",
+                minflt, majflt, end->usage.ru_maxrss);
+        return;
+    }
+
+    fprintf(stderr, "{\"input\": ");
+    printJsonString(stderr, label);
+    fprintf(stderr, ", \"host\": ");
+    printJsonString(stderr, host);
+    fprintf(stderr, ", \"ok\": %s, \"phases_ms\": {",
+            status == EXIT_SUCCESS ? "true" : "false");
+    for (int p = 0; p < SQUASHELF_PHASE_COUNT; p++) {
+        fprintf(stderr, "%s\"%s\": %.3f", p ? ", " : "",
+                squashelf_phase_name(p), stats->phaseNs[p] / 1e6);
+    }
+    fprintf(stderr,
+            "}, \"total_ms\": %.3f, \"user_ms\": %.3f, \"sys_ms\": %.3f, "
+            "\"segments_scanned\": %lu, \"segments_kept\": %lu, "
+            "\"payload_bytes\": %lu, \"output_bytes\": %lu, "
+            "\"sparse_bytes\": %lu, \"trimmed_bytes\": %lu, "
+            "\"overlaps\": %lu, \"padding_bytes\": %lu, "
+            "\"padding_removed\": %lu, ",
+            wallMs, userMs, sysMs, stats->segmentsScanned,
+            stats->segmentsKept, stats->payloadBytes, stats->outputBytes,
+            stats->sparseBytes, stats->trimmedBytes, stats->overlaps,
+            stats->paddingBytes, stats->paddingRemoved);
+    if (stats->uringCalls) {
+        fprintf(stderr,
+                "\"uring_requests\": %lu, \"uring_calls\": %lu, "
+                "\"uring_depth_avg\": %.1f, \"uring_depth_max\": %lu, "
+                "\"uring_mib_per_s\": %.1f, ",
+                stats->uringRequests, stats->uringCalls,
+                (double)stats->uringDepthSum / stats->uringCalls,
+                stats->uringDepthMax, uringMiBs);
+    }
+    if (end->haveIo) {
+        fprintf(stderr,
+                "\"bytes_read\": %lu, \"bytes_written\": %lu, "
+                "\"read_syscalls\": %lu, \"write_syscalls\": %lu, ",
+                bytesRead, end->wchar - start->wchar, readCalls,
+                end->syscw - start->syscw);
+    }
+    if (cache.dir) {
+        fprintf(stderr,
+                "\"cache_hits\": %lu, \"cache_misses\": %lu, "
+                "\"cache_evictions\": %lu, ",
+                cache.hits, cache.misses, cache.evictions);
+    }
+    fprintf(stderr,
+            "\"minor_faults\": %ld, \"major_faults\": %ld, "
+            "\"peak_rss_kb\": %ld}\n",
+            minflt, majflt, end->usage.ru_maxrss);
+}
+
+/*
+ * compareRange:
+ *   qsort comparator ordering LMA ranges by start, then end.
+ */
+static int compareRange(const void* a, const void* b)
+{
+    const struct squashelf_range* ra = a;
+    const struct squashelf_range* rb = b;
+    if (ra->minLma != rb->minLma) {
+        return ra->minLma < rb->minLma ? -1 : 1;
+    }
+    return ra->maxLma < rb->maxLma ? -1 : ra->maxLma > rb->maxLma;
+}
+
+/*
+ * cacheKey:
+ *   Name the output opts makes from inputFile: the XXH64 of the whole
+ *   input, a hash of every option that changes the output bytes, and the
+ *   input size. Options that only change how the output is produced
+ *   (mmap, writer copy engine, -j) are left out, and the ranges are
+ *   hashed sorted, so their order does not matter. The overlap mode is
+ *   hashed too, so a hit has passed the same check. Fails (and the run
+ *   bypasses the cache) for inputs that cannot be mapped.
+ */
+static int cacheKey(const struct squashelf_options* opts,
+                    const char* inputFile, char* key)
+{
+    struct stat st;
+    int         fd = open(inputFile, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    uint64_t contentHash = squashelf_hash64(map, st.st_size, 0);
+    munmap(map, st.st_size);
+
+    size_t                  rangeCount = opts->rangeCount + !!opts->hasRange;
+    struct squashelf_range* ranges     = NULL;
+    if (rangeCount) {
+        ranges = malloc(rangeCount * sizeof(*ranges));
+        if (!ranges) {
+            return -1;
+        }
+        memcpy(ranges, opts->ranges, opts->rangeCount * sizeof(*ranges));
+        if (opts->hasRange) {
+            ranges[opts->rangeCount].minLma = opts->minLma;
+            ranges[opts->rangeCount].maxLma = opts->maxLma;
+        }
+        qsort(ranges, rangeCount, sizeof(*ranges), compareRange);
+    }
+
+    bool     elf        = opts->format == SQUASHELF_FORMAT_ELF;
+    uint64_t settings[] = {
+        CACHE_VERSION,
+        opts->noSht,
+        opts->allowZeroSizeSeg,
+        opts->clip,
+        opts->format,
+        /* The uring writer's output is byte-for-byte the direct one's */
+        elf ? (opts->writer == SQUASHELF_WRITER_URING ? SQUASHELF_WRITER_DIRECT
+                                                      : opts->writer)
+            : 0,
+        opts->format == SQUASHELF_FORMAT_BIN ? opts->gapFill : 0,
+        elf && opts->coalesce,
+        elf && opts->coalesce ? opts->coalesceGap : 0,
+        elf ? opts->codec : 0,
+        elf ? opts->codecLevel : 0,
+        elf && opts->trimZeros,
+        opts->overlap,
+        elf && opts->codec == SQUASHELF_CODEC_NONE ? opts->layout : 0,
+    };
+    uint64_t optionHash = squashelf_hash64(settings, sizeof(settings), 0);
+    optionHash = squashelf_hash64(ranges, rangeCount * sizeof(*ranges),
+                                  optionHash);
+    free(ranges);
+
+    snprintf(key, CACHE_KEY_SIZE, "%016lx%016lx-%lx", contentHash,
+             optionHash, (uint64_t)st.st_size);
+    return 0;
+}
+
+/*
+ * copyFileData:
+ *   Copy everything from srcFd to dstFd, in the kernel where it can be.
+ */
+static int copyFileData(int srcFd, int dstFd)
+{
+    ssize_t n;
+    while ((n = copy_file_range(srcFd, NULL, dstFd, NULL, 1 << 30, 0)) > 0) {
+    }
+    if (n == 0) {
+        return 0;
+    }
+    if (errno != EXDEV && errno != EINVAL && errno != ENOSYS &&
+        errno != EOPNOTSUPP) {
+        return -1;
+    }
+
+    char buf[1 << 16];
+    while ((n = read(srcFd, buf, sizeof(buf))) > 0) {
+        for (ssize_t done = 0; done < n;) {
+            ssize_t w = write(dstFd, buf + done, n - done);
+            if (w < 0) {
+                return -1;
+            }
+            done += w;
+        }
+    }
+    return n == 0 ? 0 : -1;
+}
+
+/*
+ * cloneFile:
+ *   Create dst (which must not exist) with the given mode and the
+ *   contents of src: a reflink where the filesystem can share extents,
+ *   else a copy. Either way dst is a file of its own, so later writes to
+ *   one never show in the other. Returns 0 or -1.
+ */
+static int cloneFile(const char* src, const char* dst, mode_t mode)
+{
+    int srcFd = open(src, O_RDONLY);
+    if (srcFd < 0) {
+        return -1;
+    }
+    int dstFd = open(dst, O_WRONLY | O_CREAT | O_EXCL, mode);
+    int rc    = -1;
+    if (dstFd >= 0 && ioctl(dstFd, FICLONE, srcFd) != 0) {
+        rc = copyFileData(srcFd, dstFd);
+    }
+    else if (dstFd >= 0) {
+        rc = 0;
+    }
+    if (dstFd >= 0 && close(dstFd) != 0) {
+        rc = -1;
+    }
+    if (rc != 0 && dstFd >= 0) {
+        unlink(dst);
+    }
+    close(srcFd);
+    return rc;
+}
+
+/*
+ * cacheFetch:
+ *   Put the cached output for key at outputFile, replacing whatever is
+ *   there, and mark the entry as just used. Returns true on a hit.
+ */
+static bool cacheFetch(const char* key, const char* outputFile)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", cache.dir, key);
+    bool hit = access(path, F_OK) == 0 &&
+               (unlink(outputFile) == 0 || errno == ENOENT) &&
+               cloneFile(path, outputFile, 0644) == 0;
+    if (hit) {
+        utimensat(AT_FDCWD, path, NULL, 0);
+    }
+
+    pthread_mutex_lock(&cache.lock);
+    if (hit) {
+        cache.hits++;
+    }
+    else {
+        cache.misses++;
+    }
+    pthread_mutex_unlock(&cache.lock);
+    DEBUG_PRINT("Cache %s: %s\n", hit ? "hit" : "miss", key);
+    return hit;
+}
+
+/* One file in the cache directory, for eviction */
+struct cacheEntry {
+    char*           name;
+    uint64_t        size;
+    struct timespec used;
+};
+
+/*
+ * compareCacheEntry:
+ *   qsort comparator putting the least recently used entry first.
+ */
+static int compareCacheEntry(const void* a, const void* b)
+{
+    const struct cacheEntry* ea = a;
+    const struct cacheEntry* eb = b;
+    if (ea->used.tv_sec != eb->used.tv_sec) {
+        return ea->used.tv_sec < eb->used.tv_sec ? -1 : 1;
+    }
+    return (ea->used.tv_nsec > eb->used.tv_nsec) -
+           (ea->used.tv_nsec < eb->used.tv_nsec);
+}
+
+/*
+ * cacheEvict:
+ *   Delete the least recently used entries until the cache holds at most
+ *   maxBytes. Called with cache.lock held.
+ */
+static void cacheEvict(void)
+{
+    DIR* dir = opendir(cache.dir);
+    if (!dir) {
+        return;
+    }
+
+    struct cacheEntry* entries  = NULL;
+    size_t             count    = 0;
+    size_t             capacity = 0;
+    uint64_t           total    = 0;
+    struct dirent*     de;
+    while ((de = readdir(dir))) {
+        struct stat st;
+        if (de->d_name[0] == '.' ||
+            fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+            !S_ISREG(st.st_mode)) {
+            continue; /* temporaries, and anything that is not ours */
+        }
+        if (growArray((void**)&entries, &capacity, count, sizeof(*entries)) !=
+            0) {
+            break;
+        }
+        entries[count].name = strdup(de->d_name);
+        entries[count].size = st.st_size;
+        entries[count].used = st.st_mtim;
+        if (!entries[count].name) {
+            break;
+        }
+        total += entries[count++].size;
+    }
+
+    if (total > cache.maxBytes) {
+        qsort(entries, count, sizeof(*entries), compareCacheEntry);
+        for (size_t i = 0; i < count && total > cache.maxBytes; i++) {
+            if (unlinkat(dirfd(dir), entries[i].name, 0) == 0) {
+                DEBUG_PRINT("Cache evict: %s\n", entries[i].name);
+                total -= entries[i].size;
+                cache.evictions++;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        free(entries[i].name);
+    }
+    free(entries);
+    closedir(dir);
+}
+
+/*
+ * cacheStore:
+ *   Add outputFile to the cache under key, then evict down to the size
+ *   limit. The entry is a read-only copy completed under a temporary name
+ *   and renamed into place, so concurrent runs never see a partial one.
+ *   Failing to store only costs future hits.
+ */
+static void cacheStore(const char* key, const char* outputFile)
+{
+    char path[PATH_MAX];
+    char tmp[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", cache.dir, key);
+
+    pthread_mutex_lock(&cache.lock);
+    uint64_t serial = cache.tmpSerial++;
+    pthread_mutex_unlock(&cache.lock);
+    snprintf(tmp, sizeof(tmp), "%s/.%s.%ld.%lu", cache.dir, key,
+             (long)getpid(), serial);
+
+    if (cloneFile(outputFile, tmp, 0444) != 0 || rename(tmp, path) != 0) {
+        fprintf(stderr, "Warning: cannot add %s to the cache: %s\n",
+                outputFile, strerror(errno));
+        unlink(tmp);
+        return;
+    }
+
+    pthread_mutex_lock(&cache.lock);
+    cacheEvict();
+    pthread_mutex_unlock(&cache.lock);
+}
+
+/*
+ * openOutput:
+ *   Create or truncate an output file for writing. It is written through,
+ *   so other hard links to it see the new output.
+ */
+static int openOutput(const char* outputFile, int flags)
+{
+    return open(outputFile, flags | O_CREAT | O_TRUNC, 0644);
+}
+
+/*
+ * verify_output:
+ *   --verify for an output that was not written by this run (restored
+ *   from --cache): check outputFile against image. Returns 0 or -1.
+ */
+static int verify_output(const squashelf_image_t* image,
+                         const char*              outputFile)
+{
+    int fd = open(outputFile, O_RDONLY);
+    if (fd < 0) {
+        perror("open outputFile");
+        return -1;
+    }
+    int rc = squashelf_verify_fd(image, fd, NULL) == 0 ? 0 : -1;
+    close(fd);
+    return rc;
+}
+
+/*
+ * write_image:
+ *   Write a selected image to outputFile ("-" for stdout), filling
+ *   digests along the way if it is set, and with --verify check the
+ *   result. Returns 0 or -1.
+ */
+static int write_image(const squashelf_image_t* image, const char* outputFile,
+                       struct squashelf_digest* digests)
+{
+    /* Open output file for writing the filtered ELF */
+    bool stdoutOutput = strcmp(outputFile, "-") == 0;
+    int  rc           = -1;
+    int  outputFd     = stdoutOutput
+                            ? STDOUT_FILENO
+                            : openOutput(outputFile, O_RDWR);
+    if (outputFd < 0) {
+        perror("open outputFile");
+        return -1;
+    }
+    DEBUG_PRINT("Opened output file: %s (fd: %d)\n", outputFile, outputFd);
+    rc = digests ? squashelf_write_fd_digests(image, outputFd, digests)
+                 : squashelf_write_fd(image, outputFd);
+    if (rc == 0 && verify && !stdoutOutput &&
+        squashelf_verify_fd(image, outputFd, NULL) != 0) {
+        rc = -1;
+    }
+    if (!stdoutOutput && close(outputFd) != 0 && rc == 0) {
+        perror("close outputFile");
+        rc = -1;
+    }
+    return rc;
+}
+
+/*
+ * update_image:
+ *   Make outputFile the output of image by rewriting, in place, only the
+ *   segments that differ from previousFile, an earlier output of the same
+ *   options. previousFile is first copied to outputFile unless they are
+ *   the same file. Returns 0 when done, 1 if the output has to be written
+ *   in full instead, or -1 on error.
+ */
+static int update_image(const squashelf_image_t* image,
+                        const char* previousFile, const char* outputFile)
+{
+    struct stat prev;
+    struct stat out;
+    if (stat(previousFile, &prev) != 0) {
+        DEBUG_PRINT("No previous output %s (%s); writing in full\n",
+                    previousFile, strerror(errno));
+        return 1;
+    }
+    bool inPlace = stat(outputFile, &out) == 0 &&
+                   out.st_dev == prev.st_dev && out.st_ino == prev.st_ino;
+    if (!inPlace && ((unlink(outputFile) != 0 && errno != ENOENT) ||
+                     cloneFile(previousFile, outputFile, 0644) != 0)) {
+        DEBUG_PRINT("Cannot copy %s to %s (%s); writing in full\n",
+                    previousFile, outputFile, strerror(errno));
+        return 1;
+    }
+
+    int fd = open(outputFile, O_RDWR);
+    if (fd < 0) {
+        perror("open outputFile");
+        return -1;
+    }
+    size_t rewritten;
+    int    rc = squashelf_update_fd(image, fd, &rewritten);
+    if (rc == 0 && verify && squashelf_verify_fd(image, fd, NULL) != 0) {
+        rc = -1;
+    }
+    if (close(fd) != 0 && rc == 0) {
+        perror("close outputFile");
+        rc = -1;
+    }
+    if (rc == 0) {
+        DEBUG_PRINT("Updated %s in place: %zu changed segments rewritten\n",
+                    outputFile, rewritten);
+    }
+    return rc;
+}
+
+/*
+ * writeDigestManifest:
+ *   Write the --manifest JSON for an output: one entry per program
+ *   header with its addresses, sizes, flags and digests. Addresses are
+ *   hex strings, since JSON numbers cannot hold every 64-bit value.
+ */
+static int writeDigestManifest(const char* path, const char* inputFile,
+                               const char* outputFile, int format,
+                               const struct squashelf_digest* digests,
+                               size_t count)
+{
+    FILE* fp = fopen(path, "w");
+    if (!fp) {
+        perror("open manifest output");
+        return -1;
+    }
+
+    fprintf(fp, "{\"input\": ");
+    printJsonString(fp, inputFile);
+    fprintf(fp, ", \"output\": ");
+    printJsonString(fp, outputFile);
+    fprintf(fp, ", \"format\": \"%s\", \"segments\": [",
+            squashelf_format_name(format));
+    for (size_t i = 0; i < count; i++) {
+        const struct squashelf_digest* d = &digests[i];
+        fprintf(fp, "%s\n  {\"lma\": \"0x%lx\", \"vma\": \"0x%lx\", ",
+                i ? "," : "", d->lma, d->vma);
+        if (format == SQUASHELF_FORMAT_ELF) {
+            fprintf(fp, "\"offset\": %lu, ", d->offset);
+        }
+        fprintf(fp,
+                "\"size\": %lu, \"memsz\": %lu, \"flags\": \"%c%c%c\", "
+                "\"crc32\": \"%08x\", \"sha256\": \"",
+                d->size, d->memsz, d->flags & 4 ? 'r' : '-',
+                d->flags & 2 ? 'w' : '-', d->flags & 1 ? 'x' : '-', d->crc32);
+        for (int b = 0; b < 32; b++) {
+            fprintf(fp, "%02x", d->sha256[b]);
+        }
+        fprintf(fp, "\"}");
+    }
+    fprintf(fp, "\n]}\n");
+
+    if (ferror(fp) | (fclose(fp) != 0)) {
+        perror("write manifest output");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * printPlan:
+ *   Write the --plan report for an image: where each output program
+ *   header lands, its sizes and the padding before it, then the totals.
+ *   Offsets and padding only exist in ELF and bin output. As text for
+ *   people, or as one JSON object (addresses as hex strings, as in the
+ *   --manifest output).
+ */
+static void printPlan(FILE* fp, int reportFormat, const char* inputFile,
+                      int format, const squashelf_image_t* image,
+                      const struct squashelf_entry* entries, size_t count)
+{
+    bool     placed  = format == SQUASHELF_FORMAT_ELF ||
+                       format == SQUASHELF_FORMAT_BIN;
+    uint64_t size    = squashelf_image_size(image);
+    uint64_t headers = squashelf_image_headers(image);
+    uint64_t sht     = squashelf_image_sht(image);
+    uint64_t payload = 0;
+    for (size_t i = 0; i < count; i++) {
+        payload += entries[i].size;
+    }
+    /* Before the payloads and, in ELF, between the last one and the SHT */
+    uint64_t padding = size - headers - payload - sht;
+
+    if (reportFormat == STATS_TEXT) {
+        fprintf(fp, "Plan for %s (%s output, %zu segments):\n", inputFile,
+                squashelf_format_name(format), count);
+        fprintf(fp, "  %5s  %-18s  %-18s  %-12s  %12s  %12s  %10s  %s\n", "#",
+                "LMA", "VMA", "offset", "size", "memsz", "padding", "flags");
+        for (size_t i = 0; i < count; i++) {
+            const struct squashelf_entry* e = &entries[i];
+            char offset[24] = "-";
+            char pad[24]    = "-";
+            if (placed) {
+                snprintf(offset, sizeof(offset), "0x%lx", e->offset);
+                snprintf(pad, sizeof(pad), "%lu", e->padding);
+            }
+            fprintf(fp,
+                    "  %5zu  0x%016lx  0x%016lx  %-12s  %12lu  %12lu  %10s  "
+                    "%c%c%c\n",
+                    i, e->lma, e->vma, offset, e->size, e->memsz, pad,
+                    e->flags & 4 ? 'r' : '-', e->flags & 2 ? 'w' : '-',
+                    e->flags & 1 ? 'x' : '-');
+        }
+        if (placed) {
+            fprintf(fp, "  headers %lu bytes, payload %lu bytes, padding %lu "
+                        "bytes",
+                    headers, payload, padding);
+            if (sht) {
+                fprintf(fp, ", section headers %lu bytes", sht);
+            }
+            fprintf(fp, "\n");
+        }
+        else {
+            fprintf(fp, "  payload %lu bytes\n", payload);
+        }
+        fprintf(fp, "  output size %lu bytes\n", size);
+        return;
+    }
+
+    fprintf(fp, "{\"input\": ");
+    printJsonString(fp, inputFile);
+    fprintf(fp, ", \"format\": \"%s\", \"output_bytes\": %lu, ",
+            squashelf_format_name(format), size);
+    if (placed) {
+        fprintf(fp, "\"header_bytes\": %lu, \"padding_bytes\": %lu, ",
+                headers, padding);
+    }
+    if (format == SQUASHELF_FORMAT_ELF) {
+        fprintf(fp, "\"section_header_bytes\": %lu, ", sht);
+    }
+    fprintf(fp, "\"payload_bytes\": %lu, \"segments\": [", payload);
+    for (size_t i = 0; i < count; i++) {
+        const struct squashelf_entry* e = &entries[i];
+        fprintf(fp, "%s\n  {\"lma\": \"0x%lx\", \"vma\": \"0x%lx\", ",
+                i ? "," : "", e->lma, e->vma);
+        if (placed) {
+            fprintf(fp, "\"offset\": %lu, \"padding\": %lu, ", e->offset,
+                    e->padding);
+        }
+        fprintf(fp, "\"size\": %lu, \"memsz\": %lu, \"flags\": \"%c%c%c\"}",
+                e->size, e->memsz, e->flags & 4 ? 'r' : '-',
+                e->flags & 2 ? 'w' : '-', e->flags & 1 ? 'x' : '-');
+    }
+    fprintf(fp, "\n]}\n");
+}
+
+/*
+ * plan_one:
+ *   --plan: select and lay out inputFile as squash_one would, but with
+ *   planOnly, so only the headers are read, and print the plan to
+ *   stdout. No output file is opened. Returns EXIT_SUCCESS or
+ *   EXIT_FAILURE.
+ */
+static int plan_one(const struct squashelf_options* opts,
+                    const char* inputFile, int reportFormat)
+{
+    struct squashelf_options planOpts = *opts;
+    planOpts.planOnly                 = 1;
+
+    squashelf_t* input = squashelf_open_file(inputFile, &planOpts);
+    if (!input) {
+        return EXIT_FAILURE;
+    }
+    squashelf_image_t* image = squashelf_select(input, &planOpts);
+    size_t             count = image ? squashelf_image_segments(image) : 0;
+
+    struct squashelf_entry* entries = NULL;
+    int                     rc      = EXIT_FAILURE;
+    if (image && !(entries = calloc(count ? count : 1, sizeof(*entries)))) {
+        perror("calloc plan entries");
+    }
+    if (entries && squashelf_image_entries(image, entries) == 0) {
+        printPlan(stdout, reportFormat, inputFile, opts->format, image,
+                  entries, count);
+        if (fflush(stdout) != 0 || ferror(stdout)) {
+            perror("write plan");
+        }
+        else {
+            rc = EXIT_SUCCESS;
+        }
+    }
+    free(entries);
+    squashelf_image_free(image);
+    squashelf_close(input);
+    return rc;
+}
+
+/*
+ * squash_one:
+ *   Squash a single input ELF into outputFile according to opts, updating
+ *   previousFile in place if it is set, and writing the segment digests
+ *   to digestFile if that is set. Everything it allocates is released
+ *   before returning, so it can be called repeatedly (and concurrently,
+ *   one file per thread) in one process. Returns EXIT_SUCCESS or
+ *   EXIT_FAILURE.
+ */
+static int squash_one(const struct squashelf_options* opts,
+                      const char* inputFile, const char* outputFile,
+                      const char* previousFile, const char* digestFile)
+{
+    DEBUG_PRINT("Input file: %s\n", inputFile);
+    DEBUG_PRINT("Output file: %s\n", outputFile);
+
+    /* "-" for either file selects the sequential pipe-friendly path. The
+       other formats are written sequentially anyway, so for them only
+       stdin input needs it (and is not supported). */
+    bool stdinInput   = strcmp(inputFile, "-") == 0;
+    bool stdoutOutput = strcmp(outputFile, "-") == 0;
+    if (verify && (stdinInput || stdoutOutput)) {
+        fprintf(stderr, "Error: --verify needs an input file and an output "
+                        "file\n");
+        return EXIT_FAILURE;
+    }
+    if (stdinInput && opts->format != SQUASHELF_FORMAT_ELF) {
+        fprintf(stderr, "Error: %s output cannot be produced from stdin\n",
+                squashelf_format_name(opts->format));
+        return EXIT_FAILURE;
+    }
+    if (stdinInput || (stdoutOutput && opts->format == SQUASHELF_FORMAT_ELF)) {
+        int inputFd  = STDIN_FILENO;
+        int outputFd = STDOUT_FILENO;
+        int rc       = -1;
+        if (!stdinInput && (inputFd = open(inputFile, O_RDONLY)) < 0) {
+            perror("open inputFile");
+            return EXIT_FAILURE;
+        }
+        if (!stdoutOutput) {
+            outputFd = openOutput(outputFile, O_WRONLY);
+        }
+        if (outputFd < 0) {
+            perror("open outputFile");
+        }
+        else {
+            rc = squashelf_stream(inputFd, outputFd, opts);
+            if (!stdoutOutput && close(outputFd) != 0 && rc == 0) {
+                perror("close outputFile");
+                rc = -1;
+            }
+        }
+        if (!stdinInput) {
+            close(inputFd);
+        }
+        return rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    /* A cached output skips the library altogether, so it has no
+       digests to report; with --verify it is still checked */
+    char key[CACHE_KEY_SIZE];
+    bool cached   = cache.dir && !stdoutOutput && !digestFile &&
+                    cacheKey(opts, inputFile, key) == 0;
+    bool restored = cached && cacheFetch(key, outputFile);
+    if (restored && !verify) {
+        return EXIT_SUCCESS;
+    }
+
+    squashelf_t* input = squashelf_open_file(inputFile, opts);
+    if (!input) {
+        return EXIT_FAILURE;
+    }
+    squashelf_image_t*       image   = squashelf_select(input, opts);
+    struct squashelf_digest* digests = NULL;
+    int                      rc      = image ? 1 : -1;
+    if (image && digestFile &&
+        !(digests = calloc(squashelf_image_segments(image) + 1,
+                           sizeof(*digests)))) {
+        perror("calloc digests");
+        rc = -1;
+    }
+    if (rc == 1 && restored) {
+        rc = verify_output(image, outputFile);
+    }
+    if (rc == 1 && previousFile) {
+        rc = update_image(image, previousFile, outputFile);
+        if (rc == 0 && digests) {
+            rc = squashelf_digest_image(image, digests);
+        }
+    }
+    if (rc == 1) {
+        rc = write_image(image, outputFile, digests);
+    }
+    if (rc == 0 && digests) {
+        rc = writeDigestManifest(digestFile, inputFile, outputFile,
+                                 opts->format, digests,
+                                 squashelf_image_segments(image));
+    }
+    free(digests);
+    squashelf_image_free(image);
+    squashelf_close(input);
+    if (cached && !restored && rc == 0) {
+        cacheStore(key, outputFile);
+    }
+    return rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* One -o output of squash_regions */
+struct regionJob {
+    const struct regionOutput* output;
+    squashelf_image_t*         image;  /* NULL if selection failed */
+    size_t                     index;  /* position on the command line */
+    dev_t                      device; /* of the output's directory */
+    struct squashelf_stats     stats;  /* this output's share of --stats */
+    int                        status;
+};
+
+/* Region writes grouped by output device, claimed by writer threads */
+struct regionQueue {
+    struct regionJob* jobs; /* sorted by device */
+    size_t            count;
+    size_t            next; /* first job of the next unclaimed device */
+    pthread_mutex_t   lock;
+};
+
+/*
+ * outputDevice:
+ *   Device holding outputFile's directory (the file itself may not exist
+ *   yet), or 0 if it cannot be determined.
+ */
+static dev_t outputDevice(const char* outputFile)
+{
+    struct stat st;
+    char*       copy = strdup(outputFile);
+    dev_t       dev  = 0;
+    if (copy && stat(dirname(copy), &st) == 0) {
+        dev = st.st_dev;
+    }
+    free(copy);
+    return dev;
+}
+
+/*
+ * compareRegionJob:
+ *   qsort comparator grouping jobs by device, in command-line order
+ *   within a device.
+ */
+static int compareRegionJob(const void* a, const void* b)
+{
+    const struct regionJob* ja = a;
+    const struct regionJob* jb = b;
+    if (ja->device != jb->device) {
+        return ja->device < jb->device ? -1 : 1;
+    }
+    return ja->index < jb->index ? -1 : ja->index > jb->index;
+}
+
+/*
+ * regionWorker:
+ *   Writer thread: claim all outputs on the next device and write them
+ *   one after another, so each device sees one sequential writer.
+ */
+static void* regionWorker(void* arg)
+{
+    struct regionQueue* queue = arg;
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        size_t first = queue->next;
+        size_t last  = first;
+        while (last < queue->count &&
+               queue->jobs[last].device == queue->jobs[first].device) {
+            last++;
+        }
+        queue->next = last;
+        pthread_mutex_unlock(&queue->lock);
+        if (first >= queue->count) {
+            return NULL;
+        }
+
+        for (size_t i = first; i < last; i++) {
+            struct regionJob* job = &queue->jobs[i];
+            if (job->image &&
+                write_image(job->image, job->output->outputFile, NULL) == 0) {
+                job->status = EXIT_SUCCESS;
+            }
+        }
+    }
+}
+
+/*
+ * addStats:
+ *   Add the counters of src to dst.
+ */
+static void addStats(struct squashelf_stats*       dst,
+                     const struct squashelf_stats* src)
+{
+    for (int p = 0; p < SQUASHELF_PHASE_COUNT; p++) {
+        dst->phaseNs[p] += src->phaseNs[p];
+    }
+    dst->segmentsScanned += src->segmentsScanned;
+    dst->segmentsKept    += src->segmentsKept;
+    dst->payloadBytes    += src->payloadBytes;
+    dst->outputBytes     += src->outputBytes;
+    dst->sparseBytes     += src->sparseBytes;
+    dst->trimmedBytes    += src->trimmedBytes;
+    dst->overlaps        += src->overlaps;
+    dst->paddingBytes    += src->paddingBytes;
+    dst->paddingRemoved  += src->paddingRemoved;
+    dst->uringRequests   += src->uringRequests;
+    dst->uringCalls      += src->uringCalls;
+    dst->uringDepthSum   += src->uringDepthSum;
+    dst->uringBytes      += src->uringBytes;
+    dst->uringNs         += src->uringNs;
+    if (src->uringDepthMax > dst->uringDepthMax) {
+        dst->uringDepthMax = src->uringDepthMax;
+    }
+}
+
+/*
+ * squash_regions:
+ *   Parse inputFile once and write every -o region from it, each with
+ *   the ranges tagged with its name. Selection runs here, since a libelf
+ *   descriptor is not safe to share between threads, but the writes only
+ *   read the input's mapping or pread its fd, so they run in parallel:
+ *   one thread per output device (at most workers, if non-zero), reading
+ *   the segment data through the one shared mapping. A region that fails
+ *   is reported and does not stop the others. Returns EXIT_SUCCESS or
+ *   EXIT_FAILURE.
+ */
+static int squash_regions(const struct squashelf_options* opts,
+                          const char* inputFile,
+                          const struct regionOutput* outputs,
+                          size_t outputCount, const struct namedRange* ranges,
+                          size_t rangeCount, long workers)
+{
+    struct regionQueue      queue  = {.lock = PTHREAD_MUTEX_INITIALIZER};
+    struct squashelf_range* regionRanges = NULL;
+    squashelf_t*            input  = NULL;
+    int                     status = EXIT_FAILURE;
+
+    if (strcmp(inputFile, "-") == 0) {
+        fprintf(stderr, "Error: region outputs cannot be produced from "
+                        "stdin\n");
+        return EXIT_FAILURE;
+    }
+    regionRanges = malloc(rangeCount * sizeof(*regionRanges));
+    queue.jobs   = calloc(outputCount, sizeof(*queue.jobs));
+    queue.count  = outputCount;
+    if (!regionRanges || !queue.jobs) {
+        perror("malloc region jobs");
+        goto out;
+    }
+    input = squashelf_open_file(inputFile, opts);
+    if (!input) {
+        goto out;
+    }
+
+    size_t devices = 0;
+    for (size_t i = 0; i < outputCount; i++) {
+        struct regionJob*        job        = &queue.jobs[i];
+        struct squashelf_options regionOpts = *opts;
+
+        job->output = &outputs[i];
+        job->index  = i;
+        job->device = outputDevice(outputs[i].outputFile);
+        job->status = EXIT_FAILURE;
+        if (opts->stats) {
+            regionOpts.stats = &job->stats;
+        }
+        regionOpts.ranges     = regionRanges;
+        regionOpts.rangeCount = 0;
+        for (size_t r = 0; r < rangeCount; r++) {
+            if (strcmp(ranges[r].region, outputs[i].region) == 0) {
+                regionRanges[regionOpts.rangeCount++] = ranges[r].range;
+            }
+        }
+        DEBUG_PRINT("Region %s: %zu ranges -> %s\n", outputs[i].region,
+                    regionOpts.rangeCount, outputs[i].outputFile);
+        job->image = squashelf_select(input, &regionOpts);
+
+        bool newDevice = true;
+        for (size_t j = 0; j < i; j++) {
+            newDevice = newDevice && queue.jobs[j].device != job->device;
+        }
+        devices += newDevice;
+    }
+    qsort(queue.jobs, queue.count, sizeof(*queue.jobs), compareRegionJob);
+
+    long threadCount = (long)devices;
+    if (workers > 0 && workers < threadCount) {
+        threadCount = workers;
+    }
+    DEBUG_PRINT("Regions: %zu outputs on %zu devices, %ld writer threads\n",
+                outputCount, devices, threadCount);
+
+    pthread_t* threads = threadCount > 1 ? calloc(threadCount, sizeof(*threads))
+                                         : NULL;
+    long       started = 0;
+    for (; threads && started < threadCount; started++) {
+        int err = pthread_create(&threads[started], NULL, regionWorker, &queue);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            break;
+        }
+    }
+    if (started == 0) {
+        regionWorker(&queue); /* one device, or no threads: write inline */
+    }
+    for (long i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    status = EXIT_SUCCESS;
+    for (size_t i = 0; i < queue.count; i++) {
+        const struct regionJob* job = &queue.jobs[i];
+        if (job->status != EXIT_SUCCESS) {
+            fprintf(stderr, "Failed: region %s -> %s\n", job->output->region,
+                    job->output->outputFile);
+            status = EXIT_FAILURE;
+        }
+        if (opts->stats) {
+            addStats(opts->stats, &job->stats);
+        }
+    }
+
+out:
+    for (size_t i = 0; queue.jobs && i < queue.count; i++) {
+        squashelf_image_free(queue.jobs[i].image);
+    }
+    squashelf_close(input);
+    free(queue.jobs);
+    free(regionRanges);
+    return status;
+}
+
+/* One input/output pair of a batch run */
+struct batchJob {
+    const char*          inputFile;
+    const char*          outputFile;
+    struct squashelf_options opts; /* global options, plus a per-job range */
+    struct squashelf_stats   stats; /* this job's share of --stats */
+    int                  status;
+};
+
+/* State shared by the batch worker threads */
+struct batchQueue {
+    struct batchJob* jobs;
+    size_t           count;
+    size_t           next; /* index of the next unclaimed job */
+    pthread_mutex_t  lock;
+};
+
+/*
+ * loadManifest:
+ *   Parse a batch manifest ("-" for stdin) into jobs. Each non-blank line
+ *   is "input output [min-max]"; '#' starts a comment. Paths cannot
+ *   contain whitespace. The strings stay owned by the returned jobs;
+ *   freeManifest releases them.
+ */
+static int loadManifest(const char* manifestFile,
+                        const struct squashelf_options* defaults,
+                        struct batchJob** jobsOut, size_t* countOut)
+{
+    FILE* fp = strcmp(manifestFile, "-") == 0 ? stdin
+                                              : fopen(manifestFile, "r");
+    if (!fp) {
+        perror("open manifest");
+        return -1;
+    }
+
+    struct batchJob* jobs     = NULL;
+    size_t           count    = 0;
+    size_t           capacity = 0;
+    char*            line     = NULL;
+    size_t           lineCap  = 0;
+    size_t           lineNo   = 0;
+    int              rc       = -1;
+
+    while (getline(&line, &lineCap, fp) >= 0) {
+        lineNo++;
+        char* hash = strchr(line, '#');
+        if (hash) {
+            *hash = '\0';
+        }
+
+        char* save;
+        char* input  = strtok_r(line, " \t\r\n", &save);
+        char* output = strtok_r(NULL, " \t\r\n", &save);
+        char* range  = strtok_r(NULL, " \t\r\n", &save);
+        if (!input) {
+            continue; /* blank or comment-only line */
+        }
+        if (!output || strtok_r(NULL, " \t\r\n", &save)) {
+            fprintf(stderr,
+                    "%s:%zu: expected \"input output [min-max]\"\n",
+                    manifestFile, lineNo);
+            goto out;
+        }
+
+        if (count == capacity) {
+            size_t           newCap = capacity ? capacity * 2 : 64;
+            struct batchJob* grown  = realloc(jobs, newCap * sizeof(*jobs));
+            if (!grown) {
+                perror("realloc batch jobs");
+                goto out;
+            }
+            jobs     = grown;
+            capacity = newCap;
+        }
+
+        struct batchJob* job = &jobs[count];
+        job->opts            = *defaults;
+        if (range) {
+            if (parseRange(range, &job->opts.minLma, &job->opts.maxLma) != 0) {
+                fprintf(stderr, "%s:%zu: bad range\n", manifestFile, lineNo);
+                goto out;
+            }
+            job->opts.hasRange   = 1;
+            job->opts.rangeCount = 0; /* replaces --range */
+        }
+        job->inputFile  = strdup(input);
+        job->outputFile = strdup(output);
+        count++;
+        if (!job->inputFile || !job->outputFile) {
+            perror("strdup manifest entry");
+            goto out;
+        }
+    }
+    if (ferror(fp)) {
+        perror("read manifest");
+        goto out;
+    }
+    rc = 0;
+
+out:
+    free(line);
+    if (fp != stdin) {
+        fclose(fp);
+    }
+    *jobsOut  = jobs;
+    *countOut = count;
+    return rc;
+}
+
+/*
+ * batchWorker:
+ *   Pool thread: keep claiming the next job and squashing it until the
+ *   queue is drained. A failed job is recorded and does not stop others.
+ *   Each worker keeps one arena for segment buffers across its jobs.
+ */
+static void* batchWorker(void* arg)
+{
+    struct batchQueue* queue = arg;
+    squashelf_arena_t* arena = squashelf_arena_new(); /* NULL: per write */
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        size_t index = queue->next++;
+        pthread_mutex_unlock(&queue->lock);
+        if (index >= queue->count) {
+            squashelf_arena_free(arena);
+            return NULL;
+        }
+
+        struct batchJob* job = &queue->jobs[index];
+        job->opts.arena      = arena;
+        job->status = squash_one(&job->opts, job->inputFile, job->outputFile,
+                                 NULL, NULL);
+        if (job->status != EXIT_SUCCESS) {
+            fprintf(stderr, "Failed: %s -> %s\n", job->inputFile,
+                    job->outputFile);
+        }
+    }
+}
+
+/*
+ * runBatch:
+ *   Squash every job from the manifest (or from argv input/output pairs)
+ *   on a fixed pool of worker threads. Fails if any single job failed.
+ */
+static int runBatch(const struct squashelf_options* opts,
+                    const char* manifestFile, char** pairs, int pairCount,
+                    long workers)
+{
+    struct batchQueue queue = {.lock = PTHREAD_MUTEX_INITIALIZER};
+    int               rc    = EXIT_FAILURE;
+
+    if (manifestFile) {
+        if (loadManifest(manifestFile, opts, &queue.jobs, &queue.count) != 0) {
+            goto out;
+        }
+    }
+    else {
+        queue.count = pairCount / 2;
+        queue.jobs  = calloc(queue.count, sizeof(*queue.jobs));
+        if (!queue.jobs) {
+            perror("calloc batch jobs");
+            goto out;
+        }
+        for (size_t i = 0; i < queue.count; i++) {
+            queue.jobs[i].inputFile  = pairs[2 * i];
+            queue.jobs[i].outputFile = pairs[2 * i + 1];
+            queue.jobs[i].opts       = *opts;
+        }
+    }
+
+    if (workers == 0) {
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (workers < 1) {
+        workers = 1;
+    }
+    if ((size_t)workers > queue.count) {
+        workers = queue.count ? (long)queue.count : 1;
+    }
+    DEBUG_PRINT("Batch: %zu jobs on %ld workers\n", queue.count, workers);
+
+    /* Workers must not share one stats block; each job fills its own and
+       they are added up once all are done */
+    for (size_t i = 0; opts->stats && i < queue.count; i++) {
+        queue.jobs[i].opts.stats = &queue.jobs[i].stats;
+    }
+
+    pthread_t* threads = calloc(workers, sizeof(*threads));
+    if (!threads) {
+        perror("calloc batch workers");
+        goto out;
+    }
+    long started = 0;
+    for (; started < workers; started++) {
+        int err = pthread_create(&threads[started], NULL, batchWorker, &queue);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            break;
+        }
+    }
+    if (started == 0) {
+        batchWorker(&queue); /* no threads at all: run the queue inline */
+    }
+    for (long i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    size_t failed = 0;
+    for (size_t i = 0; i < queue.count; i++) {
+        failed += queue.jobs[i].status != EXIT_SUCCESS;
+    }
+    for (size_t i = 0; opts->stats && i < queue.count; i++) {
+        addStats(opts->stats, &queue.jobs[i].stats);
+    }
+    if (failed) {
+        fprintf(stderr, "Batch: %zu of %zu jobs failed\n", failed,
+                queue.count);
+    }
+    else {
+        rc = EXIT_SUCCESS;
+    }
+    DEBUG_PRINT("Batch finished: %zu ok, %zu failed\n", queue.count - failed,
+                failed);
+
+out:
+    if (manifestFile) {
+        for (size_t i = 0; i < queue.count; i++) {
+            free((char*)queue.jobs[i].inputFile);
+            free((char*)queue.jobs[i].outputFile);
+        }
+    }
+    free(queue.jobs);
+    return rc;
+}
+
+/* Longest --serve request line, and most descriptors one connection may
+   have passed that no request has taken yet */
+#define SERVE_LINE_MAX 65536
+#define SERVE_FDS_MAX  16
+
+/*
+ * inputEntry:
+ *   An input --serve keeps open between requests: its descriptor, the
+ *   mapping and parsed headers behind input, keyed by the device, inode,
+ *   size and mtime of the file. Selections from one input must not run
+ *   concurrently, so lock is held across squashelf_select; writes from
+ *   the image need no lock. An entry evicted while requests use it is
+ *   closed by the last of them.
+ */
+struct inputEntry {
+    dev_t              dev;
+    ino_t              ino;
+    off_t              size;
+    struct timespec    mtime;
+    int                fd;    /* owned; the input reads through it */
+    squashelf_t*       input;
+    pthread_mutex_t    lock;  /* serialises squashelf_select */
+    size_t             refs;  /* requests using the entry */
+    bool               evicted;
+    struct inputEntry* prev;  /* LRU list, most recently used first */
+    struct inputEntry* next;
+};
+
+/* The --serve input LRU, with the counters reported on shutdown */
+struct inputCache {
+    pthread_mutex_t    lock;
+    struct inputEntry* head;
+    struct inputEntry* tail;
+    size_t             count;
+    size_t             max; /* entries kept without users */
+    uint64_t           hits;
+    uint64_t           misses;
+    uint64_t           evictions;
+};
+
+/*
+ * serveConn:
+ *   One client connection. It is owned by one thread at a time: the
+ *   event loop while it waits for input (armed with EPOLLONESHOT), or
+ *   the worker running its current request, so its fields need no lock.
+ *   Requests of a connection run one after another; clients get
+ *   concurrency by opening several.
+ */
+struct serveConn {
+    int               fd;
+    char*             buf;  /* bytes received but not yet handled */
+    size_t            len;
+    int               fds[SERVE_FDS_MAX]; /* passed, not yet taken */
+    size_t            fdCount;
+    bool              eof;
+    struct serveConn* queued; /* next in the request queue */
+    struct serveConn* prev;   /* list of open connections */
+    struct serveConn* next;
+};
+
+/* State shared by the --serve event loop and its workers */
+struct server {
+    const struct squashelf_options* opts;
+    int                             epfd;
+    pthread_mutex_t                 lock;  /* queue, conns, stats */
+    pthread_cond_t                  ready; /* queue not empty, or stop */
+    struct serveConn*               head;  /* connections with a request */
+    struct serveConn*               tail;
+    bool                            stopping;
+    struct serveConn*               conns;
+    struct inputCache               inputs;
+    struct squashelf_stats          stats; /* summed over requests */
+    uint64_t                        requests;
+    uint64_t                        failed;
+};
+
+/*
+ * closeInput:
+ *   Release a cache entry nobody uses any more.
+ */
+static void closeInput(struct inputEntry* entry)
+{
+    squashelf_close(entry->input);
+    close(entry->fd);
+    pthread_mutex_destroy(&entry->lock);
+    free(entry);
+}
+
+/*
+ * unlinkInput:
+ *   Take entry off the LRU list of cache; the lock must be held.
+ */
+static void unlinkInput(struct inputCache* cache, struct inputEntry* entry)
+{
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    }
+    else {
+        cache->head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    }
+    else {
+        cache->tail = entry->prev;
+    }
+    entry->prev = entry->next = NULL;
+    cache->count--;
+}
+
+/*
+ * pushInput:
+ *   Put entry at the front of the LRU list of cache; the lock must be
+ *   held.
+ */
+static void pushInput(struct inputCache* cache, struct inputEntry* entry)
+{
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head) {
+        cache->head->prev = entry;
+    }
+    else {
+        cache->tail = entry;
+    }
+    cache->head = entry;
+    cache->count++;
+}
+
+/*
+ * findInput:
+ *   The cached entry opened from the file st describes, or NULL; the lock
+ *   must be held. A file that was modified has a new mtime, and so never
+ *   matches the entry of its old contents.
+ */
+static struct inputEntry* findInput(struct inputCache* cache,
+                                    const struct stat* st)
+{
+    for (struct inputEntry* e = cache->head; e; e = e->next) {
+        if (e->dev == st->st_dev && e->ino == st->st_ino &&
+            e->size == st->st_size &&
+            e->mtime.tv_sec == st->st_mtim.tv_sec &&
+            e->mtime.tv_nsec == st->st_mtim.tv_nsec) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * acquireInput:
+ *   Get the open input for the regular file on fd (which stays the
+ *   caller's) from cache, opening a duplicate of fd with opts on a miss,
+ *   and take a reference to it. Entries without users beyond cache->max
+ *   are closed, least recently used first. Returns NULL on failure.
+ */
+static struct inputEntry* acquireInput(struct inputCache* cache, int fd,
+                                       const struct squashelf_options* opts)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("fstat input");
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    struct inputEntry* entry = findInput(cache, &st);
+    if (entry) {
+        unlinkInput(cache, entry);
+        pushInput(cache, entry);
+        entry->refs++;
+        cache->hits++;
+        pthread_mutex_unlock(&cache->lock);
+        return entry;
+    }
+    cache->misses++;
+    pthread_mutex_unlock(&cache->lock);
+
+    /* Open outside the lock: a large or compressed input takes a while */
+    struct inputEntry* fresh = calloc(1, sizeof(*fresh));
+    if (!fresh) {
+        perror("calloc input entry");
+        return NULL;
+    }
+    fresh->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (fresh->fd < 0) {
+        perror("dup input");
+        free(fresh);
+        return NULL;
+    }
+    fresh->input = squashelf_open_fd(fresh->fd, opts);
+    if (!fresh->input) {
+        close(fresh->fd);
+        free(fresh);
+        return NULL;
+    }
+    fresh->dev   = st.st_dev;
+    fresh->ino   = st.st_ino;
+    fresh->size  = st.st_size;
+    fresh->mtime = st.st_mtim;
+    fresh->refs  = 1;
+    pthread_mutex_init(&fresh->lock, NULL);
+
+    struct inputEntry* victims = NULL;
+    pthread_mutex_lock(&cache->lock);
+    if ((entry = findInput(cache, &st))) {
+        /* Another request opened it meanwhile; use that one */
+        unlinkInput(cache, entry);
+        pushInput(cache, entry);
+        entry->refs++;
+    }
+    else {
+        entry = fresh;
+        fresh = NULL;
+        pushInput(cache, entry);
+    }
+    for (struct inputEntry* e = cache->tail; e && cache->count > cache->max;) {
+        struct inputEntry* prev = e->prev;
+        unlinkInput(cache, e);
+        e->evicted = true;
+        cache->evictions++;
+        if (e->refs == 0) {
+            e->next = victims;
+            victims = e;
+        }
+        e = prev;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    if (fresh) {
+        closeInput(fresh);
+    }
+    while (victims) {
+        struct inputEntry* next = victims->next;
+        closeInput(victims);
+        victims = next;
+    }
+    return entry;
+}
+
+/*
+ * releaseInput:
+ *   Drop a reference taken by acquireInput, closing an evicted entry
+ *   once nobody uses it.
+ */
+static void releaseInput(struct inputCache* cache, struct inputEntry* entry)
+{
+    pthread_mutex_lock(&cache->lock);
+    bool last = --entry->refs == 0 && entry->evicted;
+    pthread_mutex_unlock(&cache->lock);
+    if (last) {
+        closeInput(entry);
+    }
+}
+
+/*
+ * lookupName:
+ *   The value in [0, count) that name() maps to str, or -1.
+ */
+static int lookupName(const char* (*name)(int), int count, const char* str)
+{
+    for (int i = 0; i < count; i++) {
+        if (strcmp(str, name(i)) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * isOption:
+ *   Whether the len bytes at word spell the option name.
+ */
+static bool isOption(const char* word, size_t len, const char* name)
+{
+    return strlen(name) == len && strncmp(word, name, len) == 0;
+}
+
+/*
+ * parseRequestOption:
+ *   Apply one option word of a --serve request to opts, spelled like the
+ *   command-line option (--name or --name=VALUE). A --range is appended
+ *   to ranges, which has room for one per word. Returns 0, or -1 if the
+ *   option is unknown, malformed or not available per request.
+ */
+static int parseRequestOption(const char* word, struct squashelf_options* opts,
+                              struct squashelf_range* ranges,
+                              size_t* rangeCount)
+{
+    const char* value = strchr(word, '=');
+    size_t      len   = value ? (size_t)(value++ - word) : strlen(word);
+    int         n;
+
+    if (isOption(word, len, "-n") || isOption(word, len, "--nosht")) {
+        opts->noSht = 1;
+    }
+    else if (isOption(word, len, "-z") ||
+             isOption(word, len, "--zero-size-segments")) {
+        opts->allowZeroSizeSeg = 1;
+    }
+    else if (isOption(word, len, "--clip")) {
+        opts->clip = 1;
+    }
+    else if (isOption(word, len, "--sparse")) {
+        opts->sparse = 1;
+    }
+    else if (isOption(word, len, "--trim-zeros")) {
+        opts->trimZeros = 1;
+    }
+    else if (isOption(word, len, "--pack")) {
+        opts->layout = SQUASHELF_LAYOUT_PACK;
+    }
+    else if (isOption(word, len, "--coalesce")) {
+        opts->coalesce = 1;
+        if (value && parseSize(value, &opts->coalesceGap) != 0) {
+            return -1;
+        }
+    }
+    else if (isOption(word, len, "--check-overlap")) {
+        opts->overlap = SQUASHELF_OVERLAP_WARN;
+        if (value && (opts->overlap = lookupName(squashelf_overlap_name,
+                                                 SQUASHELF_OVERLAP_COUNT,
+                                                 value)) < 0) {
+            return -1;
+        }
+    }
+    else if (!value) {
+        return -1; /* the rest all take a value */
+    }
+    else if (isOption(word, len, "--range")) {
+        struct squashelf_range* range = &ranges[(*rangeCount)++];
+        if (parseRange(value, &range->minLma, &range->maxLma) != 0) {
+            return -1;
+        }
+    }
+    else if (isOption(word, len, "--format")) {
+        if ((n = lookupName(squashelf_format_name, SQUASHELF_FORMAT_COUNT,
+                            value)) < 0) {
+            return -1;
+        }
+        opts->format = n;
+    }
+    else if (isOption(word, len, "--layout")) {
+        if ((n = lookupName(squashelf_layout_name, SQUASHELF_LAYOUT_COUNT,
+                            value)) < 0) {
+            return -1;
+        }
+        opts->layout = n;
+    }
+    else if (isOption(word, len, "--writer")) {
+        if ((n = lookupName(squashelf_writer_name, SQUASHELF_WRITER_COUNT,
+                            value)) < 0) {
+            return -1;
+        }
+        opts->writer = n;
+    }
+    else if (isOption(word, len, "--gap-fill")) {
+        char* end;
+        long  fill = strtol(value, &end, 0);
+        if (*end != '\0' || fill < 0 || fill > 0xff) {
+            return -1;
+        }
+        opts->gapFill = (int)fill;
+    }
+    else if (isOption(word, len, "--compress")) {
+        return parseCodec(value, &opts->codec, &opts->codecLevel);
+    }
+    else {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * takeFd:
+ *   The next descriptor passed on conn, now owned by the caller, or -1.
+ */
+static int takeFd(struct serveConn* conn)
+{
+    if (conn->fdCount == 0) {
+        return -1;
+    }
+    int fd = conn->fds[0];
+    memmove(conn->fds, conn->fds + 1, --conn->fdCount * sizeof(*conn->fds));
+    return fd;
+}
+
+/*
+ * emptyOutputFd:
+ *   Prepare a passed output: a regular file is emptied, so it can be
+ *   written like an output path. Returns 0 or -1.
+ */
+static int emptyOutputFd(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        (ftruncate(fd, 0) != 0 || lseek(fd, 0, SEEK_SET) != 0)) {
+        perror("truncate output");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * writeImageFd:
+ *   Write image to a passed output descriptor. A regular file is written
+ *   like an output path; anything else (a pipe or socket) gets ELF output
+ *   built in arena first, since the ELF writers need to seek, and the
+ *   other formats straight away.
+ */
+static int writeImageFd(const squashelf_image_t* image, int fd, int format,
+                        squashelf_arena_t* arena)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("fstat output");
+        return -1;
+    }
+    if (S_ISREG(st.st_mode) || format != SQUASHELF_FORMAT_ELF) {
+        return squashelf_write_fd(image, fd);
+    }
+
+    void*  buf;
+    size_t size;
+    if (squashelf_write_mem(image, arena, &buf, &size) != 0) {
+        return -1;
+    }
+    for (size_t done = 0; done < size;) {
+        ssize_t n = write(fd, (char*)buf + done, size - done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("write output");
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+/*
+ * runRequest:
+ *   Carry out one --serve request line: "input output [option]...",
+ *   where input or output "-" takes the next descriptor passed on conn.
+ *   The descriptors are taken before anything else, so a request that is
+ *   refused still uses up its own and never leaves them to the next one.
+ *   Regular input files are selected from through the input cache;
+ *   anything else is streamed. Returns 0, or -1 with why in error.
+ */
+static int runRequest(struct server* srv, struct serveConn* conn, char* line,
+                      struct squashelf_options* opts, squashelf_arena_t* arena,
+                      char* error, size_t errorSize)
+{
+    size_t                  maxWords   = strlen(line) / 2 + 1;
+    struct squashelf_range* ranges     = malloc(maxWords * sizeof(*ranges));
+    char*                   save;
+    char*                   inputArg   = strtok_r(line, " \t\r", &save);
+    char*                   outputArg  = strtok_r(NULL, " \t\r", &save);
+    size_t                  rangeCount = 0;
+    struct inputEntry*      entry      = NULL;
+    squashelf_image_t*      image      = NULL;
+    int                     rc         = -1;
+
+    bool passedInput  = inputArg && strcmp(inputArg, "-") == 0;
+    bool passedOutput = outputArg && strcmp(outputArg, "-") == 0;
+    int  inputFd      = passedInput ? takeFd(conn) : -1;
+    int  outputFd     = passedOutput ? takeFd(conn) : -1;
+
+    if (!ranges) {
+        snprintf(error, errorSize, "out of memory");
+        goto out;
+    }
+    if (!inputArg || !outputArg) {
+        snprintf(error, errorSize, "expected \"input output [option]...\"");
+        goto out;
+    }
+    for (char* word; (word = strtok_r(NULL, " \t\r", &save));) {
+        if (parseRequestOption(word, opts, ranges, &rangeCount) != 0) {
+            snprintf(error, errorSize, "bad option '%s'", word);
+            goto out;
+        }
+    }
+    if (rangeCount) {
+        opts->ranges     = ranges; /* replace the server's ranges */
+        opts->rangeCount = rangeCount;
+        opts->hasRange   = 0;
+    }
+
+    if (!passedInput) {
+        inputFd = open(inputArg, O_RDONLY | O_CLOEXEC);
+    }
+    if (inputFd < 0) {
+        snprintf(error, errorSize, "cannot open input %s", inputArg);
+        goto out;
+    }
+    if (!passedOutput) {
+        outputFd = openOutput(outputArg, O_RDWR | O_CLOEXEC);
+    }
+    else if (outputFd >= 0 && emptyOutputFd(outputFd) != 0) {
+        close(outputFd);
+        outputFd = -1;
+    }
+    if (outputFd < 0) {
+        snprintf(error, errorSize, "cannot open output %s", outputArg);
+        goto out;
+    }
+
+    struct stat st;
+    if (fstat(inputFd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        if (opts->format != SQUASHELF_FORMAT_ELF) {
+            snprintf(error, errorSize, "%s output needs a regular input file",
+                     squashelf_format_name(opts->format));
+            goto out;
+        }
+        rc = squashelf_stream(inputFd, outputFd, opts);
+    }
+    else if ((entry = acquireInput(&srv->inputs, inputFd, opts))) {
+        pthread_mutex_lock(&entry->lock);
+        image = squashelf_select(entry->input, opts);
+        pthread_mutex_unlock(&entry->lock);
+        if (image) {
+            rc = passedOutput ? writeImageFd(image, outputFd, opts->format,
+                                             arena)
+                              : squashelf_write_fd(image, outputFd);
+        }
+    }
+    if (rc != 0) {
+        snprintf(error, errorSize, "squash failed (see the server log)");
+    }
+
+out:
+    squashelf_image_free(image);
+    if (entry) {
+        releaseInput(&srv->inputs, entry);
+    }
+    if (inputFd >= 0) {
+        close(inputFd);
+    }
+    if (outputFd >= 0 && close(outputFd) != 0 && rc == 0) {
+        snprintf(error, errorSize, "cannot close output %s", outputArg);
+        rc = -1;
+    }
+    free(ranges);
+    return rc;
+}
+
+/*
+ * sendReply:
+ *   Send one reply line to the client of conn. A client that went away
+ *   is noticed when its connection is read next.
+ */
+static void sendReply(struct serveConn* conn, const char* reply)
+{
+    size_t len = strlen(reply);
+    for (size_t done = 0; done < len;) {
+        ssize_t n = send(conn->fd, reply + done, len - done, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        done += n;
+    }
+}
+
+/*
+ * closeConn:
+ *   Close a connection and the descriptors it was passed but never used.
+ */
+static void closeConn(struct server* srv, struct serveConn* conn)
+{
+    pthread_mutex_lock(&srv->lock);
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    }
+    else {
+        srv->conns = conn->next;
+    }
+    if (conn->next) {
+        conn->next->prev = conn->prev;
+    }
+    pthread_mutex_unlock(&srv->lock);
+
+    while (conn->fdCount) {
+        close(takeFd(conn));
+    }
+    close(conn->fd); /* also takes it out of the epoll set */
+    free(conn->buf);
+    free(conn);
+}
+
+/*
+ * dispatchConn:
+ *   Called by the thread that owns conn once it is idle: queue it for a
+ *   worker if a whole request line has arrived, close it if the client
+ *   is done (or sent a line too long to be a request), or else hand it
+ *   back to the event loop to wait for more.
+ */
+static void dispatchConn(struct server* srv, struct serveConn* conn)
+{
+    if (memchr(conn->buf, '\n', conn->len)) {
+        pthread_mutex_lock(&srv->lock);
+        conn->queued = NULL;
+        if (srv->tail) {
+            srv->tail->queued = conn;
+        }
+        else {
+            srv->head = conn;
+        }
+        srv->tail = conn;
+        pthread_cond_signal(&srv->ready);
+        pthread_mutex_unlock(&srv->lock);
+        return;
+    }
+    if (conn->len >= SERVE_LINE_MAX) {
+        sendReply(conn, "error request line too long\n");
+        conn->eof = true;
+    }
+    struct epoll_event ev = {.events   = EPOLLIN | EPOLLONESHOT,
+                             .data.ptr = conn};
+    if (conn->eof || epoll_ctl(srv->epfd, EPOLL_CTL_MOD, conn->fd, &ev) != 0) {
+        closeConn(srv, conn);
+    }
+}
+
+/*
+ * readConn:
+ *   Take in whatever the client of conn has sent, and the descriptors
+ *   passed with it, then dispatch the connection. Reads stop once the
+ *   buffer holds SERVE_LINE_MAX bytes; the rest waits for the next turn.
+ */
+static void readConn(struct server* srv, struct serveConn* conn)
+{
+    while (conn->len < SERVE_LINE_MAX) {
+        union {
+            char           buf[CMSG_SPACE(SERVE_FDS_MAX * sizeof(int))];
+            struct cmsghdr align;
+        } control;
+        struct iovec  iov = {conn->buf + conn->len, SERVE_LINE_MAX - conn->len};
+        struct msghdr msg = {.msg_iov        = &iov,
+                             .msg_iovlen     = 1,
+                             .msg_control    = control.buf,
+                             .msg_controllen = sizeof(control.buf)};
+        ssize_t       n   = recvmsg(conn->fd, &msg,
+                                    MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        for (struct cmsghdr* c = CMSG_FIRSTHDR(&msg); n >= 0 && c;
+             c = CMSG_NXTHDR(&msg, c)) {
+            if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) {
+                continue;
+            }
+            size_t count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            int*   fds   = (int*)CMSG_DATA(c);
+            for (size_t i = 0; i < count; i++) {
+                if (conn->fdCount < SERVE_FDS_MAX) {
+                    conn->fds[conn->fdCount++] = fds[i];
+                }
+                else {
+                    close(fds[i]); /* more than any request can take */
+                }
+            }
+        }
+        if (n <= 0) {
+            conn->eof = true; /* closed, or failed */
+            break;
+        }
+        conn->len += n;
+    }
+    dispatchConn(srv, conn);
+}
 
-/* Macro for verbose printing */
-#define DEBUG_PRINT(fmt, ...)                    \
-    do {                                         \
-        if (verbose)                             \
-            fprintf(stderr, fmt, ##__VA_ARGS__); \
-    } while (0)
+/*
+ * serveWorker:
+ *   Pool thread: run queued requests, one connection at a time, until
+ *   the server stops and the queue is empty. Each worker has its own
+ *   arena for outputs that go to pipes and for segment buffers.
+ */
+static void* serveWorker(void* arg)
+{
+    struct server*     srv   = arg;
+    squashelf_arena_t* arena = squashelf_arena_new();
+    if (!arena) {
+        perror("malloc worker arena");
+        return NULL;
+    }
+    for (;;) {
+        pthread_mutex_lock(&srv->lock);
+        while (!srv->head && !srv->stopping) {
+            pthread_cond_wait(&srv->ready, &srv->lock);
+        }
+        struct serveConn* conn = srv->head;
+        if (!conn) {
+            pthread_mutex_unlock(&srv->lock);
+            break;
+        }
+        srv->head = conn->queued;
+        if (!srv->head) {
+            srv->tail = NULL;
+        }
+        pthread_mutex_unlock(&srv->lock);
+
+        char*  nl      = memchr(conn->buf, '\n', conn->len);
+        size_t lineLen = nl - conn->buf + 1;
+        *nl            = '\0';
+        DEBUG_PRINT("Request: %s\n", conn->buf);
+
+        struct squashelf_options opts  = *srv->opts;
+        struct squashelf_stats   stats = {0};
+        char                     error[256];
+        char                     reply[320];
+        if (srv->opts->stats) {
+            opts.stats = &stats;
+        }
+        opts.arena = arena;
+        int rc = runRequest(srv, conn, conn->buf, &opts, arena, error,
+                            sizeof(error));
+        squashelf_arena_reset(arena);
+        if (rc == 0) {
+            snprintf(reply, sizeof(reply), "ok\n");
+        }
+        else {
+            snprintf(reply, sizeof(reply), "error %s\n", error);
+        }
+        sendReply(conn, reply);
+
+        pthread_mutex_lock(&srv->lock);
+        srv->requests++;
+        srv->failed += rc != 0;
+        if (srv->opts->stats) {
+            addStats(&srv->stats, &stats);
+        }
+        pthread_mutex_unlock(&srv->lock);
+
+        conn->len -= lineLen;
+        memmove(conn->buf, conn->buf + lineLen, conn->len);
+        dispatchConn(srv, conn);
+    }
+    squashelf_arena_free(arena);
+    return NULL;
+}
+
+/*
+ * acceptConns:
+ *   Accept every pending client of listenFd and arm it for reading.
+ */
+static void acceptConns(struct server* srv, int listenFd)
+{
+    for (;;) {
+        int fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("accept");
+            }
+            return;
+        }
+        struct serveConn* conn = calloc(1, sizeof(*conn));
+        if (!conn || !(conn->buf = malloc(SERVE_LINE_MAX))) {
+            perror("calloc connection");
+            free(conn);
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        pthread_mutex_lock(&srv->lock);
+        conn->next = srv->conns;
+        if (srv->conns) {
+            srv->conns->prev = conn;
+        }
+        srv->conns = conn;
+        pthread_mutex_unlock(&srv->lock);
+
+        struct epoll_event ev = {.events   = EPOLLIN | EPOLLONESHOT,
+                                 .data.ptr = conn};
+        if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            perror("epoll_ctl");
+            closeConn(srv, conn);
+        }
+        DEBUG_PRINT("Accepted connection (fd %d)\n", fd);
+    }
+}
 
 /*
- * comparePhdr:
- *   qsort comparator ordering program headers by load address (p_paddr).
- *   Sorts ascending so segments land in increasing memory order.
+ * listenSocket:
+ *   Bind a listening Unix stream socket at path, replacing a stale socket
+ *   left there by an earlier server. Returns the fd or -1.
  */
-static int comparePhdr(const void* a, const void* b)
+static int listenSocket(const char* path)
 {
-    const GElf_Phdr* pa = a;
-    const GElf_Phdr* pb = b;
-    if (pa->p_paddr < pb->p_paddr) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: socket path '%s' is too long\n", path);
         return -1;
     }
-    if (pa->p_paddr > pb->p_paddr) {
-        return 1;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
     }
-    return 0;
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(fd, SOMAXCONN) != 0) {
+        perror("bind socket");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * runServer:
+ *   --serve: answer squash requests on the Unix socket at socketPath
+ *   until SIGINT or SIGTERM. One thread runs an epoll loop that accepts
+ *   clients and reads their requests; workers threads run them. Inputs
+ *   stay open in an LRU of up to inputCacheMax entries, so repeated
+ *   requests for the same file skip opening, mapping and parsing it.
+ */
+static int runServer(const struct squashelf_options* opts,
+                     const char* socketPath, long workers,
+                     size_t inputCacheMax)
+{
+    struct server srv = {.opts  = opts,
+                         .epfd  = -1,
+                         .lock  = PTHREAD_MUTEX_INITIALIZER,
+                         .ready = PTHREAD_COND_INITIALIZER,
+                         .inputs = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                                    .max  = inputCacheMax}};
+    int        rc       = EXIT_FAILURE;
+    int        listenFd = -1;
+    int        sigFd    = -1;
+    pthread_t* threads  = NULL;
+    long       started  = 0;
+
+    /* Stop signals are taken through sigFd; the workers inherit the
+       mask, so only the loop sees them */
+    sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, NULL);
+    signal(SIGPIPE, SIG_IGN); /* outputs may be pipes */
+
+    if ((listenFd = listenSocket(socketPath)) < 0) {
+        goto out;
+    }
+    sigFd    = signalfd(-1, &stopSignals, SFD_CLOEXEC);
+    srv.epfd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event listenEv = {.events = EPOLLIN, .data.ptr = NULL};
+    struct epoll_event sigEv    = {.events = EPOLLIN, .data.ptr = &srv};
+    if (sigFd < 0 || srv.epfd < 0 ||
+        epoll_ctl(srv.epfd, EPOLL_CTL_ADD, listenFd, &listenEv) != 0 ||
+        epoll_ctl(srv.epfd, EPOLL_CTL_ADD, sigFd, &sigEv) != 0) {
+        perror("epoll setup");
+        goto out;
+    }
+
+    if (workers == 0) {
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (workers < 1) {
+        workers = 1;
+    }
+    threads = calloc(workers, sizeof(*threads));
+    if (!threads) {
+        perror("calloc server workers");
+        goto out;
+    }
+    for (; started < workers; started++) {
+        int err = pthread_create(&threads[started], NULL, serveWorker, &srv);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            break;
+        }
+    }
+    if (started == 0) {
+        goto out;
+    }
+    DEBUG_PRINT("Serving on %s with %ld workers, up to %zu cached inputs\n",
+                socketPath, started, inputCacheMax);
+
+    for (bool running = true; running;) {
+        struct epoll_event events[64];
+        int                n = epoll_wait(srv.epfd, events, 64, -1);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                acceptConns(&srv, listenFd);
+            }
+            else if (events[i].data.ptr == &srv) {
+                running = false;
+            }
+            else {
+                readConn(&srv, events[i].data.ptr);
+            }
+        }
+    }
+    DEBUG_PRINT("Shutting down: finishing queued requests\n");
+    rc = EXIT_SUCCESS;
+
+out:
+    pthread_mutex_lock(&srv.lock);
+    srv.stopping = true;
+    pthread_cond_broadcast(&srv.ready);
+    pthread_mutex_unlock(&srv.lock);
+    for (long i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    while (srv.conns) {
+        closeConn(&srv, srv.conns);
+    }
+    while (srv.inputs.head) {
+        struct inputEntry* entry = srv.inputs.head;
+        unlinkInput(&srv.inputs, entry);
+        closeInput(entry);
+    }
+    if (opts->stats) {
+        addStats(opts->stats, &srv.stats);
+    }
+    DEBUG_PRINT("Served %lu requests (%lu failed); input cache %lu hits, "
+                "%lu misses, %lu evicted\n",
+                srv.requests, srv.failed, srv.inputs.hits, srv.inputs.misses,
+                srv.inputs.evictions);
+    if (srv.epfd >= 0) {
+        close(srv.epfd);
+    }
+    if (sigFd >= 0) {
+        close(sigFd);
+    }
+    if (listenFd >= 0) {
+        close(listenFd);
+        unlink(socketPath);
+    }
+    return rc;
 }
 
 int main(int argCount, char** argValues)
 {
-    int         noSht            = 0;
-    int         hasRange         = 0;
-    int         allowZeroSizeSeg = 0; /* New flag for zero-size segments */
-    uint64_t    minLma           = 0;
-    uint64_t    maxLma           = 0;
-    const char* inputFile        = NULL;
-    const char* outputFile       = NULL;
-    int         verbose          = 0;
+    struct squashelf_options opts;
+
+    struct squashelf_stats stats = {0};
+    struct processSample   statsStart;
+
+    struct namedRange*      ranges      = NULL; /* every --range, in order */
+    size_t                  rangeCount  = 0;
+    size_t                  rangeCap    = 0;
+    struct regionOutput*    outputs     = NULL; /* -o region=file */
+    size_t                  outputCount = 0;
+    size_t                  outputCap   = 0;
+    struct squashelf_range* filter      = NULL; /* the ranges without -o */
+
+    int         batch        = 0;    /* squash several files in one run */
+    int         statsFormat  = STATS_OFF; /* --stats report, if any */
+    const char* manifestFile = NULL; /* batch job list; NULL = argv pairs */
+    const char* previousFile = NULL; /* --incremental: output to update */
+    const char* digestFile   = NULL; /* --manifest: segment digests JSON */
+    long        workers      = 0;    /* batch pool size; 0 = one per CPU */
+    const char* serveSocket  = NULL; /* --serve: Unix socket to listen on */
+    size_t      inputCache   = 64;   /* --serve: inputs kept open */
+    int         planFormat   = STATS_OFF; /* --plan report, if any */
     int         opt;
     int         option_index = 0; /* For getopt_long */
 
+    squashelf_options_init(&opts);
+
     /* Define long options */
     static struct option long_options[] = {
         {"nosht", no_argument, 0, 'n'},       /* --nosht is equivalent to -n */
         {"range", required_argument, 0, 'r'}, /* --range is equivalent to -r */
+        {"ranges", required_argument, 0, OPT_RANGES}, /* --range list file */
+        {"output", required_argument, 0, 'o'}, /* region=file */
+        {"split", required_argument, 0, OPT_SPLIT}, /* range/output list */
+        {"clip", no_argument, 0, OPT_CLIP}, /* trim segments to ranges */
         {"verbose", no_argument, 0, 'v'}, /* --verbose is equivalent to -v */
         {"zero-size-segments", no_argument, 0, 'z'}, /* --zero-size-segments */
+        {"no-mmap", no_argument, 0, OPT_NO_MMAP}, /* read segments with pread */
+        {"writer", required_argument, 0, OPT_WRITER}, /* output backend */
+        {"copy", required_argument, 0, OPT_COPY}, /* first copy engine */
+        {"batch", optional_argument, 0, OPT_BATCH}, /* many inputs, one run */
+        {"workers", required_argument, 0, OPT_WORKERS}, /* batch pool size */
+        {"jobs", required_argument, 0, 'j'}, /* parallel payload copy */
+        {"stream-buffer", required_argument, 0, OPT_STREAM_BUFFER},
+        {"format", required_argument, 0, OPT_FORMAT}, /* output file format */
+        {"gap-fill", required_argument, 0, OPT_GAP_FILL}, /* bin gap byte */
+        {"coalesce", optional_argument, 0, OPT_COALESCE}, /* merge segments */
+        {"stats", optional_argument, 0, OPT_STATS}, /* timings and counters */
+        {"cache", required_argument, 0, OPT_CACHE}, /* reuse earlier outputs */
+        {"cache-size", required_argument, 0, OPT_CACHE_SIZE},
+        {"incremental", required_argument, 0, OPT_INCREMENTAL},
+        {"manifest", required_argument, 0, OPT_MANIFEST}, /* digests JSON */
+        {"compress", required_argument, 0, OPT_COMPRESS}, /* payload codec */
+        {"sparse", no_argument, 0, OPT_SPARSE}, /* holes for zero blocks */
+        {"trim-zeros", no_argument, 0, OPT_TRIM_ZEROS}, /* zero tails to bss */
+        {"check-overlap", optional_argument, 0, OPT_CHECK_OVERLAP},
+        {"layout", required_argument, 0, OPT_LAYOUT}, /* ELF file order */
+        {"pack", no_argument, 0, OPT_PACK}, /* --layout=pack */
+        {"serve", required_argument, 0, OPT_SERVE}, /* request server */
+        {"input-cache", required_argument, 0, OPT_INPUT_CACHE},
+        {"plan", optional_argument, 0, OPT_PLAN}, /* layout report only */
+        {"verify", no_argument, 0, OPT_VERIFY}, /* compare output to input */
         {0, 0, 0, 0}};
 
     /* Use getopt_long to parse command-line options */
     optind = 1; /* Reset optind */
-    while ((opt = getopt_long(argCount, argValues, "nr:vz", long_options,
+    while ((opt = getopt_long(argCount, argValues, "j:no:r:vz", long_options,
                               &option_index)) != -1) {
         switch (opt) {
+            case 'j': {
+                char* end;
+                long  jobs = strtol(optarg, &end, 10);
+                if (*end != '\0' || jobs < 1 || jobs > 1024) {
+                    fprintf(stderr, "Invalid job count '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                opts.jobs = (int)jobs;
+            } break;
             case 'n':
-                noSht = 1;
+                opts.noSht = 1;
                 break;
-            case 'r': {
-                /* Parse the range string (e.g., "0xA00000000-0xB0000000") */
-                hasRange      = 1;
-                char* dashPos = strchr(optarg, '-');
-                if (!dashPos) {
+            case 'r':
+                if (addRange(optarg, &ranges, &rangeCount, &rangeCap) != 0) {
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_RANGES:
+                if (loadRanges(optarg, &ranges, &rangeCount, &rangeCap) !=
+                    0) {
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'o': {
+                const char* eq = strchr(optarg, '=');
+                if (!eq || eq == optarg || eq[1] == '\0' ||
+                    strcmp(eq + 1, "-") == 0) {
                     fprintf(stderr,
-                            "Invalid range format. Expected: min-max\n");
+                            "Invalid output '%s'. Expected: region=file\n",
+                            optarg);
                     return EXIT_FAILURE;
                 }
-
-                /* Split the string */
-                *dashPos     = '\0';
-                char* minStr = optarg;
-                char* maxStr = dashPos + 1;
-
-                /* Check for hex or decimal format and convert */
-                if (strncmp(minStr, "0x", 2) == 0 ||
-                    strncmp(minStr, "0X", 2) == 0) {
-                    minLma = strtoull(minStr, NULL, 16);
+                if (addOutput(optarg, eq - optarg, eq + 1, &outputs,
+                              &outputCount, &outputCap) != 0) {
+                    return EXIT_FAILURE;
                 }
-                else {
-                    minLma = strtoull(minStr, NULL, 10);
+            } break;
+            case OPT_CLIP:
+                opts.clip = 1;
+                break;
+            case OPT_SPLIT:
+                if (loadSplits(optarg, &ranges, &rangeCount, &rangeCap,
+                               &outputs, &outputCount, &outputCap) != 0) {
+                    return EXIT_FAILURE;
                 }
-
-                if (strncmp(maxStr, "0x", 2) == 0 ||
-                    strncmp(maxStr, "0X", 2) == 0) {
-                    maxLma = strtoull(maxStr, NULL, 16);
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            case 'z':
+                opts.allowZeroSizeSeg = 1;
+                break;
+            case OPT_NO_MMAP:
+                opts.useMmap = 0;
+                break;
+            case OPT_WRITER:
+                for (opts.writer = 0; opts.writer < SQUASHELF_WRITER_COUNT;
+                     opts.writer++) {
+                    if (strcmp(optarg, squashelf_writer_name(opts.writer)) ==
+                        0) {
+                        break;
+                    }
+                }
+                if (opts.writer == SQUASHELF_WRITER_COUNT) {
+                    fprintf(stderr,
+                            "Invalid writer '%s'. Expected: libelf, direct "
+                            "or uring\n",
+                            optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_COPY:
+                for (opts.copyStart = 0; opts.copyStart < SQUASHELF_COPY_COUNT;
+                     opts.copyStart++) {
+                    if (strcmp(optarg, squashelf_copy_name(opts.copyStart)) ==
+                        0) {
+                        break;
+                    }
+                }
+                if (opts.copyStart == SQUASHELF_COPY_COUNT) {
+                    fprintf(stderr,
+                            "Invalid copy engine '%s'. Expected: "
+                            "copy_file_range, sendfile or buffered\n",
+                            optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_BATCH:
+                batch        = 1;
+                manifestFile = optarg;
+                break;
+            case OPT_WORKERS: {
+                char* end;
+                workers = strtol(optarg, &end, 10);
+                if (*end != '\0' || workers < 1) {
+                    fprintf(stderr, "Invalid worker count '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+            } break;
+            case OPT_STREAM_BUFFER:
+                if (parseSize(optarg, &opts.streamBufferLimit) != 0) {
+                    fprintf(stderr, "Invalid stream buffer size '%s'\n",
+                            optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_FORMAT:
+                for (opts.format = 0; opts.format < SQUASHELF_FORMAT_COUNT;
+                     opts.format++) {
+                    if (strcmp(optarg, squashelf_format_name(opts.format)) ==
+                        0) {
+                        break;
+                    }
+                }
+                if (opts.format == SQUASHELF_FORMAT_COUNT) {
+                    fprintf(stderr,
+                            "Invalid format '%s'. Expected: elf, bin, ihex "
+                            "or srec\n",
+                            optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_GAP_FILL: {
+                char* end;
+                long  fill = strtol(optarg, &end, 0);
+                if (*end != '\0' || fill < 0 || fill > 0xff) {
+                    fprintf(stderr, "Invalid gap fill byte '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                opts.gapFill = (int)fill;
+            } break;
+            case OPT_COALESCE:
+                opts.coalesce = 1;
+                if (optarg && parseSize(optarg, &opts.coalesceGap) != 0) {
+                    fprintf(stderr, "Invalid coalesce gap '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_STATS:
+                if (!optarg || strcmp(optarg, "text") == 0) {
+                    statsFormat = STATS_TEXT;
+                }
+                else if (strcmp(optarg, "json") == 0) {
+                    statsFormat = STATS_JSON;
                 }
                 else {
-                    maxLma = strtoull(maxStr, NULL, 10);
+                    fprintf(stderr,
+                            "Invalid stats format '%s'. Expected: text or "
+                            "json\n",
+                            optarg);
+                    return EXIT_FAILURE;
                 }
-
-                /* Restore the dash for error messages */
-                *(dashPos) = '-';
-
-                if (minLma >= maxLma) {
+                break;
+            case OPT_CACHE:
+                cache.dir = optarg;
+                break;
+            case OPT_CACHE_SIZE:
+                if (parseSize(optarg, &cache.maxBytes) != 0) {
+                    fprintf(stderr, "Invalid cache size '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_INCREMENTAL:
+                previousFile = optarg;
+                break;
+            case OPT_MANIFEST:
+                digestFile = optarg;
+                break;
+            case OPT_SPARSE:
+                opts.sparse = 1;
+                break;
+            case OPT_TRIM_ZEROS:
+                opts.trimZeros = 1;
+                break;
+            case OPT_VERIFY:
+                verify = 1;
+                break;
+            case OPT_CHECK_OVERLAP:
+                opts.overlap = SQUASHELF_OVERLAP_WARN;
+                if (!optarg) {
+                    break;
+                }
+                for (opts.overlap = 0; opts.overlap < SQUASHELF_OVERLAP_COUNT;
+                     opts.overlap++) {
+                    if (strcmp(optarg, squashelf_overlap_name(opts.overlap)) ==
+                        0) {
+                        break;
+                    }
+                }
+                if (opts.overlap == SQUASHELF_OVERLAP_COUNT) {
+                    fprintf(stderr,
+                            "Invalid overlap mode '%s'. Expected: off, warn, "
+                            "fail or resolve\n",
+                            optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_LAYOUT:
+                for (opts.layout = 0; opts.layout < SQUASHELF_LAYOUT_COUNT;
+                     opts.layout++) {
+                    if (strcmp(optarg, squashelf_layout_name(opts.layout)) ==
+                        0) {
+                        break;
+                    }
+                }
+                if (opts.layout == SQUASHELF_LAYOUT_COUNT) {
                     fprintf(stderr,
-                            "Invalid range: min must be less than max\n");
+                            "Invalid layout '%s'. Expected: plan, lma or "
+                            "pack\n",
+                            optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_PACK:
+                opts.layout = SQUASHELF_LAYOUT_PACK;
+                break;
+            case OPT_SERVE:
+                serveSocket = optarg;
+                break;
+            case OPT_INPUT_CACHE: {
+                char*         end;
+                unsigned long count = strtoul(optarg, &end, 10);
+                if (*end != '\0' || optarg[0] == '-') {
+                    fprintf(stderr, "Invalid input cache size '%s'\n",
+                            optarg);
                     return EXIT_FAILURE;
                 }
+                inputCache = count;
             } break;
-            case 'v':
-                verbose = 1;
+            case OPT_PLAN:
+                if (!optarg || strcmp(optarg, "text") == 0) {
+                    planFormat = STATS_TEXT;
+                }
+                else if (strcmp(optarg, "json") == 0) {
+                    planFormat = STATS_JSON;
+                }
+                else {
+                    fprintf(stderr,
+                            "Invalid plan format '%s'. Expected: text or "
+                            "json\n",
+                            optarg);
+                    return EXIT_FAILURE;
+                }
                 break;
-            case 'z':
-                allowZeroSizeSeg = 1;
+            case OPT_COMPRESS:
+                if (parseCodec(optarg, &opts.codec, &opts.codecLevel) != 0) {
+                    fprintf(stderr,
+                            "Invalid codec '%s'. Expected: zstd[:1-22] or "
+                            "lz4[:1-12]\n",
+                            optarg);
+                    return EXIT_FAILURE;
+                }
+                if (!squashelf_codec_available(opts.codec)) {
+                    fprintf(stderr, "Error: squashelf was built without %s "
+                                    "support\n",
+                            squashelf_codec_name(opts.codec));
+                    return EXIT_FAILURE;
+                }
                 break;
             case '?': /* getopt_long prints an error message */
-                fprintf(stderr,
-                        "Usage: %s [-n | --nosht] [-r | --range min-max] "
-                        "[-v | --verbose] [-z | --zero-size-segments] "
-                        "<input.elf> <output.elf>\n",
-                        argValues[0]);
+                usage(argValues[0]);
                 return EXIT_FAILURE;
             default:
                 /* Should not happen */
@@ -127,334 +3119,172 @@ int main(int argCount, char** argValues)
         }
     }
 
-    /* Check for the correct number of positional arguments */
-    if (optind + 2 != argCount) {
-        fprintf(stderr,
-                "Usage: %s [-n | --nosht] [-r | --range min-max] "
-                "[-v | --verbose] [-z | --zero-size-segments] "
-                "<input.elf> <output.elf>\n",
-                argValues[0]);
-        return EXIT_FAILURE;
-    }
-
-    inputFile  = argValues[optind];
-    outputFile = argValues[optind + 1];
-
-    /* Print initial configuration if verbose */
-    DEBUG_PRINT("Verbose mode enabled.\n");
-    DEBUG_PRINT("Input file: %s\n", inputFile);
-    DEBUG_PRINT("Output file: %s\n", outputFile);
-    DEBUG_PRINT("No SHT: %s\n", noSht ? "yes" : "no");
-    DEBUG_PRINT("Allow zero-size segments: %s\n",
-                allowZeroSizeSeg ? "yes" : "no");
-    if (hasRange) {
-        DEBUG_PRINT("Range filter: 0x%lx - 0x%lx\n", minLma, maxLma);
-    }
-
-    /* Initialize libelf library */
-    if (elf_version(EV_CURRENT) == EV_NONE) {
-        fprintf(stderr, "libelf init failed: %s\n", elf_errmsg(-1));
+    /* Check for the correct number of positional arguments: one
+       input/output pair (just the input with -o), any number of pairs in
+       batch mode, and none when the batch comes from a manifest or the
+       files from --serve requests. --plan needs no output. */
+    int positional = argCount - optind;
+    if (planFormat != STATS_OFF
+            ? positional < 1 || positional > 2 ||
+                  strcmp(argValues[optind], "-") == 0
+        : serveSocket ? positional != 0
+        : batch     ? (manifestFile ? positional != 0
+                                    : positional == 0 || positional % 2 != 0)
+                    : positional != (outputCount ? 1 : 2)) {
+        usage(argValues[0]);
         return EXIT_FAILURE;
     }
-    DEBUG_PRINT("Initialized libelf library.\n");
-
-    /* Open input ELF file for reading */
-    int inputFd = open(inputFile, O_RDONLY);
-    if (inputFd < 0) {
-        perror("open inputFile");
+    if (planFormat != STATS_OFF &&
+        (serveSocket || batch || outputCount || previousFile || digestFile ||
+         cache.dir || verify)) {
+        fprintf(stderr, "Error: --plan cannot be combined with --serve, "
+                        "--batch, -o, --incremental, --manifest, --cache or "
+                        "--verify\n");
         return EXIT_FAILURE;
     }
-    DEBUG_PRINT("Opened input file: %s (fd: %d)\n", inputFile, inputFd);
-
-    /* Create ELF descriptor from file descriptor */
-    Elf* inputElf = elf_begin(inputFd, ELF_C_READ, NULL);
-    if (!inputElf) {
-        fprintf(stderr, "elf_begin(input): %s\n", elf_errmsg(-1));
-        close(inputFd);
+    if (serveSocket && (batch || outputCount || previousFile || digestFile ||
+                        cache.dir || verify)) {
+        fprintf(stderr, "Error: --serve cannot be combined with --batch, -o, "
+                        "--incremental, --manifest, --cache or --verify\n");
         return EXIT_FAILURE;
     }
-    DEBUG_PRINT("Created ELF descriptor for input file.\n");
-
-    /* Determine 32- vs 64-bit ELF class */
-    int elfClass = gelf_getclass(inputElf);
-    if (elfClass != ELFCLASS32 && elfClass != ELFCLASS64) {
-        fprintf(stderr, "Unsupported ELF class: %d\n", elfClass);
-        elf_end(inputElf);
-        close(inputFd);
+    if (verify && ((opts.format != SQUASHELF_FORMAT_ELF &&
+                    opts.format != SQUASHELF_FORMAT_BIN) ||
+                   opts.codec != SQUASHELF_CODEC_NONE)) {
+        fprintf(stderr, "Error: --verify needs uncompressed ELF or bin "
+                        "output\n");
         return EXIT_FAILURE;
     }
-    DEBUG_PRINT("Detected ELF class: %s\n",
-                elfClass == ELFCLASS32 ? "ELF32" : "ELF64");
-
-    /* Read the ELF header into a generic GElf_Ehdr */
-    GElf_Ehdr elfHeader;
-    if (!gelf_getehdr(inputElf, &elfHeader)) {
-        fprintf(stderr, "gelf_getehdr: %s\n", elf_errmsg(-1));
-        elf_end(inputElf);
-        close(inputFd);
+    if (batch && outputCount) {
+        fprintf(stderr, "Error: -o cannot be combined with --batch\n");
         return EXIT_FAILURE;
     }
-    DEBUG_PRINT("Read input ELF header. Program header count: %u\n",
-                elfHeader.e_phnum);
-
-    /* Count how many program headers exist in the file */
-    size_t phdrCount;
-    if (elf_getphdrnum(inputElf, &phdrCount) != 0) {
-        fprintf(stderr, "elf_getphdrnum: %s\n", elf_errmsg(-1));
-        elf_end(inputElf);
-        close(inputFd);
+    if ((previousFile || digestFile) &&
+        (batch || outputCount || strcmp(argValues[optind], "-") == 0 ||
+         strcmp(argValues[optind + 1], "-") == 0)) {
+        fprintf(stderr, "Error: %s needs one input file and one output "
+                        "file\n",
+                previousFile ? "--incremental" : "--manifest");
         return EXIT_FAILURE;
     }
-    DEBUG_PRINT("Confirmed program header count: %zu\n", phdrCount);
 
-    /* Allocate array to hold all PT_LOAD entries */
-    GElf_Phdr* phdrs     = malloc(phdrCount * sizeof(GElf_Phdr));
-    size_t     loadCount = 0;
-
-    /* Extract only PT_LOAD segments from the input PHT */
-    for (size_t i = 0; i < phdrCount; i++) {
-        GElf_Phdr ph;
-        if (!gelf_getphdr(inputElf, i, &ph)) {
-            continue;
+    /* With -o every range belongs to a region and each region has an
+       output; otherwise all ranges together form the filter */
+    for (size_t i = 0; outputCount && i < rangeCount; i++) {
+        if (!ranges[i].region) {
+            fprintf(stderr,
+                    "Error: range 0x%lx-0x%lx has no region name; with -o "
+                    "every range needs one\n",
+                    ranges[i].range.minLma, ranges[i].range.maxLma);
+            return EXIT_FAILURE;
         }
-        if (ph.p_type == PT_LOAD) {
-            /* Skip segments with zero filesz unless explicitly allowed */
-            if (ph.p_filesz == 0 && !allowZeroSizeSeg) {
-                DEBUG_PRINT("  Skipping segment %zu (LMA 0x%lx) - "
-                            "zero filesz\n",
-                            i, ph.p_paddr);
-                continue;
-            }
-
-            /* Apply range filter if specified */
-            if (hasRange) {
-                uint64_t segmentEnd = ph.p_paddr + ph.p_memsz - 1;
-                /* Skip segments that aren't fully contained within the range */
-                if (ph.p_paddr < minLma || segmentEnd > maxLma) {
-                    DEBUG_PRINT("  Skipping segment %zu (LMA 0x%lx - 0x%lx) - "
-                                "outside range 0x%lx - 0x%lx\n",
-                                i, ph.p_paddr, segmentEnd, minLma, maxLma);
-                    continue;
-                }
-            }
-            DEBUG_PRINT("  Keeping segment %zu (LMA 0x%lx, size 0x%lx/0x%lx, "
-                        "offset 0x%lx, align %lu)\n",
-                        i, ph.p_paddr, ph.p_filesz, ph.p_memsz, ph.p_offset,
-                        ph.p_align);
-            phdrs[loadCount++] = ph;
+    }
+    for (size_t i = 0; i < outputCount; i++) {
+        size_t matched = 0;
+        for (size_t r = 0; r < rangeCount; r++) {
+            matched += strcmp(ranges[r].region, outputs[i].region) == 0;
         }
-        else {
-            DEBUG_PRINT("  Skipping segment %zu (type %u)\n", i, ph.p_type);
+        if (matched == 0) {
+            fprintf(stderr, "Error: no range for region '%s'\n",
+                    outputs[i].region);
+            return EXIT_FAILURE;
         }
     }
-    DEBUG_PRINT("Found %zu PT_LOAD segments matching criteria.\n", loadCount);
-    if (loadCount == 0) {
-        fprintf(stderr, "No PT_LOAD segments found\n");
-        free(phdrs);
-        elf_end(inputElf);
-        close(inputFd);
-        return EXIT_FAILURE;
+    if (!outputCount && rangeCount) {
+        filter = malloc(rangeCount * sizeof(*filter));
+        if (!filter) {
+            perror("malloc ranges");
+            return EXIT_FAILURE;
+        }
+        for (size_t i = 0; i < rangeCount; i++) {
+            filter[i] = ranges[i].range;
+        }
+        opts.ranges     = filter;
+        opts.rangeCount = rangeCount;
     }
 
-    /* Sort the loadable segments by their LMA (p_paddr) */
-    qsort(phdrs, loadCount, sizeof(GElf_Phdr), comparePhdr);
-    DEBUG_PRINT("Sorted PT_LOAD segments by LMA.\n");
-
-    /* Allocate storage for data buffers we read */
-    void** data_buffers = calloc(loadCount, sizeof(void*));
-    if (!data_buffers) {
-        perror("calloc data_buffers");
-        free(phdrs);
-        elf_end(inputElf);
-        close(inputFd);
-        return EXIT_FAILURE;
+    /* Print initial configuration if verbose */
+    DEBUG_PRINT("Verbose mode enabled.\n");
+    DEBUG_PRINT("No SHT: %s\n", opts.noSht ? "yes" : "no");
+    DEBUG_PRINT("Allow zero-size segments: %s\n",
+                opts.allowZeroSizeSeg ? "yes" : "no");
+    DEBUG_PRINT("Use mmap for input: %s\n", opts.useMmap ? "yes" : "no");
+    DEBUG_PRINT("Clip segments to ranges: %s\n", opts.clip ? "yes" : "no");
+    DEBUG_PRINT("Output format: %s\n", squashelf_format_name(opts.format));
+    if (opts.coalesce) {
+        DEBUG_PRINT("Coalesce segments: max gap 0x%lx bytes\n",
+                    opts.coalesceGap);
     }
-    bool cleanup_buffers = true; /* Flag to track if buffers need cleanup */
-
-    /* Open output file for writing the filtered ELF */
-    int outputFd = open(outputFile, O_RDWR | O_CREAT | O_TRUNC, 0644);
-    if (outputFd < 0) {
-        perror("open outputFile");
-        free(phdrs);
-        elf_end(inputElf);
-        close(inputFd);
-        return EXIT_FAILURE;
+    if (opts.codec != SQUASHELF_CODEC_NONE) {
+        DEBUG_PRINT("Compress payloads: %s (level %d)\n",
+                    squashelf_codec_name(opts.codec), opts.codecLevel);
     }
-    DEBUG_PRINT("Opened output file: %s (fd: %d)\n", outputFile, outputFd);
-
-    /* Create ELF descriptor for the output */
-    Elf* outputElf = elf_begin(outputFd, ELF_C_WRITE, NULL);
-    if (!outputElf) {
-        fprintf(stderr, "elf_begin(output): %s\n", elf_errmsg(-1));
-        close(outputFd);
-        free(phdrs);
-        elf_end(inputElf);
-        close(inputFd);
-        return EXIT_FAILURE;
+    DEBUG_PRINT("Sparse output: %s\n", opts.sparse ? "yes" : "no");
+    DEBUG_PRINT("Trim trailing zeros: %s\n", opts.trimZeros ? "yes" : "no");
+    DEBUG_PRINT("Overlap check: %s\n", squashelf_overlap_name(opts.overlap));
+    DEBUG_PRINT("ELF layout: %s\n", squashelf_layout_name(opts.layout));
+    DEBUG_PRINT("Output writer: %s\n", squashelf_writer_name(opts.writer));
+    if (opts.writer != SQUASHELF_WRITER_LIBELF) {
+        DEBUG_PRINT("First copy engine: %s\n",
+                    squashelf_copy_name(opts.copyStart));
+        DEBUG_PRINT("Copy threads: %d\n", opts.jobs);
     }
-    DEBUG_PRINT("Created output ELF descriptor.\n");
 
-    /* Create new ELF header matching input class */
-    if (!gelf_newehdr(outputElf, elfClass)) {
-        fprintf(stderr, "gelf_newehdr: %s\n", elf_errmsg(-1));
-        /* Consider if continuing makes sense, maybe just log if verbose */
+    if (cache.dir) {
+        DEBUG_PRINT("Output cache: %s (up to %lu bytes)\n", cache.dir,
+                    cache.maxBytes);
+        if (mkdir(cache.dir, 0777) != 0 && errno != EEXIST) {
+            perror("mkdir cache");
+            return EXIT_FAILURE;
+        }
     }
-    DEBUG_PRINT("Created new ELF header for output file (class %s).\n",
-                elfClass == ELFCLASS32 ? "ELF32" : "ELF64");
 
-    /* Update program header count and clear section info */
-    elfHeader.e_phnum    = loadCount;
-    elfHeader.e_shoff    = 0;
-    elfHeader.e_shnum    = 0;
-    elfHeader.e_shstrndx = SHN_UNDEF;
-    if (!gelf_update_ehdr(outputElf, &elfHeader)) {
-        fprintf(stderr, "gelf_update_ehdr: %s\n", elf_errmsg(-1));
-    }
-    DEBUG_PRINT("Updated output ELF header: phnum=%zu, shoff=0, shnum=0, "
-                "shstrndx=SHN_UNDEF\n",
-                loadCount);
+    squashelf_set_verbose(verbose);
 
-    /* Reserve space for the new program header table */
-    if (!gelf_newphdr(outputElf, loadCount)) {
-        fprintf(stderr, "gelf_newphdr: %s\n", elf_errmsg(-1));
-        /* Handle error */
+    if (statsFormat != STATS_OFF) {
+        opts.stats = &stats;
+        sampleProcess(&statsStart);
     }
-    DEBUG_PRINT("Reserved space for %zu program headers in output PHT.\n",
-                loadCount);
 
-    /* Write each sorted PT_LOAD entry into the new PHT */
-    for (size_t i = 0; i < loadCount; i++) {
-        if (!gelf_update_phdr(outputElf, i, &phdrs[i])) {
-            fprintf(stderr, "gelf_update_phdr[%zu]: %s\n", i, elf_errmsg(-1));
-        }
+    int status;
+    if (planFormat != STATS_OFF) {
+        status = plan_one(&opts, argValues[optind], planFormat);
     }
-
-    /* Flush header + PHT to the output file */
-    if (elf_update(outputElf, ELF_C_WRITE) < 0) {
-        fprintf(stderr, "elf_update header+PHT: %s\n", elf_errmsg(-1));
+    else if (serveSocket) {
+        status = runServer(&opts, serveSocket, workers, inputCache);
+    }
+    else if (batch) {
+        status = runBatch(&opts, manifestFile, argValues + optind, positional,
+                          workers);
+    }
+    else if (outputCount) {
+        status = squash_regions(&opts, argValues[optind], outputs,
+                                outputCount, ranges, rangeCount, workers);
+    }
+    else {
+        status = squash_one(&opts, argValues[optind], argValues[optind + 1],
+                            previousFile, digestFile);
     }
-    DEBUG_PRINT("Wrote initial ELF header and PHT to output file.\n");
-
-    /* Read segment data and associate with output ELF using sections/data */
-    DEBUG_PRINT("Associating segment data with output ELF...\n");
-    for (size_t i = 0; i < loadCount; i++) {
-        GElf_Phdr seg = phdrs[i]; /* Use the sorted phdr */
-
-        /* Skip segments with zero file size */
-        if (seg.p_filesz == 0) {
-            DEBUG_PRINT("  Segment %zu has zero filesz, skipping data association\n", i);
-            continue;
-        }
 
-        /* Allocate buffer for segment data */
-        void* buffer = malloc(seg.p_filesz);
-        if (!buffer) {
-            perror("malloc segment buffer");
-            goto cleanup_error; /* Use goto for centralized cleanup */
-        }
-        data_buffers[i] = buffer; /* Store buffer pointer for later free */
+    if (statsFormat != STATS_OFF) {
+        struct processSample statsEnd;
+        sampleProcess(&statsEnd);
+        const char* label = serveSocket ? "serve"
+                            : batch     ? "batch"
+                                        : argValues[optind];
+        printStats(statsFormat, label, status, &stats, &statsStart,
+                   &statsEnd);
+    }
 
-        /* Read segment data from input file */
-        ssize_t bytes_read = pread(inputFd, buffer, seg.p_filesz, seg.p_offset);
-        if (bytes_read < 0) {
-            perror("pread segment data");
-            goto cleanup_error;
-        }
-        else if ((size_t)bytes_read != seg.p_filesz) {
-            fprintf(stderr,
-                    "Warning: short read for segment %zu (expected %lu, got %zd)\n",
-                    i, seg.p_filesz, bytes_read);
-            /* Continue with potentially partial data, but adjust size?
-               For simplicity, we'll error out on short reads for now. */
-            fprintf(stderr, "Error: Short read encountered. Aborting.\n");
-             goto cleanup_error;
-       }
-
-        /* Create a new section for this segment's data */
-        Elf_Scn* scn = elf_newscn(outputElf);
-        if (!scn) {
-            fprintf(stderr, "elf_newscn[%zu]: %s\n", i, elf_errmsg(-1));
-            goto cleanup_error;
-        }
-
-        /* Create a new data descriptor for the section */
-        Elf_Data* data = elf_newdata(scn);
-        if (!data) {
-            fprintf(stderr, "elf_newdata[%zu]: %s\n", i, elf_errmsg(-1));
-            goto cleanup_error;
-        }
-
-        /* Fill the data descriptor */
-        data->d_align = seg.p_align;
-        data->d_buf   = buffer; /* libelf reads from this buffer during elf_update */
-        data->d_size  = seg.p_filesz; /* Use actual filesz */
-        data->d_type  = ELF_T_BYTE;
-        data->d_off   = 0LL; /* Offset within the section */
-
-        /* We don't need elf_flagdata(data, ELF_C_SET, ELF_F_DIRTY) because
-           elf_newdata implicitly marks the section containing the data descriptor
-           as dirty. elf_update will write it. */
-
-        DEBUG_PRINT("  Associated data for segment %zu: size=0x%lx, align=%lu\n",
-                     i, seg.p_filesz, seg.p_align);
-
-        /* Note: We do NOT update the Phdr p_offset here. elf_update calculates
-           the final offsets for both sections and segments based on layout. */
-    }
-    DEBUG_PRINT("Finished associating segment data.\n");
-
-    /* Update ELF header section info based on noSht flag *before* final update */
-    if (!gelf_getehdr(outputElf, &elfHeader)) { /* Get potentially updated header */
-         fprintf(stderr, "gelf_getehdr(out pre-final): %s\n", elf_errmsg(-1));
-         goto cleanup_error;
-     }
-
-    if (noSht) {
-        DEBUG_PRINT("Configuring output ELF for no SHT.\n");
-        elfHeader.e_shnum    = 0;
-        elfHeader.e_shoff    = 0; /* elf_update will calculate final value if needed */
-        elfHeader.e_shstrndx = SHN_UNDEF;
-        if (!gelf_update_ehdr(outputElf, &elfHeader)) {
-            fprintf(stderr, "gelf_update_ehdr (noSht): %s\n", elf_errmsg(-1));
-             goto cleanup_error;
-         }
-    } else {
-         DEBUG_PRINT("Adding NULL section header as final section.\n");
-         Elf_Scn* nullScn = elf_newscn(outputElf); /* Add NULL section */
-         if (!nullScn) {
-             fprintf(stderr, "elf_newscn(NULL): %s\n", elf_errmsg(-1));
-             goto cleanup_error;
-         }
-         /* GElf_Shdr is automatically SHT_NULL initialized by elf_newscn */
-         /* elf_update will set the correct e_shnum and e_shstrndx (usually 0 for NULL string table) */
-         DEBUG_PRINT("NULL section added; elf_update will finalize SHT info.\n");
-     }
-
-    /* Finalize all updates (offsets, sizes, data writing) */
-    DEBUG_PRINT("Finalizing output ELF file (layout and data write)...\n");
-    off_t final_size = elf_update(outputElf, ELF_C_WRITE);
-    if (final_size < 0) {
-        fprintf(stderr, "elf_update final: %s\n", elf_errmsg(-1));
-        goto cleanup_error;
-    }
-    DEBUG_PRINT("Output ELF file finalized. Final size: %ld bytes\n", final_size);
-
-cleanup_error:; /* Label for centralized cleanup */
-    int exit_status = (errno != 0 || elf_errno() != 0) ? EXIT_FAILURE : EXIT_SUCCESS;
-
-    /* Clean up handles and memory */
-    DEBUG_PRINT("Cleaning up resources.\n");
-    elf_end(outputElf);
-    close(outputFd);
-    if (cleanup_buffers && data_buffers) {
-         for (size_t i = 0; i < loadCount; i++) {
-             free(data_buffers[i]); /* Free stored buffer pointers */
-         }
-         free(data_buffers);
-     }
-    free(phdrs);
-    elf_end(inputElf);
-    close(inputFd);
-
-    return exit_status;
+    for (size_t i = 0; i < rangeCount; i++) {
+        free(ranges[i].region);
+    }
+    for (size_t i = 0; i < outputCount; i++) {
+        free(outputs[i].region);
+        free(outputs[i].outputFile);
+    }
+    free(ranges);
+    free(outputs);
+    free(filter);
+    return status;
 }